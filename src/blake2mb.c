@@ -0,0 +1,351 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file blake2mb.c
+ * Multi-buffer BLAKE2b for hashing many equal length blocks at once.
+ *
+ * Each lane of the SIMD registers holds the state for a different message,
+ * so every vector instruction does the same step of the BLAKE2b compression
+ * function for all the messages at once. Since all the messages have the same
+ * length they have the same number of blocks, the same counters, and the same
+ * final block flag, so the only per-lane difference is the message data.
+ *
+ * The message words are loaded by transposing rows of words from each
+ * message into columns of the same word across messages. The final partial
+ * block of each message is copied into a zero padded buffer first.
+ *
+ * This always calculates unkeyed 32 byte sums, which is all librsync uses. */
+
+#include <stdint.h>
+#include <string.h>
+#include "blake2mb.h"
+#include "blake2.h"
+#include "cpu.h"
+
+/** The maximum number of lanes used by any implementation. */
+#define RS_BLAKE2B_MAX_LANES 8
+
+/** The BLAKE2b block length. */
+#define RS_BLAKE2B_BLOCK_LEN 128
+
+/** The BLAKE2b sum length we calculate. */
+#define RS_BLAKE2B_SUM_LEN 32
+
+/** Calculate a single sum using the blake2 library. */
+static void rs_blake2b_1(const void *buf, size_t len, rs_strong_sum_t *sum)
+{
+    blake2b_state ctx;
+
+    blake2b_init(&ctx, RS_BLAKE2B_SUM_LEN);
+    blake2b_update(&ctx, (const uint8_t *)buf, len);
+    blake2b_final(&ctx, (uint8_t *)sum, RS_BLAKE2B_SUM_LEN);
+}
+
+static const rs_blake2b_impl_t rs_blake2b_scalar = { "scalar", 1, NULL };
+
+#ifdef RS_SIMD_X86
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}
+};
+
+/** The parameter block word 0 for an unkeyed 32 byte sum. */
+#  define RS_BLAKE2B_PARAM0 (0x01010000ULL | RS_BLAKE2B_SUM_LEN)
+
+/* The BLAKE2b G mixing function and rounds, using the vector operation
+   macros ADD, XOR, ROR32, ROR24, ROR16 and ROR63 defined for each kernel. */
+#  define G(a, b, c, d, x, y) do {\
+    a = ADD(ADD(a, b), x); d = ROR32(XOR(d, a));\
+    c = ADD(c, d); b = ROR24(XOR(b, c));\
+    a = ADD(ADD(a, b), y); d = ROR16(XOR(d, a));\
+    c = ADD(c, d); b = ROR63(XOR(b, c));\
+} while (0)
+
+#  define ROUND(s) do {\
+    G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);\
+    G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);\
+    G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);\
+    G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);\
+    G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);\
+    G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);\
+    G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);\
+    G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);\
+} while (0)
+
+/** Get the number of blocks for a message of length len. */
+static inline size_t rs_blake2b_blocks(size_t len)
+{
+    return len ? (len + RS_BLAKE2B_BLOCK_LEN - 1) / RS_BLAKE2B_BLOCK_LEN : 1;
+}
+
+/** Copy the final partial block of each lane into zero padded buffers. */
+static inline void rs_blake2b_pad(const unsigned char *const *in, size_t len,
+                                  int lanes,
+                                  unsigned char last[][RS_BLAKE2B_BLOCK_LEN])
+{
+    size_t pos = (rs_blake2b_blocks(len) - 1) * RS_BLAKE2B_BLOCK_LEN;
+    int i;
+
+    for (i = 0; i < lanes; i++) {
+        memset(last[i], 0, RS_BLAKE2B_BLOCK_LEN);
+        memcpy(last[i], in[i] + pos, len - pos);
+    }
+}
+
+/** Transpose a 4x4 matrix of 64 bit words. */
+RS_TARGET("avx2")
+static inline void rs_transpose4x4(__m256i *c, __m256i r0, __m256i r1,
+                                   __m256i r2, __m256i r3)
+{
+    __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+
+    c[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+    c[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+    c[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+    c[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+#  define ADD(a, b) _mm256_add_epi64(a, b)
+#  define XOR(a, b) _mm256_xor_si256(a, b)
+#  define ROR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#  define ROR24(x) _mm256_shuffle_epi8(x, r24)
+#  define ROR16(x) _mm256_shuffle_epi8(x, r16)
+#  define ROR63(x) _mm256_or_si256(_mm256_srli_epi64(x, 63), ADD(x, x))
+
+/** Hash 4 messages at once using AVX2. */
+RS_TARGET("avx2")
+static void rs_blake2b_avx2(const unsigned char *const *in, size_t len,
+                            rs_strong_sum_t *const *out)
+{
+    const __m256i r24 =
+        _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    const __m256i r16 =
+        _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    unsigned char last[4][RS_BLAKE2B_BLOCK_LEN];
+    const unsigned char *p[4];
+    size_t blocks = rs_blake2b_blocks(len), b;
+    __m256i h[8], v[16], m[16], c[4];
+    uint64_t t, f;
+    int i, r;
+
+    rs_blake2b_pad(in, len, 4, last);
+    for (i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi64x((long long)blake2b_iv[i]);
+    h[0] = _mm256_set1_epi64x((long long)(blake2b_iv[0] ^ RS_BLAKE2B_PARAM0));
+    for (b = 0; b < blocks; b++) {
+        if (b + 1 < blocks) {
+            for (i = 0; i < 4; i++)
+                p[i] = in[i] + b * RS_BLAKE2B_BLOCK_LEN;
+            t = (b + 1) * RS_BLAKE2B_BLOCK_LEN;
+            f = 0;
+        } else {
+            for (i = 0; i < 4; i++)
+                p[i] = last[i];
+            t = len;
+            f = ~(uint64_t)0;
+        }
+        for (i = 0; i < 16; i += 4)
+            rs_transpose4x4(&m[i],
+                            _mm256_loadu_si256((const __m256i *)(p[0] + 8 * i)),
+                            _mm256_loadu_si256((const __m256i *)(p[1] + 8 * i)),
+                            _mm256_loadu_si256((const __m256i *)(p[2] + 8 * i)),
+                            _mm256_loadu_si256((const __m256i *)(p[3] + 8 * i)));
+        for (i = 0; i < 8; i++) {
+            v[i] = h[i];
+            v[i + 8] = _mm256_set1_epi64x((long long)blake2b_iv[i]);
+        }
+        v[12] = _mm256_set1_epi64x((long long)(blake2b_iv[4] ^ t));
+        v[14] = _mm256_set1_epi64x((long long)(blake2b_iv[6] ^ f));
+        for (r = 0; r < 12; r++)
+            ROUND(blake2b_sigma[r]);
+        for (i = 0; i < 8; i++)
+            h[i] = XOR(h[i], XOR(v[i], v[i + 8]));
+    }
+    rs_transpose4x4(c, h[0], h[1], h[2], h[3]);
+    for (i = 0; i < 4; i++)
+        _mm256_storeu_si256((__m256i *)out[i], c[i]);
+}
+
+#  undef ADD
+#  undef XOR
+#  undef ROR32
+#  undef ROR24
+#  undef ROR16
+#  undef ROR63
+
+static const rs_blake2b_impl_t rs_blake2b_x4 = { "avx2x4", 4, rs_blake2b_avx2 };
+
+/** Transpose an 8x8 matrix of 64 bit words. */
+RS_TARGET("avx512f")
+static inline void rs_transpose8x8(__m512i *c, __m512i const *r)
+{
+    __m512i t[8], u[8];
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+        t[i] = _mm512_unpacklo_epi64(r[i], r[i + 1]);
+        t[i + 1] = _mm512_unpackhi_epi64(r[i], r[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+        u[i] = _mm512_shuffle_i64x2(t[i], t[i + 2], _MM_SHUFFLE(2, 0, 2, 0));
+        u[i + 1] =
+            _mm512_shuffle_i64x2(t[i], t[i + 2], _MM_SHUFFLE(3, 1, 3, 1));
+        u[i + 2] =
+            _mm512_shuffle_i64x2(t[i + 1], t[i + 3], _MM_SHUFFLE(2, 0, 2, 0));
+        u[i + 3] =
+            _mm512_shuffle_i64x2(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 1, 3, 1));
+    }
+    c[0] = _mm512_shuffle_i64x2(u[0], u[4], _MM_SHUFFLE(2, 0, 2, 0));
+    c[4] = _mm512_shuffle_i64x2(u[0], u[4], _MM_SHUFFLE(3, 1, 3, 1));
+    c[2] = _mm512_shuffle_i64x2(u[1], u[5], _MM_SHUFFLE(2, 0, 2, 0));
+    c[6] = _mm512_shuffle_i64x2(u[1], u[5], _MM_SHUFFLE(3, 1, 3, 1));
+    c[1] = _mm512_shuffle_i64x2(u[2], u[6], _MM_SHUFFLE(2, 0, 2, 0));
+    c[5] = _mm512_shuffle_i64x2(u[2], u[6], _MM_SHUFFLE(3, 1, 3, 1));
+    c[3] = _mm512_shuffle_i64x2(u[3], u[7], _MM_SHUFFLE(2, 0, 2, 0));
+    c[7] = _mm512_shuffle_i64x2(u[3], u[7], _MM_SHUFFLE(3, 1, 3, 1));
+}
+
+#  define ADD(a, b) _mm512_add_epi64(a, b)
+#  define XOR(a, b) _mm512_xor_si512(a, b)
+#  define ROR32(x) _mm512_ror_epi64(x, 32)
+#  define ROR24(x) _mm512_ror_epi64(x, 24)
+#  define ROR16(x) _mm512_ror_epi64(x, 16)
+#  define ROR63(x) _mm512_ror_epi64(x, 63)
+
+/** Hash 8 messages at once using AVX-512. */
+RS_TARGET("avx512f")
+static void rs_blake2b_avx512(const unsigned char *const *in, size_t len,
+                              rs_strong_sum_t *const *out)
+{
+    unsigned char last[8][RS_BLAKE2B_BLOCK_LEN];
+    const unsigned char *p[8];
+    size_t blocks = rs_blake2b_blocks(len), b;
+    __m512i h[8], v[16], m[16], rows[8], c[8];
+    uint64_t t, f;
+    int i, j, r;
+
+    rs_blake2b_pad(in, len, 8, last);
+    for (i = 0; i < 8; i++)
+        h[i] = _mm512_set1_epi64((long long)blake2b_iv[i]);
+    h[0] = _mm512_set1_epi64((long long)(blake2b_iv[0] ^ RS_BLAKE2B_PARAM0));
+    for (b = 0; b < blocks; b++) {
+        if (b + 1 < blocks) {
+            for (i = 0; i < 8; i++)
+                p[i] = in[i] + b * RS_BLAKE2B_BLOCK_LEN;
+            t = (b + 1) * RS_BLAKE2B_BLOCK_LEN;
+            f = 0;
+        } else {
+            for (i = 0; i < 8; i++)
+                p[i] = last[i];
+            t = len;
+            f = ~(uint64_t)0;
+        }
+        for (i = 0; i < 16; i += 8) {
+            for (j = 0; j < 8; j++)
+                rows[j] = _mm512_loadu_si512((const void *)(p[j] + 8 * i));
+            rs_transpose8x8(&m[i], rows);
+        }
+        for (i = 0; i < 8; i++) {
+            v[i] = h[i];
+            v[i + 8] = _mm512_set1_epi64((long long)blake2b_iv[i]);
+        }
+        v[12] = _mm512_set1_epi64((long long)(blake2b_iv[4] ^ t));
+        v[14] = _mm512_set1_epi64((long long)(blake2b_iv[6] ^ f));
+        for (r = 0; r < 12; r++)
+            ROUND(blake2b_sigma[r]);
+        for (i = 0; i < 8; i++)
+            h[i] = XOR(h[i], XOR(v[i], v[i + 8]));
+    }
+    rs_transpose8x8(c, h);
+    for (i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)out[i], _mm512_castsi512_si256(c[i]));
+}
+
+#  undef ADD
+#  undef XOR
+#  undef ROR32
+#  undef ROR24
+#  undef ROR16
+#  undef ROR63
+#  undef G
+#  undef ROUND
+
+static const rs_blake2b_impl_t rs_blake2b_x8 =
+    { "avx512x8", 8, rs_blake2b_avx512 };
+#endif                          /* RS_SIMD_X86 */
+
+rs_blake2b_impl_t const *rs_blake2b_select(rs_cpu_level_t level)
+{
+#ifdef RS_SIMD_X86
+    if (level >= RS_CPU_AVX512)
+        return &rs_blake2b_x8;
+    if (level >= RS_CPU_AVX2)
+        return &rs_blake2b_x4;
+#else
+    (void)level;
+#endif
+    return &rs_blake2b_scalar;
+}
+
+void rs_blake2b_mb(void const *const *bufs, size_t len, int n,
+                   rs_strong_sum_t *const *sums)
+{
+    rs_blake2b_impl_t const *impl = rs_cpu()->blake2b;
+    const unsigned char *in[RS_BLAKE2B_MAX_LANES];
+    rs_strong_sum_t *out[RS_BLAKE2B_MAX_LANES];
+    rs_strong_sum_t spare;
+    int i, k;
+
+    /* Hash full sets of lanes, filling any unused lanes with dummies. */
+    while (n > 1 && impl->lanes > 1) {
+        k = n < impl->lanes ? n : impl->lanes;
+        for (i = 0; i < impl->lanes; i++) {
+            in[i] = bufs[i < k ? i : 0];
+            out[i] = i < k ? sums[i] : &spare;
+        }
+        impl->fn(in, len, out);
+        bufs += k;
+        sums += k;
+        n -= k;
+    }
+    for (; n > 0; n--)
+        rs_blake2b_1(*bufs++, len, *sums++);
+}
@@ -0,0 +1,64 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file blake2mb.h
+ * Multi-buffer BLAKE2b for hashing many equal length blocks at once.
+ *
+ * Hashing a single short message with BLAKE2b is a long chain of dependent
+ * 64-bit operations that can't use SIMD very well. When there are many
+ * independent messages of the same length, like the blocks of a signature,
+ * they can instead be hashed in separate lanes of SIMD registers, hashing 4
+ * blocks at a time with AVX2 or 8 at a time with AVX-512. */
+#ifndef BLAKE2MB_H
+#  define BLAKE2MB_H
+
+#  include <stddef.h>
+#  include "librsync.h"
+#  include "simd.h"
+
+/** Function type for hashing a full set of lanes in rs_blake2b_mb(). */
+typedef void rs_blake2b_lanes_fn(const unsigned char *const *in, size_t len,
+                                 rs_strong_sum_t *const *out);
+
+/** A multi-buffer BLAKE2b implementation. */
+typedef struct rs_blake2b_impl {
+    char const *name;           /**< The name reported by rs_cpu_features(). */
+    int lanes;                  /**< The number of lanes it hashes at once. */
+    rs_blake2b_lanes_fn *fn;    /**< The function to hash them. */
+} rs_blake2b_impl_t;
+
+/** Get the best multi-buffer BLAKE2b implementation for a cpu level. */
+rs_blake2b_impl_t const *rs_blake2b_select(rs_cpu_level_t level);
+
+/** Calculate the 32 byte BLAKE2b sums of \p n buffers of length \p len.
+ *
+ * This gives the same results as calling rs_calc_strong_sum() with RS_BLAKE2
+ * for each of the buffers.
+ *
+ * \param bufs - array of \p n pointers to the buffers to hash.
+ *
+ * \param len - the length of every buffer.
+ *
+ * \param n - the number of buffers.
+ *
+ * \param sums - array of \p n pointers to where to store the sums. */
+void rs_blake2b_mb(void const *const *bufs, size_t len, int n,
+                   rs_strong_sum_t *const *sums);
+
+#endif                          /* !BLAKE2MB_H */
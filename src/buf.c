@@ -23,10 +23,20 @@
                                | Pick a window, Jimmy, you're leaving.
                                */
 
+#include "config.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
 #include "librsync.h"
 #include "buf.h"
 #include "job.h"
@@ -127,3 +137,133 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
     }
     return RS_DONE;
 }
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#  define RS_USE_MMAP 1
+#endif
+
+/* Use ftello64 and fseeko64, or ftello and fseeko, for the positions of long
+   files if they exist. */
+#if defined(HAVE_FSEEKO64) && (SIZEOF_OFF_T < 8)
+typedef off64_t rs_off_t;
+#  define rs_ftell(f) ftello64((f))
+#  define rs_fseek(f, o, w) fseeko64((f), (o), (w))
+#elif defined(HAVE_FSEEKO)
+typedef off_t rs_off_t;
+#  define rs_ftell(f) ftello((f))
+#  define rs_fseek(f, o, w) fseeko((f), (o), (w))
+#else
+typedef long rs_off_t;
+#  define rs_ftell(f) ftell((f))
+#  define rs_fseek(f, o, w) fseek((f), (o), (w))
+#endif
+
+/** Copies from a mapped basis at least this long get a MADV_WILLNEED hint. */
+#define RS_MAP_WILLNEED_LEN (64 * 1024)
+
+struct rs_filemap {
+    FILE *f;
+    rs_byte_t *map;             /**< The mapping of the whole file. */
+    size_t len;                 /**< The length of the file and mapping. */
+    size_t start;               /**< The file position when it was mapped. */
+    size_t page_mask;           /**< The page size - 1. */
+};
+
+rs_filemap_t *rs_filemap_new(FILE *f, int sequential)
+{
+#ifdef RS_USE_MMAP
+    rs_filemap_t *fm;
+    rs_long_t size = rs_file_size(f);
+    rs_off_t start;
+    void *map;
+
+    /* Only map non-empty regular files that fit in memory. */
+    if (!rs_mmap || size <= 0 || (rs_long_t)(rs_off_t)size != size
+        || (rs_long_t)(size_t)size != size)
+        return NULL;
+    if ((start = rs_ftell(f)) < 0 || start > size)
+        return NULL;
+    map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) {
+        rs_trace("can't map file, using stdio: %s", strerror(errno));
+        return NULL;
+    }
+#  ifdef HAVE_MADVISE
+    if (sequential)
+        madvise(map, (size_t)size, MADV_SEQUENTIAL);
+#  endif
+    fm = rs_alloc_struct(rs_filemap_t);
+    fm->f = f;
+    fm->map = map;
+    fm->len = (size_t)size;
+    fm->start = (size_t)start;
+    fm->page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    rs_trace("mapped " FMT_SIZE " byte file", fm->len);
+    return fm;
+#else
+    (void)f;
+    (void)sequential;
+    return NULL;
+#endif
+}
+
+void rs_filemap_free(rs_filemap_t *fm, size_t unused)
+{
+#ifdef RS_USE_MMAP
+    /* Leave the file positioned after the data that was used. */
+    if (fm->f && rs_fseek(fm->f, (rs_off_t)(fm->len - unused), SEEK_SET))
+        rs_warn("seek failed: %s", strerror(errno));
+    munmap(fm->map, fm->len);
+#endif
+    rs_bzero(fm, sizeof *fm);
+    free(fm);
+}
+
+void rs_filemap_release(rs_filemap_t *fm)
+{
+    if (rs_fseek(fm->f, 0, SEEK_END))
+        rs_warn("seek failed: %s", strerror(errno));
+    fm->f = NULL;
+}
+
+/* Give the stream the whole mapped file at once. */
+void const *rs_filemap_data(rs_filemap_t *fm, size_t *len)
+{
+    *len = fm->len - fm->start;
+    return fm->map + fm->start;
+}
+
+rs_result rs_inmapbuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    rs_filemap_t *fm = (rs_filemap_t *)opaque;
+
+    if (!buf->eof_in) {
+        buf->next_in = (char *)fm->map + fm->start;
+        buf->avail_in = fm->len - fm->start;
+        buf->eof_in = 1;
+        job->stats.in_bytes += buf->avail_in;
+        rs_trace("seen end of file on mapped input");
+    }
+    return RS_DONE;
+}
+
+rs_result rs_filemap_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    rs_filemap_t *fm = (rs_filemap_t *)arg;
+
+    if (pos < 0 || pos >= (rs_long_t)fm->len) {
+        rs_error("unexpected eof at " FMT_LONG " on mapped file", pos);
+        return RS_INPUT_ENDED;
+    }
+    if (*len > fm->len - (size_t)pos)
+        *len = fm->len - (size_t)pos;
+    *buf = fm->map + pos;
+#if defined(RS_USE_MMAP) && defined(HAVE_MADVISE)
+    if (*len >= RS_MAP_WILLNEED_LEN) {
+        size_t offset = (size_t)pos & fm->page_mask;
+
+        madvise(fm->map + (size_t)pos - offset, *len + offset, MADV_WILLNEED);
+    }
+#endif
+    return RS_DONE;
+}
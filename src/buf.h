@@ -24,7 +24,8 @@
  *
  * As the stream consumes input and produces output, it is refilled from
  * appropriate input and output FILEs. A dynamically allocated buffer of
- * configurable size is used as an intermediary.
+ * configurable size is used as an intermediary. Regular files can instead be
+ * memory-mapped, and the mapping used directly as the input buffer.
  *
  * \todo Perhaps be more efficient by filling the buffer on every call even if
  * not yet completely empty. Check that it's really our buffer, and shuffle
@@ -47,4 +48,44 @@ rs_result rs_infilebuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
 
 rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
 
+/** A read-only memory mapping of a whole regular file.
+ *
+ * Where it is supported, this lets jobs read their input and patch read its
+ * basis directly from the page cache without copying. */
+typedef struct rs_filemap rs_filemap_t;
+
+/** Map a stdio file into memory.
+ *
+ * \param f - the file to map. Only data after its current position is used as
+ * job input, but copy callbacks can read the whole file.
+ *
+ * \param sequential - whether to hint that it will be read sequentially.
+ *
+ * \return The new mapping, or NULL if the file can't be mapped and stdio
+ * should be used instead. */
+rs_filemap_t *rs_filemap_new(FILE *f, int sequential);
+
+/** Unmap a file.
+ *
+ * \param unused - the amount of job input left unused at the end of the
+ * mapping. The file is positioned just after the used data. */
+void rs_filemap_free(rs_filemap_t *fm, size_t unused);
+
+/** Stop using the file of a mapping, so the mapping can outlive it.
+ *
+ * The file is positioned at its end, as if all the data was used. */
+void rs_filemap_release(rs_filemap_t *fm);
+
+/** Get the data after the file position when it was mapped.
+ *
+ * This is the same data rs_inmapbuf_fill() gives as input. */
+void const *rs_filemap_data(rs_filemap_t *fm, size_t *len);
+
+/** Give the stream the whole mapped file as input. */
+rs_result rs_inmapbuf_fill(rs_job_t *, rs_buffers_t *buf, void *fm);
+
+/** ::rs_copy_cb that returns a pointer into a mapped file. */
+rs_result rs_filemap_copy_cb(void *arg, rs_long_t pos, size_t *len,
+                             void **buf);
+
 #endif                          /* !BUF_H */
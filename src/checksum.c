@@ -24,10 +24,14 @@
 #include <stdint.h>
 #include "checksum.h"
 #include "blake2.h"
+#include "blake2mb.h"
+#define XXH_INLINE_ALL
+#include "xxhash.h"
 #include "librsync_export.h"
 
 LIBRSYNC_EXPORT const int RS_MD4_SUM_LENGTH = 16;
 LIBRSYNC_EXPORT const int RS_BLAKE2_SUM_LENGTH = 32;
+LIBRSYNC_EXPORT const int RS_XXH3_SUM_LENGTH = 16;
 
 /** A simple 32bit checksum that can be incrementally updated. */
 rs_weak_sum_t rs_calc_weak_sum(weaksum_kind_t kind, void const *buf, size_t len)
@@ -60,6 +64,10 @@ void rs_calc_strong_sum(strongsum_kind_t kind, void const *buf, size_t len,
 {
     if (kind == RS_MD4) {
         rs_mdfour((unsigned char *)sum, buf, len);
+    } else if (kind == RS_XXH3) {
+        /* Store the 128 bit hash in its canonical big-endian form. */
+        XXH128_canonicalFromHash((XXH128_canonical_t *)sum,
+                                 XXH3_128bits(buf, len));
     } else {
         blake2b_state ctx;
         blake2b_init(&ctx, RS_MAX_STRONG_SUM_LENGTH);
@@ -67,3 +75,19 @@ void rs_calc_strong_sum(strongsum_kind_t kind, void const *buf, size_t len,
         blake2b_final(&ctx, (uint8_t *)sum, RS_MAX_STRONG_SUM_LENGTH);
     }
 }
+
+void rs_calc_strong_sums(strongsum_kind_t kind, void const *const *bufs,
+                         size_t len, int n, rs_strong_sum_t *const *sums)
+{
+    int i;
+
+    if (kind == RS_MD4) {
+        rs_mdfour_batch((unsigned char *const *)sums, bufs, len, n);
+    } else if (kind == RS_XXH3) {
+        /* XXH3 is already vectorized within each buffer. */
+        for (i = 0; i < n; i++)
+            rs_calc_strong_sum(kind, bufs[i], len, sums[i]);
+    } else {
+        rs_blake2b_mb(bufs, len, n, sums);
+    }
+}
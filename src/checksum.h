@@ -41,6 +41,7 @@ typedef enum {
 typedef enum {
     RS_MD4,
     RS_BLAKE2,
+    RS_XXH3,
 } strongsum_kind_t;
 
 /** Abstract wrapper around weaksum implementations.
@@ -100,6 +101,26 @@ static inline void weaksum_rotate(weaksum_t *sum, unsigned char out,
         rabinkarp_rotate(&sum->sum.rk, out, in);
 }
 
+/** Rotate a weaksum through n bytes, getting the digest before each rotation.
+ *
+ * This is the same as getting weaksum_digest() and then doing
+ * weaksum_rotate(sum, buf[k], buf[k + weaksum_count(sum)]) for each k in
+ * [0,n), but computes the digests for many offsets at once.
+ *
+ * \param buf - the bytes currently in the sum, followed by at least n more.
+ *
+ * \param n - the number of rotations.
+ *
+ * \param digests - array of \p n digests to set. */
+static inline void weaksum_rotate_n(weaksum_t *sum, const unsigned char *buf,
+                                    size_t n, rs_weak_sum_t *digests)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumRotateN(&sum->sum.rs, buf, n, digests);
+    else
+        rabinkarp_rotate_n(&sum->sum.rk, buf, n, digests);
+}
+
 static inline void weaksum_rollin(weaksum_t *sum, unsigned char in)
 {
     if (sum->kind == RS_ROLLSUM)
@@ -138,4 +159,21 @@ rs_weak_sum_t rs_calc_weak_sum(weaksum_kind_t kind, void const *buf,
 void rs_calc_strong_sum(strongsum_kind_t kind, void const *buf, size_t len,
                         rs_strong_sum_t *sum);
 
+/** Calculate the strongsums of a batch of equal length buffers.
+ *
+ * This gives the same sums as calling rs_calc_strong_sum() for each buffer,
+ * but can hash several buffers at once in different SIMD lanes.
+ *
+ * \param kind - the strongsum kind.
+ *
+ * \param bufs - array of \p n pointers to the buffers.
+ *
+ * \param len - the length of every buffer.
+ *
+ * \param n - the number of buffers.
+ *
+ * \param sums - array of \p n pointers to where to store the sums. */
+void rs_calc_strong_sums(strongsum_kind_t kind, void const *const *bufs,
+                         size_t len, int n, rs_strong_sum_t *const *sums);
+
 #endif                          /* !CHECKSUM_H */
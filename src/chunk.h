@@ -0,0 +1,59 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file chunk.h
+ * Content-defined chunking for chunked signatures.
+ *
+ * Chunked signatures cut files into chunks where a gear hash of the last
+ * bytes has enough zero bits, like FastCDC. The cut points depend only on the
+ * data since the start of the chunk, so after an insertion or deletion the
+ * chunks of the new file line up with the basis again at the next cut point.
+ * Chunks are between 1/4 and 4 times the average length, and the cut
+ * condition is harder before the average length and easier after it, which
+ * keeps most chunks close to the average. */
+#ifndef CHUNK_H
+#  define CHUNK_H
+
+#  include <stddef.h>
+
+/** Get the minimum chunk length for an average chunk length. */
+static inline size_t rs_chunk_min_len(size_t avg_len)
+{
+    return avg_len / 4;
+}
+
+/** Get the maximum chunk length for an average chunk length. */
+static inline size_t rs_chunk_max_len(size_t avg_len)
+{
+    return avg_len * 4;
+}
+
+/** Get the length of the chunk at the start of some data.
+ *
+ * \param buf - the data starting at the start of the chunk.
+ *
+ * \param len - the length of the data, which must be at least the maximum
+ * chunk length unless it is the end of the data.
+ *
+ * \param avg_len - the average chunk length.
+ *
+ * \return The length of the chunk, which is at most len. */
+size_t rs_chunk_len(void const *buf, size_t len, size_t avg_len);
+
+#endif                          /* !CHUNK_H */
@@ -29,6 +29,8 @@ struct rs_op_kind_name const rs_op_kind_names[] = {
     {"LITERAL", RS_KIND_LITERAL},
     {"SIGNATURE", RS_KIND_SIGNATURE},
     {"CHECKSUM", RS_KIND_CHECKSUM},
+    {"COPY_OUTPUT", RS_KIND_COPY_OUTPUT},
+    {"FILL", RS_KIND_FILL},
     {"INVALID", RS_KIND_INVALID},
     {NULL, 0}
 };
@@ -36,6 +36,8 @@ enum rs_op_kind {
     RS_KIND_SIGNATURE,
     RS_KIND_COPY,
     RS_KIND_CHECKSUM,
+    RS_KIND_COPY_OUTPUT,
+    RS_KIND_FILL,
     RS_KIND_RESERVED,           /* for future expansion */
 
     /* This one should never occur in file streams. It's an internal marker for
@@ -0,0 +1,143 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file cpu.c
+ * Runtime selection of the checksum kernels for the CPU. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#include "librsync.h"
+#include "cpu.h"
+#include "trace.h"
+
+/** The names of the levels, as used by LIBRSYNC_CPU and rs_cpu_select(). */
+static char const *const rs_cpu_names[] = {
+    "scalar", "sse2", "sse4.1", "avx2", "avx512"
+};
+
+static rs_cpu_t rs_cpu_table;
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t rs_cpu_once = PTHREAD_ONCE_INIT;
+#else
+static int rs_cpu_done = 0;
+#endif
+
+/** Detect the best level supported by this CPU. */
+static rs_cpu_level_t rs_cpu_detect(void)
+{
+#ifdef RS_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return RS_CPU_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return RS_CPU_AVX2;
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+        return RS_CPU_SSE41;
+    if (__builtin_cpu_supports("sse2"))
+        return RS_CPU_SSE2;
+#endif
+    return RS_CPU_SCALAR;
+}
+
+/** Parse a level name, returning the detected level for "auto".
+ *
+ * \return 0 if the name is valid, -1 if it isn't. */
+static int rs_cpu_parse(char const *name, rs_cpu_level_t *level)
+{
+    int i;
+
+    if (!name || !strcmp(name, "auto")) {
+        *level = rs_cpu_table.detected;
+        return 0;
+    }
+    for (i = 0; i <= RS_CPU_AVX512; i++)
+        if (!strcmp(name, rs_cpu_names[i])) {
+            *level = (rs_cpu_level_t)i;
+            return 0;
+        }
+    return -1;
+}
+
+/** Select the kernels for a level, capped to what the CPU supports. */
+static void rs_cpu_set(rs_cpu_level_t level)
+{
+    rs_cpu_t *cpu = &rs_cpu_table;
+
+    if (level > cpu->detected)
+        level = cpu->detected;
+    cpu->level = level;
+    cpu->blake2b = rs_blake2b_select(level);
+    cpu->mdfour = rs_mdfour_select(level);
+    cpu->rollsum = rs_rollsum_select(level);
+    cpu->rabinkarp = rs_rabinkarp_select(level);
+    snprintf(cpu->features, sizeof(cpu->features),
+             "%s blake2b=%s md4=%s rollsum=%s rabinkarp=%s",
+             rs_cpu_names[level], cpu->blake2b->name, cpu->mdfour->name,
+             cpu->rollsum->name, cpu->rabinkarp->name);
+    rs_trace("selected checksum kernels: %s", cpu->features);
+}
+
+static void rs_cpu_init(void)
+{
+    char const *env = getenv("LIBRSYNC_CPU");
+    rs_cpu_level_t level;
+
+    rs_cpu_table.detected = level = rs_cpu_detect();
+    if (env && *env && rs_cpu_parse(env, &level))
+        rs_warn("unknown LIBRSYNC_CPU level \"%s\", using %s", env,
+                rs_cpu_names[level]);
+    rs_cpu_set(level);
+}
+
+rs_cpu_t const *rs_cpu(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_once(&rs_cpu_once, rs_cpu_init);
+#else
+    if (!rs_cpu_done) {
+        rs_cpu_init();
+        rs_cpu_done = 1;
+    }
+#endif
+    return &rs_cpu_table;
+}
+
+rs_result rs_cpu_select(char const *level)
+{
+    rs_cpu_level_t l;
+
+    rs_cpu();
+    if (rs_cpu_parse(level, &l)) {
+        rs_error("unknown cpu level \"%s\"", level);
+        return RS_PARAM_ERROR;
+    }
+    rs_cpu_set(l);
+    return RS_DONE;
+}
+
+char const *rs_cpu_features(void)
+{
+    return rs_cpu()->features;
+}
@@ -0,0 +1,51 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file cpu.h
+ * Runtime selection of the checksum kernels for the CPU.
+ *
+ * The first call to rs_cpu() detects the instruction set level supported by
+ * the CPU and fills in a table with the best implementation of each kernel for
+ * it. The level can be lowered by setting the LIBRSYNC_CPU environment
+ * variable or by calling rs_cpu_select(), which is useful for testing and
+ * benchmarking the different implementations. */
+#ifndef CPU_H
+#  define CPU_H
+
+#  include "simd.h"
+#  include "blake2mb.h"
+#  include "mdfour.h"
+#  include "rollsum.h"
+#  include "rabinkarp.h"
+
+/** The table of selected kernel implementations. */
+typedef struct rs_cpu {
+    rs_cpu_level_t detected;    /**< The level supported by this CPU. */
+    rs_cpu_level_t level;       /**< The level kernels were selected for. */
+    rs_blake2b_impl_t const *blake2b;   /**< Multi-buffer BLAKE2b. */
+    rs_mdfour_impl_t const *mdfour;     /**< Multi-buffer MD4. */
+    rs_rollsum_impl_t const *rollsum;   /**< RollsumUpdate(). */
+    rs_rabinkarp_impl_t const *rabinkarp;       /**< rabinkarp_update(). */
+    char features[128];         /**< Description for rs_cpu_features(). */
+} rs_cpu_t;
+
+/** Get the table of selected kernels, initializing it if needed. */
+rs_cpu_t const *rs_cpu(void);
+
+#endif                          /* !CPU_H */
@@ -86,34 +86,98 @@
  * into the scoop that indicates the point scanned to. As data is scanned,
  * scan_pos is incremented. As data is processed, it is removed from the scoop
  * and scan_pos adjusted. Everything gets complicated because the tube can
- * block. When the tube is blocked, no data can be processed. */
+ * block. When the tube is blocked, no data can be processed.
+ *
+ * For a format 2 delta, processed data is also added to the job's history of
+ * the last window of the new file, so the new file position of scan_buf[0] is
+ * always the length of the history. The whole aligned blocks of miss data are
+ * indexed by their weak_sum as they are scanned. Where the signature has no
+ * match, the index is checked for an earlier copy of the block in the new
+ * file, and a match there is emitted as a COPY_OUTPUT command. These matches
+ * are extended forwards and backwards byte by byte, since the earlier data
+ * can always be read from the history or the scan_buf.
+ *
+ * Runs of at least two blocks of equal bytes, like the zeros in disk images,
+ * are found with word-at-a-time compares before they are hashed, with run_off
+ * remembering how far the scan_buf has been checked. A run is appended
+ * without hashing it, as a FILL command in a format 2 delta, or else as a
+ * copy of the longest run of blocks of the same bytes in the basis, or as a
+ * miss if there are none. The last block_len-1 bytes of a run are scanned
+ * normally, since a block of the basis can start with them.
+ *
+ * Below the maximum effort level, miss_run counts the misses since the last
+ * match. Once it reaches skip_after, the scan alternates between skipping
+ * skip_len bytes as misses without looking at them and scanning scan_left
+ * offsets normally, until a match is found.
+ *
+ * A segment job started by pdelta.c with rs_delta_seg_begin() does the same
+ * scan of part of the new file, but records its commands for pdelta.c to
+ * stitch together instead of emitting them, and stops soon after seg_len. */
 
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include "librsync.h"
 #include "job.h"
 #include "sumset.h"
+#include "chunk.h"
 #include "checksum.h"
 #include "scoop.h"
 #include "emit.h"
+#include "command.h"
+#include "history.h"
+#include "pdelta.h"
 #include "trace.h"
+#include "util.h"
 
-/** Max length of a miss is 64K including 3 command bytes. */
-#define MAX_MISS_LEN (MAX_DELTA_CMD - 3)
+/** A slot in the index of blocks of literal data in the history. */
+typedef struct rs_out_slot {
+    rs_weak_sum_t weak_sum;     /**< The weak_sum digest of the block. */
+    rs_long_t pos;              /**< The block position + 1, or 0 if empty. */
+} rs_out_slot_t;
+
+/** The max number of slots in the index of the history. */
+#define RS_OUT_INDEX_MAX (1 << 20)
+
+/** The max length of a run of equal bytes appended at a time. */
+#define RS_RUN_PIECE MAX_DELTA_CMD
 
 static rs_result rs_delta_s_scan(rs_job_t *job);
 static rs_result rs_delta_s_flush(rs_job_t *job);
+static rs_result rs_delta_s_chunk(rs_job_t *job);
 static rs_result rs_delta_s_end(rs_job_t *job);
 static inline rs_result rs_getinput(rs_job_t *job, size_t block_len);
 static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos,
-                               size_t *match_len);
+                               size_t *match_len, int *output);
+static inline rs_result rs_scanbatch(rs_job_t *job, size_t end);
+static inline size_t rs_findrun(rs_job_t *job, int *run);
+static inline rs_result rs_appendrun(rs_job_t *job);
 static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos,
-                                       size_t match_len);
+                                       size_t match_len, int output);
+static size_t rs_extendfwd(rs_job_t *job, rs_long_t basis_pos, size_t len);
+static size_t rs_extendback(rs_job_t *job, rs_long_t basis_pos);
+static size_t rs_matchoutput(rs_job_t *job, rs_long_t pos, size_t off,
+                             size_t len);
+static inline rs_long_t rs_findoutput(rs_job_t *job, rs_weak_sum_t weak_sum,
+                                      size_t off, size_t len);
+static size_t rs_outputback(rs_job_t *job, rs_long_t pos);
 static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len);
 static inline rs_result rs_appendflush(rs_job_t *job);
+static inline rs_result rs_appendskip(rs_job_t *job, size_t end);
 static inline rs_result rs_processmatch(rs_job_t *job);
 static inline rs_result rs_processmiss(rs_job_t *job);
 
+/** Check if a segment job for pdelta.c has reached the end of its segment.
+ *
+ * It has when the commands recorded and the miss after them reach seg_len,
+ * unless a match is still being extended. */
+static inline int rs_segdone(rs_job_t *job)
+{
+    return job->seg_len && !job->basis_len
+        && job->seg_done + (rs_long_t)job->scan_pos >= job->seg_len;
+}
+
 /** Get a block of data if possible, and see if it matches.
  *
  * On each call, we try to process all of the input data available on the scoop
@@ -122,30 +186,61 @@ static rs_result rs_delta_s_scan(rs_job_t *job)
 {
     const size_t block_len = job->signature->block_len;
     rs_long_t match_pos;
-    size_t match_len;
+    size_t match_len, run_pos;
+    int output, run;
     rs_result result;
 
     rs_job_check(job);
     /* output any pending output from the tube */
     if ((result = rs_tube_catchup(job)) != RS_DONE)
         return result;
-    /* read the input into the scoop */
-    if ((result = rs_getinput(job, block_len)) != RS_DONE)
+    /* read the input into the scoop, with enough to check for runs */
+    if ((result = rs_getinput(job, 2 * block_len)) != RS_DONE)
         return result;
     /* while output is not blocked and there is a block of data */
     while ((result == RS_DONE) && ((job->scan_pos + block_len) < job->scan_len)) {
+        /* stop a segment job at the end of its segment */
+        if (rs_segdone(job))
+            break;
+        /* append a run of equal bytes, or wait for data to check for one */
+        if ((run_pos = rs_findrun(job, &run)) == job->scan_pos) {
+            if (!run)
+                break;
+            result = rs_appendrun(job);
+            continue;
+        }
+        /* skip ahead if scanning this miss run has used up its effort */
+        if (job->skip_after && !job->basis_len && !job->scan_left
+            && job->miss_run >= (rs_long_t)job->skip_after) {
+            result = rs_appendskip(job, run_pos);
+            continue;
+        }
+        /* scan a batch of offsets if it can't flush a match or miss */
+        if (weaksum_count(&job->weak_sum) && !job->basis_len
+            && job->scan_pos < MAX_MISS_LEN) {
+            result = rs_scanbatch(job, run_pos);
+            continue;
+        }
         /* check if this block matches */
-        if (rs_findmatch(job, &match_pos, &match_len)) {
+        if (rs_findmatch(job, &match_pos, &match_len, &output)) {
             /* append the match and reset the weak_sum */
-            result = rs_appendmatch(job, match_pos, match_len);
+            result = rs_appendmatch(job, match_pos, match_len, output);
             weaksum_reset(&job->weak_sum);
         } else {
             /* rotate the weak_sum and append the miss byte */
             weaksum_rotate(&job->weak_sum, job->scan_buf[job->scan_pos],
                            job->scan_buf[job->scan_pos + block_len]);
             result = rs_appendmiss(job, 1);
+            if (job->scan_left)
+                job->scan_left--;
         }
     }
+    /* if a segment job is done, flush and set end statefn */
+    if (result == RS_DONE && rs_segdone(job)) {
+        result = rs_appendflush(job);
+        job->statefn = rs_delta_s_end;
+        return result == RS_DONE ? RS_RUNNING : result;
+    }
     /* if we completed OK */
     if (result == RS_DONE) {
         /* if we reached eof, we can flush the last fragment */
@@ -165,6 +260,7 @@ static rs_result rs_delta_s_flush(rs_job_t *job)
     const size_t block_len = job->signature->block_len;
     rs_long_t match_pos;
     size_t match_len;
+    int output;
     rs_result result;
 
     rs_job_check(job);
@@ -177,9 +273,9 @@ static rs_result rs_delta_s_flush(rs_job_t *job)
     /* while output is not blocked and there is any remaining data */
     while ((result == RS_DONE) && (job->scan_pos < job->scan_len)) {
         /* check if this block matches */
-        if (rs_findmatch(job, &match_pos, &match_len)) {
+        if (rs_findmatch(job, &match_pos, &match_len, &output)) {
             /* append the match and reset the weak_sum */
-            result = rs_appendmatch(job, match_pos, match_len);
+            result = rs_appendmatch(job, match_pos, match_len, output);
             weaksum_reset(&job->weak_sum);
         } else {
             /* rollout from weak_sum and append the miss byte */
@@ -200,9 +296,77 @@ static rs_result rs_delta_s_flush(rs_job_t *job)
     return result;
 }
 
+/** Scan the next chunks of the new file for a chunked signature.
+ *
+ * The new file is cut into chunks the same way as the basis was, so each
+ * chunk needs only one weak sum and one hashtable lookup, and after an edit
+ * the chunks line up with the basis again at the next cut point. This needs
+ * up to the maximum chunk length of data to find where a chunk ends, unless
+ * it is the end of the input.
+ *
+ * If the job can read the basis, a match is extended byte by byte into the
+ * next chunk when it doesn't match, and the rest of that chunk is a miss so
+ * the following chunks are still cut at the same places. */
+static rs_result rs_delta_s_chunk(rs_job_t *job)
+{
+    const size_t avg_len = job->signature->block_len;
+    const size_t max_len = rs_chunk_max_len(avg_len);
+    rs_byte_t const *chunk;
+    rs_long_t match_pos;
+    size_t len, ext;
+    rs_result result;
+
+    rs_job_check(job);
+    /* output any pending output from the tube */
+    if ((result = rs_tube_catchup(job)) != RS_DONE)
+        return result;
+    /* read the input into the scoop */
+    if ((result = rs_getinput(job, max_len)) != RS_DONE)
+        return result;
+    /* while output is not blocked and there is a whole chunk of data */
+    while (result == RS_DONE && !rs_segdone(job)
+           && (job->scan_pos + max_len <= job->scan_len
+               || (job->stream->eof_in && job->scan_pos < job->scan_len))) {
+        chunk = job->scan_buf + job->scan_pos;
+        len = rs_chunk_len(chunk, job->scan_len - job->scan_pos, avg_len);
+        match_pos =
+            rs_signature_find_match(job->signature,
+                                    rs_signature_calc_weak_sum(job->signature,
+                                                               chunk, len),
+                                    chunk, len);
+        if (match_pos != -1) {
+            result = rs_appendmatch(job, match_pos, len, 0);
+            continue;
+        }
+        ext = 0;
+        if (job->basis_len && job->copy_cb)
+            ext = rs_extendfwd(job, job->basis_pos + job->basis_len,
+                               len < avg_len ? len : avg_len);
+        if (ext == len) {
+            result =
+                rs_appendmatch(job, job->basis_pos + job->basis_len, len, 0);
+        } else {
+            job->basis_len += (rs_long_t)ext;
+            job->scan_pos += ext;
+            result = rs_appendmiss(job, len - ext);
+        }
+    }
+    /* if we are not blocked, flush at eof or the end of a segment job and
+       set end statefn. */
+    if (result == RS_DONE && (job->stream->eof_in || rs_segdone(job))) {
+        result = rs_appendflush(job);
+        job->statefn = rs_delta_s_end;
+        return result == RS_DONE ? RS_RUNNING : result;
+    }
+    return result == RS_DONE ? RS_BLOCKED : result;
+}
+
 static rs_result rs_delta_s_end(rs_job_t *job)
 {
-    rs_emit_end_cmd(job);
+    if (job->signature)
+        job->xstats.scan_bytes = job->stats.in_bytes - job->xstats.skip_bytes;
+    if (!job->seg_len)
+        rs_emit_end_cmd(job);
     return RS_DONE;
 }
 
@@ -221,14 +385,26 @@ static inline rs_result rs_getinput(rs_job_t *job, size_t block_len)
  * Note that this will calculate weak_sum if required. It will also determine
  * the match_len.
  *
- * This routine could be modified to do xdelta style matches that would extend
- * matches past block boundaries by matching backwards and forwards beyond the
- * block boundaries. Extending backwards would require decrementing scan_pos as
- * appropriate. */
+ * Right after a match this first checks the basis block following it, since
+ * that usually matches too. This saves a hashtable lookup, and for duplicate
+ * blocks extends the match instead of jumping to the first duplicate. If it
+ * doesn't match and the job can read the basis, rs_extendfwd() extends the
+ * match forwards past its last block byte by byte up to the first difference
+ * instead, returning that partial length as the next match.
+ *
+ * For a format 2 delta, if the signature doesn't have a match this looks for
+ * one earlier in the new file, setting \p output for a COPY_OUTPUT match.
+ *
+ * Matches are extended backwards by rs_appendmatch(), which uses
+ * rs_extendback() to take the end of any miss data before a new match that
+ * matches the basis into the match, decrementing scan_pos. Together these
+ * give xdelta style matches that can start and end anywhere, not just at
+ * block boundaries. */
 static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos,
-                               size_t *match_len)
+                               size_t *match_len, int *output)
 {
     const size_t block_len = job->signature->block_len;
+    size_t len;
 
     /* calculate the weak_sum if we don't have one */
     if (weaksum_count(&job->weak_sum) == 0) {
@@ -246,28 +422,421 @@ static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos,
         /* set the match_len to the weak_sum count */
         *match_len = weaksum_count(&job->weak_sum);
     }
+    *output = 0;
+    if (job->basis_len && job->match_output) {
+        if ((len =
+             rs_matchoutput(job, job->basis_pos + job->basis_len,
+                            job->scan_pos, *match_len))) {
+            *match_pos = job->basis_pos + job->basis_len;
+            *match_len = len;
+            *output = 1;
+            return 1;
+        }
+    } else if (job->basis_len && !job->match_fill) {
+        if (rs_signature_match_at(job->signature,
+                                  job->basis_pos + job->basis_len,
+                                  weaksum_digest(&job->weak_sum),
+                                  job->scan_buf + job->scan_pos, *match_len)) {
+            *match_pos = job->basis_pos + job->basis_len;
+            return 1;
+        }
+        if (job->copy_cb
+            && (len =
+                rs_extendfwd(job, job->basis_pos + job->basis_len,
+                             *match_len))) {
+            *match_pos = job->basis_pos + job->basis_len;
+            *match_len = len;
+            return 1;
+        }
+    }
     *match_pos =
         rs_signature_find_match(job->signature, weaksum_digest(&job->weak_sum),
                                 job->scan_buf + job->scan_pos, *match_len);
+    if (*match_pos == -1 && job->out_index) {
+        *match_pos =
+            rs_findoutput(job, weaksum_digest(&job->weak_sum), job->scan_pos,
+                          *match_len);
+        *output = *match_pos != -1;
+    }
     return *match_pos != -1;
 }
 
+/** Scan a batch of offsets using the rolling weak_sum.
+ *
+ * This gets the weak_sum digests for a batch of consecutive offsets at once
+ * and then looks them up in the signature, appending the misses before the
+ * first match and the match. The batch is limited so that appending the
+ * misses will not flush anything, so the delta is the same as scanning one
+ * offset at a time. For a format 2 delta the offsets before the first match
+ * in the signature are also looked up in the history.
+ *
+ * This requires the weak_sum to have a full block, with no pending match and
+ * less than MAX_MISS_LEN pending misses. The batch stops before \p end. */
+static inline rs_result rs_scanbatch(rs_job_t *job, size_t end)
+{
+    const size_t block_len = job->signature->block_len;
+    size_t n = job->scan_len - block_len - job->scan_pos;
+    rs_weak_sum_t digests[RS_SCAN_BATCH];
+    rs_long_t match_pos, pos;
+    rs_result result = RS_DONE;
+    int output = 0;
+    size_t j, k;
+
+    if (n > RS_SCAN_BATCH)
+        n = RS_SCAN_BATCH;
+    if (n > MAX_MISS_LEN - job->scan_pos)
+        n = MAX_MISS_LEN - job->scan_pos;
+    if (job->scan_left && n > job->scan_left)
+        n = job->scan_left;
+    if (n > end - job->scan_pos)
+        n = end - job->scan_pos;
+    weaksum_rotate_n(&job->weak_sum, job->scan_buf + job->scan_pos, n,
+                     digests);
+    k = rs_signature_find_matches(job->signature, digests, n,
+                                  job->scan_buf + job->scan_pos, block_len,
+                                  &match_pos);
+    for (j = 0; job->out_index && j < k; j++) {
+        if ((pos =
+             rs_findoutput(job, digests[j], job->scan_pos + j,
+                           block_len)) != -1) {
+            match_pos = pos;
+            k = j;
+            output = 1;
+        }
+    }
+    if (k)
+        result = rs_appendmiss(job, k);
+    job->scan_left -= job->scan_left ? k : 0;
+    if (k < n && result == RS_DONE) {
+        result = rs_appendmatch(job, match_pos, block_len, output);
+        weaksum_reset(&job->weak_sum);
+    }
+    return result;
+}
+
+/** Get the length of the run of bytes equal to buf[0], up to len.
+ *
+ * This compares a word at a time against the byte repeated. */
+static inline size_t rs_runlen(rs_byte_t const *buf, size_t len)
+{
+    const uint64_t y = buf[0] * UINT64_C(0x0101010101010101);
+    size_t i = 0;
+    uint64_t x;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&x, buf + i, 8);
+        if (x != y)
+            break;
+    }
+    while (i < len && buf[i] == buf[0])
+        i++;
+    return i;
+}
+
+/** Find the next run of at least two blocks of equal bytes in the scan_buf.
+ *
+ * This checks the offsets from scan_pos that have two blocks of data after
+ * them, or all of them at eof, continuing from where it stopped last time so
+ * it checks each byte about once.
+ *
+ * \param run - set to 1 if a run starts at the returned offset, else 0.
+ *
+ * \return The offset of the next run, or the first offset it can't check
+ * yet. */
+static inline size_t rs_findrun(rs_job_t *job, int *run)
+{
+    const size_t run_len = 2 * (size_t)job->signature->block_len;
+    size_t pos = job->run_off > job->scan_pos ? job->run_off : job->scan_pos;
+    size_t end = job->scan_len, len;
+
+    if (!job->stream->eof_in)
+        end = end >= run_len ? end - run_len + 1 : 0;
+    *run = 0;
+    while (pos < end) {
+        len = job->scan_len - pos < run_len ? job->scan_len - pos : run_len;
+        if ((len = rs_runlen(job->scan_buf + pos, len)) == run_len) {
+            *run = 1;
+            break;
+        }
+        pos += len;
+    }
+    job->run_off = pos;
+    return pos;
+}
+
+/** Get the offset and length of the longest run of basis blocks that are all
+ * \p byte, looking it up in the signature the first time. */
+static inline rs_long_t *rs_fillrun(rs_job_t *job, int byte)
+{
+    rs_long_t *run;
+    int i;
+
+    if (!job->fill_runs) {
+        job->fill_runs = rs_alloc(512 * sizeof(rs_long_t), "fill runs");
+        for (i = 0; i < 512; i += 2)
+            job->fill_runs[i] = -2;
+    }
+    run = job->fill_runs + 2 * byte;
+    if (run[0] == -2)
+        run[0] = rs_signature_find_fill(job->signature, byte, &run[1]);
+    return run;
+}
+
+/** Get the length of the common prefix of a and b, up to len.
+ *
+ * This compares a word at a time until it finds a difference. */
+static inline size_t rs_matchfwd(rs_byte_t const *a, rs_byte_t const *b,
+                                 size_t len)
+{
+    size_t i = 0;
+    uint64_t x, y;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            break;
+    }
+    while (i < len && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/** Get the length of the common suffix of a and b, both of length len. */
+static inline size_t rs_matchback(rs_byte_t const *a, rs_byte_t const *b,
+                                  size_t len)
+{
+    size_t i = 0;
+    uint64_t x, y;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&x, a + len - i - 8, 8);
+        memcpy(&y, b + len - i - 8, 8);
+        if (x != y)
+            break;
+    }
+    while (i < len && a[len - i - 1] == b[len - i - 1])
+        i++;
+    return i;
+}
+
+/** Read up to len bytes of the basis at basis_pos into the job's block_buf.
+ *
+ * \return The number of bytes read, or 0 if they can't be read. */
+static size_t rs_readbasis(rs_job_t *job, rs_long_t basis_pos, size_t len,
+                           rs_byte_t const **data)
+{
+    void *ptr = job->block_buf;
+    size_t got = len;
+
+    if ((job->copy_cb) (job->copy_arg, basis_pos, &got, &ptr) != RS_DONE
+        || got > len)
+        return 0;
+    *data = ptr;
+    return got;
+}
+
+/** Extend a match at basis_pos forwards over the data at scan_pos.
+ *
+ * This reads at most one block of the basis, and doesn't read past the start
+ * of the last block, which might be short, or the end of a chunked basis.
+ *
+ * \return The number of matching bytes, up to len. */
+static size_t rs_extendfwd(rs_job_t *job, rs_long_t basis_pos, size_t len)
+{
+    rs_signature_t const *sig = job->signature;
+    rs_long_t end = sig->offsets ? sig->offsets[sig->count] :
+        (sig->count - 1) * sig->block_len;
+    rs_byte_t const *data = NULL;
+
+    if (basis_pos >= end)
+        return 0;
+    if ((rs_long_t)len > end - basis_pos)
+        len = (size_t)(end - basis_pos);
+    len = rs_readbasis(job, basis_pos, len, &data);
+    len = rs_matchfwd(job->scan_buf + job->scan_pos, data, len);
+    rs_trace("extended match forwards " FMT_SIZE " bytes at " FMT_LONG, len,
+             basis_pos);
+    return len;
+}
+
+/** Extend a match at basis_pos backwards over the end of the miss data.
+ *
+ * This reads the basis before basis_pos a block at a time, until it finds a
+ * difference. Exhaustive scans would have matched any whole block before it,
+ * so this only reads more than one block after skipping ahead.
+ *
+ * \return The number of matching bytes. */
+static size_t rs_extendback(rs_job_t *job, rs_long_t basis_pos)
+{
+    const size_t block_len = (size_t)job->signature->block_len;
+    size_t back = 0, len, n;
+    rs_byte_t const *data = NULL;
+
+    do {
+        len = job->scan_pos - back;
+        if (len > block_len)
+            len = block_len;
+        if ((rs_long_t)len > basis_pos - (rs_long_t)back)
+            len = (size_t)(basis_pos - (rs_long_t)back);
+        if (!len
+            || rs_readbasis(job, basis_pos - (rs_long_t)(back + len), len,
+                            &data) < len)
+            break;
+        n = rs_matchback(job->scan_buf + job->scan_pos - back - len, data,
+                         len);
+        back += n;
+    } while (n == len);
+    rs_trace("extended match backwards " FMT_SIZE " bytes at " FMT_LONG, back,
+             basis_pos);
+    return back;
+}
+
+/** Get the data at pos in the new file from the history or the scan_buf.
+ *
+ * \return The number of contiguous bytes available, up to len. */
+static inline size_t rs_getoutput(rs_job_t *job, rs_long_t pos, size_t len,
+                                  rs_byte_t const **data)
+{
+    rs_long_t off = pos - job->history.len;
+
+    if (off < 0)
+        return rs_history_get(&job->history, pos, len, data);
+    if (off >= (rs_long_t)job->scan_len)
+        return 0;
+    if (len > job->scan_len - (size_t)off)
+        len = job->scan_len - (size_t)off;
+    *data = job->scan_buf + off;
+    return len;
+}
+
+/** Get the length of the match between the new file at pos and the data at
+ * offset off in the scan_buf, up to len. */
+static size_t rs_matchoutput(rs_job_t *job, rs_long_t pos, size_t off,
+                             size_t len)
+{
+    rs_byte_t const *buf = job->scan_buf + off, *data = NULL;
+    size_t done = 0, n, got;
+
+    while (done < len
+           && (n =
+               rs_getoutput(job, pos + (rs_long_t)done, len - done, &data))) {
+        got = rs_matchfwd(buf + done, data, n);
+        done += got;
+        if (got < n)
+            break;
+    }
+    return done;
+}
+
+/** Find an indexed block of the new file matching the data at offset off in
+ * the scan_buf.
+ *
+ * The match must be before the new file position of off and within the
+ * window before it, so that it is still in the history when it is copied.
+ *
+ * \return The position of the match in the new file, or -1 if there isn't
+ * one. */
+static inline rs_long_t rs_findoutput(rs_job_t *job, rs_weak_sum_t weak_sum,
+                                      size_t off, size_t len)
+{
+    rs_out_slot_t const *slot =
+        &job->out_index[weak_sum & job->out_index_mask];
+    rs_long_t pos = slot->pos - 1, new_pos = job->history.len + (rs_long_t)off;
+
+    if (pos < 0 || slot->weak_sum != weak_sum
+        || pos + (rs_long_t)len > new_pos
+        || pos + (rs_long_t)job->history.window < new_pos
+        || rs_matchoutput(job, pos, off, len) < len)
+        return -1;
+    return pos;
+}
+
+/** Extend a match at pos in the new file backwards over the end of the miss
+ * data.
+ *
+ * \return The number of matching bytes, up to one block. */
+static size_t rs_outputback(rs_job_t *job, rs_long_t pos)
+{
+    size_t len = job->scan_pos;
+    rs_byte_t const *data = NULL;
+
+    if (len > (size_t)job->signature->block_len)
+        len = (size_t)job->signature->block_len;
+    if ((rs_long_t)len > pos)
+        len = (size_t)pos;
+    if (!len || rs_getoutput(job, pos - (rs_long_t)len, len, &data) < len)
+        return 0;
+    return rs_matchback(job->scan_buf + job->scan_pos - len, data, len);
+}
+
+/** Index the whole aligned blocks of the new file from out_indexed up to
+ * scan_pos. */
+static void rs_indexoutput(rs_job_t *job)
+{
+    const rs_long_t block_len = job->signature->block_len;
+    const rs_long_t end = job->history.len + (rs_long_t)job->scan_pos;
+    rs_byte_t const *data = NULL;
+    rs_out_slot_t *slot;
+    rs_weak_sum_t weak_sum;
+    weaksum_t sum;
+    size_t got, n;
+
+    weaksum_init(&sum, rs_signature_weaksum_kind(job->signature));
+    for (; job->out_indexed + block_len <= end;
+         job->out_indexed += block_len) {
+        weaksum_reset(&sum);
+        for (got = 0; got < (size_t)block_len; got += n) {
+            if (!(n = rs_getoutput(job, job->out_indexed + (rs_long_t)got,
+                                   (size_t)block_len - got, &data)))
+                break;
+            weaksum_update(&sum, data, n);
+        }
+        if (got < (size_t)block_len)
+            continue;
+        weak_sum = weaksum_digest(&sum);
+        slot = &job->out_index[weak_sum & job->out_index_mask];
+        slot->weak_sum = weak_sum;
+        slot->pos = job->out_indexed + 1;
+    }
+}
+
 /** Append a match at match_pos of length match_len to the delta, extending a
- * previous match if possible, or flushing any previous miss/match. */
+ * previous match if possible, or flushing any previous miss/match.
+ *
+ * If \p output is set the match is earlier in the new file instead of in the
+ * basis. */
 static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos,
-                                       size_t match_len)
+                                       size_t match_len, int output)
 {
     rs_result result = RS_DONE;
+    size_t back = 0;
 
+    /* a match ends any miss run and skipping */
+    job->miss_run = 0;
+    job->skip_len = job->scan_left = 0;
     /* if last was a match that can be extended, extend it */
-    if (job->basis_len && (job->basis_pos + job->basis_len) == match_pos) {
+    if (job->basis_len && job->match_output == output && !job->match_fill
+        && (job->basis_pos + job->basis_len) == match_pos) {
         job->basis_len += match_len;
     } else {
+        /* take the end of any miss that matches into the match */
+        if (!job->basis_len && output && job->scan_pos)
+            back = rs_outputback(job, match_pos);
+        else if (!job->basis_len && job->copy_cb && job->scan_pos)
+            back = rs_extendback(job, match_pos);
+        if (back) {
+            job->scan_pos -= back;
+            match_pos -= (rs_long_t)back;
+            match_len += back;
+        }
         /* else appendflush the last value */
         result = rs_appendflush(job);
         /* make this the new match value */
         job->basis_pos = match_pos;
         job->basis_len = match_len;
+        job->match_output = output;
+        job->match_fill = 0;
     }
     /* increment scan_pos to point at next unscanned data */
     job->scan_pos += match_len;
@@ -294,23 +863,172 @@ static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len)
     }
     /* increment scan_pos */
     job->scan_pos += miss_len;
+    job->miss_run += (rs_long_t)miss_len;
+    /* index the miss data for a format 2 delta */
+    if (job->out_index)
+        rs_indexoutput(job);
     return result;
 }
 
+/** Skip ahead over data in a long run of misses, appending it as a miss.
+ *
+ * This skips the rest of skip_len, or starts skipping a length that grows
+ * with the miss run up to skip_max. After the whole skip a block's worth of
+ * offsets are scanned before skipping again. It always leaves at least a
+ * block of data to scan, and stops before \p end. */
+static inline rs_result rs_appendskip(rs_job_t *job, size_t end)
+{
+    const size_t block_len = job->signature->block_len;
+    size_t n = job->scan_len - block_len - job->scan_pos;
+
+    if (!job->skip_len) {
+        job->skip_len = (size_t)job->miss_run - job->skip_after + block_len;
+        if (job->skip_len > job->skip_max)
+            job->skip_len = job->skip_max;
+    }
+    if (n > job->skip_len)
+        n = job->skip_len;
+    if (n > end - job->scan_pos)
+        n = end - job->scan_pos;
+    if (job->scan_pos < MAX_MISS_LEN && n > MAX_MISS_LEN - job->scan_pos)
+        n = MAX_MISS_LEN - job->scan_pos;
+    else if (n > MAX_MISS_LEN)
+        n = MAX_MISS_LEN;
+    job->skip_len -= n;
+    if (!job->skip_len)
+        job->scan_left = block_len;
+    job->xstats.skip_bytes += (rs_long_t)n;
+    weaksum_reset(&job->weak_sum);
+    return rs_appendmiss(job, n);
+}
+
+/** Append a run of equal bytes at scan_pos without hashing it.
+ *
+ * The run is at least two blocks long, and all but its last block_len-1 bytes
+ * can only match basis blocks of the same bytes. This appends up to about
+ * RS_RUN_PIECE bytes of it, continuing the previous match if the basis has
+ * those blocks after it, which keeps the blocks after the run lined up.
+ * Otherwise it's a fill for a format 2 delta, or else a copy from the longest
+ * run of those blocks in the basis, or a miss if there isn't one. A fill or
+ * copy that reaches the end of the scan_buf returns RS_RUNNING to wait for
+ * more data, so it doesn't depend on buffer sizes. */
+static inline rs_result rs_appendrun(rs_job_t *job)
+{
+    const size_t block_len = job->signature->block_len;
+    const size_t piece = RS_RUN_PIECE > block_len ?
+        RS_RUN_PIECE - RS_RUN_PIECE % block_len : block_len;
+    const size_t max_len = piece + block_len - 1;
+    const int byte = job->scan_buf[job->scan_pos];
+    size_t avail = job->scan_len - job->scan_pos, len;
+    rs_long_t *run, next = 0, n = 0;
+    rs_result result = RS_DONE;
+
+    if (avail > max_len)
+        avail = max_len;
+    len = rs_runlen(job->scan_buf + job->scan_pos, avail);
+    run = rs_fillrun(job, byte);
+    if (job->basis_len && !job->match_output && !job->match_fill) {
+        next = job->basis_pos + job->basis_len;
+        if (next > run[0] && next < run[0] + run[1])
+            n = run[0] + run[1] - next;
+        else
+            n = rs_signature_fill_len(job->signature, byte, next,
+                                      (rs_long_t)(len - block_len + 1));
+    }
+    if (!n && run[0] >= 0 && job->delta_magic != RS_DELTA2_MAGIC) {
+        next = run[0];
+        n = run[1];
+    }
+    if (job->delta_magic != RS_DELTA2_MAGIC && !n) {
+        len -= block_len - 1;
+        if (job->scan_pos < MAX_MISS_LEN && len > MAX_MISS_LEN - job->scan_pos)
+            len = MAX_MISS_LEN - job->scan_pos;
+        else if (len > MAX_MISS_LEN)
+            len = MAX_MISS_LEN;
+        weaksum_reset(&job->weak_sum);
+        return rs_appendmiss(job, len);
+    }
+    if (len == job->scan_len - job->scan_pos && len < max_len
+        && !job->stream->eof_in) {
+        /* flush any miss before it, since the scan_buf can't grow past it */
+        if (job->scan_pos)
+            result = rs_appendflush(job);
+        return result == RS_DONE ? RS_RUNNING : result;
+    }
+    len -= block_len - 1;
+    weaksum_reset(&job->weak_sum);
+    if (n) {
+        /* end a copy within the basis run on a block so it can continue */
+        if ((rs_long_t)len > n)
+            len = (size_t)n;
+        else if (len > block_len)
+            len -= (size_t)((next + (rs_long_t)len) % (rs_long_t)block_len);
+        return rs_appendmatch(job, next, len, 0);
+    }
+    /* fill whole blocks so the rest of the run can match basis blocks */
+    len -= len % block_len;
+    job->miss_run = 0;
+    job->skip_len = job->scan_left = 0;
+    if (job->basis_len && job->match_fill && job->basis_pos == byte) {
+        job->basis_len += (rs_long_t)len;
+    } else {
+        result = rs_appendflush(job);
+        job->basis_pos = byte;
+        job->basis_len = (rs_long_t)len;
+        job->match_output = 0;
+        job->match_fill = 1;
+    }
+    job->scan_pos += len;
+    if (result == RS_DONE)
+        result = rs_processmatch(job);
+    return result;
+}
+
+/** Record a command for a segment job instead of emitting it. */
+static inline void rs_recordcmd(rs_job_t *job, int kind, rs_long_t pos,
+                                rs_long_t len)
+{
+    rs_delta_cmds_add(&job->delta_cmds, &job->delta_cmd_count,
+                      &job->delta_cmd_size, kind, pos, len);
+    job->seg_done += len;
+}
+
 /** Flush any accumulating hit or miss, appending it to the delta. */
 static inline rs_result rs_appendflush(rs_job_t *job)
 {
-    /* if last is a match, emit it and reset last by resetting basis_len */
-    if (job->basis_len) {
-        rs_trace("matched " FMT_LONG " bytes at " FMT_LONG "!", job->basis_len,
-                 job->basis_pos);
-        rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
+    /* if last is a fill, emit it and reset last by resetting basis_len */
+    if (job->basis_len && job->match_fill) {
+        rs_trace("filled " FMT_LONG " bytes of %d", job->basis_len,
+                 (int)job->basis_pos);
+        if (job->seg_len)
+            rs_recordcmd(job, RS_KIND_FILL, job->basis_pos, job->basis_len);
+        else
+            rs_emit_fill_cmd(job, (int)job->basis_pos, job->basis_len);
+        job->basis_len = 0;
+        job->match_fill = 0;
+        return rs_processmatch(job);
+        /* else if last is a match, emit it and reset basis_len */
+    } else if (job->basis_len) {
+        rs_trace("matched " FMT_LONG " bytes at " FMT_LONG "%s!",
+                 job->basis_len, job->basis_pos,
+                 job->match_output ? " in the output" : "");
+        if (job->seg_len)
+            rs_recordcmd(job,
+                         job->match_output ? RS_KIND_COPY_OUTPUT : RS_KIND_COPY,
+                         job->basis_pos, job->basis_len);
+        else if (job->match_output)
+            rs_emit_copy_output_cmd(job, job->basis_pos, job->basis_len);
+        else
+            rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
         job->basis_len = 0;
         return rs_processmatch(job);
         /* else if last is a miss, emit and process it */
     } else if (job->scan_pos) {
         rs_trace("got " FMT_SIZE " bytes of literal data", job->scan_pos);
-        rs_emit_literal_cmd(job, (int)job->scan_pos);
+        if (job->seg_len)
+            rs_recordcmd(job, RS_KIND_LITERAL, 0, (rs_long_t)job->scan_pos);
+        else
+            rs_emit_literal_cmd(job, (int)job->scan_pos);
         return rs_processmiss(job);
     }
     /* otherwise, nothing to flush so we are done */
@@ -325,13 +1043,24 @@ static inline rs_result rs_appendflush(rs_job_t *job)
  * the next unscanned data.
  *
  * This function currently just removes data from the scoop and adjusts
- * scan_pos appropriately. In the future this could be used for something like
- * context compressing of miss data. Note that it also calls rs_tube_catchup to
- * output any pending output. */
+ * scan_pos appropriately, adding it to the history without indexing it for a
+ * format 2 delta. In the future this could be used for something like context
+ * compressing of miss data. Note that it also calls rs_tube_catchup to output
+ * any pending output. */
 static inline rs_result rs_processmatch(rs_job_t *job)
 {
+    const rs_long_t block_len = job->signature->block_len;
+
     assert(job->copy_len == 0);
+    if (job->out_index) {
+        rs_history_add(&job->history, job->scan_buf, job->scan_pos);
+        if (job->out_indexed < job->history.len)
+            job->out_indexed =
+                (job->history.len + block_len - 1) / block_len * block_len;
+    }
     rs_scoop_advance(job, job->scan_pos);
+    job->run_off =
+        job->run_off > job->scan_pos ? job->run_off - job->scan_pos : 0;
     job->scan_buf += job->scan_pos;
     job->scan_len -= job->scan_pos;
     job->scan_pos = 0;
@@ -350,11 +1079,21 @@ static inline rs_result rs_processmatch(rs_job_t *job)
  * from the scoop, but this can block. While rs_tube_catchup is blocked,
  * scan_pos does not point at legit data, so scanning can also not proceed.
  *
+ * For a format 2 delta the miss data is also added to the history. A segment
+ * job for pdelta.c just removes the miss data from the scoop.
+ *
  * In the future this could do compression of miss data before outputing it. */
 static inline rs_result rs_processmiss(rs_job_t *job)
 {
-    assert(job->write_len > 0);
-    rs_tube_copy(job, job->scan_pos);
+    assert(job->write_len > 0 || job->seg_len);
+    if (job->out_index)
+        rs_history_add(&job->history, job->scan_buf, job->scan_pos);
+    if (job->seg_len)
+        rs_scoop_advance(job, job->scan_pos);
+    else
+        rs_tube_copy(job, job->scan_pos);
+    job->run_off =
+        job->run_off > job->scan_pos ? job->run_off - job->scan_pos : 0;
     job->scan_buf += job->scan_pos;
     job->scan_len -= job->scan_pos;
     job->scan_pos = 0;
@@ -379,11 +1118,48 @@ static rs_result rs_delta_s_slack(rs_job_t *job)
     return RS_BLOCKED;
 }
 
+size_t rs_delta_window(rs_signature_t const *sig)
+{
+    const size_t block_len = sig ? (size_t)sig->block_len : 1;
+
+    if (block_len > RS_OUTPUT_WINDOW / 4)
+        return RS_OUTPUT_WINDOW;
+    return RS_OUTPUT_WINDOW / block_len * block_len;
+}
+
 /** State function for writing out the header of the encoding job. */
 static rs_result rs_delta_s_header(rs_job_t *job)
 {
-    rs_emit_delta_header(job);
-    if (job->signature) {
+    size_t block_len, slots;
+
+    if (job->delta_magic == RS_DELTA2_MAGIC) {
+        /* Use a window of whole blocks, and index it if it has enough. Output
+           matches are only found for unchunked signatures. */
+        block_len = job->signature ? (size_t)job->signature->block_len : 1;
+        rs_history_init(&job->history, rs_delta_window(job->signature));
+        if (job->signature && !job->signature->offsets
+            && block_len <= RS_OUTPUT_WINDOW / 4) {
+            for (slots = 1;
+                 slots < 2 * RS_OUTPUT_WINDOW / block_len
+                 && slots < RS_OUT_INDEX_MAX; slots *= 2) ;
+            job->out_index =
+                rs_alloc_struct0(slots * sizeof(rs_out_slot_t),
+                                 "output index");
+            job->out_index_mask = slots - 1;
+        }
+    }
+    /* Set up skipping ahead for low effort levels. */
+    if (job->signature && !job->signature->offsets
+        && job->delta_effort < RS_DELTA_EFFORT_MAX) {
+        block_len = (size_t)job->signature->block_len;
+        job->skip_after = block_len << (job->delta_effort + 2);
+        job->skip_max = block_len << (8 - job->delta_effort);
+    }
+    if (!job->seg_len)
+        rs_emit_delta_header(job);
+    if (job->signature && job->signature->offsets) {
+        job->statefn = rs_delta_s_chunk;
+    } else if (job->signature) {
         job->statefn = rs_delta_s_scan;
     } else {
         rs_trace("no signature provided for delta, using slack deltas");
@@ -392,11 +1168,59 @@ static rs_result rs_delta_s_header(rs_job_t *job)
     return RS_RUNNING;
 }
 
+rs_result rs_delta_set_basis(rs_job_t *job, rs_copy_cb * basis_cb,
+                             void *basis_arg)
+{
+    rs_job_check(job);
+    if (job->statefn != rs_delta_s_header) {
+        rs_error("can only set the basis of a delta job before it starts");
+        return RS_PARAM_ERROR;
+    }
+    job->copy_cb = basis_cb;
+    job->copy_arg = basis_arg;
+    if (job->signature && !job->block_buf)
+        job->block_buf = rs_alloc((size_t)job->signature->block_len,
+                                  "basis buffer");
+    return RS_DONE;
+}
+
+rs_result rs_delta_set_magic(rs_job_t *job, rs_magic_number magic)
+{
+    rs_job_check(job);
+    if (job->statefn != rs_delta_s_header) {
+        rs_error("can only set the format of a delta job before it starts");
+        return RS_PARAM_ERROR;
+    }
+    if (magic != RS_DELTA_MAGIC && magic != RS_DELTA2_MAGIC) {
+        rs_error("invalid delta magic %#x", magic);
+        return RS_PARAM_ERROR;
+    }
+    job->delta_magic = magic;
+    return RS_DONE;
+}
+
+rs_result rs_delta_set_effort(rs_job_t *job, int effort)
+{
+    rs_job_check(job);
+    if (job->statefn != rs_delta_s_header) {
+        rs_error("can only set the effort of a delta job before it starts");
+        return RS_PARAM_ERROR;
+    }
+    if (effort < 0 || effort > RS_DELTA_EFFORT_MAX) {
+        rs_error("invalid delta effort %d", effort);
+        return RS_PARAM_ERROR;
+    }
+    job->delta_effort = effort;
+    return RS_DONE;
+}
+
 rs_job_t *rs_delta_begin(rs_signature_t *sig)
 {
     rs_job_t *job;
 
     job = rs_job_new("delta", rs_delta_s_header);
+    job->delta_magic = RS_DELTA_MAGIC;
+    job->delta_effort = RS_DELTA_EFFORT_MAX;
     /* Caller can pass NULL sig or empty sig for "slack deltas". */
     if (sig && sig->count > 0) {
         rs_signature_check(sig);
@@ -407,3 +1231,17 @@ rs_job_t *rs_delta_begin(rs_signature_t *sig)
     }
     return job;
 }
+
+rs_job_t *rs_delta_seg_begin(rs_signature_t *sig, rs_magic_number magic,
+                             int effort, rs_long_t seg_len)
+{
+    rs_job_t *job;
+
+    assert(seg_len > 0);
+    job = rs_delta_begin(sig);
+    assert(job->signature);
+    job->delta_magic = magic;
+    job->delta_effort = effort;
+    job->seg_len = seg_len;
+    return job;
+}
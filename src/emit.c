@@ -24,13 +24,18 @@
 #include "emit.h"
 #include "job.h"
 #include "netint.h"
+#include "command.h"
 #include "prototab.h"
 #include "trace.h"
 
 void rs_emit_delta_header(rs_job_t *job)
 {
-    rs_trace("emit DELTA magic");
-    rs_squirt_n4(job, RS_DELTA_MAGIC);
+    rs_trace("emit DELTA magic %#x", job->delta_magic);
+    rs_squirt_n4(job, job->delta_magic);
+    if (job->delta_magic == RS_DELTA2_MAGIC) {
+        rs_trace("emit output window " FMT_SIZE, job->history.window);
+        rs_squirt_n4(job, (int)job->history.window);
+    }
 }
 
 void rs_emit_literal_cmd(rs_job_t *job, int len)
@@ -62,24 +67,24 @@ void rs_emit_literal_cmd(rs_job_t *job, int len)
     job->stats.lit_cmdbytes += 1 + param_len;
 }
 
-void rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+/** Emit a COPY, COPY_OUTPUT or FILL command, where \p cmd is the N1_N1 form.
+ *
+ * \return The number of command bytes. */
+static int rs_emit_copy_op(rs_job_t *job, int cmd, rs_long_t where,
+                           rs_long_t len)
 {
-    int cmd;
-    rs_stats_t *stats = &job->stats;
     const int where_bytes = rs_int_len(where);
     const int len_bytes = rs_int_len(len);
 
     /* Commands ascend (1,1), (1,2), ... (8, 8) */
     if (where_bytes == 8)
-        cmd = RS_OP_COPY_N8_N1;
+        cmd += 12;
     else if (where_bytes == 4)
-        cmd = RS_OP_COPY_N4_N1;
+        cmd += 8;
     else if (where_bytes == 2)
-        cmd = RS_OP_COPY_N2_N1;
-    else {
+        cmd += 4;
+    else
         assert(where_bytes == 1);
-        cmd = RS_OP_COPY_N1_N1;
-    }
     if (len_bytes == 1) ;
     else if (len_bytes == 2)
         cmd += 1;
@@ -90,15 +95,42 @@ void rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
         cmd += 3;
     }
 
-    rs_trace("emit COPY_N%d_N%d(where=" FMT_LONG ", len=" FMT_LONG
-             "), cmd_byte=%#04x", where_bytes, len_bytes, where, len, cmd);
+    rs_trace("emit %s_N%d_N%d(where=" FMT_LONG ", len=" FMT_LONG
+             "), cmd_byte=%#04x",
+             rs_op_kind_name(rs_prototab[cmd].kind), where_bytes, len_bytes,
+             where, len, cmd);
     rs_squirt_byte(job, (rs_byte_t)cmd);
     rs_squirt_netint(job, where, where_bytes);
     rs_squirt_netint(job, len, len_bytes);
+    return 1 + where_bytes + len_bytes;
+}
+
+void rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+{
+    rs_stats_t *stats = &job->stats;
 
+    stats->copy_cmdbytes += rs_emit_copy_op(job, RS_OP_COPY_N1_N1, where, len);
     stats->copy_cmds++;
     stats->copy_bytes += len;
-    stats->copy_cmdbytes += 1 + where_bytes + len_bytes;
+}
+
+void rs_emit_copy_output_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+{
+    rs_xstats_t *stats = &job->xstats;
+
+    stats->output_cmdbytes +=
+        rs_emit_copy_op(job, RS_OP_COPY_OUTPUT_N1_N1, where, len);
+    stats->output_cmds++;
+    stats->output_bytes += len;
+}
+
+void rs_emit_fill_cmd(rs_job_t *job, int byte, rs_long_t len)
+{
+    rs_xstats_t *stats = &job->xstats;
+
+    stats->fill_cmdbytes += rs_emit_copy_op(job, RS_OP_FILL_N1_N1, byte, len);
+    stats->fill_cmds++;
+    stats->fill_bytes += len;
 }
 
 void rs_emit_end_cmd(rs_job_t *job)
@@ -29,7 +29,8 @@
 
 #  include "librsync.h"
 
-/** Write the magic for the start of a delta. */
+/** Write the magic for the start of a delta, and the output window for a
+ * format 2 delta. */
 void rs_emit_delta_header(rs_job_t *);
 
 /** Write a LITERAL command. */
@@ -41,6 +42,12 @@ void rs_emit_literal_cmd(rs_job_t *, int len);
  * representation for the parameters. */
 void rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len);
 
+/** Write a COPY_OUTPUT command for given new file offset and length. */
+void rs_emit_copy_output_cmd(rs_job_t *job, rs_long_t where, rs_long_t len);
+
+/** Write a FILL command for given byte value and length. */
+void rs_emit_fill_cmd(rs_job_t *job, int byte, rs_long_t len);
+
 /** Write an END command. */
 void rs_emit_end_cmd(rs_job_t *);
 
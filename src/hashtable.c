@@ -33,31 +33,70 @@
 #define HASHTABLE_LOADFACTOR_NUM 7
 #define HASHTABLE_LOADFACTOR_DEN 10
 
-hashtable_t *_hashtable_new(int size)
+hashtable_t *_hashtable_new(size_t size, int bloom_bits, int mode)
 {
     hashtable_t *t;
-    unsigned size2, bits2;
+    size_t size2;
+    uint64_t want;
+#ifndef HASHTABLE_NBLOOM
+    /* Bloom filter entries in each 256 bit block, which the 32 bit hash can
+       only address 2^32 of. */
+    uint64_t bcount = ((uint64_t)size * (uint64_t)bloom_bits + 255) / 256;
+
+    if (bcount > UINT32_MAX)
+        bcount = UINT32_MAX;
+#endif
 
     /* Adjust requested size to account for max load factor. */
-    size = 1 + size * HASHTABLE_LOADFACTOR_DEN / HASHTABLE_LOADFACTOR_NUM;
-    /* Use next power of 2 larger than the requested size and get mask bits. */
-    for (size2 = 2, bits2 = 1; (int)size2 < size; size2 <<= 1, bits2++) ;
-    if (!(t = calloc(1, sizeof(hashtable_t)+ size2 * sizeof(unsigned))))
-        return NULL;
-    if (!(t->etable = calloc(size2, sizeof(void *)))) {
+    want = 1 + (uint64_t)size * HASHTABLE_LOADFACTOR_DEN /
+        HASHTABLE_LOADFACTOR_NUM;
+    /* Use next power of 2 larger than the requested size, and at least one
+       group for group mode. */
+    size2 = (mode & HASHTABLE_MODE_GROUP) ? HASHTABLE_GROUP_SIZE : 2;
+    for (; size2 < want; size2 <<= 1)
+        if (size2 > SIZE_MAX / 2)
+            return NULL;
+    /* Index mode needs 64 bit indexes for more than 2^32 entries. */
+    if ((mode & HASHTABLE_MODE_INDEX) && (uint64_t)size > HASHTABLE_NARROW_MAX)
+        mode |= HASHTABLE_MODE_WIDE;
+    if (mode) {
+        /* The tag table is allocated just after the hashtable struct. */
+        if (!(t = calloc(1, sizeof(hashtable_t) + size2)))
+            return NULL;
+        t->ttable = (unsigned char *)(t + 1);
+    } else {
+        /* The key table is allocated just after the hashtable struct. */
+        if (!(t = calloc(1, sizeof(hashtable_t) + size2 * sizeof(unsigned))))
+            return NULL;
+        t->ktable = (unsigned *)(t + 1);
+    }
+    if (mode & HASHTABLE_MODE_WIDE)
+        t->itable64 = calloc(size2, sizeof(uint64_t));
+    else if (mode & HASHTABLE_MODE_INDEX)
+        t->itable = calloc(size2, sizeof(uint32_t));
+    else
+        t->etable = calloc(size2, sizeof(void *));
+    if (!t->itable && !t->itable64 && !t->etable) {
         _hashtable_free(t);
         return NULL;
     }
-    t->size = (int)size2;
+    t->size = size2;
     t->count = 0;
     t->tmask = size2 - 1;
 #ifndef HASHTABLE_NBLOOM
-    if (!(t->kbloom = calloc((size2 + 7) / 8, sizeof(unsigned char)))) {
-        _hashtable_free(t);
-        return NULL;
+    if (bloom_bits > 0) {
+        if (bcount < 1)
+            bcount = 1;
+        /* Align the blocks to 32 bytes so they never straddle cache lines. */
+        if (!(t->kbloom_mem =
+              calloc((size_t)bcount * 8 + 7, sizeof(uint32_t)))) {
+            _hashtable_free(t);
+            return NULL;
+        }
+        t->kbloom =
+            (uint32_t *)(((uintptr_t)t->kbloom_mem + 31) & ~(uintptr_t)31);
+        t->bcount = (unsigned)bcount;
     }
-    t->bshift = (unsigned)sizeof(unsigned) * 8 - bits2;
-    assert(t->tmask == (unsigned)-1 >> t->bshift);
 #endif
 #ifndef HASHTABLE_NSTATS
     t->find_count = t->match_count = t->hashcmp_count = t->entrycmp_count = 0;
@@ -69,8 +108,10 @@ void _hashtable_free(hashtable_t *t)
 {
     if (t) {
         free(t->etable);
+        free(t->itable);
+        free(t->itable64);
 #ifndef HASHTABLE_NBLOOM
-        free(t->kbloom);
+        free(t->kbloom_mem);
 #endif
         free(t);
     }
@@ -36,8 +36,20 @@
  * particular entries by more than just their key. There is an iterator for
  * iterating through all entries in the hashtable. There are optional
  * NAME_find() find/match/hashcmp/entrycmp stats counters that can be disabled
- * by defining HASHTABLE_NSTATS. There is an optional simple k=1 bloom filter
- * for speed that can be disabled by defining HASHTABLE_NBLOOM.
+ * by defining HASHTABLE_NSTATS. There is an optional blocked bloom filter for
+ * speed that can be disabled by defining HASHTABLE_NBLOOM.
+ *
+ * The bloom filter is a "split block" bloom filter made of 256 bit blocks,
+ * each holding 8 words of 32 bits. A key's hash selects one block and sets or
+ * tests one bit in each of its 8 words, so each test only touches a single
+ * cache line. Its size is set by the bits per entry, independent of the table
+ * size, so it can be made small enough to stay in cache for big tables. With
+ * the default HASHTABLE_BLOOM_BITS it rejects all but about 2% of missing
+ * keys without touching the table.
+ *
+ * The tables are referenced by pointers from the hashtable_t struct, so a copy
+ * of the struct can be used to do NAME_find() concurrently with other threads
+ * while accumulating its own stats counters.
  *
  * The types and methods of the hashtable and its contents are specified by
  * using \#define parameters set to their basenames (the prefixes for the *_t
@@ -80,7 +92,7 @@
  *   k = ...;
  *   e = myentry_hashtable_find(t, &k);
  *
- *   int i;
+ *   size_t i;
  *   for (e = myentry_hashtable_iter(t, &i); e != NULL;
  *        e = myentry_hashtable_next(t, &i))
  *     ...
@@ -118,19 +130,64 @@
  * The mymatch_cmp() function is only called for finding hashtable entries and
  * can mutate the mymatch_t object for doing things like deferred and cached
  * evaluation of expensive match data. It can also access the whole myentry_t
- * object to match against more than just the key. */
+ * object to match against more than just the key.
+ *
+ * If HASHTABLE_INDEX is defined, the hashtable is instead an index of entries
+ * kept in an array by the caller. It stores an array index for each entry
+ * instead of a pointer, and an 8 bit tag of the hash instead of the whole
+ * hash, using 5 bytes per bucket instead of 12. The indexes are 32 bits, or
+ * 64 bits for tables made for more than HASHTABLE_NARROW_MAX entries, using 9
+ * bytes per bucket. NAME_add() then takes a key and the index to add for it,
+ * the find and iterator methods return int64_t indexes with -1 for none, and
+ * the cmp() method is called with an index instead of an entry pointer.
+ * Because only the tags are compared, cmp() must compare the whole key, and
+ * is called a little more often for entries that don't match.
+ *
+ * Tables can have more than 2^32 buckets where size_t is 64 bits. The hashes
+ * are still 32 bits, so at most 2^32 buckets are used as the first bucket
+ * probed, spread evenly through bigger tables.
+ *
+ * Example: \code
+ *   int mymatch_cmp(mymatch_t *m, int64_t i);  // Compare to entries[i].
+ *
+ *   #define HASHTABLE_INDEX
+ *   #define ENTRY myentry
+ *   #define KEY mykey
+ *   #define MATCH mymatch
+ *   #include "hashtable.h"
+ *
+ *   myentry_hashtable_add(t, &entries[5].key, 5);
+ *   i = myentry_hashtable_find(t, &m);
+ * \endcode
+ *
+ * If HASHTABLE_GROUP is defined, the hashtable instead probes groups of 16
+ * buckets at a time like SwissTable. It stores a 7 bit tag of the hash for
+ * each bucket, and compares the tags of a whole group with the key's tag using
+ * one SSE2 instruction where available. Collisions probe the next group
+ * quadratically, and a probe ends at the first group with an empty bucket.
+ * This means fewer probes at high load factors, and with the 1 byte tags it
+ * uses 9 bytes per bucket instead of 12, or 5 with HASHTABLE_INDEX. The API
+ * is the same, so it can be switched on for any instantiation. */
 #ifndef HASHTABLE_H
 #  define HASHTABLE_H
 
 #  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+#  ifdef __SSE2__
+#    include <emmintrin.h>
+#  endif
+
+/** Default bloom filter bits per entry. */
+#  define HASHTABLE_BLOOM_BITS 8
 
 /** The hashtable type. */
 typedef struct hashtable {
-    int size;                   /**< Size of allocated hashtable. */
-    int count;                  /**< Number of entries in hashtable. */
-    unsigned tmask;             /**< Mask to get the hashtable index. */
+    size_t size;                /**< Size of allocated hashtable. */
+    size_t count;               /**< Number of entries in hashtable. */
+    size_t tmask;               /**< Mask to get the hashtable index. */
 #  ifndef HASHTABLE_NBLOOM
-    unsigned bshift;            /**< Shift to get the bloomfilter index. */
+    unsigned bcount;            /**< Number of bloom filter blocks. */
 #  endif
 #  ifndef HASHTABLE_NSTATS
     /* The following are for accumulating NAME_find() stats. */
@@ -140,29 +197,80 @@ typedef struct hashtable {
     long entrycmp_count;        /**< The count of entry compares done. */
 #  endif
 #  ifndef HASHTABLE_NBLOOM
-    unsigned char *kbloom;      /**< Bloom filter of hash keys with k=1. */
+    uint32_t *kbloom;           /**< Bloom filter of hash keys, or NULL. */
+    void *kbloom_mem;           /**< Unaligned allocation for kbloom. */
 #  endif
     void **etable;              /**< Table of pointers to entries. */
-    unsigned ktable[];          /**< Table of hash keys. */
+    unsigned *ktable;           /**< Table of hash keys. */
+    uint32_t *itable;           /**< Table of entry indexes in index mode. */
+    uint64_t *itable64;         /**< Table of 64 bit entry indexes instead. */
+    unsigned char *ttable;      /**< Table of hash tags in index/group mode. */
 } hashtable_t;
 
+/** _hashtable_new() mode flag for HASHTABLE_INDEX instantiations. */
+#  define HASHTABLE_MODE_INDEX 1
+/** _hashtable_new() mode flag for HASHTABLE_GROUP instantiations. */
+#  define HASHTABLE_MODE_GROUP 2
+
+/** _hashtable_new() mode flag for 64 bit indexes, set for index mode tables
+ * made for more than HASHTABLE_NARROW_MAX entries. */
+#  define HASHTABLE_MODE_WIDE 4
+
+/** Max entries for index mode to use 32 bit indexes.
+ *
+ * Tests can define this smaller to use 64 bit indexes for small tables. */
+#  ifndef HASHTABLE_NARROW_MAX
+#    define HASHTABLE_NARROW_MAX ((uint64_t)1 << 32)
+#  endif
+
+/** Number of buckets in each group for HASHTABLE_GROUP. */
+#  define HASHTABLE_GROUP_SIZE 16
+
 /* void* implementations for the type-safe static inline wrappers below. */
-hashtable_t *_hashtable_new(int size);
+hashtable_t *_hashtable_new(size_t size, int bloom_bits, int mode);
 void _hashtable_free(hashtable_t *t);
 
 #  ifndef HASHTABLE_NBLOOM
+/** Odd constants for getting the bit in each bloom filter block word. */
+static const uint32_t hashtable_bloomsalt[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/** Get the index of the bloom filter block for a hash.
+ *
+ * This is monotonic in the hash, so ranges of blocks are ranges of hashes. */
+static inline unsigned hashtable_bloomindex(hashtable_t *t, unsigned const h)
+{
+    return (unsigned)(((uint64_t)h * t->bcount) >> 32);
+}
+
+/** Get the bloom filter block for a hash. */
+static inline uint32_t *hashtable_bloomblock(hashtable_t *t, unsigned const h)
+{
+    return &t->kbloom[(size_t)hashtable_bloomindex(t, h) * 8];
+}
+
 static inline void hashtable_setbloom(hashtable_t *t, unsigned const h)
 {
-    /* Use upper bits for a "different hash". */
-    unsigned const i = h >> t->bshift;
-    t->kbloom[i / 8] |= (unsigned char)(1 << (i % 8));
+    uint32_t *b = hashtable_bloomblock(t, h);
+    int i;
+
+    for (i = 0; i < 8; i++)
+        b[i] |= (uint32_t)1 << ((uint32_t)h * hashtable_bloomsalt[i] >> 27);
 }
 
 static inline bool hashtable_getbloom(hashtable_t *t, unsigned const h)
 {
-    /* Use upper bits for a "different hash". */
-    unsigned const i = h >> t->bshift;
-    return (t->kbloom[i / 8] >> (i % 8)) & 1;
+    uint32_t const *b = hashtable_bloomblock(t, h);
+    uint32_t r = 1;
+    int i;
+
+    /* Test all the bits without branches, which is faster than stopping at
+       the first clear bit because that is hard to predict. */
+    for (i = 0; i < 8; i++)
+        r &= b[i] >> ((uint32_t)h * hashtable_bloomsalt[i] >> 27);
+    return r;
 }
 #  endif
 
@@ -177,12 +285,128 @@ static inline unsigned mix32(unsigned h)
     return h;
 }
 
+/** Inverse of mix32(). */
+static inline unsigned unmix32(unsigned h)
+{
+    h ^= h >> 16;
+    h *= 0x7ed1b41d;
+    h ^= (h >> 13) ^ (h >> 26);
+    h *= 0xa5cb9243;
+    h ^= h >> 16;
+    return h;
+}
+
+/** Max number of finds done at once by NAME_find_batch(). */
+#  define HASHTABLE_BATCH 16
+
+/** Hint that memory at p will soon be read. */
+#  if defined(__GNUC__) || defined(__clang__)
+#    define hashtable_prefetch(p) __builtin_prefetch(p)
+#  else
+#    define hashtable_prefetch(p) ((void)(p))
+#  endif
+
 /** Ensure hash's are never zero. */
 static inline unsigned nozero(unsigned h)
 {
     return h ? h : (unsigned)-1;
 }
 
+/** Odd constant for remixing hashes into tags. */
+#  define HASHTABLE_TAGMUL 0x9e3779b1U
+
+/** Get the 8 bit tag of a hash for index mode, which is never zero.
+ *
+ * This is the top byte of the hash times an odd constant, so it depends on
+ * all the bits of the hash. The top byte of the hash itself overlaps the
+ * bucket bits in tables of more than 2^24 buckets, where hashes probing the
+ * same buckets would mostly get the same tag. */
+static inline unsigned hashtable_tag(unsigned h)
+{
+    h = (uint32_t)(h * HASHTABLE_TAGMUL) >> 24;
+    return h ? h : 1;
+}
+
+/** Get the 7 bit tag of a hash for group mode, with the top bit set so it is
+ * never zero.
+ *
+ * Like hashtable_tag() this is from the remixed hash, so it doesn't overlap
+ * the group bits in tables of more than 2^25 buckets. */
+static inline unsigned hashtable_grouptag(unsigned h)
+{
+    return 0x80 | (uint32_t)(h * HASHTABLE_TAGMUL) >> 25;
+}
+
+/** Get the first bucket to probe for a hash.
+ *
+ * This is just the low bits of the hash for tables of up to 2^32 buckets. For
+ * bigger tables it repeats the hash in the high bits so the buckets used are
+ * spread through the table. Each bucket is then the first for at most one
+ * hash, so tags can't tell apart entries probed from the same bucket, but as
+ * hashtable_tag() and hashtable_grouptag() depend on all the bits of the hash
+ * they still filter out entries probed from nearby buckets. */
+static inline size_t hashtable_bucket(hashtable_t *t, unsigned h)
+{
+    return (size_t)(((uint64_t)h << 32 | h) & t->tmask);
+}
+
+/** Get the index of the first bucket in the group for a hash. */
+static inline size_t hashtable_group(hashtable_t *t, unsigned h)
+{
+    return hashtable_bucket(t, h) & ~(size_t)(HASHTABLE_GROUP_SIZE - 1);
+}
+
+/** Get the next group to probe after group i on the s'th probe. */
+static inline size_t hashtable_groupnext(hashtable_t *t, size_t i, size_t s)
+{
+    return (i + s * HASHTABLE_GROUP_SIZE) & t->tmask;
+}
+
+/** Get a bitmap of the buckets in the group at i with tags equal to tag. */
+static inline unsigned hashtable_groupmatch(hashtable_t *t, size_t i,
+                                            unsigned tag)
+{
+    unsigned char const *g = &t->ttable[i];
+#  ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((__m128i const *)g);
+
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8
+                                       (v, _mm_set1_epi8((char)tag)));
+#  else
+    unsigned m = 0;
+    int j;
+
+    for (j = 0; j < HASHTABLE_GROUP_SIZE; j++)
+        m |= (unsigned)(g[j] == tag) << j;
+    return m;
+#  endif
+}
+
+/** Get the index of the lowest set bit of a non-zero bitmap. */
+static inline unsigned hashtable_firstbit(unsigned m)
+{
+#  if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(m);
+#  else
+    unsigned j;
+
+    for (j = 0; !(m & 1); j++)
+        m >>= 1;
+    return j;
+#  endif
+}
+
+/** Get the first empty bucket for a hash in group mode. */
+static inline size_t hashtable_groupslot(hashtable_t *t, unsigned h)
+{
+    size_t i = hashtable_group(t, h), s = 0;
+    unsigned m;
+
+    while (!(m = hashtable_groupmatch(t, i, 0)))
+        i = hashtable_groupnext(t, i, ++s);
+    return i + hashtable_firstbit(m);
+}
+
 #endif                          /* !HASHTABLE_H */
 
 /* If ENTRY is defined, define type-dependent static inline methods. */
@@ -213,10 +437,18 @@ static inline unsigned nozero(unsigned h)
 #  define MATCH_cmp _JOIN(MATCH, _cmp)  /**< The match cmp(m, e) method. */
 /* The names for all the hashtable methods. */
 #  define NAME_new _JOIN(NAME, _new)
+#  define NAME_new_bloom _JOIN(NAME, _new_bloom)
 #  define NAME_free _JOIN(NAME, _free)
 #  define NAME_stats_init _JOIN(NAME, _stats_init)
 #  define NAME_add _JOIN(NAME, _add)
 #  define NAME_find _JOIN(NAME, _find)
+#  define NAME_find_hashed _JOIN(NAME, _find_hashed)
+#  define NAME_find_batch _JOIN(NAME, _find_batch)
+#  define NAME_hash _JOIN(NAME, _hash)
+#  define NAME_prefetch_key _JOIN(NAME, _prefetch_key)
+#  define NAME_probe _JOIN(NAME, _probe)
+#  define NAME_fill _JOIN(NAME, _fill)
+#  define NAME_find_add _JOIN(NAME, _find_add)
 #  define NAME_iter _JOIN(NAME, _iter)
 #  define NAME_next _JOIN(NAME, _next)
 
@@ -227,19 +459,62 @@ static inline unsigned nozero(unsigned h)
 #    define _KEY_HASH(k) nozero(mix32(KEY_hash((KEY_t *)k)))
 #  endif
 
+/* Types and accessors for the entry and hash tables, with index mode storing
+   32 or 64 bit indexes and 8 bit hash tags instead of entry pointers and
+   hashes, and group mode storing 7 bit hash tags. */
+#  ifdef HASHTABLE_INDEX
+#    define _ENTRY_REF int64_t
+#    define _ENTRY_NONE -1
+#    define _ENTRY_GET(t, i) ((t)->itable64 ? (int64_t)(t)->itable64[i] :\
+                              (int64_t)(t)->itable[i])
+#    define _ENTRY_SET(t, i, e) ((t)->itable64 ?\
+                                 (int64_t)((t)->itable64[i] = (uint64_t)(e)) :\
+                                 (int64_t)((t)->itable[i] = (uint32_t)(e)))
+#    define _MODE_INDEX HASHTABLE_MODE_INDEX
+#  else
+#    define _ENTRY_REF ENTRY_t *
+#    define _ENTRY_NONE NULL
+#    define _ENTRY_GET(t, i) ((ENTRY_t *)(t)->etable[i])
+#    define _ENTRY_SET(t, i, e) ((t)->etable[i] = (e))
+#    define _MODE_INDEX 0
+#  endif
+#  if defined(HASHTABLE_GROUP)
+#    define _KTABLE_t unsigned char
+#    define _KTABLE(t) ((t)->ttable)
+#    define _KEY_TAG(h) hashtable_grouptag(h)
+#    define _BUCKET(t, h) hashtable_group(t, h)
+#    define _MODE_GROUP HASHTABLE_MODE_GROUP
+#  elif defined(HASHTABLE_INDEX)
+#    define _KTABLE_t unsigned char
+#    define _KTABLE(t) ((t)->ttable)
+#    define _KEY_TAG(h) hashtable_tag(h)
+#    define _BUCKET(t, h) hashtable_bucket(t, h)
+#    define _MODE_GROUP 0
+#  else
+#    define _KTABLE_t unsigned
+#    define _KTABLE(t) ((t)->ktable)
+#    define _KEY_TAG(h) (h)
+#    define _BUCKET(t, h) hashtable_bucket(t, h)
+#    define _MODE_GROUP 0
+#  endif
+
 /* Loop macro for probing table t for key hash hk, iterating with index i and
-   entry hash h, terminating at an empty bucket. */
+   entry hash tag h, terminating at an empty bucket. */
 #  define _for_probe(t, hk, i, h) \
-    unsigned const *const ktable = t->ktable;\
-    unsigned const tmask = t->tmask;\
-    unsigned i, s, h;\
-    for (i = hk & tmask, s = 0; (h = ktable[i]); i = (i + ++s) & tmask)
+    _KTABLE_t const *const ktable = _KTABLE(t);\
+    size_t const tmask = t->tmask;\
+    size_t i, s;\
+    unsigned h;\
+    for (i = hashtable_bucket(t, hk), s = 0; (h = ktable[i]);\
+         i = (i + ++s) & tmask)
 
 /* Conditional macro for incrementing stats counters. */
 #  ifndef HASHTABLE_NSTATS
 #    define _stats_inc(c) (c++)
+#    define _stats_add(c, n) (c += (n))
 #  else
 #    define _stats_inc(c)
+#    define _stats_add(c, n)
 #  endif
 
 /** Allocate and initialize a hashtable instance.
@@ -250,12 +525,31 @@ static inline unsigned nozero(unsigned h)
  * be possible to fill the table beyond the requested size, but performance can
  * start to degrade badly if it is over filled.
  *
+ * The bloom filter uses HASHTABLE_BLOOM_BITS per entry.
+ *
+ * \param size - The desired minimum size of the hash table.
+ *
+ * \return The initialized hashtable instance or NULL if it failed. */
+static inline hashtable_t *NAME_new(size_t size)
+{
+    return _hashtable_new(size, HASHTABLE_BLOOM_BITS, _MODE_INDEX | _MODE_GROUP);
+}
+
+/** Allocate and initialize a hashtable instance with a sized bloom filter.
+ *
+ * This is the same as NAME_new() except the bloom filter is sized for \p
+ * bloom_bits per entry, where 0 means no bloom filter. More bits give fewer
+ * false positives for missing keys, with about 2% at 8 bits and 0.5% at 12
+ * bits, at the cost of more memory and cache.
+ *
  * \param size - The desired minimum size of the hash table.
  *
+ * \param bloom_bits - The bloom filter bits per entry.
+ *
  * \return The initialized hashtable instance or NULL if it failed. */
-static inline hashtable_t *NAME_new(int size)
+static inline hashtable_t *NAME_new_bloom(size_t size, int bloom_bits)
 {
-    return _hashtable_new(size);
+    return _hashtable_new(size, bloom_bits, _MODE_INDEX | _MODE_GROUP);
 }
 
 /** Destroy and free a hashtable instance.
@@ -292,21 +586,79 @@ static inline void NAME_stats_init(hashtable_t *t)
  *
  * \param *e - The entry object to add.
  *
- * \return The added entry, or NULL if the table is full. */
+ * \return The added entry, or NULL if the table is full.
+ *
+ * In index mode this is instead NAME_add(t, KEY_t *k, int64_t e) adding index
+ * e for key k, returning e or -1 if the table is full. */
+#  ifdef HASHTABLE_INDEX
+static inline int64_t NAME_add(hashtable_t *t, KEY_t *k, int64_t e)
+{
+    unsigned he = _KEY_HASH(k);
+
+    assert(e >= 0);
+#  else
 static inline ENTRY_t *NAME_add(hashtable_t *t, ENTRY_t *e)
 {
     unsigned he = _KEY_HASH(e);
 
     assert(e != NULL);
+#  endif
     if (t->count + 1 == t->size)
-        return NULL;
+        return _ENTRY_NONE;
 #  ifndef HASHTABLE_NBLOOM
-    hashtable_setbloom(t, he);
+    if (t->kbloom)
+        hashtable_setbloom(t, he);
 #  endif
+#  ifdef HASHTABLE_GROUP
+    size_t i = hashtable_groupslot(t, he);
+#  else
     _for_probe(t, he, i, h);
+#  endif
     t->count++;
-    t->ktable[i] = he;
-    return t->etable[i] = e;
+    _KTABLE(t)[i] = _KEY_TAG(he);
+    return _ENTRY_SET(t, i, e);
+}
+
+/* Find an entry for a match object with key hash hm after the bloom filter. */
+static inline _ENTRY_REF NAME_find_hashed(hashtable_t *t, MATCH_t *m,
+                                          unsigned const hm)
+{
+    unsigned const tm = _KEY_TAG(hm);
+    _ENTRY_REF e;
+
+#  ifdef HASHTABLE_GROUP
+    size_t i = hashtable_group(t, hm), s = 0;
+    unsigned b;
+
+    for (;;) {
+        /* Count each group compare as one hash compare. */
+        _stats_inc(t->hashcmp_count);
+        for (b = hashtable_groupmatch(t, i, tm); b; b &= b - 1) {
+            _stats_inc(t->entrycmp_count);
+            if (!MATCH_cmp(m, e = _ENTRY_GET(t, i + hashtable_firstbit(b)))) {
+                _stats_inc(t->match_count);
+                return e;
+            }
+        }
+        if (hashtable_groupmatch(t, i, 0))
+            return _ENTRY_NONE;
+        i = hashtable_groupnext(t, i, ++s);
+    }
+#  else
+    _for_probe(t, hm, i, he) {
+        _stats_inc(t->hashcmp_count);
+        if (tm == he) {
+            _stats_inc(t->entrycmp_count);
+            if (!MATCH_cmp(m, e = _ENTRY_GET(t, i))) {
+                _stats_inc(t->match_count);
+                return e;
+            }
+        }
+    }
+    /* Also count the compare for the empty bucket. */
+    _stats_inc(t->hashcmp_count);
+    return _ENTRY_NONE;
+#  endif
 }
 
 /** Find an entry in a hashtable.
@@ -318,34 +670,205 @@ static inline ENTRY_t *NAME_add(hashtable_t *t, ENTRY_t *e)
  *
  * \param *m - The key or match object to search for.
  *
- * \return The first found entry, or NULL if nothing was found. */
-static inline ENTRY_t *NAME_find(hashtable_t *t, MATCH_t *m)
+ * \return The first found entry, or NULL if nothing was found. In index mode
+ * the index of the first found entry, or -1 if nothing was found. */
+static inline _ENTRY_REF NAME_find(hashtable_t *t, MATCH_t *m)
 {
     assert(m != NULL);
     unsigned hm = _KEY_HASH(m);
-    ENTRY_t *e;
 
     _stats_inc(t->find_count);
 #  ifndef HASHTABLE_NBLOOM
-    if (!hashtable_getbloom(t, hm))
-        return NULL;
+    if (t->kbloom && !hashtable_getbloom(t, hm))
+        return _ENTRY_NONE;
 #  endif
-    _for_probe(t, hm, i, he) {
-        _stats_inc(t->hashcmp_count);
-        if (hm == he) {
-            _stats_inc(t->entrycmp_count);
-            if (!MATCH_cmp(m, e = t->etable[i])) {
-                _stats_inc(t->match_count);
-                return e;
+    return NAME_find_hashed(t, m, hm);
+}
+
+/** Find the first of an array of match objects that has an entry.
+ *
+ * This gives the same result as calling NAME_find() for m[0], m[1], ... until
+ * an entry is found, but is faster for big tables. It hashes up to
+ * HASHTABLE_BATCH match objects at a time and prefetches their bloom filter
+ * blocks, then prefetches the buckets of those that pass the bloom filter, and
+ * then probes them in order. This overlaps the cache misses of the lookups
+ * instead of waiting for each in turn.
+ *
+ * \param *t - The hashtable to search.
+ *
+ * \param *m - The array of match objects to search for.
+ *
+ * \param n - The number of match objects.
+ *
+ * \param *e - Set to the found entry (or entry index in index mode) if one
+ * was found.
+ *
+ * \return The index of the first match object found, or n if none were. */
+static inline int NAME_find_batch(hashtable_t *t, MATCH_t *m, int n,
+                                  _ENTRY_REF *e)
+{
+    unsigned hm[HASHTABLE_BATCH];
+    int jp[HASHTABLE_BATCH];
+    int i, j, k, np;
+
+    assert(m != NULL);
+    assert(e != NULL);
+    for (i = 0; i < n; i += k) {
+        k = n - i < HASHTABLE_BATCH ? n - i : HASHTABLE_BATCH;
+        for (j = 0; j < k; j++) {
+            hm[j] = _KEY_HASH(&m[i + j]);
+#  ifndef HASHTABLE_NBLOOM
+            if (t->kbloom)
+                hashtable_prefetch(hashtable_bloomblock(t, hm[j]));
+            else
+#  endif
+                hashtable_prefetch(&_KTABLE(t)[_BUCKET(t, hm[j])]);
+        }
+        for (np = 0, j = 0; j < k; j++) {
+#  ifndef HASHTABLE_NBLOOM
+            /* Keep only the hashes that pass the bloom filter, prefetching
+               their buckets. */
+            if (t->kbloom) {
+                if (!hashtable_getbloom(t, hm[j]))
+                    continue;
+                hashtable_prefetch(&_KTABLE(t)[_BUCKET(t, hm[j])]);
+            }
+#  endif
+            hm[np] = hm[j];
+            jp[np++] = j;
+        }
+        for (j = 0; j < np; j++) {
+            if ((*e = NAME_find_hashed(t, &m[i + jp[j]], hm[j])) !=
+                _ENTRY_NONE) {
+                _stats_add(t->find_count, jp[j] + 1);
+                return i + jp[j];
             }
         }
+        _stats_add(t->find_count, k);
     }
-    /* Also count the compare for the empty bucket. */
-    _stats_inc(t->hashcmp_count);
-    return NULL;
+    return n;
 }
 
-static inline ENTRY_t *NAME_next(hashtable_t *t, int *i);
+/** Get the hash of a key or match object as used by the hashtable.
+ *
+ * This is never zero, and is what hashtable_getbloom(), hashtable_setbloom()
+ * and hashtable_bloomindex() take. */
+static inline unsigned NAME_hash(MATCH_t *m)
+{
+    return _KEY_HASH(m);
+}
+
+/** Prefetch the bloom filter block and first bucket for a match object.
+ *
+ * Doing this for a batch of match objects before adding or finding them
+ * overlaps their cache misses. */
+static inline void NAME_prefetch_key(hashtable_t *t, MATCH_t *m)
+{
+    unsigned hm = _KEY_HASH(m);
+
+#  ifndef HASHTABLE_NBLOOM
+    if (t->kbloom)
+        hashtable_prefetch(hashtable_bloomblock(t, hm));
+#  endif
+    hashtable_prefetch(&_KTABLE(t)[_BUCKET(t, hm)]);
+}
+
+/** Find the bucket for a match object, only probing buckets in [lo, hi).
+ *
+ * This is for building a hashtable with several threads, each only touching
+ * its own range of buckets. In group mode lo and hi must be multiples of
+ * HASHTABLE_GROUP_SIZE. It doesn't check the bloom filter or count stats.
+ *
+ * \param *t - The hashtable to search.
+ *
+ * \param *m - The match object to search for.
+ *
+ * \param lo, hi - The range of buckets to probe.
+ *
+ * \return The bucket of the first matching entry, or the first empty bucket
+ * if there isn't one. -1 if the first bucket probed is not in [lo, hi), or -2
+ * if the probe leaves [lo, hi) before finding a bucket. */
+static inline int64_t NAME_probe(hashtable_t *t, MATCH_t *m, size_t lo,
+                                 size_t hi)
+{
+    unsigned const hm = _KEY_HASH(m);
+    unsigned const tm = _KEY_TAG(hm);
+    size_t i = _BUCKET(t, hm), s = 0;
+
+    if (i < lo || i >= hi)
+        return -1;
+#  ifdef HASHTABLE_GROUP
+    unsigned b;
+
+    for (;;) {
+        /* Groups fill from the start, so there are no entries after an empty
+           bucket. */
+        for (b = hashtable_groupmatch(t, i, tm); b; b &= b - 1)
+            if (!MATCH_cmp(m, _ENTRY_GET(t, i + hashtable_firstbit(b))))
+                return (int64_t)(i + hashtable_firstbit(b));
+        if ((b = hashtable_groupmatch(t, i, 0)))
+            return (int64_t)(i + hashtable_firstbit(b));
+        i = hashtable_groupnext(t, i, ++s);
+        if (i < lo || i >= hi)
+            return -2;
+    }
+#  else
+    unsigned h;
+
+    for (;;) {
+        h = _KTABLE(t)[i];
+        if (!h || (h == tm && !MATCH_cmp(m, _ENTRY_GET(t, i))))
+            return (int64_t)i;
+        i = (i + ++s) & t->tmask;
+        if (i < lo || i >= hi)
+            return -2;
+    }
+#  endif
+}
+
+/** Put an entry for a match object in an empty bucket from NAME_probe().
+ *
+ * This doesn't update the count or the bloom filter. */
+static inline void NAME_fill(hashtable_t *t, size_t i, MATCH_t *m,
+                             _ENTRY_REF e)
+{
+    assert(!_KTABLE(t)[i]);
+    _KTABLE(t)[i] = _KEY_TAG(_KEY_HASH(m));
+    _ENTRY_SET(t, i, e);
+}
+
+/** Find the entry for a match object, or add one if there isn't one.
+ *
+ * This is the same as doing NAME_find() and then NAME_add() if nothing was
+ * found, but probes the table once and doesn't count stats.
+ *
+ * \param *t - The hashtable to search and add to.
+ *
+ * \param *m - The match object to search for.
+ *
+ * \param e - The entry (or entry index in index mode) to add.
+ *
+ * \return The found or added entry, or NULL (-1 in index mode) if nothing
+ * was found and the table is full. */
+static inline _ENTRY_REF NAME_find_add(hashtable_t *t, MATCH_t *m,
+                                       _ENTRY_REF e)
+{
+    size_t i = (size_t)NAME_probe(t, m, 0, t->size);
+
+    if (_KTABLE(t)[i])
+        return _ENTRY_GET(t, i);
+    if (t->count + 1 == t->size)
+        return _ENTRY_NONE;
+#  ifndef HASHTABLE_NBLOOM
+    if (t->kbloom)
+        hashtable_setbloom(t, _KEY_HASH(m));
+#  endif
+    NAME_fill(t, i, m, e);
+    t->count++;
+    return e;
+}
+
+static inline _ENTRY_REF NAME_next(hashtable_t *t, size_t *i);
 
 /** Initialize a iteration and return the first entry.
  *
@@ -359,10 +882,11 @@ static inline ENTRY_t *NAME_next(hashtable_t *t, int *i);
  *
  * \param *t - the hashtable to iterate over.
  *
- * \param *i - the int iterator index to initialize.
+ * \param *i - the size_t iterator index to initialize.
  *
- * \return The first entry or NULL if the hashtable is empty. */
-static inline ENTRY_t *NAME_iter(hashtable_t *t, int *i)
+ * \return The first entry or NULL if the hashtable is empty. In index mode
+ * the first entry index or -1. */
+static inline _ENTRY_REF NAME_iter(hashtable_t *t, size_t *i)
 {
     assert(t != NULL);
     assert(i != NULL);
@@ -377,17 +901,19 @@ static inline ENTRY_t *NAME_iter(hashtable_t *t, int *i)
  *
  * \param *t - the hashtable to iterate over.
  *
- * \param *i - the int iterator index to use.
+ * \param *i - the size_t iterator index to use.
  *
- * \return The next entry or NULL if the iterator is finished. */
-static inline ENTRY_t *NAME_next(hashtable_t *t, int *i)
+ * \return The next entry or NULL if the iterator is finished. In index mode
+ * the next entry index or -1. */
+static inline _ENTRY_REF NAME_next(hashtable_t *t, size_t *i)
 {
     assert(t != NULL);
     assert(i != NULL);
-    ENTRY_t *e = NULL;
 
-    while ((*i < t->size) && !(e = t->etable[(*i)++])) ;
-    return e;
+    while (*i < t->size)
+        if (_KTABLE(t)[(*i)++])
+            return _ENTRY_GET(t, *i - 1);
+    return _ENTRY_NONE;
 }
 
 #  undef ENTRY
@@ -400,11 +926,29 @@ static inline ENTRY_t *NAME_next(hashtable_t *t, int *i)
 #  undef KEY_hash
 #  undef MATCH_cmp
 #  undef NAME_new
+#  undef NAME_new_bloom
 #  undef NAME_free
 #  undef NAME_stats_init
 #  undef NAME_add
 #  undef NAME_find
+#  undef NAME_find_hashed
+#  undef NAME_find_batch
+#  undef NAME_hash
+#  undef NAME_prefetch_key
+#  undef NAME_probe
+#  undef NAME_fill
+#  undef NAME_find_add
 #  undef NAME_iter
 #  undef NAME_next
 #  undef _KEY_HASH
+#  undef _ENTRY_REF
+#  undef _ENTRY_NONE
+#  undef _ENTRY_GET
+#  undef _ENTRY_SET
+#  undef _KTABLE_t
+#  undef _KTABLE
+#  undef _KEY_TAG
+#  undef _BUCKET
+#  undef _MODE_INDEX
+#  undef _MODE_GROUP
 #endif                          /* ENTRY */
@@ -0,0 +1,103 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+                              /*=
+                               | Those who cannot remember the past
+                               | are condemned to repeat it.
+                               */
+
+/** \file history.c
+ * A window of the most recent data of the new file.
+ *
+ * While less than \p window bytes have been added the buffer holds all of
+ * them at their own positions, doubling in size as needed. Once it reaches
+ * \p window bytes it wraps around, overwriting the oldest data. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "librsync.h"
+#include "history.h"
+#include "util.h"
+
+/** The initial allocation for a history. */
+#define RS_HISTORY_MIN_ALLOC (1 << 16)
+
+void rs_history_init(rs_history_t *h, size_t window)
+{
+    assert(window > 0);
+    h->buf = NULL;
+    h->alloc = 0;
+    h->window = window;
+    h->len = 0;
+}
+
+void rs_history_done(rs_history_t *h)
+{
+    free(h->buf);
+    h->buf = NULL;
+    h->alloc = h->window = 0;
+    h->len = 0;
+}
+
+void rs_history_add(rs_history_t *h, void const *data, size_t len)
+{
+    rs_byte_t const *p = data;
+    size_t alloc, off, n;
+
+    if (len >= h->window) {
+        /* Only the last window bytes are kept. */
+        h->len += (rs_long_t)(len - h->window);
+        p += len - h->window;
+        len = h->window;
+    }
+    if (h->alloc < h->window && (size_t)h->len + len > h->alloc) {
+        /* It holds less than a window, so data is at its own positions. */
+        for (alloc = h->alloc ? h->alloc : RS_HISTORY_MIN_ALLOC;
+             alloc < (size_t)h->len + len && alloc < h->window; alloc *= 2) ;
+        if (alloc > h->window)
+            alloc = h->window;
+        h->buf = rs_realloc(h->buf, alloc, "output history");
+        h->alloc = alloc;
+    }
+    while (len) {
+        off = (size_t)(h->len % (rs_long_t)h->window);
+        n = h->alloc - off < len ? h->alloc - off : len;
+        memcpy(h->buf + off, p, n);
+        h->len += (rs_long_t)n;
+        p += n;
+        len -= n;
+    }
+}
+
+size_t rs_history_get(rs_history_t const *h, rs_long_t pos, size_t len,
+                      rs_byte_t const **data)
+{
+    size_t off;
+
+    if (pos < 0 || pos >= h->len || pos < h->len - (rs_long_t)h->window)
+        return 0;
+    off = (size_t)(pos % (rs_long_t)h->window);
+    if ((rs_long_t)len > h->len - pos)
+        len = (size_t)(h->len - pos);
+    if (len > h->alloc - off)
+        len = h->alloc - off;
+    *data = h->buf + off;
+    return len;
+}
@@ -0,0 +1,66 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file history.h
+ * A window of the most recent data of the new file.
+ *
+ * Format 2 deltas can have COPY_OUTPUT commands that copy data from earlier in
+ * the new file. Both delta.c and patch.c keep the last \p window bytes of the
+ * new file in a history to find and serve them. Position \p pos of the new
+ * file is kept at offset \p pos % \p window of a ring buffer, which starts
+ * small and grows up to \p window bytes as data is added. */
+#ifndef HISTORY_H
+#  define HISTORY_H
+
+#  include <stddef.h>
+#  include "librsync.h"
+
+/** The default history window for format 2 deltas. */
+#  define RS_OUTPUT_WINDOW (1 << 24)
+
+/** The largest history window accepted in format 2 deltas. */
+#  define RS_MAX_OUTPUT_WINDOW (1 << 30)
+
+/** The history of the new file. */
+typedef struct rs_history {
+    rs_byte_t *buf;             /**< The ring buffer. */
+    size_t alloc;               /**< The allocated size of buf. */
+    size_t window;              /**< The max size of buf, or 0 if unused. */
+    rs_long_t len;              /**< The total length of data added. */
+} rs_history_t;
+
+/** Initialize a history keeping the last \p window bytes of data. */
+void rs_history_init(rs_history_t *h, size_t window);
+
+/** Free the memory used by a history. */
+void rs_history_done(rs_history_t *h);
+
+/** Add \p len bytes of data to the end of a history. */
+void rs_history_add(rs_history_t *h, void const *data, size_t len);
+
+/** Get the data at \p pos in a history.
+ *
+ * \param data - Set to point at the data.
+ *
+ * \return The number of contiguous bytes available up to \p len, or 0 if
+ * \p pos is not in the history. */
+size_t rs_history_get(rs_history_t const *h, rs_long_t pos, size_t len,
+                      rs_byte_t const **data);
+
+#endif                          /* !HISTORY_H */
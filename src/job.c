@@ -30,6 +30,7 @@
 #include <time.h>
 #include "librsync.h"
 #include "job.h"
+#include "pool.h"
 #include "scoop.h"
 #include "trace.h"
 #include "util.h"
@@ -57,6 +58,14 @@ rs_job_t *rs_job_new(char const *job_name, rs_result (*statefn)(rs_job_t *))
 rs_result rs_job_free(rs_job_t *job)
 {
     free(job->scoop_buf);
+    free(job->sig_batch);
+    free(job->index_buf);
+    free(job->block_buf);
+    free(job->delta_cmds);
+    free(job->out_index);
+    free(job->fill_runs);
+    rs_history_done(&job->history);
+    rs_pool_free(job->pool);
     if (job->job_owns_sig)
         rs_free_sumset(job->signature);
     rs_bzero(job, sizeof *job);
@@ -107,21 +116,26 @@ rs_result rs_job_iter(rs_job_t *job, rs_buffers_t *buffers)
 static rs_result rs_job_work(rs_job_t *job, rs_buffers_t *buffers)
 {
     rs_result result;
+    char *out;
 
     rs_job_check(job);
     assert(buffers);
 
     job->stream = buffers;
     while (1) {
+        out = buffers->next_out;
         result = rs_tube_catchup(job);
-        if (result == RS_DONE && job->statefn) {
+        if (result == RS_DONE && job->statefn)
             result = job->statefn(job);
-            if (result == RS_DONE) {
-                /* The job is done so clear statefn. */
-                job->statefn = NULL;
-                /* There might be stuff in the tube, so keep running. */
-                continue;
-            }
+        /* Record the output written by this step for COPY_OUTPUT. */
+        if (job->record_output)
+            rs_history_add(&job->history, out,
+                           (size_t)(buffers->next_out - out));
+        if (result == RS_DONE && job->statefn) {
+            /* The job is done so clear statefn. */
+            job->statefn = NULL;
+            /* There might be stuff in the tube, so keep running. */
+            continue;
         }
         if (result == RS_BLOCKED)
             return result;
@@ -130,11 +144,26 @@ static rs_result rs_job_work(rs_job_t *job, rs_buffers_t *buffers)
     }
 }
 
+rs_result rs_job_set_threads(rs_job_t *job, int threads)
+{
+    rs_job_check(job);
+    if (threads < 0)
+        return RS_PARAM_ERROR;
+    job->threads = threads < RS_POOL_MAX_THREADS ? threads :
+        RS_POOL_MAX_THREADS;
+    return RS_DONE;
+}
+
 const rs_stats_t *rs_job_statistics(rs_job_t *job)
 {
     return &job->stats;
 }
 
+const rs_xstats_t *rs_job_xstats(rs_job_t *job)
+{
+    return &job->xstats;
+}
+
 rs_result rs_job_drive(rs_job_t *job, rs_buffers_t *buf, rs_driven_cb in_cb,
                        void *in_opaque, rs_driven_cb out_cb, void *out_opaque)
 {
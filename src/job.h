@@ -33,6 +33,7 @@
 #  include <stddef.h>
 #  include "mdfour.h"
 #  include "checksum.h"
+#  include "history.h"
 #  include "librsync.h"
 
 /** Magic job tag number for checking jobs have been initialized. */
@@ -43,6 +44,18 @@
  * This is used to constrain and set the internal buffer sizes. */
 #  define MAX_DELTA_CMD (1<<16)
 
+/** Max length of a miss is 64K including 3 command bytes. */
+#  define MAX_MISS_LEN (MAX_DELTA_CMD - 3)
+
+/** Max number of offsets to scan in each batch by delta.c. */
+#  define RS_SCAN_BATCH 256
+
+/** Max number of blocks per thread in each batch of signature sums.
+ *
+ * This is also used to size the input buffer for signatures, so each thread
+ * gets a reasonable amount of work from each batch. */
+#  define RS_SIG_BATCH_BLOCKS 16
+
 /** The contents of this structure are private. */
 struct rs_job {
     int dogtag;
@@ -80,6 +93,9 @@ struct rs_job {
     /** The weak signature digest used by readsums.c */
     rs_weak_sum_t weak_sig;
 
+    /** The chunk length of a chunked signature block used by readsums.c */
+    int chunk_len;
+
     /** The rollsum weak signature accumulator used by delta.c */
     weaksum_t weak_sum;
 
@@ -91,6 +107,7 @@ struct rs_job {
 
     /** Encoding statistics. */
     rs_stats_t stats;
+    rs_xstats_t xstats;         /**< More encoding statistics. */
 
     /** Buffer of data in the scoop. Allocation is scoop_buf[0..scoop_alloc],
      * and scoop_next[0..scoop_avail] contains data yet to be processed. */
@@ -105,8 +122,11 @@ struct rs_job {
     size_t scan_len;            /**< The delta scan buffer length. */
     size_t scan_pos;            /**< The delta scan position. */
 
-    /** If USED is >0, then buf contains that much write data to be sent out. */
-    rs_byte_t write_buf[36];
+    /** If USED is >0, then buf contains that much write data to be sent out.
+     *
+     * It holds the largest signature block, which is a weak sum, a chunk
+     * length and a strong sum. */
+    rs_byte_t write_buf[40];
     size_t write_len;
 
     /** If \p copy_len is >0, then that much data should be copied through
@@ -116,9 +136,100 @@ struct rs_job {
     /** Copy from the basis position. */
     rs_long_t basis_pos, basis_len;
 
-    /** Callback used to copy data from the basis into the output. */
+    /** Callback used to copy data from the basis into the output, or to read
+     * the basis to extend matches in delta.c. */
     rs_copy_cb *copy_cb;
     void *copy_arg;
+
+    /** Number of threads to use for parallel processing, 0 or 1 for none. */
+    int threads;
+
+    /** The pool of worker threads, created on demand if threads > 1. */
+    struct rs_pool *pool;
+
+    /** Block sums calculated in a batch by mksum.c waiting to be sent, where
+     * sig_batch[sig_batch_pos..sig_batch_len] are yet to be sent. */
+    struct rs_block_sig *sig_batch;
+    int sig_batch_len;          /**< The number of sums in the batch. */
+    int sig_batch_pos;          /**< The next sum in the batch to send. */
+
+    /** An indexed signature being read by readsums.c, where
+     * index_buf[0..index_pos] has been read out of index_len. */
+    rs_byte_t *index_buf;
+    size_t index_len;           /**< The length of the indexed signature. */
+    size_t index_pos;           /**< The amount read so far. */
+
+    /** Positions in the new file used by sigdelta.c, where new_pos is the
+     * start of the current delta command's data, and sig_pos is the start of
+     * the next block to send sums for. */
+    rs_long_t new_pos, sig_pos;
+
+    /** The number of block sums reused from the old signature by sigdelta.c. */
+    rs_long_t sig_reused;
+
+    /** Buffer for blocks read back from the new file by sigdelta.c, or from
+     * the basis by delta.c. */
+    rs_byte_t *block_buf;
+
+    /** The delta format magic generated by delta.c and pdelta.c. */
+    int delta_magic;
+
+    /** The last window of the new file, used by delta.c to find COPY_OUTPUT
+     * matches and by patch.c to apply them. */
+    rs_history_t history;
+
+    /** Flag set by patch.c to add all its output to the history. */
+    int record_output;
+
+    /** Index of the blocks of literal data in the history used by delta.c,
+     * with out_index_mask+1 slots, where out_indexed is the position of the
+     * next block to index. */
+    struct rs_out_slot *out_index;
+    size_t out_index_mask;      /**< The mask for slot numbers. */
+    rs_long_t out_indexed;      /**< The next block position to index. */
+
+    /** Flag set by delta.c when the current match at basis_pos is a
+     * COPY_OUTPUT from earlier in the new file instead of the basis. */
+    int match_output;
+
+    /** The skip-ahead state used by delta.c for effort levels below
+     * ::RS_DELTA_EFFORT_MAX. After a run of skip_after misses it skips up to
+     * skip_max bytes at a time, scanning scan_left offsets between skips.
+     * skip_after is 0 for an exhaustive scan. */
+    size_t skip_after, skip_max;
+    rs_long_t miss_run;         /**< The length of the current miss run. */
+    size_t skip_len;            /**< The length still to skip. */
+    size_t scan_left;           /**< The offsets to scan before skipping. */
+
+    /** The delta effort level set by rs_delta_set_effort(). */
+    int delta_effort;
+
+    /** The offset in scan_buf up to which delta.c has checked that no run of
+     * equal bytes starts. */
+    size_t run_off;
+
+    /** Flag set by delta.c when the current match is a FILL of the byte in
+     * basis_pos instead of a COPY. */
+    int match_fill;
+
+    /** The offset and length of the longest run of basis blocks of each byte
+     * value used by delta.c, found when first needed. */
+    rs_long_t *fill_runs;
+
+    /** The delta commands found by pdelta.c, where delta_cmds[delta_cmd_pos]
+     * is the next to send, with delta_cmd_done bytes of it already sent. */
+    struct rs_delta_cmd *delta_cmds;
+    size_t delta_cmd_count;     /**< The number of delta commands. */
+    size_t delta_cmd_size;      /**< The number of delta commands allocated. */
+    size_t delta_cmd_pos;       /**< The next delta command to send. */
+    rs_long_t delta_cmd_done;   /**< The bytes of the command already sent. */
+
+    /** The length of the segment of the new file scanned by a delta.c job
+     * for pdelta.c, or 0 for a normal delta job. A segment job records its
+     * commands in delta_cmds instead of emitting them, with seg_done bytes
+     * recorded so far, and stops at the first command end after seg_len. */
+    rs_long_t seg_len;
+    rs_long_t seg_done;         /**< The bytes of commands recorded. */
 };
 
 rs_job_t *rs_job_new(const char *, rs_result (*statefn)(rs_job_t *));
@@ -65,11 +65,23 @@ typedef intmax_t rs_long_t;
 typedef enum {
     /** A delta file.
      *
-     * At present, there's only one delta format.
+     * The original delta format, with LITERAL and COPY commands. This is the
+     * default.
      *
      * The four-byte literal \c "rs\x026". */
     RS_DELTA_MAGIC = 0x72730236,
 
+    /** A format 2 delta file.
+     *
+     * This also has COPY_OUTPUT commands that copy data from earlier in the
+     * new file, so repeated data is only sent once. Older versions of
+     * librsync can't apply it.
+     *
+     * The four-byte literal \c "rs\x027".
+     *
+     * \sa rs_delta_set_magic() */
+    RS_DELTA2_MAGIC = 0x72730237,
+
     /** A signature file with MD4 signatures.
      *
      * Backward compatible with librsync < 1.0, but strongly deprecated because
@@ -108,6 +120,56 @@ typedef enum {
      * \sa rs_sig_begin() */
     RS_RK_BLAKE2_SIG_MAGIC = 0x72730147,
 
+    /** A signature file with RabinKarp rollsum and XXH3 hash.
+     *
+     * Uses the 128 bit XXH3 hash, which is many times faster than BLAKE2 but
+     * is not a cryptographic hash. It is only safe to use when the basis and
+     * new files are both trusted, since anyone who controls their contents can
+     * easily create collisions that corrupt the reconstructed file. Supported
+     * since librsync 2.3.3.
+     *
+     * The four-byte literal \c "rs\x01H".
+     *
+     * \sa rs_sig_begin() */
+    RS_RK_XXH3_SIG_MAGIC = 0x72730148,
+
+    /** A chunked signature file with BLAKE2 hash.
+     *
+     * The blocks are content-defined chunks of variable length averaging the
+     * block length, and each block has its length as well as its sums. The
+     * delta only looks up the chunks of the new file instead of every byte
+     * offset, and an insertion or deletion only changes the chunks around it.
+     * Supported since librsync 2.3.3.
+     *
+     * The four-byte literal \c "rs\x01W".
+     *
+     * \sa rs_sig_begin() */
+    RS_CDC_BLAKE2_SIG_MAGIC = 0x72730157,
+
+    /** A chunked signature file with XXH3 hash.
+     *
+     * Like ::RS_CDC_BLAKE2_SIG_MAGIC but with the XXH3 hash, which is only
+     * safe to use for trusted files like ::RS_RK_XXH3_SIG_MAGIC. Supported
+     * since librsync 2.3.3.
+     *
+     * The four-byte literal \c "rs\x01X".
+     *
+     * \sa rs_sig_begin() */
+    RS_CDC_XXH3_SIG_MAGIC = 0x72730158,
+
+    /** An indexed signature file with a prebuilt hashtable.
+     *
+     * This holds a signature of any of the other unchunked kinds together
+     * with its hashtable, laid out so it can be memory-mapped and used in place instead
+     * of being parsed and indexed. It is in native byte order, so it is only
+     * for use on the machine that made it or ones like it. Supported since
+     * librsync 2.3.3.
+     *
+     * The four-byte literal \c "rs\x01I".
+     *
+     * \sa rs_indexsig_file() */
+    RS_INDEX_SIG_MAGIC = 0x72730149,
+
 } rs_magic_number;
 
 /** Log severity levels.
@@ -204,6 +266,28 @@ typedef enum rs_result {
 /** Return an English description of a ::rs_result value. */
 LIBRSYNC_EXPORT char const *rs_strerror(rs_result r);
 
+/** Select the instruction set used by the checksum kernels.
+ *
+ * By default the best kernels supported by the CPU are selected the first
+ * time they are needed, unless the \c LIBRSYNC_CPU environment variable is
+ * set to a lower level. This can be used to select a lower level for testing
+ * or benchmarking. It must not be called while any jobs are running.
+ *
+ * \param level One of "scalar", "sse2", "sse4.1", "avx2" or "avx512", or
+ * "auto" or NULL for the best supported level. Levels higher than the CPU
+ * supports are reduced to the best supported level.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if \p level is not a known level.
+ *
+ * \sa rs_cpu_features() */
+LIBRSYNC_EXPORT rs_result rs_cpu_select(char const *level);
+
+/** Describe the selected instruction set level and checksum kernels.
+ *
+ * \returns A string like "avx2 blake2b=avx2x4 md4=avx2x8", giving the level
+ * followed by the implementation selected for each kernel. */
+LIBRSYNC_EXPORT char const *rs_cpu_features(void);
+
 /** Performance statistics from a librsync encoding or decoding operation.
  *
  * \sa api_stats \sa rs_format_stats() \sa rs_log_stats() */
@@ -230,12 +314,37 @@ typedef struct rs_stats {
     time_t start, end;
 } rs_stats_t;
 
+/** More performance statistics from a librsync encoding or decoding
+ * operation.
+ *
+ * These are kept out of ::rs_stats_t, which callers allocate, so that more
+ * can be added without changing its size. Only use them through the
+ * pointers returned by rs_job_xstats() and rs_whole_xstats().
+ *
+ * \sa api_stats \sa rs_format_xstats() \sa rs_log_xstats() */
+typedef struct rs_xstats {
+    rs_long_t output_cmds;      /**< Number of COPY_OUTPUT commands. */
+    rs_long_t output_bytes;     /**< Number of bytes copied from the output. */
+    rs_long_t output_cmdbytes;  /**< Number of bytes used in COPY_OUTPUT
+                                 * commands. */
+
+    rs_long_t scan_bytes;       /**< Number of new file bytes scanned for
+                                 * matches by delta. */
+    rs_long_t skip_bytes;       /**< Number of new file bytes skipped without
+                                 * scanning by delta. */
+
+    rs_long_t fill_cmds;        /**< Number of FILL commands. */
+    rs_long_t fill_bytes;       /**< Number of bytes filled with a value. */
+    rs_long_t fill_cmdbytes;    /**< Number of bytes used in FILL commands. */
+} rs_xstats_t;
+
 /** MD4 message-digest accumulator.
  *
  * \sa rs_mdfour(), rs_mdfour_begin(), rs_mdfour_update(), rs_mdfour_result() */
 typedef struct rs_mdfour rs_mdfour_t;
 
-LIBRSYNC_EXPORT extern const int RS_MD4_SUM_LENGTH, RS_BLAKE2_SUM_LENGTH;
+LIBRSYNC_EXPORT extern const int RS_MD4_SUM_LENGTH, RS_BLAKE2_SUM_LENGTH,
+    RS_XXH3_SUM_LENGTH;
 
 #  define RS_MAX_STRONG_SUM_LENGTH 32
 
@@ -243,6 +352,21 @@ typedef uint32_t rs_weak_sum_t;
 typedef unsigned char rs_strong_sum_t[RS_MAX_STRONG_SUM_LENGTH];
 
 LIBRSYNC_EXPORT void rs_mdfour(unsigned char *out, void const *in, size_t);
+
+/** Calculate the MD4 sums of several buffers of the same length.
+ *
+ * This gives the same results as calling rs_mdfour() for each buffer, but
+ * hashes several buffers at once in SIMD lanes when the CPU supports it.
+ *
+ * \param out Array of \p n pointers to 16 byte buffers for the sums.
+ *
+ * \param in Array of \p n pointers to the buffers to hash.
+ *
+ * \param len The length of every buffer.
+ *
+ * \param n The number of buffers. */
+LIBRSYNC_EXPORT void rs_mdfour_batch(unsigned char *const *out,
+                                     void const *const *in, size_t len, int n);
 LIBRSYNC_EXPORT void rs_mdfour_begin( /* @out@ */ rs_mdfour_t *md);
 
 /** Feed some data into the MD4 accumulator.
@@ -278,6 +402,20 @@ LIBRSYNC_EXPORT char *rs_format_stats(rs_stats_t const *stats, char *buf,
  * \sa \ref api_stats \sa \ref api_trace */
 LIBRSYNC_EXPORT int rs_log_stats(rs_stats_t const *stats);
 
+/** Return a human-readable representation of more statistics.
+ *
+ * This is like rs_format_stats(), but gives an empty string if there are
+ * none of these statistics.
+ *
+ * \sa \ref api_stats */
+LIBRSYNC_EXPORT char *rs_format_xstats(rs_xstats_t const *xstats, char *buf,
+                                       size_t size);
+
+/** Write more statistics into the current log as text, if there are any.
+ *
+ * \sa \ref api_stats \sa \ref api_trace */
+LIBRSYNC_EXPORT int rs_log_xstats(rs_xstats_t const *xstats);
+
 /** The signature datastructure type. */
 typedef struct rs_signature rs_signature_t;
 
@@ -414,9 +552,23 @@ LIBRSYNC_EXPORT rs_result rs_job_drive(rs_job_t *job, rs_buffers_t *buf,
 /** Return a pointer to the statistics in a job. */
 LIBRSYNC_EXPORT const rs_stats_t *rs_job_statistics(rs_job_t *job);
 
+/** Return a pointer to the more statistics in a job. */
+LIBRSYNC_EXPORT const rs_xstats_t *rs_job_xstats(rs_job_t *job);
+
 /** Deallocate job state. */
 LIBRSYNC_EXPORT rs_result rs_job_free(rs_job_t *);
 
+/** Set the number of threads a job can use.
+ *
+ * Jobs that can split their work up, currently only signature generation, will
+ * use up to \p threads threads including the calling thread. The default 0
+ * means use only the calling thread. The output is the same regardless of how
+ * many threads are used. This must be called before the first rs_job_iter().
+ * More than 1024 threads are treated as 1024.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if threads is negative. */
+LIBRSYNC_EXPORT rs_result rs_job_set_threads(rs_job_t *job, int threads);
+
 /** Get or check signature arguments for a given file size.
  *
  * This can be used to get the recommended arguments for generating a
@@ -468,8 +620,8 @@ LIBRSYNC_EXPORT rs_job_t *rs_sig_begin(size_t block_len, size_t strong_len,
 
 /** Prepare to compute a streaming delta.
  *
- * \todo Add a version of this that takes a ::rs_magic_number controlling the
- * delta format. */
+ * This generates a ::RS_DELTA_MAGIC format delta, unless changed with
+ * rs_delta_set_magic(). */
 LIBRSYNC_EXPORT rs_job_t *rs_delta_begin(rs_signature_t *);
 
 /** Read a signature from a file into an ::rs_signature structure in memory.
@@ -482,10 +634,33 @@ LIBRSYNC_EXPORT rs_job_t *rs_delta_begin(rs_signature_t *);
 LIBRSYNC_EXPORT rs_job_t *rs_loadsig_begin(rs_signature_t **);
 
 /** Call this after loading a signature to index it.
+ *
+ * This only indexes the blocks added since the last call, so it can also be
+ * called while loading a signature with rs_loadsig_begin() to index the
+ * blocks loaded so far while they are still in cache. The time spent is
+ * included in rs_signature_log_stats().
  *
  * Use rs_free_sumset() to release it after use. */
 LIBRSYNC_EXPORT rs_result rs_build_hash_table(rs_signature_t *sums);
 
+/** Index a signature using several threads.
+ *
+ * This is the same as rs_build_hash_table(), but for big signatures it
+ * splits the hashtable and bloom filter into parts by hash and fills them
+ * concurrently using \p threads threads.
+ *
+ * \sa rs_threads */
+LIBRSYNC_EXPORT rs_result rs_build_hash_table_par(rs_signature_t *sums,
+                                                  int threads);
+
+/** Bloom filter bits per block used by rs_build_hash_table().
+ *
+ * The bloom filter is checked before the hashtable to quickly reject weak
+ * sums that are not in the signature. The default 8 bits rejects about 98%
+ * of them, and more bits reject more at the cost of more memory and cache.
+ * Setting it to 0 disables the bloom filter. */
+LIBRSYNC_EXPORT extern int rs_bloom_bits;
+
 /** Callback used to retrieve parts of the basis file.
  *
  * \param opaque The opaque object to execute the callback with. Often the file
@@ -520,6 +695,109 @@ typedef rs_result rs_copy_cb(void *opaque, rs_long_t pos, size_t *len,
  * \sa rs_patch_file() \sa \ref api_streaming */
 LIBRSYNC_EXPORT rs_job_t *rs_patch_begin(rs_copy_cb * copy_cb, void *copy_arg);
 
+/** Generate the signature of a new file from the old file's signature and
+ * the delta that created it.
+ *
+ * The job takes the delta as input and outputs the new signature, using the
+ * same magic, block_len and strong_len as the old signature. The sums of new
+ * blocks copied whole from block-aligned positions in the basis are taken
+ * from the old signature, and only the other blocks are read back from the
+ * new file using \p new_cb and hashed. The result is the same as generating a
+ * signature for the whole new file with rs_sig_begin().
+ *
+ * The delta must have been generated against the file \p old_sig was
+ * generated from, and the new file must be the result of applying it.
+ *
+ * \param old_sig The signature of the basis file, as loaded by
+ * rs_loadsig_begin(). It doesn't need a hashtable.
+ *
+ * \param new_cb Callback used to read parts of the new file.
+ *
+ * \param new_arg Opaque environment pointer passed through to the callback.
+ *
+ * \sa rs_sig_from_delta_file() \sa \ref api_streaming */
+LIBRSYNC_EXPORT rs_job_t *rs_sig_from_delta_begin(rs_signature_t *old_sig,
+                                                  rs_copy_cb * new_cb,
+                                                  void *new_arg);
+
+/** Let a delta job read the basis file to extend matches byte by byte.
+ *
+ * Without the basis a delta can only match whole blocks, so an edit anywhere
+ * in a block makes all of it literal data. With it, matches are extended
+ * forwards past the end of their last block, and backwards over the end of
+ * the literal data before them, up to the edited bytes. This gives smaller
+ * deltas with fewer, longer COPY commands. The delta is still a standard
+ * delta for the basis.
+ *
+ * This must be called before the first rs_job_iter().
+ *
+ * \param job A job from rs_delta_begin().
+ *
+ * \param basis_cb Callback used to read parts of the basis file. It must
+ * be for the file the job's signature was generated from.
+ *
+ * \param basis_arg Opaque environment pointer passed through to the callback.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if the job is not a delta job that
+ * hasn't started yet.
+ *
+ * \sa rs_delta_basis_file() \sa \ref api_streaming */
+LIBRSYNC_EXPORT rs_result rs_delta_set_basis(rs_job_t *job,
+                                             rs_copy_cb * basis_cb,
+                                             void *basis_arg);
+
+/** Set the format of the delta generated by a delta job.
+ *
+ * A ::RS_DELTA2_MAGIC delta also indexes the blocks of literal data in the
+ * last window of the new file, and copies repeats of them with COPY_OUTPUT
+ * commands instead of sending them again. The window is 16MB, and patching
+ * needs that much memory for the history of the output.
+ *
+ * This must be called before the first rs_job_iter().
+ *
+ * \param job A job from rs_delta_begin().
+ *
+ * \param magic ::RS_DELTA_MAGIC or ::RS_DELTA2_MAGIC.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if the job is not a delta job that
+ * hasn't started yet or \p magic is not a delta format.
+ *
+ * \sa rs_delta_magic */
+LIBRSYNC_EXPORT rs_result rs_delta_set_magic(rs_job_t *job,
+                                             rs_magic_number magic);
+
+/** The highest delta effort level, which scans every offset of the new file.
+ *
+ * \sa rs_delta_set_effort() */
+#  define RS_DELTA_EFFORT_MAX 9
+
+/** Set how hard a delta job looks for matches, like a compression level.
+ *
+ * At ::RS_DELTA_EFFORT_MAX, the default, every offset of the new file is
+ * looked up in the signature. Lower levels skip ahead in long runs of misses,
+ * such as new compressed or encrypted data. After a run of misses of
+ * `block_len << (effort + 2)` bytes it skips a growing number of bytes, up to
+ * `block_len << (8 - effort)`, between scans of `block_len` offsets. Any run
+ * of matching data at least that long plus three blocks is still found, and
+ * if the job can read the basis the match is extended backwards over the
+ * skipped data that hasn't been sent yet. Shorter runs of misses are scanned
+ * as before. The bytes skipped are counted in rs_xstats::skip_bytes.
+ *
+ * Chunked signatures already look up only one offset per chunk and ignore
+ * this.
+ *
+ * This must be called before the first rs_job_iter().
+ *
+ * \param job A job from rs_delta_begin().
+ *
+ * \param effort The effort level from 0 to ::RS_DELTA_EFFORT_MAX.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if the job is not a delta job that
+ * hasn't started yet or \p effort is out of range.
+ *
+ * \sa rs_delta_effort */
+LIBRSYNC_EXPORT rs_result rs_delta_set_effort(rs_job_t *job, int effort);
+
 #  ifndef RSYNC_NO_STDIO_INTERFACE
 #    include <stdio.h>
 
@@ -563,6 +841,46 @@ LIBRSYNC_EXPORT rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len,
  * only need to change these in testing. */
 LIBRSYNC_EXPORT extern int rs_inbuflen, rs_outbuflen;
 
+/** Number of threads for file IO operations.
+ *
+ * The default 0 means use only the calling thread, any other value is passed
+ * to rs_job_set_threads() for the jobs run by the whole-file functions. With
+ * more than 1 thread rs_delta_file() also scans segments of a new regular
+ * file in parallel. */
+LIBRSYNC_EXPORT extern int rs_threads;
+
+/** Format of the deltas generated by the whole-file functions.
+ *
+ * The default is ::RS_DELTA_MAGIC. With ::RS_DELTA2_MAGIC the new file is
+ * always scanned serially. \sa rs_delta_set_magic() */
+LIBRSYNC_EXPORT extern rs_magic_number rs_delta_magic;
+
+/** Effort level of the deltas generated by the whole-file functions.
+ *
+ * The default is ::RS_DELTA_EFFORT_MAX. With lower levels the new file is
+ * always scanned serially. \sa rs_delta_set_effort() */
+LIBRSYNC_EXPORT extern int rs_delta_effort;
+
+/** Whether to memory-map regular files for file IO operations.
+ *
+ * The default 0 means the whole-file functions always use stdio. Set it to 1
+ * to read regular input, basis and signature files directly from a read-only
+ * memory mapping where the platform supports it, instead of copying them
+ * through stdio buffers. Input files are still not mapped if rs_inbuflen is
+ * set.
+ *
+ * \warning If a mapped file is truncated while it is being used, for example
+ * a live file being backed up, reading the missing pages raises SIGBUS and
+ * kills the process instead of giving a short read or ::RS_IO_ERROR. Only set
+ * this for files that won't be truncated while in use. */
+LIBRSYNC_EXPORT extern int rs_mmap;
+
+/** Return a pointer to the more statistics from the last whole-file function.
+ *
+ * These are for the last whole-file function called by any thread, so they
+ * are only meaningful when one thread uses the whole-file functions. */
+LIBRSYNC_EXPORT const rs_xstats_t *rs_whole_xstats(void);
+
 /** Generate the signature of a basis file, and write it out to another.
  *
  * It's recommended you use rs_sig_args() to get the recommended arguments for
@@ -591,6 +909,11 @@ LIBRSYNC_EXPORT rs_result rs_sig_file(FILE *old_file, FILE *sig_file,
                                       rs_stats_t *stats);
 
 /** Load signatures from a signature file into memory.
+ *
+ * With rs_mmap set, an indexed signature file from rs_indexsig_file() is
+ * memory-mapped read-only where possible, so loading it takes constant time
+ * and processes loading the same file share one copy in the page cache. It is
+ * already indexed, so rs_build_hash_table() does nothing for it.
  *
  * \param sig_file Readable stdio file from which the signature will be read.
  *
@@ -603,17 +926,74 @@ LIBRSYNC_EXPORT rs_result rs_loadsig_file(FILE *sig_file,
                                           rs_signature_t **sumset,
                                           rs_stats_t *stats);
 
+/** Write a signature with its hashtable as an indexed signature file.
+ *
+ * The signature is indexed first if it isn't already. Loading the file with
+ * rs_loadsig_file() gives the same signature without parsing or indexing it.
+ *
+ * \param sumset The signature to write.
+ *
+ * \param index_file Writable stdio file for the indexed signature.
+ *
+ * \sa ::RS_INDEX_SIG_MAGIC \sa \ref api_whole */
+LIBRSYNC_EXPORT rs_result rs_indexsig_file(rs_signature_t *sumset,
+                                           FILE *index_file);
+
 /** Generate a delta between a signature and a new file into a delta file.
+ *
+ * If rs_threads is more than 1 and the new file is a regular file, it is
+ * mapped with rs_mmap or else read into memory, and large segments of it are
+ * scanned concurrently and their commands stitched into one delta. This can
+ * miss up to about a block or chunk of matching data at each segment
+ * boundary, and format 2 COPY_OUTPUT matches from earlier segments, so the
+ * delta can be slightly larger than a serial one.
  *
  * \sa \ref api_whole */
 LIBRSYNC_EXPORT rs_result rs_delta_file(rs_signature_t *, FILE *new_file,
                                         FILE *delta_file, rs_stats_t *);
 
+/** Generate a delta like rs_delta_file(), reading the basis file to extend
+ * matches byte by byte.
+ *
+ * The new file is always scanned serially. \sa rs_delta_set_basis()
+ *
+ * \sa \ref api_whole */
+LIBRSYNC_EXPORT rs_result rs_delta_basis_file(rs_signature_t *,
+                                              FILE *basis_file,
+                                              FILE *new_file,
+                                              FILE *delta_file, rs_stats_t *);
+
+/** Generate a delta between a basis file and a new file that are both local.
+ *
+ * Instead of using a signature, this indexes the weak sums of small blocks of
+ * the basis in memory and checks candidate matches by comparing them with the
+ * basis data, then extends matches byte by byte. This finds more and longer
+ * matches than a signature, and never has false matches. The basis is mapped
+ * if rs_mmap is set and it can be, otherwise it is read into memory. The new
+ * file is streamed and scanned serially. The result is an ordinary delta for
+ * rs_patch_file().
+ *
+ * \sa \ref api_whole */
+LIBRSYNC_EXPORT rs_result rs_delta_local_file(FILE *basis_file, FILE *new_file,
+                                              FILE *delta_file, rs_stats_t *);
+
 /** Apply a patch, relative to a basis, into a new file.
  *
  * \sa \ref api_whole */
 LIBRSYNC_EXPORT rs_result rs_patch_file(FILE *basis_file, FILE *delta_file,
                                         FILE *new_file, rs_stats_t *);
+
+/** Generate a new file's signature from the old signature and a delta.
+ *
+ * Only the parts of \p new_file that can't be taken from \p old_sig are
+ * read. \sa rs_sig_from_delta_begin()
+ *
+ * \sa \ref api_whole */
+LIBRSYNC_EXPORT rs_result rs_sig_from_delta_file(rs_signature_t *old_sig,
+                                                 FILE *delta_file,
+                                                 FILE *new_file,
+                                                 FILE *sig_file,
+                                                 rs_stats_t *stats);
 #  endif                        /* !RSYNC_NO_STDIO_INTERFACE */
 
 #  ifdef __cplusplus
@@ -25,6 +25,7 @@
 #include <string.h>
 #include "librsync.h"
 #include "mdfour.h"
+#include "cpu.h"
 
 #define F(X,Y,Z) (((X)&(Y)) | ((~(X))&(Z)))
 #define G(X,Y,Z) (((X)&(Y)) | ((X)&(Z)) | ((Y)&(Z)))
@@ -324,3 +325,352 @@ void rs_mdfour(unsigned char *out, void const *in, size_t n)
     rs_mdfour_update(&md, in, n);
     rs_mdfour_result(&md, out);
 }
+
+/** The maximum number of lanes used by any multi-buffer implementation. */
+#define RS_MDFOUR_MAX_LANES 16
+
+static const rs_mdfour_impl_t rs_mdfour_scalar = { "scalar", 1, NULL };
+
+#ifdef RS_SIMD_X86
+/* Multi-buffer MD4 kernels.
+
+   These hash several equal length messages at once, one per SIMD lane. Every
+   message has the same number of blocks and the same padding, so only the
+   message words differ between lanes. The message words for each block are
+   transposed from rows of words in each message into columns of the same
+   word across messages. The final padded block or two of each message are
+   assembled in a small buffer first. The round steps are the same as
+   rs_mdfour64(), using the vector operation macros ADD, AND, OR, XOR, ANDNOT,
+   ROTL and SET1 defined for each kernel. */
+
+#  define VF(x, y, z) OR(AND(x, y), ANDNOT(x, z))
+#  define VG(x, y, z) OR(AND(x, y), AND(OR(x, y), z))
+#  define VH(x, y, z) XOR(XOR(x, y), z)
+#  define VROUND1(a, b, c, d, k, s) a = ROTL(ADD(ADD(a, VF(b, c, d)), X[k]), s)
+#  define VROUND2(a, b, c, d, k, s)\
+    a = ROTL(ADD(ADD(ADD(a, VG(b, c, d)), X[k]), SET1(0x5A827999)), s)
+#  define VROUND3(a, b, c, d, k, s)\
+    a = ROTL(ADD(ADD(ADD(a, VH(b, c, d)), X[k]), SET1(0x6ED9EBA1)), s)
+#  define VMDFOUR64() do {\
+    AA = A; BB = B; CC = C; DD = D;\
+    VROUND1(A, B, C, D, 0, 3); VROUND1(D, A, B, C, 1, 7);\
+    VROUND1(C, D, A, B, 2, 11); VROUND1(B, C, D, A, 3, 19);\
+    VROUND1(A, B, C, D, 4, 3); VROUND1(D, A, B, C, 5, 7);\
+    VROUND1(C, D, A, B, 6, 11); VROUND1(B, C, D, A, 7, 19);\
+    VROUND1(A, B, C, D, 8, 3); VROUND1(D, A, B, C, 9, 7);\
+    VROUND1(C, D, A, B, 10, 11); VROUND1(B, C, D, A, 11, 19);\
+    VROUND1(A, B, C, D, 12, 3); VROUND1(D, A, B, C, 13, 7);\
+    VROUND1(C, D, A, B, 14, 11); VROUND1(B, C, D, A, 15, 19);\
+    VROUND2(A, B, C, D, 0, 3); VROUND2(D, A, B, C, 4, 5);\
+    VROUND2(C, D, A, B, 8, 9); VROUND2(B, C, D, A, 12, 13);\
+    VROUND2(A, B, C, D, 1, 3); VROUND2(D, A, B, C, 5, 5);\
+    VROUND2(C, D, A, B, 9, 9); VROUND2(B, C, D, A, 13, 13);\
+    VROUND2(A, B, C, D, 2, 3); VROUND2(D, A, B, C, 6, 5);\
+    VROUND2(C, D, A, B, 10, 9); VROUND2(B, C, D, A, 14, 13);\
+    VROUND2(A, B, C, D, 3, 3); VROUND2(D, A, B, C, 7, 5);\
+    VROUND2(C, D, A, B, 11, 9); VROUND2(B, C, D, A, 15, 13);\
+    VROUND3(A, B, C, D, 0, 3); VROUND3(D, A, B, C, 8, 9);\
+    VROUND3(C, D, A, B, 4, 11); VROUND3(B, C, D, A, 12, 15);\
+    VROUND3(A, B, C, D, 2, 3); VROUND3(D, A, B, C, 10, 9);\
+    VROUND3(C, D, A, B, 6, 11); VROUND3(B, C, D, A, 14, 15);\
+    VROUND3(A, B, C, D, 1, 3); VROUND3(D, A, B, C, 9, 9);\
+    VROUND3(C, D, A, B, 5, 11); VROUND3(B, C, D, A, 13, 15);\
+    VROUND3(A, B, C, D, 3, 3); VROUND3(D, A, B, C, 11, 9);\
+    VROUND3(C, D, A, B, 7, 11); VROUND3(B, C, D, A, 15, 15);\
+    A = ADD(A, AA); B = ADD(B, BB); C = ADD(C, CC); D = ADD(D, DD);\
+} while (0)
+
+/** The max length of the padded tail blocks of a message. */
+#  define RS_MDFOUR_TAIL_LEN 128
+
+/** Assemble the padded tail blocks of each lane's message.
+ *
+ * \return The number of tail blocks, 1 or 2. */
+static inline int rs_mdfour_pad(unsigned char const *const *in, size_t n,
+                                int lanes,
+                                unsigned char tail[][RS_MDFOUR_TAIL_LEN])
+{
+    size_t pos = n & ~(size_t)63, tail_len = n - pos;
+    int blocks = tail_len < 56 ? 1 : 2;
+    unsigned char bits[8];
+    int i;
+
+    copy8(bits, (uint64_t)n << 3);
+    for (i = 0; i < lanes; i++) {
+        memcpy(tail[i], in[i] + pos, tail_len);
+        tail[i][tail_len] = 0x80;
+        memset(tail[i] + tail_len + 1, 0, 64 * blocks - 9 - tail_len);
+        memcpy(tail[i] + 64 * blocks - 8, bits, 8);
+    }
+    return blocks;
+}
+
+/** Get the message block pointers for block b of each lane. */
+static inline void rs_mdfour_lanes(unsigned char const **p,
+                                   unsigned char const *const *in, size_t n,
+                                   int lanes,
+                                   unsigned char tail[][RS_MDFOUR_TAIL_LEN],
+                                   size_t b)
+{
+    size_t full = n / 64;
+    int i;
+
+    for (i = 0; i < lanes; i++)
+        p[i] = b < full ? in[i] + 64 * b : tail[i] + 64 * (b - full);
+}
+
+/** Store the final state of each lane's sum. */
+static inline void rs_mdfour_store(unsigned char *const *out, int lanes,
+                                   uint32_t const *a, uint32_t const *b,
+                                   uint32_t const *c, uint32_t const *d)
+{
+    int i;
+
+    for (i = 0; i < lanes; i++) {
+        copy4(out[i], a[i]);
+        copy4(out[i] + 4, b[i]);
+        copy4(out[i] + 8, c[i]);
+        copy4(out[i] + 12, d[i]);
+    }
+}
+
+/** Transpose each 4x4 matrix of 32 bit words in the 128 bit lanes. */
+#  define TRANSPOSE4(UNPACKLO32, UNPACKHI32, UNPACKLO64, UNPACKHI64, c, r)\
+do {\
+    t0 = UNPACKLO32(r[0], r[1]); t1 = UNPACKHI32(r[0], r[1]);\
+    t2 = UNPACKLO32(r[2], r[3]); t3 = UNPACKHI32(r[2], r[3]);\
+    c[0] = UNPACKLO64(t0, t2); c[1] = UNPACKHI64(t0, t2);\
+    c[2] = UNPACKLO64(t1, t3); c[3] = UNPACKHI64(t1, t3);\
+} while (0)
+
+#  define ADD(a, b) _mm_add_epi32(a, b)
+#  define AND(a, b) _mm_and_si128(a, b)
+#  define OR(a, b) _mm_or_si128(a, b)
+#  define XOR(a, b) _mm_xor_si128(a, b)
+#  define ANDNOT(a, b) _mm_andnot_si128(a, b)
+#  define ROTL(x, s) OR(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+#  define SET1(x) _mm_set1_epi32((int)(x))
+
+/** Hash 4 messages at once using SSE2. */
+RS_TARGET("sse2")
+static void rs_mdfour_sse2(unsigned char *const *out,
+                           unsigned char const *const *in, size_t n)
+{
+    unsigned char tail[4][RS_MDFOUR_TAIL_LEN];
+    unsigned char const *p[4];
+    size_t blocks = n / 64 + rs_mdfour_pad(in, n, 4, tail), b;
+    __m128i A, B, C, D, AA, BB, CC, DD, X[16], r[4], t0, t1, t2, t3;
+    uint32_t a[4], bb[4], c[4], d[4];
+    int i, j;
+
+    A = SET1(0x67452301U);
+    B = SET1(0xefcdab89U);
+    C = SET1(0x98badcfeU);
+    D = SET1(0x10325476U);
+    for (b = 0; b < blocks; b++) {
+        rs_mdfour_lanes(p, in, n, 4, tail, b);
+        for (i = 0; i < 16; i += 4) {
+            for (j = 0; j < 4; j++)
+                r[j] = _mm_loadu_si128((const __m128i *)(p[j] + 4 * i));
+            TRANSPOSE4(_mm_unpacklo_epi32, _mm_unpackhi_epi32,
+                       _mm_unpacklo_epi64, _mm_unpackhi_epi64, (X + i), r);
+        }
+        VMDFOUR64();
+    }
+    _mm_storeu_si128((__m128i *)a, A);
+    _mm_storeu_si128((__m128i *)bb, B);
+    _mm_storeu_si128((__m128i *)c, C);
+    _mm_storeu_si128((__m128i *)d, D);
+    rs_mdfour_store(out, 4, a, bb, c, d);
+}
+
+#  undef ADD
+#  undef AND
+#  undef OR
+#  undef XOR
+#  undef ANDNOT
+#  undef ROTL
+#  undef SET1
+
+static const rs_mdfour_impl_t rs_mdfour_x4 = { "sse2x4", 4, rs_mdfour_sse2 };
+
+#  define ADD(a, b) _mm256_add_epi32(a, b)
+#  define AND(a, b) _mm256_and_si256(a, b)
+#  define OR(a, b) _mm256_or_si256(a, b)
+#  define XOR(a, b) _mm256_xor_si256(a, b)
+#  define ANDNOT(a, b) _mm256_andnot_si256(a, b)
+#  define ROTL(x, s) OR(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#  define SET1(x) _mm256_set1_epi32((int)(x))
+
+/** Hash 8 messages at once using AVX2. */
+RS_TARGET("avx2")
+static void rs_mdfour_avx2(unsigned char *const *out,
+                           unsigned char const *const *in, size_t n)
+{
+    unsigned char tail[8][RS_MDFOUR_TAIL_LEN];
+    unsigned char const *p[8];
+    size_t blocks = n / 64 + rs_mdfour_pad(in, n, 8, tail), b;
+    __m256i A, B, C, D, AA, BB, CC, DD, X[16], r[8], u[8], t0, t1, t2, t3;
+    uint32_t a[8], bb[8], c[8], d[8];
+    int i, j;
+
+    A = SET1(0x67452301U);
+    B = SET1(0xefcdab89U);
+    C = SET1(0x98badcfeU);
+    D = SET1(0x10325476U);
+    for (b = 0; b < blocks; b++) {
+        rs_mdfour_lanes(p, in, n, 8, tail, b);
+        for (i = 0; i < 16; i += 8) {
+            for (j = 0; j < 8; j++)
+                r[j] = _mm256_loadu_si256((const __m256i *)(p[j] + 4 * i));
+            /* Transpose 4x4 words in each half, then swap the halves. */
+            TRANSPOSE4(_mm256_unpacklo_epi32, _mm256_unpackhi_epi32,
+                       _mm256_unpacklo_epi64, _mm256_unpackhi_epi64, u, r);
+            TRANSPOSE4(_mm256_unpacklo_epi32, _mm256_unpackhi_epi32,
+                       _mm256_unpacklo_epi64, _mm256_unpackhi_epi64, (u + 4),
+                       (r + 4));
+            for (j = 0; j < 4; j++) {
+                X[i + j] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x20);
+                X[i + j + 4] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x31);
+            }
+        }
+        VMDFOUR64();
+    }
+    _mm256_storeu_si256((__m256i *)a, A);
+    _mm256_storeu_si256((__m256i *)bb, B);
+    _mm256_storeu_si256((__m256i *)c, C);
+    _mm256_storeu_si256((__m256i *)d, D);
+    rs_mdfour_store(out, 8, a, bb, c, d);
+}
+
+#  undef ADD
+#  undef AND
+#  undef OR
+#  undef XOR
+#  undef ANDNOT
+#  undef ROTL
+#  undef SET1
+
+static const rs_mdfour_impl_t rs_mdfour_x8 = { "avx2x8", 8, rs_mdfour_avx2 };
+
+#  define ADD(a, b) _mm512_add_epi32(a, b)
+#  define AND(a, b) _mm512_and_si512(a, b)
+#  define OR(a, b) _mm512_or_si512(a, b)
+#  define XOR(a, b) _mm512_xor_si512(a, b)
+#  define ANDNOT(a, b) _mm512_andnot_si512(a, b)
+#  define ROTL(x, s) _mm512_rol_epi32(x, s)
+#  define SET1(x) _mm512_set1_epi32((int)(x))
+/* Use ternary logic for the round functions. */
+#  undef VF
+#  undef VG
+#  undef VH
+#  define VF(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xca)
+#  define VG(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xe8)
+#  define VH(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+
+/** Hash 16 messages at once using AVX-512. */
+RS_TARGET("avx512f")
+static void rs_mdfour_avx512(unsigned char *const *out,
+                             unsigned char const *const *in, size_t n)
+{
+    unsigned char tail[16][RS_MDFOUR_TAIL_LEN];
+    unsigned char const *p[16];
+    size_t blocks = n / 64 + rs_mdfour_pad(in, n, 16, tail), b;
+    __m512i A, B, C, D, AA, BB, CC, DD, X[16], r[16], u[16], v0, v1, v2, v3,
+        t0, t1, t2, t3;
+    uint32_t a[16], bb[16], c[16], d[16];
+    int i, j;
+
+    A = SET1(0x67452301U);
+    B = SET1(0xefcdab89U);
+    C = SET1(0x98badcfeU);
+    D = SET1(0x10325476U);
+    for (b = 0; b < blocks; b++) {
+        rs_mdfour_lanes(p, in, n, 16, tail, b);
+        for (j = 0; j < 16; j++)
+            r[j] = _mm512_loadu_si512((const void *)p[j]);
+        /* Transpose 4x4 words in each quarter, then shuffle the quarters. */
+        for (j = 0; j < 16; j += 4)
+            TRANSPOSE4(_mm512_unpacklo_epi32, _mm512_unpackhi_epi32,
+                       _mm512_unpacklo_epi64, _mm512_unpackhi_epi64, (u + j),
+                       (r + j));
+        for (i = 0; i < 4; i++) {
+            v0 = _mm512_shuffle_i32x4(u[i], u[i + 4], _MM_SHUFFLE(1, 0, 1, 0));
+            v1 = _mm512_shuffle_i32x4(u[i + 8], u[i + 12],
+                                      _MM_SHUFFLE(1, 0, 1, 0));
+            v2 = _mm512_shuffle_i32x4(u[i], u[i + 4], _MM_SHUFFLE(3, 2, 3, 2));
+            v3 = _mm512_shuffle_i32x4(u[i + 8], u[i + 12],
+                                      _MM_SHUFFLE(3, 2, 3, 2));
+            X[i] = _mm512_shuffle_i32x4(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+            X[i + 4] = _mm512_shuffle_i32x4(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+            X[i + 8] = _mm512_shuffle_i32x4(v2, v3, _MM_SHUFFLE(2, 0, 2, 0));
+            X[i + 12] = _mm512_shuffle_i32x4(v2, v3, _MM_SHUFFLE(3, 1, 3, 1));
+        }
+        VMDFOUR64();
+    }
+    _mm512_storeu_si512((void *)a, A);
+    _mm512_storeu_si512((void *)bb, B);
+    _mm512_storeu_si512((void *)c, C);
+    _mm512_storeu_si512((void *)d, D);
+    rs_mdfour_store(out, 16, a, bb, c, d);
+}
+
+#  undef ADD
+#  undef AND
+#  undef OR
+#  undef XOR
+#  undef ANDNOT
+#  undef ROTL
+#  undef SET1
+#  undef VF
+#  undef VG
+#  undef VH
+#  undef VROUND1
+#  undef VROUND2
+#  undef VROUND3
+#  undef VMDFOUR64
+#  undef TRANSPOSE4
+
+static const rs_mdfour_impl_t rs_mdfour_x16 =
+    { "avx512x16", 16, rs_mdfour_avx512 };
+#endif                          /* RS_SIMD_X86 */
+
+rs_mdfour_impl_t const *rs_mdfour_select(rs_cpu_level_t level)
+{
+#ifdef RS_SIMD_X86
+    if (level >= RS_CPU_AVX512)
+        return &rs_mdfour_x16;
+    if (level >= RS_CPU_AVX2)
+        return &rs_mdfour_x8;
+    if (level >= RS_CPU_SSE2)
+        return &rs_mdfour_x4;
+#else
+    (void)level;
+#endif
+    return &rs_mdfour_scalar;
+}
+
+void rs_mdfour_batch(unsigned char *const *out, void const *const *in,
+                     size_t len, int n)
+{
+    rs_mdfour_impl_t const *impl = rs_cpu()->mdfour;
+    unsigned char const *lin[RS_MDFOUR_MAX_LANES];
+    unsigned char *lout[RS_MDFOUR_MAX_LANES];
+    unsigned char spare[16];
+    int i, k;
+
+    /* Hash full sets of lanes, filling any unused lanes with dummies. */
+    while (n > 1 && impl->lanes > 1) {
+        k = n < impl->lanes ? n : impl->lanes;
+        for (i = 0; i < impl->lanes; i++) {
+            lin[i] = in[i < k ? i : 0];
+            lout[i] = i < k ? out[i] : spare;
+        }
+        impl->fn(lout, lin, len);
+        in += k;
+        out += k;
+        n -= k;
+    }
+    for (; n > 0; n--)
+        rs_mdfour(*out++, *in++, len);
+}
@@ -40,7 +40,9 @@
 #ifndef MDFOUR_H
 #  define MDFOUR_H
 
+#  include <stddef.h>
 #  include <stdint.h>
+#  include "simd.h"
 
 /** The rs_mdfour state type. */
 struct rs_mdfour {
@@ -54,4 +56,18 @@ struct rs_mdfour {
     unsigned char tail[64];
 };
 
+/** Function type for hashing a full set of lanes in rs_mdfour_batch(). */
+typedef void rs_mdfour_lanes_fn(unsigned char *const *out,
+                                unsigned char const *const *in, size_t n);
+
+/** A multi-buffer MD4 implementation. */
+typedef struct rs_mdfour_impl {
+    char const *name;           /**< The name reported by rs_cpu_features(). */
+    int lanes;                  /**< The number of lanes it hashes at once. */
+    rs_mdfour_lanes_fn *fn;     /**< The function to hash them. */
+} rs_mdfour_impl_t;
+
+/** Get the best multi-buffer MD4 implementation for a cpu level. */
+rs_mdfour_impl_t const *rs_mdfour_select(rs_cpu_level_t level);
+
 #endif                          /* !MDFOUR_H */
@@ -25,20 +25,36 @@
  *
  * Generating checksums is pretty easy, since we can always just process
  * whatever data is available. When a whole block has arrived, or we've reached
- * the end of the file, we write the checksum out. */
+ * the end of the file, we write the checksum out.
+ *
+ * Whenever several whole blocks are available contiguously in the input they
+ * are processed as a batch, with the strong sums done several blocks at a time
+ * using SIMD where possible. If the job has been given more than one thread,
+ * the batch is also split between a pool of worker threads. The sums are then
+ * written out in block order, so the output is the same either way.
+ *
+ * Chunked signatures instead cut the input into content-defined chunks with
+ * rs_chunk_len(), and write each chunk's length with its sums. */
 
 #include <stdlib.h>
 #include "librsync.h"
 #include "job.h"
 #include "sumset.h"
+#include "chunk.h"
 #include "scoop.h"
 #include "netint.h"
+#include "pool.h"
 #include "trace.h"
 #include "util.h"
 
+/** The max number of blocks to calculate strong sums for at once. */
+#define RS_SIG_BATCH_LANES 8
+
 /* Possible state functions for signature generation. */
 static rs_result rs_sig_s_header(rs_job_t *);
 static rs_result rs_sig_s_generate(rs_job_t *);
+static rs_result rs_sig_s_batch(rs_job_t *);
+static rs_result rs_sig_s_chunk(rs_job_t *);
 
 /** State of trying to send the signature header. \private */
 static rs_result rs_sig_s_header(rs_job_t *job)
@@ -57,10 +73,33 @@ static rs_result rs_sig_s_header(rs_job_t *job)
              sig->magic, sig->block_len, sig->strong_sum_len);
     job->stats.block_len = sig->block_len;
 
-    job->statefn = rs_sig_s_generate;
+    if (sig->offsets)
+        job->statefn = rs_sig_s_chunk;
+    else
+        job->statefn = rs_sig_s_generate;
     return RS_RUNNING;
 }
 
+/** Write out the checksums for a block. \private */
+static void rs_sig_send_sum(rs_job_t *job, rs_weak_sum_t weak_sum,
+                            size_t len, rs_strong_sum_t *strong_sum)
+{
+    rs_signature_t *sig = job->signature;
+
+    rs_squirt_n4(job, weak_sum);
+    /* Blocks of chunked signatures also have their length. */
+    if (sig->offsets)
+        rs_squirt_n4(job, (int)len);
+    rs_tube_write(job, strong_sum, sig->strong_sum_len);
+    if (rs_trace_enabled()) {
+        char strong_sum_hex[RS_MAX_STRONG_SUM_LENGTH * 2 + 1];
+        rs_hexify(strong_sum_hex, strong_sum, sig->strong_sum_len);
+        rs_trace("sent block: weak=" FMT_WEAKSUM ", len=" FMT_SIZE
+                 ", strong=%s", weak_sum, len, strong_sum_hex);
+    }
+    job->stats.sig_blocks++;
+}
+
 /** Generate the checksums for a block and write it out. Called when we
  * already know we have enough data in memory at \p block. \private */
 static rs_result rs_sig_do_block(rs_job_t *job, const void *block, size_t len)
@@ -71,27 +110,123 @@ static rs_result rs_sig_do_block(rs_job_t *job, const void *block, size_t len)
 
     weak_sum = rs_signature_calc_weak_sum(sig, block, len);
     rs_signature_calc_strong_sum(sig, block, len, &strong_sum);
-    rs_squirt_n4(job, weak_sum);
-    rs_tube_write(job, strong_sum, sig->strong_sum_len);
-    if (rs_trace_enabled()) {
-        char strong_sum_hex[RS_MAX_STRONG_SUM_LENGTH * 2 + 1];
-        rs_hexify(strong_sum_hex, strong_sum, sig->strong_sum_len);
-        rs_trace("sent block: weak=" FMT_WEAKSUM ", strong=%s", weak_sum,
-                 strong_sum_hex);
+    rs_sig_send_sum(job, weak_sum, len, &strong_sum);
+    return RS_RUNNING;
+}
+
+/** Arguments for the tasks calculating a batch of block sums. \private */
+typedef struct rs_sig_batch {
+    rs_signature_t const *sig;  /**< The signature being generated. */
+    rs_byte_t const *buf;       /**< The data for all the blocks. */
+    rs_block_sig_t *sums;       /**< The calculated block sums. */
+    int blocks;                 /**< The number of blocks in the batch. */
+    int tasks;                  /**< The number of tasks to split it into. */
+} rs_sig_batch_t;
+
+/** Calculate the sums for the i'th share of a batch of blocks. \private */
+static void rs_sig_batch_task(void *arg, int i)
+{
+    rs_sig_batch_t const *batch = arg;
+    size_t len = (size_t)batch->sig->block_len;
+    int b = batch->blocks * i / batch->tasks;
+    int end = batch->blocks * (i + 1) / batch->tasks;
+    void const *bufs[RS_SIG_BATCH_LANES];
+    rs_strong_sum_t *sums[RS_SIG_BATCH_LANES];
+    int j, n;
+
+    /* Do the strong sums a few blocks at a time so they can use SIMD. */
+    for (; b < end; b += n) {
+        n = end - b < RS_SIG_BATCH_LANES ? end - b : RS_SIG_BATCH_LANES;
+        for (j = 0; j < n; j++) {
+            bufs[j] = batch->buf + (b + j) * len;
+            sums[j] = &batch->sums[b + j].strong_sum;
+            batch->sums[b + j].weak_sum =
+                rs_signature_calc_weak_sum(batch->sig, bufs[j], len);
+        }
+        rs_signature_calc_strong_sums(batch->sig, bufs, len, n, sums);
     }
-    job->stats.sig_blocks++;
+}
+
+/** Calculate the checksums for a batch of whole blocks.
+ *
+ * The batch is split between the threads in the job's pool if it has one. The
+ * sums are stored in the job's sig_batch, to be sent by rs_sig_s_batch().
+ * \private */
+static void rs_sig_do_batch(rs_job_t *job, const void *buf, int blocks)
+{
+    rs_sig_batch_t batch;
+
+    batch.sig = job->signature;
+    batch.buf = buf;
+    batch.sums = job->sig_batch;
+    batch.blocks = blocks;
+    if (job->pool) {
+        batch.tasks = rs_pool_threads(job->pool);
+        if (batch.tasks > blocks)
+            batch.tasks = blocks;
+        rs_pool_run(job->pool, rs_sig_batch_task, &batch, batch.tasks);
+    } else {
+        batch.tasks = 1;
+        rs_sig_batch_task(&batch, 0);
+    }
+    rs_trace("got %d block batch", blocks);
+    job->sig_batch_len = blocks;
+    job->sig_batch_pos = 0;
+    job->statefn = rs_sig_s_batch;
+}
+
+/** State of sending the sums calculated for a batch of blocks. \private */
+static rs_result rs_sig_s_batch(rs_job_t *job)
+{
+    rs_block_sig_t *sum = &job->sig_batch[job->sig_batch_pos++];
+
+    /* The tube only has room for one block's sums at a time. */
+    rs_sig_send_sum(job, sum->weak_sum, (size_t)job->signature->block_len,
+                    &sum->strong_sum);
+    if (job->sig_batch_pos == job->sig_batch_len)
+        job->statefn = rs_sig_s_generate;
     return RS_RUNNING;
 }
 
+/** Get the number of whole blocks available to calculate as a batch.
+ *
+ * This initializes the batch buffer and any thread pool on first use.
+ * \private */
+static int rs_sig_batch_blocks(rs_job_t *job)
+{
+    /* rs_job_set_threads() limits threads, so this can't overflow. */
+    int threads = job->threads > 1 ? job->threads : 1;
+    int max_blocks = RS_SIG_BATCH_BLOCKS * threads;
+    size_t blocks;
+
+    if (!job->sig_batch) {
+        if (threads > 1)
+            job->pool = rs_pool_new(threads);
+        job->sig_batch =
+            rs_alloc((size_t)max_blocks * sizeof(rs_block_sig_t),
+                     "signature batch");
+    }
+    blocks = rs_scoop_len(job) / (size_t)job->signature->block_len;
+    return blocks < (size_t)max_blocks ? (int)blocks : max_blocks;
+}
+
 /** State of reading a block and trying to generate its sum. \private */
 static rs_result rs_sig_s_generate(rs_job_t *job)
 {
     rs_result result;
     size_t len;
     void *block;
+    int blocks;
 
-    /* must get a whole block, otherwise try again */
     len = job->signature->block_len;
+    /* If there are several whole contiguous blocks, do them as a batch. */
+    if ((blocks = rs_sig_batch_blocks(job)) > 1) {
+        block = rs_scoop_buf(job);
+        rs_sig_do_batch(job, block, blocks);
+        rs_scoop_advance(job, blocks * len);
+        return RS_RUNNING;
+    }
+    /* must get a whole block, otherwise try again */
     result = rs_scoop_read(job, len, &block);
     /* If we are near EOF, get whatever is left. */
     if (result == RS_INPUT_ENDED)
@@ -106,6 +241,33 @@ static rs_result rs_sig_s_generate(rs_job_t *job)
     return rs_sig_do_block(job, block, len);
 }
 
+/** Generate the sums for the next chunk of a chunked signature.
+ *
+ * This needs up to the maximum chunk length of data to find where the chunk
+ * ends, unless it is the end of the input. Chunks are done one at a time
+ * without threads. */
+static rs_result rs_sig_s_chunk(rs_job_t *job)
+{
+    size_t avg_len = (size_t)job->signature->block_len;
+    size_t len = rs_scoop_avail(job);
+    rs_result result;
+    void *buf;
+
+    if (rs_scoop_eof(job))
+        return RS_DONE;
+    if (len > rs_chunk_max_len(avg_len) || !job->stream->eof_in)
+        len = rs_chunk_max_len(avg_len);
+    if ((result = rs_scoop_readahead(job, len, &buf)) != RS_DONE) {
+        rs_trace("generate stopped: %s", rs_strerror(result));
+        return result;
+    }
+    len = rs_chunk_len(buf, len, avg_len);
+    rs_trace("got " FMT_SIZE " byte chunk", len);
+    rs_sig_do_block(job, buf, len);
+    rs_scoop_advance(job, len);
+    return RS_RUNNING;
+}
+
 rs_job_t *rs_sig_begin(size_t block_len, size_t strong_len,
                        rs_magic_number sig_magic)
 {
@@ -24,7 +24,11 @@
                                */
 
 /** \file patch.c
- * Apply a delta to an old file to generate a new file. */
+ * Apply a delta to an old file to generate a new file.
+ *
+ * For a format 2 delta all the output is also recorded in the job's history,
+ * so COPY_OUTPUT commands can be served from the last window of it. FILL
+ * commands are written straight into the output without reading the basis. */
 
 #include <assert.h>
 #include <stdlib.h>
@@ -36,6 +40,7 @@
 #include "scoop.h"
 #include "command.h"
 #include "prototab.h"
+#include "history.h"
 #include "trace.h"
 
 static rs_result rs_patch_s_cmdbyte(rs_job_t *);
@@ -44,6 +49,10 @@ static rs_result rs_patch_s_run(rs_job_t *);
 static rs_result rs_patch_s_literal(rs_job_t *);
 static rs_result rs_patch_s_copy(rs_job_t *);
 static rs_result rs_patch_s_copying(rs_job_t *);
+static rs_result rs_patch_s_copy_output(rs_job_t *);
+static rs_result rs_patch_s_copying_output(rs_job_t *);
+static rs_result rs_patch_s_fill(rs_job_t *);
+static rs_result rs_patch_s_filling(rs_job_t *);
 
 /** State of trying to read the first byte of a command. Once we've taken that
  * in, we can know how much data to read to get the arguments. */
@@ -103,6 +112,15 @@ static rs_result rs_patch_s_run(rs_job_t *job)
     case RS_KIND_COPY:
         job->statefn = rs_patch_s_copy;
         return RS_RUNNING;
+    case RS_KIND_COPY_OUTPUT:
+    case RS_KIND_FILL:
+        /* Only format 2 deltas can copy from the output or fill. */
+        if (job->record_output) {
+            job->statefn = job->cmd->kind == RS_KIND_FILL ? rs_patch_s_fill :
+                rs_patch_s_copy_output;
+            return RS_RUNNING;
+        }
+        /* fallthrough */
     default:
         rs_error("bogus command %#04x", job->op);
         return RS_CORRUPT;
@@ -199,6 +217,119 @@ static rs_result rs_patch_s_copying(rs_job_t *job)
     return RS_RUNNING;
 }
 
+static rs_result rs_patch_s_copy_output(rs_job_t *job)
+{
+    const rs_long_t pos = job->param1;
+    const rs_long_t len = job->param2;
+    const rs_long_t out = job->history.len;
+    rs_xstats_t *stats = &job->xstats;
+
+    rs_trace("COPY_OUTPUT(position=" FMT_LONG ", length=" FMT_LONG ")", pos,
+             len);
+    if (len <= 0) {
+        rs_error("invalid length=" FMT_LONG " on COPY_OUTPUT command", len);
+        return RS_CORRUPT;
+    }
+    if (pos < 0 || pos >= out || pos < out - (rs_long_t)job->history.window) {
+        rs_error("invalid position=" FMT_LONG " on COPY_OUTPUT command at "
+                 FMT_LONG, pos, out);
+        return RS_CORRUPT;
+    }
+    stats->output_cmds++;
+    stats->output_bytes += len;
+    stats->output_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+    job->basis_pos = pos;
+    job->basis_len = len;
+    job->statefn = rs_patch_s_copying_output;
+    return RS_RUNNING;
+}
+
+/** Called when we're executing a COPY_OUTPUT command.
+ *
+ * Each step copies what it can of the history into the output, and the job
+ * then adds that to the history. The source can overlap the data being
+ * written, so this can take several steps. */
+static rs_result rs_patch_s_copying_output(rs_job_t *job)
+{
+    rs_buffers_t *buffs = job->stream;
+    rs_byte_t const *data = NULL;
+    size_t len = buffs->avail_out;
+
+    if (!len)
+        return RS_BLOCKED;
+    if ((rs_long_t)len > job->basis_len)
+        len = (size_t)job->basis_len;
+    len = rs_history_get(&job->history, job->basis_pos, len, &data);
+    /* The command was checked, so some of the source must be available. */
+    assert(len > 0);
+    rs_trace("copy " FMT_SIZE " bytes from output at offset " FMT_LONG "", len,
+             job->basis_pos);
+    memcpy(buffs->next_out, data, len);
+    buffs->next_out += len;
+    buffs->avail_out -= len;
+    job->basis_pos += (rs_long_t)len;
+    job->basis_len -= (rs_long_t)len;
+    if (!job->basis_len)
+        job->statefn = rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+static rs_result rs_patch_s_fill(rs_job_t *job)
+{
+    const rs_long_t len = job->param2;
+    rs_xstats_t *stats = &job->xstats;
+
+    rs_trace("FILL(byte=" FMT_LONG ", length=" FMT_LONG ")", job->param1, len);
+    if (len <= 0) {
+        rs_error("invalid length=" FMT_LONG " on FILL command", len);
+        return RS_CORRUPT;
+    }
+    stats->fill_cmds++;
+    stats->fill_bytes += len;
+    stats->fill_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+    job->basis_len = len;
+    job->statefn = rs_patch_s_filling;
+    return RS_RUNNING;
+}
+
+/** Called when we're executing a FILL command. */
+static rs_result rs_patch_s_filling(rs_job_t *job)
+{
+    rs_buffers_t *buffs = job->stream;
+    size_t len = buffs->avail_out;
+
+    if (!len)
+        return RS_BLOCKED;
+    if ((rs_long_t)len > job->basis_len)
+        len = (size_t)job->basis_len;
+    memset(buffs->next_out, (int)job->param1, len);
+    buffs->next_out += len;
+    buffs->avail_out -= len;
+    job->basis_len -= (rs_long_t)len;
+    if (!job->basis_len)
+        job->statefn = rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+/** Called while reading the output window of a format 2 delta. */
+static rs_result rs_patch_s_window(rs_job_t *job)
+{
+    int window;
+    rs_result result;
+
+    if ((result = rs_suck_n4(job, &window)) != RS_DONE)
+        return result;
+    if (window <= 0 || window > RS_MAX_OUTPUT_WINDOW) {
+        rs_error("invalid output window %d", window);
+        return RS_CORRUPT;
+    }
+    rs_trace("got output window %d", window);
+    rs_history_init(&job->history, (size_t)window);
+    job->record_output = 1;
+    job->statefn = rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
 /** Called while we're trying to read the header of the patch. */
 static rs_result rs_patch_s_header(rs_job_t *job)
 {
@@ -207,13 +338,16 @@ static rs_result rs_patch_s_header(rs_job_t *job)
 
     if ((result = rs_suck_n4(job, &v)) != RS_DONE)
         return result;
-    if (v != RS_DELTA_MAGIC) {
+    if (v != RS_DELTA_MAGIC && v != RS_DELTA2_MAGIC) {
         rs_error("got magic number %#x rather than expected value %#x", v,
                  RS_DELTA_MAGIC);
         return RS_BAD_MAGIC;
     } else
         rs_trace("got patch magic %#x", v);
-    job->statefn = rs_patch_s_cmdbyte;
+    if (v == RS_DELTA2_MAGIC)
+        job->statefn = rs_patch_s_window;
+    else
+        job->statefn = rs_patch_s_cmdbyte;
     return RS_RUNNING;
 }
 
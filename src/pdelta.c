@@ -0,0 +1,306 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+                              /*=
+                               | Divide each difficulty into as many
+                               | parts as is feasible and necessary
+                               | to resolve it.
+                               |        -- Rene Descartes
+                               */
+
+/** \file pdelta.c
+ * Parallel delta generation for a new file that is all in memory.
+ *
+ * The new file is split into large segments that are scanned concurrently
+ * against the shared signature. Each segment is scanned by a delta.c job from
+ * rs_delta_seg_begin(), so it finds the same commands as a serial delta with
+ * the same format and effort, including runs of equal bytes, COPY_OUTPUT
+ * matches within the segment, skipping ahead and chunked signatures. The job
+ * records its commands instead of emitting them, and may read past the end of
+ * its segment to finish a match that crosses into the next one, so it ends
+ * just after its last command.
+ *
+ * The lists are then stitched together in order. The start of each segment's
+ * list that overlaps the end of the previous segment's last command is
+ * trimmed off, and adjacent literals and contiguous copies are merged. The
+ * scan of a segment starts without knowing where the previous segment's
+ * matches end, or any of the new file before it, so it can miss up to about a
+ * block of matching data before it finds the same alignment, and can't find
+ * COPY_OUTPUT matches from earlier segments. Apart from that the delta is the
+ * same as a serial delta.
+ *
+ * The delta is then sent by a job that reads the new file as its input,
+ * copying literal data through from it and skipping the data of the other
+ * commands. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "librsync.h"
+#include "pdelta.h"
+#include "job.h"
+#include "sumset.h"
+#include "scoop.h"
+#include "emit.h"
+#include "command.h"
+#include "history.h"
+#include "pool.h"
+#include "trace.h"
+#include "util.h"
+
+/** The commands found in one segment of the new file. */
+typedef struct rs_delta_seg {
+    rs_long_t start;            /**< The start of the segment. */
+    rs_long_t end;              /**< The end of the segment. */
+    rs_delta_cmd_t *cmds;       /**< The commands found. */
+    size_t count;               /**< The number of commands found. */
+    rs_long_t skip_bytes;       /**< The bytes skipped without scanning. */
+} rs_delta_seg_t;
+
+/** The shared state for scanning all the segments. */
+typedef struct rs_delta_par {
+    rs_byte_t const *buf;       /**< The whole new file. */
+    size_t len;                 /**< The length of the new file. */
+    rs_magic_number magic;      /**< The delta format. */
+    int effort;                 /**< The delta effort. */
+    rs_delta_seg_t *segs;       /**< The segments. */
+    rs_signature_t *forks;      /**< A signature copy for each segment. */
+    hashtable_t *tables;        /**< The hashtable structs for the copies. */
+} rs_delta_par_t;
+
+void rs_delta_cmds_add(rs_delta_cmd_t **cmds, size_t *count, size_t *size,
+                       int kind, rs_long_t pos, rs_long_t len)
+{
+    rs_delta_cmd_t *last = *count ? &(*cmds)[*count - 1] : NULL;
+
+    if (!len)
+        return;
+    if (last && last->kind == kind
+        && (kind == RS_KIND_LITERAL
+            || (kind == RS_KIND_FILL && last->pos == pos)
+            || (kind != RS_KIND_FILL && last->pos + last->len == pos))) {
+        last->len += len;
+        return;
+    }
+    if (*count == *size) {
+        *size = *size ? 2 * *size : 64;
+        *cmds = rs_realloc(*cmds, *size * sizeof(rs_delta_cmd_t), "delta cmds");
+    }
+    (*cmds)[*count].kind = kind;
+    (*cmds)[*count].pos = pos;
+    (*cmds)[*count].len = len;
+    (*count)++;
+}
+
+/** Scan one segment of the new file with a delta.c job, run as a pool task.
+ *
+ * The job gets the rest of the new file from the segment start as its input,
+ * and stops at the first command end at or after the segment end. */
+static void rs_delta_scan_seg(void *arg, int i)
+{
+    rs_delta_par_t *par = (rs_delta_par_t *)arg;
+    rs_delta_seg_t *seg = &par->segs[i];
+    rs_buffers_t buf;
+    rs_job_t *job;
+    rs_result result;
+
+    job = rs_delta_seg_begin(&par->forks[i], par->magic, par->effort,
+                             seg->end - seg->start);
+    buf.next_in = (char *)par->buf + seg->start;
+    buf.avail_in = par->len - (size_t)seg->start;
+    buf.eof_in = 1;
+    buf.next_out = NULL;
+    buf.avail_out = 0;
+    /* All the input is there and nothing is output, so it can't block. */
+    result = rs_job_iter(job, &buf);
+    assert(result == RS_DONE);
+    (void)result;
+    seg->cmds = job->delta_cmds;
+    seg->count = job->delta_cmd_count;
+    seg->skip_bytes = job->xstats.skip_bytes;
+    job->delta_cmds = NULL;
+    rs_job_free(job);
+}
+
+/** Stitch the segment command lists together into the job's commands. */
+static void rs_delta_stitch(rs_job_t *job, rs_delta_seg_t *segs, int nsegs)
+{
+    rs_long_t done = 0, pos, skip, cmd_pos;
+    rs_delta_cmd_t *cmd;
+    size_t c;
+    int i;
+
+    for (i = 0; i < nsegs; i++) {
+        pos = segs[i].start;
+        assert(pos <= done);
+        job->xstats.skip_bytes += segs[i].skip_bytes;
+        for (c = 0; c < segs[i].count; c++) {
+            cmd = &segs[i].cmds[c];
+            /* trim off anything already covered by the previous segment */
+            if (pos + cmd->len > done) {
+                skip = done - pos > 0 ? done - pos : 0;
+                cmd_pos = cmd->pos;
+                if (cmd->kind == RS_KIND_COPY)
+                    cmd_pos += skip;
+                else if (cmd->kind == RS_KIND_COPY_OUTPUT)
+                    cmd_pos += segs[i].start + skip;
+                rs_delta_cmds_add(&job->delta_cmds, &job->delta_cmd_count,
+                                  &job->delta_cmd_size, cmd->kind, cmd_pos,
+                                  cmd->len - skip);
+                done = pos + cmd->len;
+            }
+            pos += cmd->len;
+        }
+    }
+}
+
+/** Emit the command for the next delta command to send. */
+static inline void rs_delta_par_emit(rs_job_t *job, rs_delta_cmd_t const *cmd)
+{
+    switch (cmd->kind) {
+    case RS_KIND_COPY:
+        rs_trace("matched " FMT_LONG " bytes at " FMT_LONG "!", cmd->len,
+                 cmd->pos);
+        rs_emit_copy_cmd(job, cmd->pos, cmd->len);
+        break;
+    case RS_KIND_COPY_OUTPUT:
+        rs_trace("matched " FMT_LONG " bytes at " FMT_LONG " in the output!",
+                 cmd->len, cmd->pos);
+        rs_emit_copy_output_cmd(job, cmd->pos, cmd->len);
+        break;
+    default:
+        assert(cmd->kind == RS_KIND_FILL);
+        rs_trace("filled " FMT_LONG " bytes of %d", cmd->len, (int)cmd->pos);
+        rs_emit_fill_cmd(job, (int)cmd->pos, cmd->len);
+    }
+}
+
+/** State function that sends the stitched delta commands. */
+static rs_result rs_delta_par_s_cmds(rs_job_t *job)
+{
+    rs_delta_cmd_t const *cmd;
+    rs_result result;
+    size_t len;
+
+    while (job->delta_cmd_pos < job->delta_cmd_count) {
+        /* output any pending output from the tube */
+        if ((result = rs_tube_catchup(job)) != RS_DONE)
+            return result;
+        cmd = &job->delta_cmds[job->delta_cmd_pos];
+        if (cmd->kind == RS_KIND_LITERAL) {
+            /* send literal data in MAX_MISS_LEN pieces like delta.c */
+            len = (size_t)(cmd->len - job->delta_cmd_done);
+            if (len > MAX_MISS_LEN)
+                len = MAX_MISS_LEN;
+            rs_trace("got " FMT_SIZE " bytes of literal data", len);
+            rs_emit_literal_cmd(job, (int)len);
+            rs_tube_copy(job, len);
+        } else {
+            /* send the command and then skip over its data */
+            if (!job->delta_cmd_done)
+                rs_delta_par_emit(job, cmd);
+            len = rs_scoop_len(job);
+            if ((rs_long_t)len > cmd->len - job->delta_cmd_done)
+                len = (size_t)(cmd->len - job->delta_cmd_done);
+            if (!len)
+                return rs_scoop_eof(job) ? RS_INPUT_ENDED : RS_BLOCKED;
+            rs_scoop_advance(job, len);
+        }
+        job->delta_cmd_done += (rs_long_t)len;
+        if (job->delta_cmd_done == cmd->len) {
+            job->delta_cmd_pos++;
+            job->delta_cmd_done = 0;
+        }
+    }
+    if ((result = rs_tube_catchup(job)) != RS_DONE)
+        return result;
+    job->xstats.scan_bytes = job->stats.in_bytes - job->xstats.skip_bytes;
+    rs_emit_end_cmd(job);
+    return RS_DONE;
+}
+
+/** State function for writing out the header of the delta. */
+static rs_result rs_delta_par_s_header(rs_job_t *job)
+{
+    rs_emit_delta_header(job);
+    job->statefn = rs_delta_par_s_cmds;
+    return RS_RUNNING;
+}
+
+rs_job_t *rs_delta_par_begin(rs_signature_t *sig, void const *buf, size_t len,
+                             int threads, rs_magic_number magic, int effort)
+{
+    rs_job_t *job;
+    rs_delta_par_t par;
+    size_t seg_len;
+    int nsegs, i;
+
+    job = rs_job_new("delta", rs_delta_par_s_header);
+    job->delta_magic = magic;
+    job->delta_effort = effort;
+    if (magic == RS_DELTA2_MAGIC)
+        rs_history_init(&job->history, rs_delta_window(sig));
+    /* Caller can pass NULL sig or empty sig for "slack deltas". */
+    if (!sig || sig->count == 0 || !len) {
+        rs_trace("no signature provided for delta, using slack deltas");
+        rs_delta_cmds_add(&job->delta_cmds, &job->delta_cmd_count,
+                          &job->delta_cmd_size, RS_KIND_LITERAL, 0,
+                          (rs_long_t)len);
+        return job;
+    }
+    rs_signature_check(sig);
+    /* Caller must have called rs_build_hash_table() by now. */
+    assert(sig->hashtable);
+    if (threads > RS_POOL_MAX_THREADS)
+        threads = RS_POOL_MAX_THREADS;
+    /* Use a few segments per thread to balance the load, but keep them long
+       enough that the boundaries don't cost much. */
+    seg_len = 16 * (size_t)sig->block_len;
+    if (seg_len < RS_DELTA_SEGMENT_LEN)
+        seg_len = RS_DELTA_SEGMENT_LEN;
+    nsegs = len / seg_len > (size_t)(4 * threads) ? 4 * threads :
+        (int)(len / seg_len);
+    if (nsegs < 1)
+        nsegs = 1;
+    rs_trace("scanning " FMT_SIZE " bytes in %d segments with %d threads",
+             len, nsegs, threads);
+    par.buf = (rs_byte_t const *)buf;
+    par.len = len;
+    par.magic = magic;
+    par.effort = effort;
+    par.segs = rs_alloc_struct0(nsegs * sizeof(rs_delta_seg_t), "segments");
+    par.forks = rs_alloc(nsegs * sizeof(rs_signature_t), "signature copies");
+    par.tables = rs_alloc(nsegs * sizeof(hashtable_t), "hashtable copies");
+    for (i = 0; i < nsegs; i++) {
+        par.segs[i].start = (rs_long_t)(len / nsegs * i);
+        par.segs[i].end =
+            i + 1 < nsegs ? (rs_long_t)(len / nsegs * (i + 1)) : (rs_long_t)len;
+        rs_signature_fork(sig, &par.forks[i], &par.tables[i]);
+    }
+    job->pool = rs_pool_new(threads);
+    rs_pool_run(job->pool, rs_delta_scan_seg, &par, nsegs);
+    rs_delta_stitch(job, par.segs, nsegs);
+    for (i = 0; i < nsegs; i++) {
+        rs_signature_join(sig, &par.forks[i]);
+        free(par.segs[i].cmds);
+    }
+    free(par.tables);
+    free(par.forks);
+    free(par.segs);
+    return job;
+}
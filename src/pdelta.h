@@ -0,0 +1,85 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file pdelta.h
+ * Parallel delta generation for a new file that is all in memory. */
+#ifndef PDELTA_H
+#  define PDELTA_H
+
+#  include <stddef.h>
+#  include "librsync.h"
+
+/** A delta command found by scanning the new file. */
+typedef struct rs_delta_cmd {
+    int kind;                   /**< The ::rs_op_kind of the command. */
+    rs_long_t pos;              /**< The position to copy, or the byte to
+                                 * fill. */
+    rs_long_t len;              /**< The length of the command's data. */
+} rs_delta_cmd_t;
+
+/** Min length of the new file segments scanned in parallel. */
+#  define RS_DELTA_SEGMENT_LEN (1<<22)
+
+/** Append a command to a list, merging it with the last command if possible.
+ *
+ * \param pos - the position to copy, or the byte to fill, ignored for
+ * literal data. */
+void rs_delta_cmds_add(rs_delta_cmd_t **cmds, size_t *count, size_t *size,
+                       int kind, rs_long_t pos, rs_long_t len);
+
+/** Get the history window of a format 2 delta for a signature.
+ *
+ * This is in delta.c, so both kinds of delta job use the same window. */
+size_t rs_delta_window(rs_signature_t const *sig);
+
+/** Start a delta.c job that scans a segment of the new file for pdelta.c.
+ *
+ * The job must be given the new file from the segment start to the end of the
+ * file as its input. It does the same scan as a job from rs_delta_begin() with
+ * the same format and effort, but records the commands in its delta_cmds
+ * instead of emitting them, with COPY_OUTPUT positions relative to the
+ * segment start. It stops at the first command end at or after \p seg_len.
+ *
+ * \param sig - the signature to match against, which must not be empty. */
+rs_job_t *rs_delta_seg_begin(rs_signature_t *sig, rs_magic_number magic,
+                             int effort, rs_long_t seg_len);
+
+/** Start a delta job that scans a whole new file in parallel.
+ *
+ * The new file is split into segments that are scanned against the signature
+ * concurrently, and their commands are stitched into a single delta. The job
+ * must then be given the same new file data as its input, which it copies the
+ * literal data from.
+ *
+ * \param sig - the signature to match against, which must have its hashtable
+ * built. It can be NULL or empty for a slack delta.
+ *
+ * \param buf - the whole new file.
+ *
+ * \param len - the length of the new file.
+ *
+ * \param threads - the number of threads to use.
+ *
+ * \param magic - the delta format, as for rs_delta_set_magic().
+ *
+ * \param effort - the delta effort, as for rs_delta_set_effort(). */
+rs_job_t *rs_delta_par_begin(rs_signature_t *sig, void const *buf, size_t len,
+                             int threads, rs_magic_number magic, int effort);
+
+#endif                          /* !PDELTA_H */
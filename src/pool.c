@@ -0,0 +1,180 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+                              /*=
+                               | Many hands make light work.
+                               */
+
+/** \file pool.c
+ * A minimal pool of worker threads for running independent tasks.
+ *
+ * The workers sleep on a condition variable until rs_pool_run() posts a new
+ * batch of tasks. Every thread, including the caller, then repeatedly claims
+ * the next unclaimed task index until there are none left. The caller waits
+ * for the last running task to finish before returning. */
+
+#include "config.h"
+#include <assert.h>
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#include "pool.h"
+#include "trace.h"
+#include "util.h"
+
+struct rs_pool {
+    int threads;                /**< Number of threads including caller. */
+#ifdef HAVE_PTHREAD
+    int workers;                /**< Number of worker threads started. */
+    pthread_t *worker;          /**< The worker threads. */
+    pthread_mutex_t lock;       /**< Lock protecting everything below. */
+    pthread_cond_t work_cond;   /**< Signalled when work is posted. */
+    pthread_cond_t done_cond;   /**< Signalled when the last task is done. */
+    unsigned long batch;        /**< Count of batches posted so far. */
+    int stop;                   /**< Flag telling workers to exit. */
+#endif
+    rs_pool_fn *fn;             /**< The current batch's task function. */
+    void *arg;                  /**< The current batch's task argument. */
+    int n;                      /**< The number of tasks in the batch. */
+    int next;                   /**< The next task to be claimed. */
+    int done;                   /**< The number of tasks completed. */
+};
+
+#ifdef HAVE_PTHREAD
+/** Claim and run tasks until there are none left.
+ *
+ * Must be called with the lock held, and returns with the lock held. */
+static void rs_pool_work(rs_pool_t *pool)
+{
+    int i;
+
+    while (pool->next < pool->n) {
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->arg, i);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->done == pool->n)
+            pthread_cond_signal(&pool->done_cond);
+    }
+}
+
+static void *rs_pool_worker(void *arg)
+{
+    rs_pool_t *pool = arg;
+    unsigned long batch = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->batch == batch)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->stop)
+            break;
+        batch = pool->batch;
+        rs_pool_work(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif                          /* HAVE_PTHREAD */
+
+rs_pool_t *rs_pool_new(int threads)
+{
+    rs_pool_t *pool = rs_alloc_struct(rs_pool_t);
+
+    pool->threads = threads < 1 ? 1 : threads < RS_POOL_MAX_THREADS ? threads :
+        RS_POOL_MAX_THREADS;
+#ifdef HAVE_PTHREAD
+    if (pool->threads > 1) {
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work_cond, NULL);
+        pthread_cond_init(&pool->done_cond, NULL);
+        pool->worker =
+            rs_alloc((size_t)(pool->threads - 1) * sizeof(pthread_t),
+                     "pool workers");
+        for (; pool->workers < pool->threads - 1; pool->workers++)
+            if (pthread_create(&pool->worker[pool->workers], NULL,
+                               rs_pool_worker, pool)) {
+                rs_warn("failed to start worker thread %d", pool->workers);
+                break;
+            }
+        pool->threads = pool->workers + 1;
+    }
+#else
+    if (pool->threads > 1)
+        rs_trace("built without thread support, running tasks serially");
+    pool->threads = 1;
+#endif
+    rs_trace("created pool with %d threads", pool->threads);
+    return pool;
+}
+
+int rs_pool_threads(rs_pool_t const *pool)
+{
+    return pool->threads;
+}
+
+void rs_pool_run(rs_pool_t *pool, rs_pool_fn *fn, void *arg, int n)
+{
+    int i;
+
+    assert(pool);
+    assert(n >= 0);
+#ifdef HAVE_PTHREAD
+    if (pool->workers && n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->fn = fn;
+        pool->arg = arg;
+        pool->n = n;
+        pool->next = pool->done = 0;
+        pool->batch++;
+        pthread_cond_broadcast(&pool->work_cond);
+        rs_pool_work(pool);
+        while (pool->done < pool->n)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+        fn(arg, i);
+}
+
+void rs_pool_free(rs_pool_t *pool)
+{
+    if (!pool)
+        return;
+#ifdef HAVE_PTHREAD
+    if (pool->threads > 1 || pool->worker) {
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->workers; i++)
+            pthread_join(pool->worker[i], NULL);
+        free(pool->worker);
+        pthread_cond_destroy(&pool->done_cond);
+        pthread_cond_destroy(&pool->work_cond);
+        pthread_mutex_destroy(&pool->lock);
+    }
+#endif
+    free(pool);
+}
@@ -0,0 +1,58 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file pool.h
+ * A minimal pool of worker threads for running independent tasks.
+ *
+ * A pool runs a batch of \p n tasks by calling \p fn(arg, i) for each i in
+ * [0,n), spreading the calls over the pool's worker threads and the calling
+ * thread, and returns when they are all complete. Tasks must not depend on
+ * each other's ordering, and must only write to their own part of \p arg.
+ *
+ * If librsync was built without thread support, or the pool was created with
+ * less than 2 threads, the tasks are simply run serially by the caller. */
+#ifndef POOL_H
+#  define POOL_H
+
+/** The most threads a pool uses, which jobs also limit their threads to. */
+#  define RS_POOL_MAX_THREADS 1024
+
+/** A pool of worker threads. */
+typedef struct rs_pool rs_pool_t;
+
+/** The type of a task function run by a pool. */
+typedef void rs_pool_fn(void *arg, int i);
+
+/** Create a pool for running tasks using \p threads threads.
+ *
+ * This includes the calling thread, so it starts \p threads-1 worker threads,
+ * up to RS_POOL_MAX_THREADS in all. If threads cannot be started, the pool
+ * falls back to running tasks serially. */
+rs_pool_t *rs_pool_new(int threads);
+
+/** Get the number of threads a pool uses, including the caller. */
+int rs_pool_threads(rs_pool_t const *pool);
+
+/** Run \p n tasks using a pool and wait for them all to complete. */
+void rs_pool_run(rs_pool_t *pool, rs_pool_fn *fn, void *arg, int n);
+
+/** Stop all the worker threads and free a pool. */
+void rs_pool_free(rs_pool_t *pool);
+
+#endif                          /* !POOL_H */
@@ -109,26 +109,26 @@ const struct rs_prototab_ent rs_prototab[] = {
     {RS_KIND_COPY, 0, 8, 2},    /* RS_OP_COPY_N8_N2 = 0x52 */
     {RS_KIND_COPY, 0, 8, 4},    /* RS_OP_COPY_N8_N4 = 0x53 */
     {RS_KIND_COPY, 0, 8, 8},    /* RS_OP_COPY_N8_N8 = 0x54 */
-    {RS_KIND_RESERVED, 85, 0, 0},       /* RS_OP_RESERVED_85 = 0x55 */
-    {RS_KIND_RESERVED, 86, 0, 0},       /* RS_OP_RESERVED_86 = 0x56 */
-    {RS_KIND_RESERVED, 87, 0, 0},       /* RS_OP_RESERVED_87 = 0x57 */
-    {RS_KIND_RESERVED, 88, 0, 0},       /* RS_OP_RESERVED_88 = 0x58 */
-    {RS_KIND_RESERVED, 89, 0, 0},       /* RS_OP_RESERVED_89 = 0x59 */
-    {RS_KIND_RESERVED, 90, 0, 0},       /* RS_OP_RESERVED_90 = 0x5a */
-    {RS_KIND_RESERVED, 91, 0, 0},       /* RS_OP_RESERVED_91 = 0x5b */
-    {RS_KIND_RESERVED, 92, 0, 0},       /* RS_OP_RESERVED_92 = 0x5c */
-    {RS_KIND_RESERVED, 93, 0, 0},       /* RS_OP_RESERVED_93 = 0x5d */
-    {RS_KIND_RESERVED, 94, 0, 0},       /* RS_OP_RESERVED_94 = 0x5e */
-    {RS_KIND_RESERVED, 95, 0, 0},       /* RS_OP_RESERVED_95 = 0x5f */
-    {RS_KIND_RESERVED, 96, 0, 0},       /* RS_OP_RESERVED_96 = 0x60 */
-    {RS_KIND_RESERVED, 97, 0, 0},       /* RS_OP_RESERVED_97 = 0x61 */
-    {RS_KIND_RESERVED, 98, 0, 0},       /* RS_OP_RESERVED_98 = 0x62 */
-    {RS_KIND_RESERVED, 99, 0, 0},       /* RS_OP_RESERVED_99 = 0x63 */
-    {RS_KIND_RESERVED, 100, 0, 0},      /* RS_OP_RESERVED_100 = 0x64 */
-    {RS_KIND_RESERVED, 101, 0, 0},      /* RS_OP_RESERVED_101 = 0x65 */
-    {RS_KIND_RESERVED, 102, 0, 0},      /* RS_OP_RESERVED_102 = 0x66 */
-    {RS_KIND_RESERVED, 103, 0, 0},      /* RS_OP_RESERVED_103 = 0x67 */
-    {RS_KIND_RESERVED, 104, 0, 0},      /* RS_OP_RESERVED_104 = 0x68 */
+    {RS_KIND_COPY_OUTPUT, 0, 1, 1},     /* RS_OP_COPY_OUTPUT_N1_N1 = 0x55 */
+    {RS_KIND_COPY_OUTPUT, 0, 1, 2},     /* RS_OP_COPY_OUTPUT_N1_N2 = 0x56 */
+    {RS_KIND_COPY_OUTPUT, 0, 1, 4},     /* RS_OP_COPY_OUTPUT_N1_N4 = 0x57 */
+    {RS_KIND_COPY_OUTPUT, 0, 1, 8},     /* RS_OP_COPY_OUTPUT_N1_N8 = 0x58 */
+    {RS_KIND_COPY_OUTPUT, 0, 2, 1},     /* RS_OP_COPY_OUTPUT_N2_N1 = 0x59 */
+    {RS_KIND_COPY_OUTPUT, 0, 2, 2},     /* RS_OP_COPY_OUTPUT_N2_N2 = 0x5a */
+    {RS_KIND_COPY_OUTPUT, 0, 2, 4},     /* RS_OP_COPY_OUTPUT_N2_N4 = 0x5b */
+    {RS_KIND_COPY_OUTPUT, 0, 2, 8},     /* RS_OP_COPY_OUTPUT_N2_N8 = 0x5c */
+    {RS_KIND_COPY_OUTPUT, 0, 4, 1},     /* RS_OP_COPY_OUTPUT_N4_N1 = 0x5d */
+    {RS_KIND_COPY_OUTPUT, 0, 4, 2},     /* RS_OP_COPY_OUTPUT_N4_N2 = 0x5e */
+    {RS_KIND_COPY_OUTPUT, 0, 4, 4},     /* RS_OP_COPY_OUTPUT_N4_N4 = 0x5f */
+    {RS_KIND_COPY_OUTPUT, 0, 4, 8},     /* RS_OP_COPY_OUTPUT_N4_N8 = 0x60 */
+    {RS_KIND_COPY_OUTPUT, 0, 8, 1},     /* RS_OP_COPY_OUTPUT_N8_N1 = 0x61 */
+    {RS_KIND_COPY_OUTPUT, 0, 8, 2},     /* RS_OP_COPY_OUTPUT_N8_N2 = 0x62 */
+    {RS_KIND_COPY_OUTPUT, 0, 8, 4},     /* RS_OP_COPY_OUTPUT_N8_N4 = 0x63 */
+    {RS_KIND_COPY_OUTPUT, 0, 8, 8},     /* RS_OP_COPY_OUTPUT_N8_N8 = 0x64 */
+    {RS_KIND_FILL, 0, 1, 1},    /* RS_OP_FILL_N1_N1 = 0x65 */
+    {RS_KIND_FILL, 0, 1, 2},    /* RS_OP_FILL_N1_N2 = 0x66 */
+    {RS_KIND_FILL, 0, 1, 4},    /* RS_OP_FILL_N1_N4 = 0x67 */
+    {RS_KIND_FILL, 0, 1, 8},    /* RS_OP_FILL_N1_N8 = 0x68 */
     {RS_KIND_RESERVED, 105, 0, 0},      /* RS_OP_RESERVED_105 = 0x69 */
     {RS_KIND_RESERVED, 106, 0, 0},      /* RS_OP_RESERVED_106 = 0x6a */
     {RS_KIND_RESERVED, 107, 0, 0},      /* RS_OP_RESERVED_107 = 0x6b */
@@ -133,26 +133,26 @@ enum {
     RS_OP_COPY_N8_N2 = 0x52,
     RS_OP_COPY_N8_N4 = 0x53,
     RS_OP_COPY_N8_N8 = 0x54,
-    RS_OP_RESERVED_85 = 0x55,
-    RS_OP_RESERVED_86 = 0x56,
-    RS_OP_RESERVED_87 = 0x57,
-    RS_OP_RESERVED_88 = 0x58,
-    RS_OP_RESERVED_89 = 0x59,
-    RS_OP_RESERVED_90 = 0x5a,
-    RS_OP_RESERVED_91 = 0x5b,
-    RS_OP_RESERVED_92 = 0x5c,
-    RS_OP_RESERVED_93 = 0x5d,
-    RS_OP_RESERVED_94 = 0x5e,
-    RS_OP_RESERVED_95 = 0x5f,
-    RS_OP_RESERVED_96 = 0x60,
-    RS_OP_RESERVED_97 = 0x61,
-    RS_OP_RESERVED_98 = 0x62,
-    RS_OP_RESERVED_99 = 0x63,
-    RS_OP_RESERVED_100 = 0x64,
-    RS_OP_RESERVED_101 = 0x65,
-    RS_OP_RESERVED_102 = 0x66,
-    RS_OP_RESERVED_103 = 0x67,
-    RS_OP_RESERVED_104 = 0x68,
+    RS_OP_COPY_OUTPUT_N1_N1 = 0x55,
+    RS_OP_COPY_OUTPUT_N1_N2 = 0x56,
+    RS_OP_COPY_OUTPUT_N1_N4 = 0x57,
+    RS_OP_COPY_OUTPUT_N1_N8 = 0x58,
+    RS_OP_COPY_OUTPUT_N2_N1 = 0x59,
+    RS_OP_COPY_OUTPUT_N2_N2 = 0x5a,
+    RS_OP_COPY_OUTPUT_N2_N4 = 0x5b,
+    RS_OP_COPY_OUTPUT_N2_N8 = 0x5c,
+    RS_OP_COPY_OUTPUT_N4_N1 = 0x5d,
+    RS_OP_COPY_OUTPUT_N4_N2 = 0x5e,
+    RS_OP_COPY_OUTPUT_N4_N4 = 0x5f,
+    RS_OP_COPY_OUTPUT_N4_N8 = 0x60,
+    RS_OP_COPY_OUTPUT_N8_N1 = 0x61,
+    RS_OP_COPY_OUTPUT_N8_N2 = 0x62,
+    RS_OP_COPY_OUTPUT_N8_N4 = 0x63,
+    RS_OP_COPY_OUTPUT_N8_N8 = 0x64,
+    RS_OP_FILL_N1_N1 = 0x65,
+    RS_OP_FILL_N1_N2 = 0x66,
+    RS_OP_FILL_N1_N4 = 0x67,
+    RS_OP_FILL_N1_N8 = 0x68,
     RS_OP_RESERVED_105 = 0x69,
     RS_OP_RESERVED_106 = 0x6a,
     RS_OP_RESERVED_107 = 0x6b,
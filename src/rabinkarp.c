@@ -19,6 +19,7 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 #include "rabinkarp.h"
+#include "cpu.h"
 
 /* Constant for RABINKARP_MULT^2. */
 #define RABINKARP_MULT2 0xa5b71959U
@@ -84,10 +85,244 @@ static inline uint32_t rabinkarp_pow(uint32_t n)
     return ans;
 }
 
+#ifdef RS_SIMD_X86
+/* SIMD kernels using power-table lane splitting.
+
+   The bytes are processed in iterations of B bytes, with the byte at position
+   L of each iteration summed into a separate 32 bit lane A[L] using A[L] =
+   A[L]*M^B + b. After n iterations the hash of all the bytes is then
+   hash*M^(B*n) + sum(A[L]*M^(B-1-L)). */
+
+/* Table of RABINKARP_MULT^i for the lane weights. */
+static const uint32_t RABINKARP_MULT_POW[65] = {
+    0x00000001U, 0x08104225U, 0xa5b71959U, 0x858f9bddU,
+    0xf9c080f1U, 0x5120c4d5U, 0x21cb5cc9U, 0x64e03b0dU,
+    0x7c71e2e1U, 0x8f03cc85U, 0x9696d939U, 0x035e173dU,
+    0x1a6715d1U, 0x49960935U, 0x8c5efea9U, 0xf9f2606dU,
+    0x0bb409c1U, 0xbf992ae5U, 0x04823d19U, 0xd423469dU,
+    0x131daeb1U, 0xdd63e195U, 0x80e80489U, 0x0343f9cdU,
+    0x0409f4a1U, 0x7891dd45U, 0x0470c4f9U, 0xcea4a9fdU,
+    0xd96fcb91U, 0x80b3cdf5U, 0x7c65ee69U, 0x70c2872dU,
+    0x4dc72381U, 0xd4ff63a5U, 0x02e9f0d9U, 0x9177c15dU,
+    0xe3f8ec71U, 0x6eff4e55U, 0x6a683c49U, 0x4d2b888dU,
+    0x514f1661U, 0x92433e05U, 0x820540b9U, 0xf9020cbdU,
+    0x38649151U, 0xb10fe2b5U, 0x830e6e29U, 0xd40c7dedU,
+    0x25154d41U, 0xb60eec65U, 0x176a3499U, 0xd5790c1dU,
+    0xb96e3a31U, 0x62ff0b15U, 0x69080409U, 0xc7c2e74dU,
+    0xfb9d4821U, 0x7463eec5U, 0xaa504c79U, 0xe0e23f7dU,
+    0xb4e16711U, 0x3a364775U, 0x87947de9U, 0x077c44adU,
+    0xd17a8701U
+};
+
+/** Get the lane weights M^(B-1-L) for B byte iterations. */
+static inline void rabinkarp_weights(uint32_t *w, int b)
+{
+    int i;
+
+    for (i = 0; i < b; i++)
+        w[i] = RABINKARP_MULT_POW[b - 1 - i];
+}
+
+/** Hash 16 bytes per iteration in 4 vectors of 4 lanes using SSE4.1. */
+RS_TARGET("sse4.1")
+static size_t rabinkarp_update_sse41(uint32_t *hash, const unsigned char *buf,
+                                     size_t len)
+{
+    const __m128i m = _mm_set1_epi32((int)RABINKARP_MULT_POW[16]);
+    __m128i a[4], v, w;
+    uint32_t ws[16];
+    size_t n = len / 16, i;
+    int k;
+
+    if (!n)
+        return 0;
+    for (k = 0; k < 4; k++)
+        a[k] = _mm_setzero_si128();
+    for (i = 0; i < n; i++) {
+        v = _mm_loadu_si128((const __m128i *)(buf + 16 * i));
+        a[0] = _mm_add_epi32(_mm_mullo_epi32(a[0], m), _mm_cvtepu8_epi32(v));
+        a[1] = _mm_add_epi32(_mm_mullo_epi32(a[1], m),
+                             _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+        a[2] = _mm_add_epi32(_mm_mullo_epi32(a[2], m),
+                             _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+        a[3] = _mm_add_epi32(_mm_mullo_epi32(a[3], m),
+                             _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+    }
+    rabinkarp_weights(ws, 16);
+    v = _mm_setzero_si128();
+    for (k = 0; k < 4; k++) {
+        w = _mm_loadu_si128((const __m128i *)(ws + 4 * k));
+        v = _mm_add_epi32(v, _mm_mullo_epi32(a[k], w));
+    }
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    *hash = *hash * rabinkarp_pow((uint32_t)(16 * n)) +
+        (uint32_t)_mm_cvtsi128_si32(v);
+    return 16 * n;
+}
+
+/** Hash 32 bytes per iteration in 4 vectors of 8 lanes using AVX2. */
+RS_TARGET("avx2")
+static size_t rabinkarp_update_avx2(uint32_t *hash, const unsigned char *buf,
+                                    size_t len)
+{
+    const __m256i m = _mm256_set1_epi32((int)RABINKARP_MULT_POW[32]);
+    __m256i a[4], v, w;
+    __m128i h;
+    uint32_t ws[32];
+    size_t n = len / 32, i;
+    int k;
+
+    if (!n)
+        return 0;
+    for (k = 0; k < 4; k++)
+        a[k] = _mm256_setzero_si256();
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 4; k++) {
+            h = _mm_loadl_epi64((const __m128i *)(buf + 32 * i + 8 * k));
+            a[k] = _mm256_add_epi32(_mm256_mullo_epi32(a[k], m),
+                                    _mm256_cvtepu8_epi32(h));
+        }
+    }
+    rabinkarp_weights(ws, 32);
+    v = _mm256_setzero_si256();
+    for (k = 0; k < 4; k++) {
+        w = _mm256_loadu_si256((const __m256i *)(ws + 8 * k));
+        v = _mm256_add_epi32(v, _mm256_mullo_epi32(a[k], w));
+    }
+    h = _mm_add_epi32(_mm256_castsi256_si128(v),
+                      _mm256_extracti128_si256(v, 1));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    *hash = *hash * rabinkarp_pow((uint32_t)(32 * n)) +
+        (uint32_t)_mm_cvtsi128_si32(h);
+    return 32 * n;
+}
+
+/** Hash 64 bytes per iteration in 4 vectors of 16 lanes using AVX-512. */
+RS_TARGET("avx512f")
+static size_t rabinkarp_update_avx512(uint32_t *hash, const unsigned char *buf,
+                                      size_t len)
+{
+    const __m512i m = _mm512_set1_epi32((int)RABINKARP_MULT_POW[64]);
+    __m512i a[4], v, w;
+    __m128i h;
+    uint32_t ws[64];
+    size_t n = len / 64, i;
+    int k;
+
+    if (!n)
+        return 0;
+    for (k = 0; k < 4; k++)
+        a[k] = _mm512_setzero_si512();
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 4; k++) {
+            h = _mm_loadu_si128((const __m128i *)(buf + 64 * i + 16 * k));
+            a[k] = _mm512_add_epi32(_mm512_mullo_epi32(a[k], m),
+                                    _mm512_cvtepu8_epi32(h));
+        }
+    }
+    rabinkarp_weights(ws, 64);
+    v = _mm512_setzero_si512();
+    for (k = 0; k < 4; k++) {
+        w = _mm512_loadu_si512((const void *)(ws + 16 * k));
+        v = _mm512_add_epi32(v, _mm512_mullo_epi32(a[k], w));
+    }
+    /* Add the lanes with wrapping adds, not _mm512_reduce_add_epi32(). */
+    h = _mm_add_epi32(_mm_add_epi32(_mm512_castsi512_si128(v),
+                                    _mm512_extracti32x4_epi32(v, 1)),
+                      _mm_add_epi32(_mm512_extracti32x4_epi32(v, 2),
+                                    _mm512_extracti32x4_epi32(v, 3)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    *hash = *hash * rabinkarp_pow((uint32_t)(64 * n)) +
+        (uint32_t)_mm_cvtsi128_si32(h);
+    return 64 * n;
+}
+
+/** Rotate 8 offsets at a time using AVX2.
+ *
+ * Each rotation is hash = hash*M + d[k], with d[k] = in[k] - mult*(out[k] +
+ * RABINKARP_ADJ). A prefix scan gives x[k] = sum(d[j]*M^(k-j)) for j <= k,
+ * so with the hash h at the start of the vector, the hash before rotation k
+ * is h*M^k + x[k-1]. */
+RS_TARGET("avx2")
+static size_t rabinkarp_rotate_n_avx2(rabinkarp_t *sum,
+                                      const unsigned char *buf, size_t n,
+                                      uint32_t *digests)
+{
+    const size_t count = sum->count;
+    const __m256i m1 = _mm256_set1_epi32((int)RABINKARP_MULT_POW[1]);
+    const __m256i m2 = _mm256_set1_epi32((int)RABINKARP_MULT_POW[2]);
+    const __m256i m4 = _mm256_set1_epi32((int)RABINKARP_MULT_POW[4]);
+    const __m256i pw = _mm256_loadu_si256((const __m256i *)RABINKARP_MULT_POW);
+    const __m256i mult = _mm256_set1_epi32((int)sum->mult);
+    const __m256i adj = _mm256_set1_epi32((int)(sum->mult * RABINKARP_ADJ));
+    const uint32_t m8 = RABINKARP_MULT_POW[8];
+    uint32_t hash = sum->hash;
+    __m256i o, x;
+    size_t k;
+
+    for (k = 0; k + 8 <= n; k += 8) {
+        o = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(buf + k)));
+        x = _mm256_cvtepu8_epi32(_mm_loadl_epi64
+                                 ((const __m128i *)(buf + k + count)));
+        x = _mm256_sub_epi32(x, _mm256_add_epi32(_mm256_mullo_epi32(mult, o),
+                                                 adj));
+        x = _mm256_add_epi32(x, _mm256_mullo_epi32
+                             (RS_MM256_SLLI_LANES(x, 1), m1));
+        x = _mm256_add_epi32(x, _mm256_mullo_epi32
+                             (RS_MM256_SLLI_LANES(x, 2), m2));
+        x = _mm256_add_epi32(x, _mm256_mullo_epi32
+                             (RS_MM256_SLLI_LANES(x, 4), m4));
+        _mm256_storeu_si256((__m256i *)(digests + k),
+                            _mm256_add_epi32(_mm256_mullo_epi32
+                                             (pw,
+                                              _mm256_set1_epi32((int)hash)),
+                                             RS_MM256_SLLI_LANES(x, 1)));
+        hash = hash * m8 + (uint32_t)_mm256_extract_epi32(x, 7);
+    }
+    sum->hash = hash;
+    return k;
+}
+
+static const rs_rabinkarp_impl_t rs_rabinkarp_sse41 =
+    { "sse4.1", rabinkarp_update_sse41, NULL };
+static const rs_rabinkarp_impl_t rs_rabinkarp_avx2 =
+    { "avx2", rabinkarp_update_avx2, rabinkarp_rotate_n_avx2 };
+static const rs_rabinkarp_impl_t rs_rabinkarp_avx512 =
+    { "avx512", rabinkarp_update_avx512, rabinkarp_rotate_n_avx2 };
+#endif                          /* RS_SIMD_X86 */
+
+static const rs_rabinkarp_impl_t rs_rabinkarp_scalar =
+    { "scalar", NULL, NULL };
+
+rs_rabinkarp_impl_t const *rs_rabinkarp_select(rs_cpu_level_t level)
+{
+#ifdef RS_SIMD_X86
+    if (level >= RS_CPU_AVX512)
+        return &rs_rabinkarp_avx512;
+    if (level >= RS_CPU_AVX2)
+        return &rs_rabinkarp_avx2;
+    if (level >= RS_CPU_SSE41)
+        return &rs_rabinkarp_sse41;
+#else
+    (void)level;
+#endif
+    return &rs_rabinkarp_scalar;
+}
+
 void rabinkarp_update(rabinkarp_t *sum, const unsigned char *buf, size_t len)
 {
     size_t n = len;
     uint32_t hash = sum->hash;
+    rs_rabinkarp_impl_t const *impl = rs_cpu()->rabinkarp;
+
+    if (impl->fn) {
+        size_t done = impl->fn(&hash, buf, n);
+        buf += done;
+        n -= done;
+    }
 
     while (n >= 16) {
         hash = PAR2X8(hash, buf);
@@ -102,3 +337,17 @@ void rabinkarp_update(rabinkarp_t *sum, const unsigned char *buf, size_t len)
     sum->count += len;
     sum->mult *= rabinkarp_pow((uint32_t)len);
 }
+
+void rabinkarp_rotate_n(rabinkarp_t *sum, const unsigned char *buf, size_t n,
+                        uint32_t *digests)
+{
+    rs_rabinkarp_impl_t const *impl = rs_cpu()->rabinkarp;
+    size_t k = 0;
+
+    if (impl->rotate_n)
+        k = impl->rotate_n(sum, buf, n, digests);
+    for (; k < n; k++) {
+        digests[k] = rabinkarp_digest(sum);
+        rabinkarp_rotate(sum, buf[k], buf[k + sum->count]);
+    }
+}
@@ -26,6 +26,7 @@
 
 #  include <stddef.h>
 #  include <stdint.h>
+#  include "simd.h"
 
 /** The RabinKarp seed value.
  *
@@ -68,6 +69,41 @@ static inline void rabinkarp_init(rabinkarp_t *sum)
 
 void rabinkarp_update(rabinkarp_t *sum, const unsigned char *buf, size_t len);
 
+/** Rotate a rabinkarp through n bytes, getting the digest before each
+ * rotation.
+ *
+ * This sets digests[k] to rabinkarp_digest(), and then does
+ * rabinkarp_rotate(sum, buf[k], buf[k + sum->count]), for each k in [0,n).
+ *
+ * \param buf - the bytes currently in the sum, followed by at least n more. */
+void rabinkarp_rotate_n(rabinkarp_t *sum, const unsigned char *buf, size_t n,
+                        uint32_t *digests);
+
+/** Function type for a SIMD rabinkarp_update() kernel.
+ *
+ * It adds as many bytes of \p buf as it can efficiently to \p hash, and
+ * returns the number of bytes added. */
+typedef size_t rs_rabinkarp_fn(uint32_t *hash, const unsigned char *buf,
+                               size_t len);
+
+/** Function type for a SIMD rabinkarp_rotate_n() kernel.
+ *
+ * It does as many of the \p n rotations as it can efficiently, and returns
+ * the number done. */
+typedef size_t rs_rabinkarp_rotate_fn(rabinkarp_t *sum,
+                                      const unsigned char *buf, size_t n,
+                                      uint32_t *digests);
+
+/** A rabinkarp_update() and rabinkarp_rotate_n() implementation. */
+typedef struct rs_rabinkarp_impl {
+    char const *name;           /**< The name reported by rs_cpu_features(). */
+    rs_rabinkarp_fn *fn;        /**< The update kernel, or NULL for scalar. */
+    rs_rabinkarp_rotate_fn *rotate_n;   /**< The rotate kernel or NULL. */
+} rs_rabinkarp_impl_t;
+
+/** Get the best rabinkarp_update() implementation for a cpu level. */
+rs_rabinkarp_impl_t const *rs_rabinkarp_select(rs_cpu_level_t level);
+
 static inline void rabinkarp_rotate(rabinkarp_t *sum, unsigned char out,
                                     unsigned char in)
 {
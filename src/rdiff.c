@@ -60,6 +60,10 @@ static int show_stats = 0;
 static int bzip2_level = 0;
 static int gzip_level = 0;
 static int file_force = 0;
+static int use_mmap = 0;
+static char *basis_name = NULL;
+static int delta_format = 1;
+static int delta_effort = RS_DELTA_EFFORT_MAX;
 
 enum {
     OPT_GZIP = 1069, OPT_BZIP2
@@ -98,21 +102,35 @@ static void help(void)
 {
     printf("Usage: rdiff [OPTIONS] signature [BASIS [SIGNATURE]]\n"
            "             [OPTIONS] delta SIGNATURE [NEWFILE [DELTA]]\n"
-           "             [OPTIONS] patch BASIS [DELTA [NEWFILE]]\n" "\n"
+           "             [OPTIONS] diff BASIS NEWFILE [DELTA]\n"
+           "             [OPTIONS] patch BASIS [DELTA [NEWFILE]]\n"
+           "             [OPTIONS] resignature SIGNATURE DELTA NEWFILE [SIGNATURE]\n"
+           "             [OPTIONS] index SIGNATURE [INDEX]\n"
+           "\n"
            "Options:\n"
            "  -v, --verbose             Trace internal processing\n"
            "  -V, --version             Show program version\n"
            "  -?, --help                Show this help message\n"
            "  -s, --statistics          Show performance statistics\n"
            "  -f, --force               Force overwriting existing files\n"
+           "  -j, --threads=N           Number of threads to use, 0 (default) for one\n"
            "Signature generation options:\n"
-           "  -H, --hash=ALG            Hash algorithm: blake2 (default), md4\n"
-           "  -R, --rollsum=ALG         Rollsum algorithm: rabinkarp (default), rollsum\n"
+           "  -H, --hash=ALG            Hash algorithm: blake2 (default), md4, xxh3\n"
+           "  -R, --rollsum=ALG         Rollsum algorithm: rabinkarp (default), rollsum,\n"
+           "                            or cdc for content-defined chunks\n"
            "Delta-encoding options:\n"
            "  -b, --block-size=BYTES    Signature block size, 0 (default) for recommended\n"
            "  -S, --sum-size=BYTES      Signature strength, 0 (default) for max, -1 for min\n"
+           "      --bloom-bits=N        Bloom filter bits per block, 0 for none\n"
+           "  -B, --basis=BASIS         Read the basis to extend matches past blocks\n"
+           "      --delta-format=N      Delta format: 1 (default), or 2 to also copy\n"
+           "                            repeated data from earlier in the new file\n"
+           "      --effort=N            Delta effort from 0 to 9 (default), lower\n"
+           "                            levels skip ahead in long runs of new data\n"
            "IO options:\n" "  -I, --input-size=BYTES    Input buffer size\n"
            "  -O, --output-size=BYTES   Output buffer size\n"
+           "      --mmap                Memory-map files instead of using stdio, only\n"
+           "                            for files that won't be truncated while read\n"
            "  -z, --gzip[=LEVEL]        gzip-compress deltas\n"
            "  -i, --bzip2[=LEVEL]       bzip2-compress deltas\n");
 }
@@ -139,12 +157,14 @@ static void rdiff_show_version(void)
     printf("rdiff (%s)\n"
            "Copyright (C) 1997-2016 by Martin Pool, Andrew Tridgell and others.\n"
            "http://librsync.sourcefrog.net/\n"
-           "Capabilities: %ld bit files%s%s%s\n" "\n"
+           "Capabilities: %ld bit files%s%s%s\n"
+           "Checksum kernels: %s\n" "\n"
            "librsync comes with NO WARRANTY, to the extent permitted by law.\n"
            "You may redistribute copies of librsync under the terms of the GNU\n"
            "Lesser General Public License.  For more information about these\n"
            "matters, see the files named COPYING.\n", rs_librsync_version,
-           (long)(8 * sizeof(rs_long_t)), zlib, bzlib, trace);
+           (long)(8 * sizeof(rs_long_t)), zlib, bzlib, trace,
+           rs_cpu_features());
 }
 
 static void rdiff_options(poptContext opcon)
@@ -190,6 +210,13 @@ static void rdiff_options(poptContext opcon)
     }
 }
 
+/* Log the stats and more stats of the last whole-file function. */
+static void rdiff_log_stats(rs_stats_t const *stats)
+{
+    rs_log_stats(stats);
+    rs_log_xstats(rs_whole_xstats());
+}
+
 /** Generate signature from remaining command line arguments. */
 static rs_result rdiff_sig(poptContext opcon)
 {
@@ -207,6 +234,14 @@ static rs_result rdiff_sig(poptContext opcon)
         sig_magic = RS_BLAKE2_SIG_MAGIC;
     } else if (!strcmp(rs_hash_name, "md4")) {
         sig_magic = RS_MD4_SIG_MAGIC;
+    } else if (!strcmp(rs_hash_name, "xxh3")) {
+        /* There is no rollsum variant, so use the RabinKarp magic - 0x10. */
+        if (rs_rollsum_name && !strcmp(rs_rollsum_name, "rollsum")) {
+            rdiff_usage("Hash algorithm 'xxh3' requires rollsum 'rabinkarp' "
+                        "or 'cdc'.");
+            exit(RS_SYNTAX_ERROR);
+        }
+        sig_magic = RS_RK_XXH3_SIG_MAGIC - 0x10;
     } else {
         rdiff_usage("Unknown hash algorithm '%s'.", rs_hash_name);
         exit(RS_SYNTAX_ERROR);
@@ -214,6 +249,13 @@ static rs_result rdiff_sig(poptContext opcon)
     if (!rs_rollsum_name || !strcmp(rs_rollsum_name, "rabinkarp")) {
         /* The RabinKarp magics are 0x10 greater than the rollsum magics. */
         sig_magic += 0x10;
+    } else if (!strcmp(rs_rollsum_name, "cdc")) {
+        /* The chunked magics are 0x20 greater, and there is no MD4 one. */
+        if (sig_magic == RS_MD4_SIG_MAGIC) {
+            rdiff_usage("Rollsum 'cdc' requires hash 'blake2' or 'xxh3'.");
+            exit(RS_SYNTAX_ERROR);
+        }
+        sig_magic += 0x20;
     } else if (strcmp(rs_rollsum_name, "rollsum")) {
         rdiff_usage("Unknown rollsum algorithm '%s'.", rs_rollsum_name);
         exit(RS_SYNTAX_ERROR);
@@ -229,14 +271,30 @@ static rs_result rdiff_sig(poptContext opcon)
         return result;
 
     if (show_stats)
-        rs_log_stats(&stats);
+        rdiff_log_stats(&stats);
 
     return result;
 }
 
+/* Set the delta format and effort for the whole-file functions. */
+static void rdiff_delta_format(void)
+{
+    if (delta_format == 2)
+        rs_delta_magic = RS_DELTA2_MAGIC;
+    else if (delta_format != 1) {
+        rdiff_usage("Unknown delta format %d.", delta_format);
+        exit(RS_SYNTAX_ERROR);
+    }
+    if (delta_effort < 0 || delta_effort > RS_DELTA_EFFORT_MAX) {
+        rdiff_usage("Delta effort must be from 0 to %d.", RS_DELTA_EFFORT_MAX);
+        exit(RS_SYNTAX_ERROR);
+    }
+    rs_delta_effort = delta_effort;
+}
+
 static rs_result rdiff_delta(poptContext opcon)
 {
-    FILE *sig_file, *new_file, *delta_file;
+    FILE *sig_file, *new_file, *delta_file, *basis_file = NULL;
     char const *sig_name;
     rs_result result;
     rs_signature_t *sumset;
@@ -251,28 +309,37 @@ static rs_result rdiff_delta(poptContext opcon)
     sig_file = rs_file_open(sig_name, "rb", file_force);
     new_file = rs_file_open(poptGetArg(opcon), "rb", file_force);
     delta_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
+    if (basis_name)
+        basis_file = rs_file_open(basis_name, "rb", file_force);
 
     rdiff_no_more_args(opcon);
+    rdiff_delta_format();
 
     result = rs_loadsig_file(sig_file, &sumset, &stats);
     if (result != RS_DONE)
         return result;
 
     if (show_stats)
-        rs_log_stats(&stats);
+        rdiff_log_stats(&stats);
 
-    if ((result = rs_build_hash_table(sumset)) != RS_DONE)
+    if ((result = rs_build_hash_table_par(sumset, rs_threads)) != RS_DONE)
         return result;
 
-    result = rs_delta_file(sumset, new_file, delta_file, &stats);
+    if (basis_file)
+        result = rs_delta_basis_file(sumset, basis_file, new_file, delta_file,
+                                     &stats);
+    else
+        result = rs_delta_file(sumset, new_file, delta_file, &stats);
 
+    if (basis_file)
+        rs_file_close(basis_file);
     rs_file_close(delta_file);
     rs_file_close(new_file);
     rs_file_close(sig_file);
 
     if (show_stats) {
         rs_signature_log_stats(sumset);
-        rs_log_stats(&stats);
+        rdiff_log_stats(&stats);
     }
 
     rs_free_sumset(sumset);
@@ -280,6 +347,39 @@ static rs_result rdiff_delta(poptContext opcon)
     return result;
 }
 
+static rs_result rdiff_diff(poptContext opcon)
+{
+    /* diff BASIS NEWFILE [DELTA] */
+    FILE *old_file, *new_file, *delta_file;
+    char const *old_name, *new_name;
+    rs_stats_t stats;
+    rs_result result;
+
+    if (!(old_name = poptGetArg(opcon)) || !(new_name = poptGetArg(opcon))) {
+        rdiff_usage("Usage for diff: "
+                    "rdiff [OPTIONS] diff BASIS NEWFILE [DELTA]");
+        exit(RS_SYNTAX_ERROR);
+    }
+
+    old_file = rs_file_open(old_name, "rb", file_force);
+    new_file = rs_file_open(new_name, "rb", file_force);
+    delta_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
+
+    rdiff_no_more_args(opcon);
+    rdiff_delta_format();
+
+    result = rs_delta_local_file(old_file, new_file, delta_file, &stats);
+
+    rs_file_close(delta_file);
+    rs_file_close(new_file);
+    rs_file_close(old_file);
+
+    if (show_stats)
+        rdiff_log_stats(&stats);
+
+    return result;
+}
+
 static rs_result rdiff_patch(poptContext opcon)
 {
     /* patch BASIS [DELTA [NEWFILE]] */
@@ -307,7 +407,93 @@ static rs_result rdiff_patch(poptContext opcon)
     rs_file_close(basis_file);
 
     if (show_stats)
-        rs_log_stats(&stats);
+        rdiff_log_stats(&stats);
+
+    return result;
+}
+
+static rs_result rdiff_resig(poptContext opcon)
+{
+    /* resignature SIGNATURE DELTA NEWFILE [SIGNATURE] */
+    FILE *sig_file, *delta_file, *new_file, *new_sig_file;
+    char const *sig_name, *delta_name, *new_name;
+    rs_signature_t *sumset;
+    rs_stats_t stats;
+    rs_result result;
+
+    if (!(sig_name = poptGetArg(opcon)) || !(delta_name = poptGetArg(opcon))
+        || !(new_name = poptGetArg(opcon))) {
+        rdiff_usage("Usage for resignature: "
+                    "rdiff [OPTIONS] resignature SIGNATURE DELTA NEWFILE "
+                    "[SIGNATURE]");
+        exit(RS_SYNTAX_ERROR);
+    }
+
+    sig_file = rs_file_open(sig_name, "rb", file_force);
+    delta_file = rs_file_open(delta_name, "rb", file_force);
+    new_file = rs_file_open(new_name, "rb", file_force);
+    new_sig_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
+
+    rdiff_no_more_args(opcon);
+
+    result = rs_loadsig_file(sig_file, &sumset, &stats);
+    if (result != RS_DONE)
+        return result;
+
+    if (show_stats)
+        rdiff_log_stats(&stats);
+
+    result =
+        rs_sig_from_delta_file(sumset, delta_file, new_file, new_sig_file,
+                               &stats);
+
+    rs_file_close(new_sig_file);
+    rs_file_close(new_file);
+    rs_file_close(delta_file);
+    rs_file_close(sig_file);
+
+    if (show_stats)
+        rdiff_log_stats(&stats);
+
+    rs_free_sumset(sumset);
+
+    return result;
+}
+
+static rs_result rdiff_index(poptContext opcon)
+{
+    /* index SIGNATURE [INDEX] */
+    FILE *sig_file, *index_file;
+    char const *sig_name;
+    rs_signature_t *sumset;
+    rs_stats_t stats;
+    rs_result result;
+
+    if (!(sig_name = poptGetArg(opcon))) {
+        rdiff_usage("Usage for index: "
+                    "rdiff [OPTIONS] index SIGNATURE [INDEX]");
+        exit(RS_SYNTAX_ERROR);
+    }
+
+    sig_file = rs_file_open(sig_name, "rb", file_force);
+    index_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
+
+    rdiff_no_more_args(opcon);
+
+    result = rs_loadsig_file(sig_file, &sumset, &stats);
+    if (result != RS_DONE)
+        return result;
+
+    if (show_stats)
+        rdiff_log_stats(&stats);
+
+    if ((result = rs_build_hash_table_par(sumset, rs_threads)) == RS_DONE)
+        result = rs_indexsig_file(sumset, index_file);
+
+    rs_file_close(index_file);
+    rs_file_close(sig_file);
+
+    rs_free_sumset(sumset);
 
     return result;
 }
@@ -322,11 +508,17 @@ static rs_result rdiff_action(poptContext opcon)
         return rdiff_sig(opcon);
     else if (isprefix(action, "delta"))
         return rdiff_delta(opcon);
+    else if (isprefix(action, "diff"))
+        return rdiff_diff(opcon);
     else if (isprefix(action, "patch"))
         return rdiff_patch(opcon);
+    else if (isprefix(action, "resignature"))
+        return rdiff_resig(opcon);
+    else if (isprefix(action, "index"))
+        return rdiff_index(opcon);
 
-    rdiff_usage
-        ("You must specify an action: `signature', `delta', or `patch'.");
+    rdiff_usage("You must specify an action: `signature', `delta', `diff', "
+                "`patch', `resignature', or `index'.");
     exit(RS_SYNTAX_ERROR);
 }
 
@@ -338,6 +530,7 @@ int main(const int argc, const char *argv[])
         {"version", 'V', POPT_ARG_NONE, 0, 'V'},
         {"input-size", 'I', POPT_ARG_INT, &rs_inbuflen},
         {"output-size", 'O', POPT_ARG_INT, &rs_outbuflen},
+        {"threads", 'j', POPT_ARG_INT, &rs_threads},
         {"hash", 'H', POPT_ARG_STRING, &rs_hash_name},
         {"rollsum", 'R', POPT_ARG_STRING, &rs_rollsum_name},
         {"help", '?', POPT_ARG_NONE, 0, 'h'},
@@ -349,6 +542,11 @@ int main(const int argc, const char *argv[])
         {"gzip", 'z', POPT_ARG_NONE, 0, OPT_GZIP},
         {"bzip2", 'i', POPT_ARG_NONE, 0, OPT_BZIP2},
         {"force", 'f', POPT_ARG_NONE, &file_force},
+        {"mmap", 0, POPT_ARG_NONE, &use_mmap},
+        {"bloom-bits", 0, POPT_ARG_INT, &rs_bloom_bits},
+        {"basis", 'B', POPT_ARG_STRING, &basis_name},
+        {"delta-format", 0, POPT_ARG_INT, &delta_format},
+        {"effort", 0, POPT_ARG_INT, &delta_effort},
         {0}
     };
 
@@ -357,6 +555,7 @@ int main(const int argc, const char *argv[])
 
     opcon = poptGetContext("rdiff", argc, argv, opts, 0);
     rdiff_options(opcon);
+    rs_mmap = use_mmap;
     result = rdiff_action(opcon);
 
     if (result != RS_DONE)
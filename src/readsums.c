@@ -23,15 +23,19 @@
 /** \file readsums.c
  * Load signatures from a file. */
 
+#include <stdlib.h>
+#include <string.h>
 #include "librsync.h"
 #include "job.h"
 #include "sumset.h"
+#include "chunk.h"
 #include "scoop.h"
 #include "netint.h"
 #include "trace.h"
 #include "util.h"
 
 static rs_result rs_loadsig_s_weak(rs_job_t *job);
+static rs_result rs_loadsig_s_chunklen(rs_job_t *job);
 static rs_result rs_loadsig_s_strong(rs_job_t *job);
 
 /** Add a just-read-in checksum pair to the signature block. */
@@ -45,7 +49,11 @@ static rs_result rs_loadsig_add_sum(rs_job_t *job, rs_strong_sum_t *strong)
         rs_trace("got block: weak=" FMT_WEAKSUM ", strong=%s", job->weak_sig,
                  hexbuf);
     }
-    rs_signature_add_block(job->signature, job->weak_sig, strong);
+    if (sig->offsets)
+        rs_signature_add_chunk(sig, job->weak_sig, strong,
+                               (size_t)job->chunk_len);
+    else
+        rs_signature_add_block(sig, job->weak_sig, strong);
     job->stats.sig_blocks++;
     return RS_RUNNING;
 }
@@ -61,6 +69,25 @@ static rs_result rs_loadsig_s_weak(rs_job_t *job)
         return result;
     }
     job->weak_sig = l;
+    if (job->signature->offsets)
+        job->statefn = rs_loadsig_s_chunklen;
+    else
+        job->statefn = rs_loadsig_s_strong;
+    return RS_RUNNING;
+}
+
+static rs_result rs_loadsig_s_chunklen(rs_job_t *job)
+{
+    int l;
+    rs_result result;
+
+    if ((result = rs_suck_n4(job, &l)) != RS_DONE)
+        return result;
+    if (l < 1 || (size_t)l > rs_chunk_max_len((size_t)job->sig_block_len)) {
+        rs_error("chunk length of %d is bogus", l);
+        return RS_CORRUPT;
+    }
+    job->chunk_len = l;
     job->statefn = rs_loadsig_s_strong;
     return RS_RUNNING;
 }
@@ -118,6 +145,59 @@ static rs_result rs_loadsig_s_blocklen(rs_job_t *job)
     return RS_RUNNING;
 }
 
+static rs_result rs_loadsig_s_index(rs_job_t *job)
+{
+    size_t len = job->index_len - job->index_pos;
+    void *buf;
+    rs_result result;
+
+    /* Copy whatever input is available straight into the index buffer. */
+    while (len && rs_scoop_avail(job)) {
+        size_t ilen = len;
+
+        buf = rs_scoop_getbuf(job, &ilen);
+        memcpy(job->index_buf + job->index_pos, buf, ilen);
+        rs_scoop_advance(job, ilen);
+        job->index_pos += ilen;
+        len -= ilen;
+    }
+    if (len)
+        return rs_scoop_eof(job) ? RS_INPUT_ENDED : RS_BLOCKED;
+    if ((result =
+         rs_signature_index_load(job->signature, job->index_buf,
+                                 job->index_len, free)) != RS_DONE)
+        return result;
+    /* The signature owns the buffer now. */
+    job->index_buf = NULL;
+    job->stats.sig_blocks = job->signature->count;
+    job->stats.block_len = job->signature->block_len;
+    return RS_DONE;
+}
+
+static rs_result rs_loadsig_s_indexhdr(rs_job_t *job)
+{
+    rs_byte_t hdr[RS_SIG_INDEX_HEADER_LEN];
+    void *buf;
+    rs_result result;
+
+    if ((result =
+         rs_scoop_read(job, RS_SIG_INDEX_HEADER_LEN - 4, &buf)) != RS_DONE)
+        return result;
+    memcpy(hdr, "rs\x01I", 4);
+    memcpy(hdr + 4, buf, RS_SIG_INDEX_HEADER_LEN - 4);
+    if ((result = rs_signature_index_len(hdr, &job->index_len)) != RS_DONE)
+        return result;
+    if (!(job->index_buf = malloc(job->index_len))) {
+        rs_error("can't allocate " FMT_SIZE " bytes for indexed signature",
+                 job->index_len);
+        return RS_MEM_ERROR;
+    }
+    memcpy(job->index_buf, hdr, RS_SIG_INDEX_HEADER_LEN);
+    job->index_pos = RS_SIG_INDEX_HEADER_LEN;
+    job->statefn = rs_loadsig_s_index;
+    return RS_RUNNING;
+}
+
 static rs_result rs_loadsig_s_magic(rs_job_t *job)
 {
     int l;
@@ -126,6 +206,10 @@ static rs_result rs_loadsig_s_magic(rs_job_t *job)
     if ((result = rs_suck_n4(job, &l)) != RS_DONE)
         return result;
     rs_trace("got signature magic %#x", l);
+    if (l == RS_INDEX_SIG_MAGIC) {
+        job->statefn = rs_loadsig_s_indexhdr;
+        return RS_RUNNING;
+    }
     job->sig_magic = l;
     job->statefn = rs_loadsig_s_blocklen;
     return RS_RUNNING;
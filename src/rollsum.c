@@ -19,7 +19,10 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
+#include <stdint.h>
 #include "rollsum.h"
+#include "cpu.h"
+#include "hashtable.h"
 
 #define DO1(buf,i)  {s1 += buf[i]; s2 += s1;}
 #define DO2(buf,i)  DO1(buf,i); DO1(buf,i+1);
@@ -27,6 +30,281 @@
 #define DO8(buf,i)  DO4(buf,i); DO4(buf,i+4);
 #define DO16(buf)   DO8(buf,0); DO8(buf,8);
 
+#ifdef RS_SIMD_X86
+/* SIMD kernels for the raw s1 and s2 sums.
+
+   For a chunk of L bytes b[0..L-1], s2 += L*s1 + sum((L-i)*b[i]) and s1 +=
+   sum(b[i]). The chunk is processed in vectors of W bytes, accumulating the
+   byte sums of each vector with sad, the weighted sums with W..1 weights
+   using maddubs, and the sum of the previous vectors' byte sums, which gives
+   the W*(number of following vectors) part of each byte's weight. Chunks are
+   limited to ROLLSUM_SIMD_CHUNK bytes so these fit in 32 bit lanes, and then
+   added into s1 and s2 with the same wraparound as the scalar code. */
+
+/** The max number of bytes summed in 32 bit lanes before adding to s1/s2. */
+#  define ROLLSUM_SIMD_CHUNK 4096
+
+/** Add a chunk's sums to s1 and s2.
+ *
+ * \param len - the length of the chunk.
+ *
+ * \param w - the vector width in bytes.
+ *
+ * \param vs1 - the sum of the bytes.
+ *
+ * \param vps - the sum of the preceding vector byte sums for each vector.
+ *
+ * \param vs2 - the sum of the bytes weighted by W..1 in each vector. */
+static inline void RollsumAddChunk(uint_fast16_t *s1, uint_fast16_t *s2,
+                                   size_t len, size_t w, uint32_t vs1,
+                                   uint32_t vps, uint32_t vs2)
+{
+    *s2 += (uint64_t)len * *s1 + (uint64_t)w * vps + vs2;
+    *s1 += vs1;
+}
+
+RS_TARGET("sse4.1")
+static inline uint32_t RollsumHsum_sse41(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+/** Sum 16 bytes at a time using SSE4.1. */
+RS_TARGET("sse4.1")
+static size_t RollsumUpdate_sse41(uint_fast16_t *s1, uint_fast16_t *s2,
+                                  const unsigned char *buf, size_t len)
+{
+    const __m128i w = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6,
+                                    5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+    size_t done = 0, n, i;
+
+    while (len - done >= 16) {
+        __m128i vs1 = zero, vps = zero, vs2 = zero, v;
+
+        n = (len - done) / 16;
+        if (n > ROLLSUM_SIMD_CHUNK / 16)
+            n = ROLLSUM_SIMD_CHUNK / 16;
+        for (i = 0; i < n; i++) {
+            v = _mm_loadu_si128((const __m128i *)(buf + done + 16 * i));
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+            vs2 = _mm_add_epi32(vs2,
+                                _mm_madd_epi16(_mm_maddubs_epi16(v, w), ones));
+        }
+        RollsumAddChunk(s1, s2, 16 * n, 16, RollsumHsum_sse41(vs1),
+                        RollsumHsum_sse41(vps), RollsumHsum_sse41(vs2));
+        done += 16 * n;
+    }
+    return done;
+}
+
+RS_TARGET("avx2")
+static inline uint32_t RollsumHsum_avx2(__m256i v)
+{
+    return RollsumHsum_sse41(_mm_add_epi32(_mm256_castsi256_si128(v),
+                                           _mm256_extracti128_si256(v, 1)));
+}
+
+/** Sum 32 bytes at a time using AVX2. */
+RS_TARGET("avx2")
+static size_t RollsumUpdate_avx2(uint_fast16_t *s1, uint_fast16_t *s2,
+                                 const unsigned char *buf, size_t len)
+{
+    const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23,
+                                       22, 21, 20, 19, 18, 17, 16, 15, 14, 13,
+                                       12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+    size_t done = 0, n, i;
+
+    while (len - done >= 32) {
+        __m256i vs1 = zero, vps = zero, vs2 = zero, v;
+
+        n = (len - done) / 32;
+        if (n > ROLLSUM_SIMD_CHUNK / 32)
+            n = ROLLSUM_SIMD_CHUNK / 32;
+        for (i = 0; i < n; i++) {
+            v = _mm256_loadu_si256((const __m256i *)(buf + done + 32 * i));
+            vps = _mm256_add_epi32(vps, vs1);
+            vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+            vs2 = _mm256_add_epi32(vs2,
+                                   _mm256_madd_epi16(_mm256_maddubs_epi16
+                                                     (v, w), ones));
+        }
+        RollsumAddChunk(s1, s2, 32 * n, 32, RollsumHsum_avx2(vs1),
+                        RollsumHsum_avx2(vps), RollsumHsum_avx2(vs2));
+        done += 32 * n;
+    }
+    return done;
+}
+
+/* This adds the lanes as unsigned instead of using _mm512_reduce_add_epi32(),
+   which does signed adds of sums that are meant to wrap. */
+RS_TARGET("avx512f")
+static inline uint32_t RollsumHsum_avx512(__m512i v)
+{
+    return RollsumHsum_avx2(_mm256_add_epi32(_mm512_castsi512_si256(v),
+                                             _mm512_extracti64x4_epi64(v, 1)));
+}
+
+/** Sum 64 bytes at a time using AVX-512. */
+RS_TARGET("avx512f,avx512bw")
+static size_t RollsumUpdate_avx512(uint_fast16_t *s1, uint_fast16_t *s2,
+                                   const unsigned char *buf, size_t len)
+{
+    const __m512i w = _mm512_set_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                      13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
+                                      23, 24, 25, 26, 27, 28, 29, 30, 31, 32,
+                                      33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
+                                      43, 44, 45, 46, 47, 48, 49, 50, 51, 52,
+                                      53, 54, 55, 56, 57, 58, 59, 60, 61, 62,
+                                      63, 64);
+    const __m512i ones = _mm512_set1_epi16(1), zero = _mm512_setzero_si512();
+    size_t done = 0, n, i;
+
+    while (len - done >= 64) {
+        __m512i vs1 = zero, vps = zero, vs2 = zero, v;
+
+        n = (len - done) / 64;
+        if (n > ROLLSUM_SIMD_CHUNK / 64)
+            n = ROLLSUM_SIMD_CHUNK / 64;
+        for (i = 0; i < n; i++) {
+            v = _mm512_loadu_si512((const void *)(buf + done + 64 * i));
+            vps = _mm512_add_epi32(vps, vs1);
+            vs1 = _mm512_add_epi32(vs1, _mm512_sad_epu8(v, zero));
+            vs2 = _mm512_add_epi32(vs2,
+                                   _mm512_madd_epi16(_mm512_maddubs_epi16
+                                                     (v, w), ones));
+        }
+        RollsumAddChunk(s1, s2, 64 * n, 64,
+                        RollsumHsum_avx512(vs1), RollsumHsum_avx512(vps),
+                        RollsumHsum_avx512(vs2));
+        done += 64 * n;
+    }
+    return done;
+}
+
+/** The max number of rotations done in 32 bit lanes before updating the
+ * full width sum state. */
+#  define ROLLSUM_ROTATE_CHUNK 256
+
+/** Vector mix32() of 8 lanes. */
+RS_TARGET("avx2")
+static inline __m256i RollsumMix32_avx2(__m256i h)
+{
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x85ebca6b));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0xc2b2ae35));
+    return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+/** Vector inclusive prefix sum of 8 lanes. */
+RS_TARGET("avx2")
+static inline __m256i RollsumPrefix_avx2(__m256i x)
+{
+    x = _mm256_add_epi32(x, RS_MM256_SLLI_LANES(x, 1));
+    x = _mm256_add_epi32(x, RS_MM256_SLLI_LANES(x, 2));
+    return _mm256_add_epi32(x, RS_MM256_SLLI_LANES(x, 4));
+}
+
+/** Rotate 8 offsets at a time using AVX2.
+ *
+ * For rotations k = 0..7 from the state s1, s2 at the start of a vector, with
+ * d[k] = in[k] - out[k] and its inclusive prefix sum p[k], the s1 before
+ * rotation k is s1 + p[k] - d[k]. Each rotation adds e[k] = s1 + p[k] -
+ * count*(out[k] + ROLLSUM_CHAR_OFFSET) to s2, so with its prefix sum q[k] the
+ * s2 before rotation k is s2 + q[k] - e[k]. These are only calculated in 32
+ * bit lanes, which is enough for the digests. After each chunk of rotations
+ * the full width s1 and s2 are updated from the exact changes, which are
+ * recovered from the 32 bit lanes where they are small enough. */
+RS_TARGET("avx2")
+static size_t RollsumRotateN_avx2(Rollsum *sum, const unsigned char *buf,
+                                  size_t n, uint32_t *digests)
+{
+    const size_t count = sum->count;
+    const __m256i c = _mm256_set1_epi32((int)count);
+    const __m256i coff = _mm256_set1_epi32((int)(count * ROLLSUM_CHAR_OFFSET));
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    __m256i s1, s2, o, d, p, e, q, osum, dig;
+    uint_fast16_t ds2;
+    size_t done = 0, m, k;
+    int32_t dq;
+
+    while (n - done >= 8) {
+        m = (n - done) & ~(size_t)7;
+        if (m > ROLLSUM_ROTATE_CHUNK)
+            m = ROLLSUM_ROTATE_CHUNK;
+        s1 = _mm256_set1_epi32((int)sum->s1);
+        s2 = _mm256_set1_epi32((int)sum->s2);
+        osum = _mm256_setzero_si256();
+        for (k = done; k < done + m; k += 8) {
+            o = _mm256_cvtepu8_epi32(_mm_loadl_epi64
+                                     ((const __m128i *)(buf + k)));
+            d = _mm256_sub_epi32(_mm256_cvtepu8_epi32
+                                 (_mm_loadl_epi64
+                                  ((const __m128i *)(buf + k + count))), o);
+            p = RollsumPrefix_avx2(d);
+            e = _mm256_sub_epi32(_mm256_add_epi32(s1, p),
+                                 _mm256_add_epi32(_mm256_mullo_epi32(c, o),
+                                                  coff));
+            q = RollsumPrefix_avx2(e);
+            dig = _mm256_or_si256(_mm256_slli_epi32
+                                  (_mm256_sub_epi32
+                                   (_mm256_add_epi32(s2, q), e), 16),
+                                  _mm256_and_si256(_mm256_sub_epi32
+                                                   (_mm256_add_epi32(s1, p),
+                                                    d), low));
+            _mm256_storeu_si256((__m256i *)(digests + k),
+                                RollsumMix32_avx2(dig));
+            s1 = _mm256_add_epi32(s1, RS_MM256_BCAST_TOP(p));
+            s2 = _mm256_add_epi32(s2, RS_MM256_BCAST_TOP(q));
+            osum = _mm256_add_epi32(osum, o);
+        }
+        /* Update the full width state from the exact changes. The change in
+           s1 is sum(d), and the change in s2 is m*s1 - count*(sum(out) +
+           m*ROLLSUM_CHAR_OFFSET) + sum(p), where sum(d) and sum(p) fit in
+           an int32_t. */
+        ds2 = (uint_fast16_t)(m * sum->s1 -
+                              count * (RollsumHsum_avx2(osum) +
+                                       m * ROLLSUM_CHAR_OFFSET));
+        dq = (int32_t)((uint32_t)_mm256_cvtsi256_si32(s2) -
+                       (uint32_t)sum->s2 - (uint32_t)ds2);
+        sum->s1 += (int32_t)((uint32_t)_mm256_cvtsi256_si32(s1) -
+                             (uint32_t)sum->s1);
+        sum->s2 += ds2 + dq;
+        done += m;
+    }
+    return done;
+}
+
+static const rs_rollsum_impl_t rs_rollsum_sse41 =
+    { "sse4.1", RollsumUpdate_sse41, NULL };
+static const rs_rollsum_impl_t rs_rollsum_avx2 =
+    { "avx2", RollsumUpdate_avx2, RollsumRotateN_avx2 };
+static const rs_rollsum_impl_t rs_rollsum_avx512 =
+    { "avx512", RollsumUpdate_avx512, RollsumRotateN_avx2 };
+#endif                          /* RS_SIMD_X86 */
+
+static const rs_rollsum_impl_t rs_rollsum_scalar = { "scalar", NULL, NULL };
+
+rs_rollsum_impl_t const *rs_rollsum_select(rs_cpu_level_t level)
+{
+#ifdef RS_SIMD_X86
+    if (level >= RS_CPU_AVX512)
+        return &rs_rollsum_avx512;
+    if (level >= RS_CPU_AVX2)
+        return &rs_rollsum_avx2;
+    if (level >= RS_CPU_SSE41)
+        return &rs_rollsum_sse41;
+#else
+    (void)level;
+#endif
+    return &rs_rollsum_scalar;
+}
+
 void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len)
 {
     /* ANSI C says no overflow for unsigned. zlib's adler32 goes to extra
@@ -34,7 +312,13 @@ void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len)
     size_t n = len;
     uint_fast16_t s1 = sum->s1;
     uint_fast16_t s2 = sum->s2;
+    rs_rollsum_impl_t const *impl = rs_cpu()->rollsum;
 
+    if (impl->fn) {
+        size_t done = impl->fn(&s1, &s2, buf, n);
+        buf += done;
+        n -= done;
+    }
     while (n >= 16) {
         DO16(buf);
         buf += 16;
@@ -52,3 +336,17 @@ void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len)
     sum->s1 = s1;
     sum->s2 = s2;
 }
+
+void RollsumRotateN(Rollsum *sum, const unsigned char *buf, size_t n,
+                    uint32_t *digests)
+{
+    rs_rollsum_impl_t const *impl = rs_cpu()->rollsum;
+    size_t k = 0;
+
+    if (impl->rotate_n)
+        k = impl->rotate_n(sum, buf, n, digests);
+    for (; k < n; k++) {
+        digests[k] = mix32(RollsumDigest(sum));
+        RollsumRotate(sum, buf[k], buf[k + sum->count]);
+    }
+}
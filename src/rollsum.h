@@ -27,6 +27,7 @@
 
 #  include <stddef.h>
 #  include <stdint.h>
+#  include "simd.h"
 
 /* We should make this something other than zero to improve the checksum
    algorithm: tridge suggests a prime number. */
@@ -41,6 +42,41 @@ typedef struct Rollsum {
 
 void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len);
 
+/** Rotate a Rollsum through n bytes, getting the digest before each rotation.
+ *
+ * This sets digests[k] to the mix32() of RollsumDigest() used for matching,
+ * and then does RollsumRotate(sum, buf[k], buf[k + sum->count]), for each k
+ * in [0,n).
+ *
+ * \param buf - the bytes currently in the sum, followed by at least n more. */
+void RollsumRotateN(Rollsum *sum, const unsigned char *buf, size_t n,
+                    uint32_t *digests);
+
+/** Function type for a SIMD RollsumUpdate() kernel.
+ *
+ * It adds as many bytes of \p buf as it can efficiently to the raw \p s1 and
+ * \p s2 sums, without the ROLLSUM_CHAR_OFFSET, and returns the number of
+ * bytes added. */
+typedef size_t rs_rollsum_fn(uint_fast16_t *s1, uint_fast16_t *s2,
+                             const unsigned char *buf, size_t len);
+
+/** Function type for a SIMD RollsumRotateN() kernel.
+ *
+ * It does as many of the \p n rotations as it can efficiently, and returns
+ * the number done. */
+typedef size_t rs_rollsum_rotate_fn(Rollsum *sum, const unsigned char *buf,
+                                    size_t n, uint32_t *digests);
+
+/** A RollsumUpdate() and RollsumRotateN() implementation. */
+typedef struct rs_rollsum_impl {
+    char const *name;           /**< The name reported by rs_cpu_features(). */
+    rs_rollsum_fn *fn;          /**< The update kernel, or NULL for scalar. */
+    rs_rollsum_rotate_fn *rotate_n;     /**< The rotate kernel or NULL. */
+} rs_rollsum_impl_t;
+
+/** Get the best RollsumUpdate() implementation for a cpu level. */
+rs_rollsum_impl_t const *rs_rollsum_select(rs_cpu_level_t level);
+
 /* static inline implementations of simple routines */
 
 static inline void RollsumInit(Rollsum *sum)
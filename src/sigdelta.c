@@ -0,0 +1,415 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+                              /*=
+                               | What has been is what will be,
+                               | and what has been done is what will
+                               | be done.
+                               */
+
+/** \file sigdelta.c
+ * Generate a new file's signature from the old signature and a delta.
+ *
+ * A delta describes the new file as a sequence of COPY commands from the basis
+ * and LITERAL data. A block of the new file that lies entirely inside one COPY
+ * starting on a block boundary in the basis has exactly the same data as that
+ * basis block, so its sums can be taken straight from the old signature. Only
+ * the other blocks, covering literal data, misaligned copies or the boundaries
+ * between commands, are read back from the new file and hashed. COPY_OUTPUT
+ * and FILL commands in format 2 deltas are treated like literal data, since
+ * the data they make isn't in the basis.
+ *
+ * The delta is parsed one command at a time. Each command's data is an extent
+ * of the new file, and once an extent has been parsed the sums of all the
+ * blocks that end inside it are sent before parsing the next command. Runs of
+ * blocks that need hashing are read and hashed as a batch. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "librsync.h"
+#include "job.h"
+#include "sumset.h"
+#include "netint.h"
+#include "scoop.h"
+#include "command.h"
+#include "prototab.h"
+#include "trace.h"
+#include "util.h"
+
+static rs_result rs_sigdelta_s_cmdbyte(rs_job_t *);
+static rs_result rs_sigdelta_s_params(rs_job_t *);
+static rs_result rs_sigdelta_s_run(rs_job_t *);
+static rs_result rs_sigdelta_s_literal(rs_job_t *);
+static rs_result rs_sigdelta_s_blocks(rs_job_t *);
+static rs_result rs_sigdelta_s_batch(rs_job_t *);
+static rs_result rs_sigdelta_s_end(rs_job_t *);
+
+/** Write out the checksums for a block. */
+static void rs_sigdelta_send_sum(rs_job_t *job, rs_weak_sum_t weak_sum,
+                                 rs_strong_sum_t *strong_sum)
+{
+    rs_squirt_n4(job, weak_sum);
+    rs_tube_write(job, strong_sum, job->signature->strong_sum_len);
+    job->stats.sig_blocks++;
+}
+
+/** Get the old signature block with the same data as a new block.
+ *
+ * \param pos - the position of a whole new block in the current extent.
+ *
+ * \return The index of the old block, or -1 if there isn't one. */
+static rs_long_t rs_sigdelta_old_block(rs_job_t *job, rs_long_t pos)
+{
+    rs_signature_t const *sig = job->signature;
+    rs_long_t old_pos;
+
+    /* Literals have basis_pos -1, and blocks starting before the extent
+       include data from the previous command. */
+    if (job->basis_pos < 0 || pos < job->new_pos)
+        return -1;
+    old_pos = job->basis_pos + (pos - job->new_pos);
+    if (old_pos % sig->block_len || old_pos / sig->block_len >= sig->count)
+        return -1;
+    return old_pos / sig->block_len;
+}
+
+/** Read part of the new file into the block buffer. */
+static rs_result rs_sigdelta_read(rs_job_t *job, rs_long_t pos, size_t len)
+{
+    rs_byte_t *buf = job->block_buf;
+    rs_result result;
+    size_t got;
+    void *ptr;
+
+    while (len) {
+        got = len;
+        ptr = buf;
+        result = (job->copy_cb) (job->copy_arg, pos, &got, &ptr);
+        if (result != RS_DONE) {
+            rs_trace("new file callback returned %s", rs_strerror(result));
+            return result;
+        }
+        if (!got || got > len) {
+            rs_error("new file callback returned " FMT_SIZE " bytes at "
+                     FMT_LONG " when " FMT_SIZE " were requested", got, pos,
+                     len);
+            return RS_IO_ERROR;
+        }
+        if (ptr != buf)
+            memcpy(buf, ptr, got);
+        buf += got;
+        pos += (rs_long_t)got;
+        len -= got;
+    }
+    return RS_DONE;
+}
+
+/** Read and hash a run of \p n whole new blocks starting at sig_pos.
+ *
+ * The sums are stored in the job's sig_batch, to be sent by
+ * rs_sigdelta_s_batch(). */
+static rs_result rs_sigdelta_do_batch(rs_job_t *job, int n)
+{
+    rs_signature_t const *sig = job->signature;
+    size_t len = (size_t)sig->block_len;
+    void const *bufs[RS_SIG_BATCH_BLOCKS];
+    rs_strong_sum_t *sums[RS_SIG_BATCH_BLOCKS];
+    rs_result result;
+    int i;
+
+    rs_trace("hash %d blocks at " FMT_LONG, n, job->sig_pos);
+    if ((result = rs_sigdelta_read(job, job->sig_pos, n * len)) != RS_DONE)
+        return result;
+    for (i = 0; i < n; i++) {
+        bufs[i] = job->block_buf + i * len;
+        sums[i] = &job->sig_batch[i].strong_sum;
+        job->sig_batch[i].weak_sum =
+            rs_signature_calc_weak_sum(sig, bufs[i], len);
+    }
+    rs_signature_calc_strong_sums(sig, bufs, len, n, sums);
+    job->sig_pos += n * (rs_long_t)len;
+    job->sig_batch_len = n;
+    job->sig_batch_pos = 0;
+    job->statefn = rs_sigdelta_s_batch;
+    return RS_RUNNING;
+}
+
+/** State of sending the sums for a batch of hashed blocks. */
+static rs_result rs_sigdelta_s_batch(rs_job_t *job)
+{
+    rs_block_sig_t *sum = &job->sig_batch[job->sig_batch_pos++];
+
+    /* The tube only has room for one block's sums at a time. */
+    rs_sigdelta_send_sum(job, sum->weak_sum, &sum->strong_sum);
+    if (job->sig_batch_pos == job->sig_batch_len)
+        job->statefn = rs_sigdelta_s_blocks;
+    return RS_RUNNING;
+}
+
+/** State of sending the sums for the blocks that end in the current extent. */
+static rs_result rs_sigdelta_s_blocks(rs_job_t *job)
+{
+    rs_signature_t *sig = job->signature;
+    rs_long_t block_len = sig->block_len;
+    rs_long_t end = job->new_pos + job->basis_len;
+    rs_strong_sum_t *strong_sum;
+    rs_weak_sum_t weak_sum;
+    rs_long_t i;
+    int n;
+
+    if (job->sig_pos + block_len > end) {
+        /* No more whole blocks end in this extent. */
+        job->new_pos = end;
+        job->statefn = rs_sigdelta_s_cmdbyte;
+        return RS_RUNNING;
+    }
+    if ((i = rs_sigdelta_old_block(job, job->sig_pos)) >= 0) {
+        weak_sum = rs_signature_get_block(sig, i, &strong_sum);
+        rs_sigdelta_send_sum(job, weak_sum, strong_sum);
+        job->sig_pos += block_len;
+        job->sig_reused++;
+        return RS_RUNNING;
+    }
+    /* Hash the run of blocks up to the next one we can reuse. */
+    for (n = 1; n < RS_SIG_BATCH_BLOCKS; n++)
+        if (job->sig_pos + (n + 1) * block_len > end
+            || rs_sigdelta_old_block(job, job->sig_pos + n * block_len) >= 0)
+            break;
+    return rs_sigdelta_do_batch(job, n);
+}
+
+/** State of sending the sums for the last short block after the END
+ * command. */
+static rs_result rs_sigdelta_s_end(rs_job_t *job)
+{
+    rs_signature_t const *sig = job->signature;
+    size_t len = (size_t)(job->new_pos - job->sig_pos);
+    rs_weak_sum_t weak_sum;
+    rs_strong_sum_t strong_sum;
+    rs_result result;
+
+    if (len) {
+        assert(len < (size_t)sig->block_len);
+        if ((result = rs_sigdelta_read(job, job->sig_pos, len)) != RS_DONE)
+            return result;
+        weak_sum = rs_signature_calc_weak_sum(sig, job->block_buf, len);
+        rs_signature_calc_strong_sum(sig, job->block_buf, len, &strong_sum);
+        rs_sigdelta_send_sum(job, weak_sum, &strong_sum);
+        job->sig_pos = job->new_pos;
+        return RS_RUNNING;
+    }
+    rs_trace("reused " FMT_LONG " of " FMT_LONG " block sums", job->sig_reused,
+             job->stats.sig_blocks);
+    return RS_DONE;
+}
+
+/** State of skipping over literal data in the delta. */
+static rs_result rs_sigdelta_s_literal(rs_job_t *job)
+{
+    size_t len = rs_scoop_len(job);
+
+    if ((rs_long_t)len > job->param1)
+        len = (size_t)job->param1;
+    if (!len)
+        return rs_scoop_eof(job) ? RS_INPUT_ENDED : RS_BLOCKED;
+    rs_scoop_advance(job, len);
+    job->param1 -= (rs_long_t)len;
+    if (!job->param1)
+        job->statefn = rs_sigdelta_s_blocks;
+    return RS_RUNNING;
+}
+
+/** State of trying to read the first byte of a command. */
+static rs_result rs_sigdelta_s_cmdbyte(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_byte(job, &job->op)) != RS_DONE)
+        return result;
+    job->cmd = &rs_prototab[job->op];
+    rs_trace("got command %#04x (%s), len_1=%d, len_2=%d", job->op,
+             rs_op_kind_name(job->cmd->kind), job->cmd->len_1, job->cmd->len_2);
+    if (job->cmd->len_1)
+        job->statefn = rs_sigdelta_s_params;
+    else {
+        job->param1 = job->cmd->immediate;
+        job->statefn = rs_sigdelta_s_run;
+    }
+    return RS_RUNNING;
+}
+
+/** State of reading the parameters of a command. */
+static rs_result rs_sigdelta_s_params(rs_job_t *job)
+{
+    rs_result result;
+    const size_t len = (size_t)(job->cmd->len_1 + job->cmd->len_2);
+    void *p;
+
+    assert(len);
+    result = rs_scoop_readahead(job, len, &p);
+    if (result != RS_DONE)
+        return result;
+    result = rs_suck_netint(job, &job->param1, job->cmd->len_1);
+    assert(result == RS_DONE);
+    if (job->cmd->len_2) {
+        result = rs_suck_netint(job, &job->param2, job->cmd->len_2);
+        assert(result == RS_DONE);
+    }
+    job->statefn = rs_sigdelta_s_run;
+    return RS_RUNNING;
+}
+
+/** State of setting up the extent of the new file for a whole command. */
+static rs_result rs_sigdelta_s_run(rs_job_t *job)
+{
+    rs_stats_t *stats = &job->stats;
+
+    switch (job->cmd->kind) {
+    case RS_KIND_LITERAL:
+        rs_trace("LITERAL(length=" FMT_LONG ")", job->param1);
+        if (job->param1 <= 0) {
+            rs_error("invalid length=" FMT_LONG " on LITERAL command",
+                     job->param1);
+            return RS_CORRUPT;
+        }
+        stats->lit_cmds++;
+        stats->lit_bytes += job->param1;
+        stats->lit_cmdbytes += 1 + job->cmd->len_1;
+        job->basis_pos = -1;
+        job->basis_len = job->param1;
+        job->statefn = rs_sigdelta_s_literal;
+        return RS_RUNNING;
+    case RS_KIND_COPY:
+        rs_trace("COPY(position=" FMT_LONG ", length=" FMT_LONG ")",
+                 job->param1, job->param2);
+        if (job->param2 <= 0 || job->param1 < 0) {
+            rs_error("invalid position=" FMT_LONG " length=" FMT_LONG
+                     " on COPY command", job->param1, job->param2);
+            return RS_CORRUPT;
+        }
+        stats->copy_cmds++;
+        stats->copy_bytes += job->param2;
+        stats->copy_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+        job->basis_pos = job->param1;
+        job->basis_len = job->param2;
+        job->statefn = rs_sigdelta_s_blocks;
+        return RS_RUNNING;
+    case RS_KIND_COPY_OUTPUT:
+        rs_trace("COPY_OUTPUT(position=" FMT_LONG ", length=" FMT_LONG ")",
+                 job->param1, job->param2);
+        if (job->param2 <= 0 || job->param1 < 0
+            || job->param1 >= job->new_pos) {
+            rs_error("invalid position=" FMT_LONG " length=" FMT_LONG
+                     " on COPY_OUTPUT command", job->param1, job->param2);
+            return RS_CORRUPT;
+        }
+        job->xstats.output_cmds++;
+        job->xstats.output_bytes += job->param2;
+        job->xstats.output_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+        job->basis_pos = -1;
+        job->basis_len = job->param2;
+        job->statefn = rs_sigdelta_s_blocks;
+        return RS_RUNNING;
+    case RS_KIND_FILL:
+        rs_trace("FILL(byte=" FMT_LONG ", length=" FMT_LONG ")", job->param1,
+                 job->param2);
+        if (job->param2 <= 0) {
+            rs_error("invalid length=" FMT_LONG " on FILL command",
+                     job->param2);
+            return RS_CORRUPT;
+        }
+        job->xstats.fill_cmds++;
+        job->xstats.fill_bytes += job->param2;
+        job->xstats.fill_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+        job->basis_pos = -1;
+        job->basis_len = job->param2;
+        job->statefn = rs_sigdelta_s_blocks;
+        return RS_RUNNING;
+    case RS_KIND_END:
+        job->statefn = rs_sigdelta_s_end;
+        return RS_RUNNING;
+    default:
+        rs_error("bogus command %#04x", job->op);
+        return RS_CORRUPT;
+    }
+}
+
+/** State of skipping the output window of a format 2 delta. */
+static rs_result rs_sigdelta_s_window(rs_job_t *job)
+{
+    rs_result result;
+    int window;
+
+    if ((result = rs_suck_n4(job, &window)) != RS_DONE)
+        return result;
+    rs_trace("got output window %d", window);
+    job->statefn = rs_sigdelta_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+/** State of reading the delta header and sending the signature header. */
+static rs_result rs_sigdelta_s_header(rs_job_t *job)
+{
+    rs_signature_t const *sig = job->signature;
+    rs_result result;
+    int v;
+
+    /* The chunks of the new file can't be taken from the delta. */
+    if (sig->offsets) {
+        rs_error("can't make a signature from a delta for a chunked signature");
+        return RS_UNIMPLEMENTED;
+    }
+    if ((result = rs_suck_n4(job, &v)) != RS_DONE)
+        return result;
+    if (v != RS_DELTA_MAGIC && v != RS_DELTA2_MAGIC) {
+        rs_error("got magic number %#x rather than expected value %#x", v,
+                 RS_DELTA_MAGIC);
+        return RS_BAD_MAGIC;
+    }
+    rs_squirt_n4(job, sig->magic);
+    rs_squirt_n4(job, sig->block_len);
+    rs_squirt_n4(job, sig->strong_sum_len);
+    rs_trace("sent header (magic %#x, block len = %d, strong sum len = %d)",
+             sig->magic, sig->block_len, sig->strong_sum_len);
+    job->stats.block_len = sig->block_len;
+    job->statefn =
+        v == RS_DELTA2_MAGIC ? rs_sigdelta_s_window : rs_sigdelta_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+rs_job_t *rs_sig_from_delta_begin(rs_signature_t *old_sig, rs_copy_cb * new_cb,
+                                  void *new_arg)
+{
+    rs_job_t *job;
+
+    rs_signature_check(old_sig);
+    job = rs_job_new("resignature", rs_sigdelta_s_header);
+    job->signature = old_sig;
+    job->copy_cb = new_cb;
+    job->copy_arg = new_arg;
+    job->sig_batch =
+        rs_alloc(RS_SIG_BATCH_BLOCKS * sizeof(rs_block_sig_t),
+                 "signature batch");
+    job->block_buf =
+        rs_alloc(RS_SIG_BATCH_BLOCKS * (size_t)old_sig->block_len,
+                 "signature block buffer");
+    return job;
+}
@@ -0,0 +1,66 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file simd.h
+ * Portability macros for compiling SIMD checksum kernels.
+ *
+ * The library as a whole is compiled for the baseline instruction set. Kernels
+ * using later x86 extensions are compiled with per-function target attributes
+ * using RS_TARGET(), and must only be called after checking at runtime that
+ * the CPU supports them.
+ *
+ * RS_SIMD_X86 is only defined for compilers that support this, currently gcc
+ * and clang on x86 and x86_64. Elsewhere only the portable scalar kernels are
+ * compiled.
+ *
+ * Each kernel module provides a function that selects its best implementation
+ * for a given rs_cpu_level_t, which is used by the dispatch table in cpu.c. */
+#ifndef SIMD_H
+#  define SIMD_H
+
+#  if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#    define RS_SIMD_X86 1
+#    include <immintrin.h>
+/** Compile a function for the given target instruction set. */
+#    define RS_TARGET(isa) __attribute__((target(isa)))
+/** Shift the 32 bit lanes of an AVX2 vector up by 1, 2 or 4 lanes.
+ *
+ * Zeros are shifted into the low lanes. This can only be used in functions
+ * compiled for "avx2". */
+#    define RS_MM256_SLLI_LANES(x, n) ((n) == 4 ?\
+    _mm256_permute2x128_si256(x, x, 0x08) :\
+    _mm256_alignr_epi8(x, _mm256_permute2x128_si256(x, x, 0x08), 16 - 4 * (n)))
+/** Broadcast the top 32 bit lane of an AVX2 vector to all lanes. */
+#    define RS_MM256_BCAST_TOP(x)\
+    _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7))
+#  endif
+
+/** Instruction set levels that kernels can be selected for.
+ *
+ * Each level includes all the levels before it. */
+typedef enum rs_cpu_level {
+    RS_CPU_SCALAR = 0,          /**< Portable C only. */
+    RS_CPU_SSE2,                /**< SSE2. */
+    RS_CPU_SSE41,               /**< SSE4.1 and SSSE3. */
+    RS_CPU_AVX2,                /**< AVX2. */
+    RS_CPU_AVX512,              /**< AVX-512 F and BW. */
+} rs_cpu_level_t;
+
+#endif                          /* !SIMD_H */
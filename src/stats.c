@@ -88,3 +88,43 @@ char *rs_format_stats(rs_stats_t const *stats, char *buf, size_t size)
              mb_in, mb_in / sec, mb_out, mb_out / sec, sec);
     return buf;
 }
+
+int rs_log_xstats(rs_xstats_t const *xstats)
+{
+    char buf[1000];
+
+    rs_format_xstats(xstats, buf, sizeof buf - 1);
+    if (*buf)
+        rs_log(RS_LOG_INFO | RS_LOG_NONAME, "%s", buf);
+    return 0;
+}
+
+char *rs_format_xstats(rs_xstats_t const *xstats, char *buf, size_t size)
+{
+    int len = 0;
+
+    *buf = '\0';
+    if (xstats->output_cmds) {
+        len +=
+            snprintf(buf + len, size - (size_t)len,
+                     "copy-output[" FMT_LONG " cmds, " FMT_LONG " bytes, "
+                     FMT_LONG " cmdbytes] ", xstats->output_cmds,
+                     xstats->output_bytes, xstats->output_cmdbytes);
+    }
+
+    if (xstats->fill_cmds) {
+        len +=
+            snprintf(buf + len, size - (size_t)len,
+                     "fill[" FMT_LONG " cmds, " FMT_LONG " bytes, " FMT_LONG
+                     " cmdbytes] ", xstats->fill_cmds, xstats->fill_bytes,
+                     xstats->fill_cmdbytes);
+    }
+
+    if (xstats->skip_bytes) {
+        len +=
+            snprintf(buf + len, size - (size_t)len,
+                     "scan[" FMT_LONG " bytes, " FMT_LONG " skipped] ",
+                     xstats->scan_bytes, xstats->skip_bytes);
+    }
+    return buf;
+}
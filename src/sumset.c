@@ -20,12 +20,17 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "librsync.h"
 #include "sumset.h"
+#include "pool.h"
 #include "trace.h"
 #include "util.h"
+#include "librsync_export.h"
 
 static void rs_block_sig_init(rs_block_sig_t *sig, rs_weak_sum_t weak_sum,
                               rs_strong_sum_t *strong_sum, int strong_len)
@@ -59,9 +64,100 @@ static void rs_block_match_init(rs_block_match_t *match, rs_signature_t *sig,
     match->len = len;
 }
 
+/* Get the weak sum of the block with index block_idx. */
+static inline rs_weak_sum_t rs_block_sig_weak(const rs_signature_t *sig,
+                                              rs_long_t block_idx)
+{
+    return sig->weak_sums[block_idx];
+}
+
+/* Get the pointer to the strong sum of the block with index block_idx. */
+static inline rs_strong_sum_t *rs_block_sig_strong(const rs_signature_t *sig,
+                                                   rs_long_t block_idx)
+{
+    return (rs_strong_sum_t *)(sig->strong_sums +
+                               (size_t)block_idx * (size_t)sig->strong_sum_len);
+}
+
+/* Initialize a match for adding the block with index block_idx to the
+   hashtable. The blocks of a local signature are compared by their data, and
+   the blocks of a chunked signature by their length too. */
+static inline void rs_block_match_init_block(rs_block_match_t *match,
+                                             rs_signature_t *sig,
+                                             rs_long_t block_idx)
+{
+    rs_long_t pos, len;
+
+    if (sig->basis) {
+        pos = block_idx * sig->block_len;
+        len = sig->basis_len - pos < sig->block_len ?
+            sig->basis_len - pos : sig->block_len;
+        rs_block_match_init(match, sig, rs_block_sig_weak(sig, block_idx),
+                            NULL, (rs_byte_t const *)sig->basis + pos,
+                            (size_t)len);
+    } else {
+        len = sig->offsets ?
+            sig->offsets[block_idx + 1] - sig->offsets[block_idx] : 0;
+        rs_block_match_init(match, sig, rs_block_sig_weak(sig, block_idx),
+                            rs_block_sig_strong(sig, block_idx), NULL,
+                            (size_t)len);
+    }
+}
+
+/* Allocate or reallocate the block sums for sig->size blocks. */
+static void rs_block_sigs_alloc(rs_signature_t *sig)
+{
+    if ((rs_long_t)(size_t)sig->size != sig->size
+        || (size_t)sig->size > SIZE_MAX / RS_MAX_STRONG_SUM_LENGTH)
+        rs_fatal("can't allocate " FMT_LONG " block sums", sig->size);
+    sig->weak_sums =
+        rs_realloc(sig->weak_sums, (size_t)sig->size * sizeof(rs_weak_sum_t),
+                   "signature->weak_sums");
+    sig->strong_sums =
+        rs_realloc(sig->strong_sums,
+                   (size_t)sig->size * (size_t)sig->strong_sum_len,
+                   "signature->strong_sums");
+    if (rs_sig_magic_chunked(sig->magic))
+        sig->offsets =
+            rs_realloc(sig->offsets, ((size_t)sig->size + 1) *
+                       sizeof(rs_long_t), "signature->offsets");
+}
+
+/* Compare a match to the block with index block_idx in a local signature.
+
+   The match data is compared with the basis data of the block, which can be
+   longer than the match for the last short block of the new data. */
+static inline int rs_block_match_data(rs_block_match_t *match,
+                                      rs_long_t block_idx)
+{
+    rs_signature_t const *sig = match->signature;
+    rs_long_t const pos = block_idx * sig->block_len;
+
+    if ((rs_long_t)match->len > sig->basis_len - pos)
+        return 1;
+    return memcmp(match->buf, (rs_byte_t const *)sig->basis + pos, match->len);
+}
+
+/* Compare a match to the block with index block_idx.
+
+   The hashtable only keeps 8 bits of each block's weak sum, so this checks
+   the whole weak sum before calculating and comparing the strong sum. */
 static inline int rs_block_match_cmp(rs_block_match_t *match,
-                                     const rs_block_sig_t *block_sig)
+                                     rs_long_t block_idx)
 {
+    /* Don't trust the indexes in a loaded index to be in range. */
+    if ((uint64_t)block_idx >= (uint64_t)match->signature->count)
+        return 1;
+    if (match->block_sig.weak_sum !=
+        rs_block_sig_weak(match->signature, block_idx))
+        return 1;
+    if (match->signature->basis)
+        return rs_block_match_data(match, block_idx);
+    if (match->signature->offsets
+        && (rs_long_t)match->len !=
+        match->signature->offsets[block_idx + 1] -
+        match->signature->offsets[block_idx])
+        return 1;
     /* If buf is not NULL, the strong sum is yet to be calculated. */
     if (match->buf) {
 #ifndef HASHTABLE_NSTATS
@@ -71,44 +167,27 @@ static inline int rs_block_match_cmp(rs_block_match_t *match,
                                      &(match->block_sig.strong_sum));
         match->buf = NULL;
     }
-    return memcmp(&match->block_sig.strong_sum, &block_sig->strong_sum,
+    return memcmp(&match->block_sig.strong_sum,
+                  rs_block_sig_strong(match->signature, block_idx),
                   (size_t)match->signature->strong_sum_len);
 }
 
+/** Bloom filter bits per block for rs_build_hash_table(). */
+LIBRSYNC_EXPORT int rs_bloom_bits = HASHTABLE_BLOOM_BITS;
+
 /* Disable mix32() in the hashtable because RabinKarp doesn't need it. We
    manually apply mix32() to rollsums before using them in the hashtable. */
 #define HASHTABLE_NMIX32
+/* Index the blocks by their index in the signature instead of pointers to
+   make the hashtable less than half the size. Building with -DHASHTABLE_GROUP
+   switches it to group probing. */
+#define HASHTABLE_INDEX
 /* Instantiate hashtable for rs_block_sig and rs_block_match. */
 #define ENTRY rs_block_sig
 #define MATCH rs_block_match
 #define NAME hashtable
 #include "hashtable.h"
 
-/* Get the size of a packed rs_block_sig_t. */
-static inline size_t rs_block_sig_size(const rs_signature_t *sig)
-{
-    /* Round up to multiple of sizeof(weak_sum) to align memory correctly. */
-    const size_t mask = sizeof(rs_weak_sum_t)- 1;
-    return (offsetof(rs_block_sig_t, strong_sum) +
-            (((size_t)sig->strong_sum_len + mask) & ~mask));
-}
-
-/* Get the pointer to the block_sig_t from a block index. */
-static inline rs_block_sig_t *rs_block_sig_ptr(const rs_signature_t *sig,
-                                               int block_idx)
-{
-    return (rs_block_sig_t *)((char *)sig->block_sigs +
-                               block_idx * rs_block_sig_size(sig));
-}
-
-/* Get the index of a block from a block_sig_t pointer. */
-static inline int rs_block_sig_idx(const rs_signature_t *sig,
-                                   rs_block_sig_t *block_sig)
-{
-    return (int)(((char *)block_sig -
-                  (char *)sig->block_sigs) / rs_block_sig_size(sig));
-}
-
 rs_result rs_sig_args(rs_long_t old_fsize, rs_magic_number * magic,
                       size_t *block_len, size_t *strong_len)
 {
@@ -123,12 +202,17 @@ rs_result rs_sig_args(rs_long_t old_fsize, rs_magic_number * magic,
     switch (*magic) {
     case RS_BLAKE2_SIG_MAGIC:
     case RS_RK_BLAKE2_SIG_MAGIC:
+    case RS_CDC_BLAKE2_SIG_MAGIC:
         max_strong_len = RS_BLAKE2_SUM_LENGTH;
         break;
     case RS_MD4_SIG_MAGIC:
     case RS_RK_MD4_SIG_MAGIC:
         max_strong_len = RS_MD4_SUM_LENGTH;
         break;
+    case RS_RK_XXH3_SIG_MAGIC:
+    case RS_CDC_XXH3_SIG_MAGIC:
+        max_strong_len = RS_XXH3_SUM_LENGTH;
+        break;
     default:
         rs_error("invalid magic %#x", *magic);
         return RS_BAD_MAGIC;
@@ -194,18 +278,88 @@ rs_result rs_signature_init(rs_signature_t *sig, rs_magic_number magic,
     sig->strong_sum_len = (int)strong_len;
     sig->count = 0;
     /* Calculate the number of blocks if we have the signature file size. */
-    /* Magic+header is 12 bytes, each block thereafter is 4 bytes
-       weak_sum+strong_sum_len bytes */
-    sig->size = (int)(sig_fsize < 12 ? 0 : (sig_fsize - 12) / (4 + strong_len));
-    if (sig->size)
-        sig->block_sigs =
-            rs_alloc(sig->size * rs_block_sig_size(sig),
-                     "signature->block_sigs");
-    else
-        sig->block_sigs = NULL;
+    /* Magic+header is 12 bytes, each block thereafter is 4 bytes weak_sum, 4
+       bytes length for a chunked signature, and strong_sum_len bytes */
+    sig->size =
+        sig_fsize < 12 ? 0 : (sig_fsize - 12) /
+        (rs_long_t)((rs_sig_magic_chunked(magic) ? 8 : 4) + strong_len);
+    sig->weak_sums = NULL;
+    sig->strong_sums = NULL;
+    sig->offsets = NULL;
+    if (sig->size || rs_sig_magic_chunked(magic))
+        rs_block_sigs_alloc(sig);
+    if (sig->offsets)
+        sig->offsets[0] = 0;
     sig->hashtable = NULL;
+    sig->hashed = 0;
+    sig->mem = NULL;
+    sig->mem_free = NULL;
+    sig->basis = NULL;
+    sig->basis_len = 0;
 #ifndef HASHTABLE_NSTATS
     sig->calc_strong_count = 0;
+    sig->predict_count = 0;
+    sig->predict_match_count = 0;
+    sig->build_time = 0;
+#endif
+    rs_signature_check(sig);
+    return RS_DONE;
+}
+
+/** The smallest recommended block length for a local signature. */
+#define RS_LOCAL_BLOCK_LEN 64
+
+/** The most blocks in a local signature with the recommended block length.
+ *
+ * This limits the weak sums and hashtable to about 11 bytes per block, or
+ * 200MB for big files. */
+#define RS_LOCAL_MAX_BLOCKS ((rs_long_t)1 << 24)
+
+rs_result rs_signature_init_local(rs_signature_t *sig, void const *basis,
+                                  rs_long_t len, size_t block_len)
+{
+    rs_byte_t const *p = basis;
+    rs_long_t i;
+    size_t n;
+
+    if (!block_len)
+        for (block_len = RS_LOCAL_BLOCK_LEN;
+             len / (rs_long_t)block_len > RS_LOCAL_MAX_BLOCKS; block_len *= 2) ;
+    if (block_len > INT_MAX) {
+        rs_error("invalid block_len=" FMT_SIZE, block_len);
+        return RS_PARAM_ERROR;
+    }
+    /* Local signatures use RabinKarp weak sums and don't have strong sums. */
+    sig->magic = RS_RK_BLAKE2_SIG_MAGIC;
+    sig->block_len = (int)block_len;
+    sig->strong_sum_len = 1;
+    sig->count = sig->size = (len + (rs_long_t)block_len - 1) /
+        (rs_long_t)block_len;
+    if ((rs_long_t)(size_t)sig->size != sig->size
+        || (size_t)sig->size > SIZE_MAX / sizeof(rs_weak_sum_t))
+        rs_fatal("can't allocate " FMT_LONG " block sums", sig->size);
+    sig->weak_sums = sig->size ?
+        rs_alloc((size_t)sig->size * sizeof(rs_weak_sum_t),
+                 "signature->weak_sums") : NULL;
+    for (i = 0; i < sig->count; i++) {
+        n = len - i * (rs_long_t)block_len < (rs_long_t)block_len ?
+            (size_t)(len - i * (rs_long_t)block_len) : block_len;
+        sig->weak_sums[i] =
+            rs_signature_calc_weak_sum(sig, p + i * (rs_long_t)block_len, n);
+    }
+    sig->strong_sums = NULL;
+    sig->offsets = NULL;
+    sig->hashtable = NULL;
+    sig->hashed = 0;
+    sig->mem = NULL;
+    sig->mem_free = NULL;
+    sig->basis = basis;
+    sig->basis_len = len;
+#ifndef HASHTABLE_NSTATS
+    sig->calc_strong_count = 0;
+    sig->predict_count = 0;
+    sig->predict_match_count = 0;
+    sig->build_time = 0;
 #endif
     rs_signature_check(sig);
     return RS_DONE;
@@ -213,45 +367,235 @@ rs_result rs_signature_init(rs_signature_t *sig, rs_magic_number magic,
 
 void rs_signature_done(rs_signature_t *sig)
 {
-    hashtable_free(sig->hashtable);
-    free(sig->block_sigs);
+    if (sig->mem) {
+        /* The tables are in the loaded index. */
+        free(sig->hashtable);
+        if (sig->mem_free)
+            sig->mem_free(sig->mem);
+    } else {
+        hashtable_free(sig->hashtable);
+        free(sig->weak_sums);
+        free(sig->strong_sums);
+        free(sig->offsets);
+    }
     rs_bzero(sig, sizeof(*sig));
 }
 
-rs_block_sig_t *rs_signature_add_block(rs_signature_t *sig,
-                                       rs_weak_sum_t weak_sum,
-                                       rs_strong_sum_t *strong_sum)
+void rs_signature_add_block(rs_signature_t *sig, rs_weak_sum_t weak_sum,
+                            rs_strong_sum_t *strong_sum)
 {
     rs_signature_check(sig);
+    /* Signatures loaded from an index are read-only. */
+    assert(!sig->mem);
     /* Apply mix32() to rollsum weaksums to improve their distribution. */
     if (rs_signature_weaksum_kind(sig) == RS_ROLLSUM)
         weak_sum = mix32(weak_sum);
-    /* If block_sigs is full, allocate more space. */
+    /* If the block sums are full, allocate more space. */
     if (sig->count == sig->size) {
+        /* Drop any hashtable built for the old size, so that
+           rs_build_hash_table() makes a bigger one. */
+        hashtable_free(sig->hashtable);
+        sig->hashtable = NULL;
+        sig->hashed = 0;
         sig->size = sig->size ? sig->size * 2 : 16;
-        sig->block_sigs =
-            rs_realloc(sig->block_sigs, sig->size * rs_block_sig_size(sig),
-                       "signature->block_sigs");
+        rs_block_sigs_alloc(sig);
     }
-    rs_block_sig_t *b = rs_block_sig_ptr(sig, sig->count++);
-    rs_block_sig_init(b, weak_sum, strong_sum, sig->strong_sum_len);
-    return b;
+    sig->weak_sums[sig->count] = weak_sum;
+    memcpy(rs_block_sig_strong(sig, sig->count), strong_sum,
+           (size_t)sig->strong_sum_len);
+    /* Blocks added without a length to a chunked signature are whole. */
+    if (sig->offsets)
+        sig->offsets[sig->count + 1] =
+            sig->offsets[sig->count] + sig->block_len;
+    sig->count++;
+}
+
+void rs_signature_add_chunk(rs_signature_t *sig, rs_weak_sum_t weak_sum,
+                            rs_strong_sum_t *strong_sum, size_t len)
+{
+    assert(sig->offsets);
+    rs_signature_add_block(sig, weak_sum, strong_sum);
+    sig->offsets[sig->count] = sig->offsets[sig->count - 1] + (rs_long_t)len;
+}
+
+rs_weak_sum_t rs_signature_get_block(rs_signature_t *sig, rs_long_t i,
+                                     rs_strong_sum_t **strong_sum)
+{
+    assert(0 <= i && i < sig->count);
+    *strong_sum = rs_block_sig_strong(sig, i);
+    if (rs_signature_weaksum_kind(sig) == RS_ROLLSUM)
+        return unmix32(rs_block_sig_weak(sig, i));
+    return rs_block_sig_weak(sig, i);
 }
 
 rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum,
                                   void const *buf, size_t len)
 {
     rs_block_match_t m;
-    rs_block_sig_t *b;
+    int64_t b;
 
     rs_signature_check(sig);
     rs_block_match_init(&m, sig, weak_sum, NULL, buf, len);
-    if ((b = hashtable_find(sig->hashtable, &m))) {
-        return (rs_long_t)rs_block_sig_idx(sig, b) * sig->block_len;
+    if ((b = hashtable_find(sig->hashtable, &m)) >= 0) {
+        return rs_signature_block_pos(sig, b);
     }
     return -1;
 }
 
+int rs_signature_match_at(rs_signature_t *sig, rs_long_t pos,
+                          rs_weak_sum_t weak_sum, void const *buf, size_t len)
+{
+    rs_block_match_t m;
+
+    rs_signature_check(sig);
+    /* Chunked signatures are only matched a chunk at a time. */
+    if (sig->offsets || pos < 0 || pos % sig->block_len)
+        return 0;
+#ifndef HASHTABLE_NSTATS
+    sig->predict_count++;
+#endif
+    rs_block_match_init(&m, sig, weak_sum, NULL, buf, len);
+    if (rs_block_match_cmp(&m, pos / sig->block_len))
+        return 0;
+#ifndef HASHTABLE_NSTATS
+    sig->predict_match_count++;
+#endif
+    return 1;
+}
+
+/** Min hashtable size to use hashtable_find_batch() for.
+ *
+ * Smaller tables stay in cache, so prefetching doesn't gain enough to pay for
+ * setting up the batches. */
+#define RS_FIND_BATCH_MIN_SIZE (1 << 18)
+
+size_t rs_signature_find_matches(rs_signature_t *sig,
+                                 rs_weak_sum_t const *weak_sums, size_t n,
+                                 void const *buf, size_t len,
+                                 rs_long_t *match_pos)
+{
+    rs_block_match_t m[HASHTABLE_BATCH];
+    int64_t b = -1;
+    size_t i, j, k;
+
+    rs_signature_check(sig);
+    if (sig->hashtable->size < RS_FIND_BATCH_MIN_SIZE) {
+        for (i = 0; i < n; i++) {
+            rs_block_match_init(&m[0], sig, weak_sums[i], NULL,
+                                (const char *)buf + i, len);
+            if ((b = hashtable_find(sig->hashtable, &m[0])) >= 0) {
+                *match_pos = rs_signature_block_pos(sig, b);
+                return i;
+            }
+        }
+        return n;
+    }
+    for (i = 0; i < n; i += k) {
+        k = n - i < HASHTABLE_BATCH ? n - i : HASHTABLE_BATCH;
+        for (j = 0; j < k; j++)
+            rs_block_match_init(&m[j], sig, weak_sums[i + j], NULL,
+                                (const char *)buf + i + j, len);
+        if ((j = (size_t)hashtable_find_batch(sig->hashtable, m, (int)k, &b))
+            < k) {
+            *match_pos = rs_signature_block_pos(sig, b);
+            return i + j;
+        }
+    }
+    return n;
+}
+
+/** Initialize a match for a block filled with \p byte in buf. */
+static void rs_fill_match_init(rs_block_match_t *match, rs_signature_t *sig,
+                               int byte, rs_byte_t *buf)
+{
+    weaksum_t sum;
+
+    memset(buf, byte, (size_t)sig->block_len);
+    weaksum_init(&sum, rs_signature_weaksum_kind(sig));
+    weaksum_update(&sum, buf, (size_t)sig->block_len);
+    rs_block_match_init(match, sig, weaksum_digest(&sum), NULL, buf,
+                        (size_t)sig->block_len);
+}
+
+rs_long_t rs_signature_find_fill(rs_signature_t *sig, int byte,
+                                 rs_long_t *len)
+{
+    rs_byte_t *buf;
+    rs_block_match_t m;
+    rs_long_t i, start = 0, pos = -1;
+
+    rs_signature_check(sig);
+    *len = 0;
+    if (sig->offsets)
+        return -1;
+    buf = rs_alloc((size_t)sig->block_len, "fill block");
+    rs_fill_match_init(&m, sig, byte, buf);
+    /* Only the weak sums are compared until one matches, so this is fast. */
+    for (i = 0; i < sig->count; i++) {
+        if (rs_block_match_cmp(&m, i)) {
+            start = i + 1;
+        } else if ((i + 1 - start) * sig->block_len > *len) {
+            pos = start * sig->block_len;
+            *len = (i + 1 - start) * sig->block_len;
+        }
+    }
+    free(buf);
+    rs_trace("found " FMT_LONG " byte run of %#04x at " FMT_LONG, *len, byte,
+             pos);
+    return pos;
+}
+
+rs_long_t rs_signature_fill_len(rs_signature_t *sig, int byte, rs_long_t pos,
+                                rs_long_t max_len)
+{
+    rs_byte_t *buf;
+    rs_block_match_t m;
+    rs_long_t i, len = 0;
+
+    rs_signature_check(sig);
+    if (sig->offsets || pos < 0 || pos % sig->block_len)
+        return 0;
+    buf = rs_alloc((size_t)sig->block_len, "fill block");
+    rs_fill_match_init(&m, sig, byte, buf);
+    for (i = pos / sig->block_len; len < max_len && !rs_block_match_cmp(&m, i);
+         i++)
+        len += sig->block_len;
+    free(buf);
+    return len;
+}
+
+void rs_signature_fork(rs_signature_t const *sig, rs_signature_t *copy,
+                       hashtable_t *table)
+{
+    rs_signature_check(sig);
+    assert(sig->hashtable);
+    *table = *sig->hashtable;
+    hashtable_stats_init(table);
+    *copy = *sig;
+    copy->hashtable = table;
+#ifndef HASHTABLE_NSTATS
+    copy->calc_strong_count = 0;
+    copy->predict_count = 0;
+    copy->predict_match_count = 0;
+#endif
+}
+
+void rs_signature_join(rs_signature_t *sig, rs_signature_t const *copy)
+{
+#ifndef HASHTABLE_NSTATS
+    hashtable_t *t = sig->hashtable;
+    hashtable_t const *c = copy->hashtable;
+
+    t->find_count += c->find_count;
+    t->match_count += c->match_count;
+    t->hashcmp_count += c->hashcmp_count;
+    t->entrycmp_count += c->entrycmp_count;
+    sig->calc_strong_count += copy->calc_strong_count;
+    sig->predict_count += copy->predict_count;
+    sig->predict_match_count += copy->predict_match_count;
+#endif
+}
+
 void rs_signature_log_stats(rs_signature_t const *sig)
 {
 #ifndef HASHTABLE_NSTATS
@@ -260,33 +604,463 @@ void rs_signature_log_stats(rs_signature_t const *sig)
     rs_log(RS_LOG_INFO | RS_LOG_NONAME,
            "match statistics: signature[%ld searches, %ld (%.3f%%) matches, "
            "%ld (%.3fx) weak sum compares, %ld (%.3f%%) strong sum compares, "
-           "%ld (%.3f%%) strong sum calcs]", t->find_count, t->match_count,
+           "%ld (%.3f%%) strong sum calcs, %ld of %ld predicted blocks "
+           "matched, %.3fs hashtable build]",
+           t->find_count, t->match_count,
            100.0 * (double)t->match_count / (double)t->find_count,
            t->hashcmp_count, (double)t->hashcmp_count / (double)t->find_count,
            t->entrycmp_count,
            100.0 * (double)t->entrycmp_count / (double)t->find_count,
            sig->calc_strong_count,
-           100.0 * (double)sig->calc_strong_count / (double)t->find_count);
+           100.0 * (double)sig->calc_strong_count /
+           (double)(t->find_count + sig->predict_count),
+           sig->predict_match_count, sig->predict_count,
+           sig->build_time);
 #endif
 }
 
-rs_result rs_build_hash_table(rs_signature_t *sig)
+/** Min number of blocks to build the hashtable with several threads for.
+ *
+ * Smaller signatures build quickly, so starting threads isn't worth it. */
+#define RS_BUILD_PAR_MIN (1 << 16)
+
+/* Add blocks [sig->hashed, sig->count) to the hashtable one at a time. */
+static void rs_build_hash_serial(rs_signature_t *sig)
+{
+    rs_block_match_t m[HASHTABLE_BATCH];
+    rs_long_t i;
+    int j, k;
+
+    for (i = sig->hashed; i < sig->count; i += k) {
+        k = sig->count - i < HASHTABLE_BATCH ? (int)(sig->count - i) :
+            HASHTABLE_BATCH;
+        /* Prefetch the buckets for a batch of blocks before adding them, so
+           their cache misses overlap. */
+        for (j = 0; j < k; j++) {
+            rs_block_match_init_block(&m[j], sig, i + j);
+            hashtable_prefetch_key(sig->hashtable, &m[j]);
+        }
+        for (j = 0; j < k; j++)
+            hashtable_find_add(sig->hashtable, &m[j], i + j);
+    }
+}
+
+/* The shared state for building a hashtable with several threads. */
+typedef struct rs_build_par {
+    rs_signature_t *sig;
+    int parts;                  /**< The number of parts. */
+    size_t *added;              /**< The number of blocks each part added. */
+    rs_long_t **deferred;       /**< The blocks each part couldn't add. */
+    size_t *deferred_count;     /**< The number of deferred blocks. */
+} rs_build_par_t;
+
+/* Add the blocks with hashes for part i of the buckets and bloom filter.
+
+   Each part scans all the new blocks, setting the bloom filter bits in its
+   range of bloom filter blocks, and adding the blocks that start probing in
+   its range of buckets. Blocks that would probe outside the range are
+   deferred to be added afterwards. Duplicate blocks have the same hash so
+   they are always in the same part, and a duplicate of a deferred block is
+   always deferred too. */
+static void rs_build_hash_part(void *arg, int i)
+{
+    rs_build_par_t *par = arg;
+    rs_signature_t *sig = par->sig;
+    hashtable_t *t = sig->hashtable;
+    /* Parts of the table are whole groups for group mode. */
+    size_t const g = t->size / (size_t)par->parts;
+    size_t const lo = g * (size_t)i;
+    size_t const hi = i == par->parts - 1 ? t->size : lo + g;
+    size_t deferred_size = 0;
+    rs_block_match_t m;
+    rs_long_t j;
+    int64_t k;
+#ifndef HASHTABLE_NBLOOM
+    unsigned const blo = (unsigned)((uint64_t)t->bcount * i / par->parts);
+    unsigned const bhi = (unsigned)((uint64_t)t->bcount * (i + 1) / par->parts);
+    unsigned bi;
+#endif
+
+    par->added[i] = par->deferred_count[i] = 0;
+    par->deferred[i] = NULL;
+    for (j = sig->hashed; j < sig->count; j++) {
+        rs_block_match_init_block(&m, sig, j);
+#ifndef HASHTABLE_NBLOOM
+        if (t->kbloom) {
+            bi = hashtable_bloomindex(t, hashtable_hash(&m));
+            if (blo <= bi && bi < bhi)
+                hashtable_setbloom(t, hashtable_hash(&m));
+        }
+#endif
+        if ((k = hashtable_probe(t, &m, lo, hi)) == -1)
+            continue;
+        if (k == -2) {
+            if (par->deferred_count[i] == deferred_size) {
+                deferred_size = deferred_size ? deferred_size * 2 : 64;
+                par->deferred[i] =
+                    rs_realloc(par->deferred[i],
+                               deferred_size * sizeof(rs_long_t),
+                               "deferred blocks");
+            }
+            par->deferred[i][par->deferred_count[i]++] = j;
+        } else if (!t->ttable[k]) {
+            hashtable_fill(t, (size_t)k, &m, j);
+            par->added[i]++;
+        }
+    }
+}
+
+/* Add blocks [sig->hashed, sig->count) to the hashtable using a pool. */
+static void rs_build_hash_par(rs_signature_t *sig, int threads)
 {
+    hashtable_t *t = sig->hashtable;
+    rs_pool_t *pool = rs_pool_new(threads);
+    rs_build_par_t par;
     rs_block_match_t m;
-    rs_block_sig_t *b;
+    rs_long_t b;
+    size_t j, k;
     int i;
 
+    par.sig = sig;
+    /* Use a power of 2 number of parts of at least one group each, so that
+       no two parts write the control bytes of the same group. */
+    for (par.parts = 1; par.parts < rs_pool_threads(pool)
+         && t->size / (size_t)par.parts >= 2 * HASHTABLE_GROUP_SIZE;
+         par.parts <<= 1) ;
+    par.added = rs_alloc(par.parts * sizeof(size_t), "added counts");
+    par.deferred = rs_alloc(par.parts * sizeof(rs_long_t *), "deferred blocks");
+    par.deferred_count =
+        rs_alloc(par.parts * sizeof(size_t), "deferred counts");
+    rs_pool_run(pool, rs_build_hash_part, &par, par.parts);
+    rs_pool_free(pool);
+    /* Add the deferred blocks, which the bloom filter already has. */
+    for (i = 0; i < par.parts; i++) {
+        t->count += par.added[i];
+        for (j = 0; j < par.deferred_count[i]; j++) {
+            b = par.deferred[i][j];
+            rs_block_match_init_block(&m, sig, b);
+            k = (size_t)hashtable_probe(t, &m, 0, t->size);
+            if (!t->ttable[k]) {
+                hashtable_fill(t, k, &m, b);
+                t->count++;
+            }
+        }
+        free(par.deferred[i]);
+    }
+    rs_trace("built hashtable with %d parts", par.parts);
+    free(par.added);
+    free(par.deferred);
+    free(par.deferred_count);
+}
+
+rs_result rs_build_hash_table_par(rs_signature_t *sig, int threads)
+{
+#ifndef HASHTABLE_NSTATS
+    double start = rs_now();
+#endif
+
     rs_signature_check(sig);
-    sig->hashtable = hashtable_new(sig->count);
-    if (!sig->hashtable)
-        return RS_MEM_ERROR;
-    for (i = 0; i < sig->count; i++) {
-        b = rs_block_sig_ptr(sig, i);
-        rs_block_match_init(&m, sig, b->weak_sum, &b->strong_sum, NULL, 0);
-        if (!hashtable_find(sig->hashtable, &m))
-            hashtable_add(sig->hashtable, b);
+    if (!sig->hashtable) {
+        /* Make it big enough for all the allocated blocks, so blocks that are
+           still being loaded can be added later. */
+        sig->hashtable =
+            hashtable_new_bloom((size_t)(sig->size > sig->count ? sig->size :
+                                         sig->count), rs_bloom_bits);
+        if (!sig->hashtable)
+            return RS_MEM_ERROR;
+        sig->hashed = 0;
     }
+    if (threads > 1 && sig->count - sig->hashed >= RS_BUILD_PAR_MIN)
+        rs_build_hash_par(sig, threads);
+    else
+        rs_build_hash_serial(sig);
+    sig->hashed = sig->count;
     hashtable_stats_init(sig->hashtable);
+#ifndef HASHTABLE_NSTATS
+    sig->build_time += rs_now() - start;
+#endif
+    return RS_DONE;
+}
+
+rs_result rs_build_hash_table(rs_signature_t *sig)
+{
+    return rs_build_hash_table_par(sig, 1);
+}
+
+/* The hashtable mode flags of the index in an indexed signature. */
+#ifdef HASHTABLE_GROUP
+#  define RS_SIG_INDEX_MODE (HASHTABLE_MODE_INDEX | HASHTABLE_MODE_GROUP)
+#else
+#  define RS_SIG_INDEX_MODE HASHTABLE_MODE_INDEX
+#endif
+
+/* Byte order mark for the native byte order data in an indexed signature. */
+#define RS_SIG_INDEX_BOM 0x01020304
+
+/* The largest hashtable size in an indexed signature. With fewer blocks than
+   buckets the layout is less than 128 bytes per bucket, so this keeps every
+   product and offset in rs_sig_index_layout() within rs_long_t and size_t. */
+#define RS_SIG_INDEX_MAX_SIZE \
+    ((uint64_t)((uintmax_t)SIZE_MAX < INTMAX_MAX ? SIZE_MAX : INTMAX_MAX) / 128)
+
+/* Round up to the alignment of the parts of an indexed signature. */
+#define rs_sig_index_align(n) (((n) + 63) & ~(rs_long_t)63)
+
+/* Indexed signature header fields, as bigendian uint32s. */
+enum {
+    RS_SIG_INDEX_MAGIC_OFF,     /**< RS_INDEX_SIG_MAGIC. */
+    RS_SIG_INDEX_SIG_MAGIC_OFF, /**< The signature's magic. */
+    RS_SIG_INDEX_BLOCK_LEN_OFF, /**< The block length. */
+    RS_SIG_INDEX_STRONG_LEN_OFF,        /**< The strong sum length. */
+    RS_SIG_INDEX_COUNT_OFF,     /**< The number of blocks. */
+    RS_SIG_INDEX_SIZE_OFF,      /**< The number of hashtable buckets. */
+    RS_SIG_INDEX_BCOUNT_OFF,    /**< The number of bloom filter blocks. */
+    RS_SIG_INDEX_MODE_OFF,      /**< The hashtable mode flags. */
+    RS_SIG_INDEX_ENTRIES_OFF,   /**< The number of hashtable entries. */
+    RS_SIG_INDEX_BOM_OFF,       /**< RS_SIG_INDEX_BOM in native byte order. */
+    RS_SIG_INDEX_COUNT_HI_OFF,  /**< The high 32 bits of the count. */
+    RS_SIG_INDEX_SIZE_HI_OFF,   /**< The high 32 bits of the size. */
+    RS_SIG_INDEX_ENTRIES_HI_OFF /**< The high 32 bits of the entries. */
+};
+
+static uint32_t rs_sig_index_get(unsigned char const *hdr, int i)
+{
+    hdr += 4 * i;
+    return (uint32_t)hdr[0] << 24 | (uint32_t)hdr[1] << 16 |
+        (uint32_t)hdr[2] << 8 | hdr[3];
+}
+
+static void rs_sig_index_put(unsigned char *hdr, int i, uint32_t v)
+{
+    hdr += 4 * i;
+    hdr[0] = (unsigned char)(v >> 24);
+    hdr[1] = (unsigned char)(v >> 16);
+    hdr[2] = (unsigned char)(v >> 8);
+    hdr[3] = (unsigned char)v;
+}
+
+/* Get a 64 bit header field split into low and high uint32 fields. */
+static uint64_t rs_sig_index_get64(unsigned char const *hdr, int lo, int hi)
+{
+    return (uint64_t)rs_sig_index_get(hdr, hi) << 32 |
+        rs_sig_index_get(hdr, lo);
+}
+
+static void rs_sig_index_put64(unsigned char *hdr, int lo, int hi, uint64_t v)
+{
+    rs_sig_index_put(hdr, lo, (uint32_t)v);
+    rs_sig_index_put(hdr, hi, (uint32_t)(v >> 32));
+}
+
+/* Get the offsets of the parts of an indexed signature and its length. The
+   weak sums start right after the header. */
+static rs_long_t rs_sig_index_layout(rs_long_t count, rs_long_t strong_len,
+                                     rs_long_t bcount, rs_long_t size,
+                                     int mode, rs_long_t *strong_off,
+                                     rs_long_t *bloom_off,
+                                     rs_long_t *ttable_off,
+                                     rs_long_t *itable_off)
+{
+    *strong_off = rs_sig_index_align(RS_SIG_INDEX_HEADER_LEN +
+                                     count * (rs_long_t)sizeof(rs_weak_sum_t));
+    *bloom_off = rs_sig_index_align(*strong_off + count * strong_len);
+    *ttable_off = rs_sig_index_align(*bloom_off + bcount * 8 * 4);
+    *itable_off = rs_sig_index_align(*ttable_off + size);
+    return *itable_off + size * (mode & HASHTABLE_MODE_WIDE ? 8 : 4);
+}
+
+rs_result rs_signature_index_len(void const *header, size_t *len)
+{
+    unsigned char const *hdr = header;
+    rs_long_t strong_len = rs_sig_index_get(hdr, RS_SIG_INDEX_STRONG_LEN_OFF);
+    uint64_t count = rs_sig_index_get64(hdr, RS_SIG_INDEX_COUNT_OFF,
+                                        RS_SIG_INDEX_COUNT_HI_OFF);
+    uint64_t size = rs_sig_index_get64(hdr, RS_SIG_INDEX_SIZE_OFF,
+                                       RS_SIG_INDEX_SIZE_HI_OFF);
+    uint64_t entries = rs_sig_index_get64(hdr, RS_SIG_INDEX_ENTRIES_OFF,
+                                          RS_SIG_INDEX_ENTRIES_HI_OFF);
+    rs_long_t bcount = rs_sig_index_get(hdr, RS_SIG_INDEX_BCOUNT_OFF);
+    int mode = (int)rs_sig_index_get(hdr, RS_SIG_INDEX_MODE_OFF);
+    uint32_t bom;
+    rs_long_t strong_off, bloom_off, ttable_off, itable_off, total;
+
+    if (rs_sig_index_get(hdr, RS_SIG_INDEX_MAGIC_OFF) != RS_INDEX_SIG_MAGIC) {
+        rs_error("not an indexed signature");
+        return RS_BAD_MAGIC;
+    }
+    memcpy(&bom, hdr + 4 * RS_SIG_INDEX_BOM_OFF, sizeof(bom));
+    if (bom != RS_SIG_INDEX_BOM) {
+        rs_error("indexed signature has the wrong byte order");
+        return RS_UNIMPLEMENTED;
+    }
+    if ((mode & ~HASHTABLE_MODE_WIDE) != RS_SIG_INDEX_MODE) {
+        rs_error("indexed signature has an unsupported index type");
+        return RS_UNIMPLEMENTED;
+    }
+    /* The hashtable must be a power of 2 with at least one empty bucket, and
+       only needs 64 bit indexes for more than 2^32 blocks. */
+    if (strong_len > RS_MAX_STRONG_SUM_LENGTH || size < 2 || (size & (size - 1))
+        || entries >= size || count >= size || (uint64_t)bcount > size
+        || (!(mode & HASHTABLE_MODE_WIDE) && count > (uint64_t)1 << 32)) {
+        rs_error("indexed signature header is corrupt");
+        return RS_CORRUPT;
+    }
+    /* Check the size before computing the layout so it can't overflow. */
+    if (size > RS_SIG_INDEX_MAX_SIZE) {
+        rs_error("indexed signature is too big");
+        return RS_MEM_ERROR;
+    }
+    total = rs_sig_index_layout((rs_long_t)count, strong_len, bcount,
+                                (rs_long_t)size, mode, &strong_off, &bloom_off,
+                                &ttable_off, &itable_off);
+    *len = (size_t)total;
+    return RS_DONE;
+}
+
+rs_result rs_signature_index_load(rs_signature_t *sig, void *data, size_t len,
+                                  void (*mem_free)(void *))
+{
+    unsigned char *hdr = data;
+    rs_magic_number magic;
+    size_t block_len, strong_len, total;
+    rs_long_t strong_off, bloom_off, ttable_off, itable_off;
+    hashtable_t *t;
+    int mode;
+    rs_result result;
+
+    if (len < RS_SIG_INDEX_HEADER_LEN) {
+        rs_error("indexed signature is truncated");
+        return RS_INPUT_ENDED;
+    }
+    if ((result = rs_signature_index_len(hdr, &total)) != RS_DONE)
+        return result;
+    if (len < total) {
+        rs_error("indexed signature is truncated");
+        return RS_INPUT_ENDED;
+    }
+    magic = (rs_magic_number)rs_sig_index_get(hdr, RS_SIG_INDEX_SIG_MAGIC_OFF);
+    block_len = rs_sig_index_get(hdr, RS_SIG_INDEX_BLOCK_LEN_OFF);
+    strong_len = rs_sig_index_get(hdr, RS_SIG_INDEX_STRONG_LEN_OFF);
+    if (!magic || block_len < 1 || block_len > INT_MAX || strong_len < 1) {
+        rs_error("indexed signature header is corrupt");
+        return RS_CORRUPT;
+    }
+    if ((result = rs_sig_args(-1, &magic, &block_len, &strong_len)) != RS_DONE)
+        return result;
+    if (rs_sig_magic_chunked(magic)) {
+        rs_error("indexed chunked signatures are not supported");
+        return RS_UNIMPLEMENTED;
+    }
+    if (!(t = rs_alloc_struct(hashtable_t)))
+        return RS_MEM_ERROR;
+    sig->magic = magic;
+    sig->block_len = (int)block_len;
+    sig->strong_sum_len = (int)strong_len;
+    sig->count = sig->size = sig->hashed =
+        (rs_long_t)rs_sig_index_get64(hdr, RS_SIG_INDEX_COUNT_OFF,
+                                      RS_SIG_INDEX_COUNT_HI_OFF);
+    t->size = (size_t)rs_sig_index_get64(hdr, RS_SIG_INDEX_SIZE_OFF,
+                                         RS_SIG_INDEX_SIZE_HI_OFF);
+    t->count = (size_t)rs_sig_index_get64(hdr, RS_SIG_INDEX_ENTRIES_OFF,
+                                          RS_SIG_INDEX_ENTRIES_HI_OFF);
+    t->tmask = t->size - 1;
+    mode = (int)rs_sig_index_get(hdr, RS_SIG_INDEX_MODE_OFF);
+    rs_sig_index_layout(sig->count, sig->strong_sum_len,
+                        rs_sig_index_get(hdr, RS_SIG_INDEX_BCOUNT_OFF),
+                        (rs_long_t)t->size, mode, &strong_off, &bloom_off,
+                        &ttable_off, &itable_off);
+#ifndef HASHTABLE_NBLOOM
+    t->bcount = rs_sig_index_get(hdr, RS_SIG_INDEX_BCOUNT_OFF);
+    t->kbloom = t->bcount ? (uint32_t *)(hdr + bloom_off) : NULL;
+#endif
+    t->ttable = hdr + ttable_off;
+    if (mode & HASHTABLE_MODE_WIDE)
+        t->itable64 = (uint64_t *)(hdr + itable_off);
+    else
+        t->itable = (uint32_t *)(hdr + itable_off);
+    sig->weak_sums = (rs_weak_sum_t *)(hdr + RS_SIG_INDEX_HEADER_LEN);
+    sig->strong_sums = hdr + strong_off;
+    sig->hashtable = t;
+    sig->mem = data;
+    sig->mem_free = mem_free;
+    sig->offsets = NULL;
+    sig->basis = NULL;
+    sig->basis_len = 0;
+#ifndef HASHTABLE_NSTATS
+    sig->calc_strong_count = 0;
+    sig->predict_count = 0;
+    sig->predict_match_count = 0;
+    sig->build_time = 0;
+#endif
+    rs_signature_check(sig);
+    return RS_DONE;
+}
+
+/* Write len bytes at p and zero padding to align the next part. */
+static int rs_sig_index_write(FILE *f, void const *p, rs_long_t len)
+{
+    static unsigned char const zeros[64] = { 0 };
+    size_t pad = (size_t)(rs_sig_index_align(len) - len);
+
+    return (!len || fwrite(p, (size_t)len, 1, f) == 1)
+        && (!pad || fwrite(zeros, pad, 1, f) == 1);
+}
+
+rs_result rs_signature_index_save(rs_signature_t *sig, FILE *f)
+{
+    unsigned char hdr[RS_SIG_INDEX_HEADER_LEN] = { 0 };
+    uint32_t const bom = RS_SIG_INDEX_BOM;
+    uint32_t *kbloom = NULL;
+    size_t bcount = 0;
+    hashtable_t *t;
+    rs_result result;
+
+    if (sig->basis) {
+        rs_error("can't save a local signature without strong sums");
+        return RS_PARAM_ERROR;
+    }
+    if (sig->offsets) {
+        rs_error("can't save a chunked signature as an indexed signature");
+        return RS_UNIMPLEMENTED;
+    }
+    if ((!sig->hashtable || sig->hashed < sig->count)
+        && (result = rs_build_hash_table(sig)) != RS_DONE)
+        return result;
+    t = sig->hashtable;
+#ifndef HASHTABLE_NBLOOM
+    if ((kbloom = t->kbloom))
+        bcount = t->bcount;
+#endif
+    rs_sig_index_put(hdr, RS_SIG_INDEX_MAGIC_OFF, RS_INDEX_SIG_MAGIC);
+    rs_sig_index_put(hdr, RS_SIG_INDEX_SIG_MAGIC_OFF, (uint32_t)sig->magic);
+    rs_sig_index_put(hdr, RS_SIG_INDEX_BLOCK_LEN_OFF, (uint32_t)sig->block_len);
+    rs_sig_index_put(hdr, RS_SIG_INDEX_STRONG_LEN_OFF,
+                     (uint32_t)sig->strong_sum_len);
+    rs_sig_index_put64(hdr, RS_SIG_INDEX_COUNT_OFF, RS_SIG_INDEX_COUNT_HI_OFF,
+                       (uint64_t)sig->count);
+    rs_sig_index_put64(hdr, RS_SIG_INDEX_SIZE_OFF, RS_SIG_INDEX_SIZE_HI_OFF,
+                       t->size);
+    rs_sig_index_put(hdr, RS_SIG_INDEX_BCOUNT_OFF, (uint32_t)bcount);
+    rs_sig_index_put(hdr, RS_SIG_INDEX_MODE_OFF, t->itable64 ?
+                     RS_SIG_INDEX_MODE | HASHTABLE_MODE_WIDE :
+                     RS_SIG_INDEX_MODE);
+    rs_sig_index_put64(hdr, RS_SIG_INDEX_ENTRIES_OFF,
+                       RS_SIG_INDEX_ENTRIES_HI_OFF, t->count);
+    memcpy(hdr + 4 * RS_SIG_INDEX_BOM_OFF, &bom, sizeof(bom));
+    if (!rs_sig_index_write(f, hdr, sizeof(hdr))
+        || !rs_sig_index_write(f, sig->weak_sums,
+                               (rs_long_t)sig->count *
+                               (rs_long_t)sizeof(rs_weak_sum_t))
+        || !rs_sig_index_write(f, sig->strong_sums,
+                               (rs_long_t)sig->count * sig->strong_sum_len)
+        || !rs_sig_index_write(f, kbloom, (rs_long_t)bcount * 8 * 4)
+        || !rs_sig_index_write(f, t->ttable, (rs_long_t)t->size)
+        || !rs_sig_index_write(f, t->itable64 ? (void *)t->itable64 :
+                               (void *)t->itable, (rs_long_t)t->size *
+                               (t->itable64 ? 8 : 4))) {
+        rs_error("error writing indexed signature: %s", strerror(errno));
+        return RS_IO_ERROR;
+    }
     return RS_DONE;
 }
 
@@ -298,19 +1072,19 @@ void rs_free_sumset(rs_signature_t *psums)
 
 void rs_sumset_dump(rs_signature_t const *sums)
 {
-    int i;
-    rs_block_sig_t *b;
+    rs_long_t i;
     char strong_hex[RS_MAX_STRONG_SUM_LENGTH * 3];
 
     rs_log(RS_LOG_INFO | RS_LOG_NONAME,
-           "sumset info: magic=%#x, block_len=%d, block_num=%d", sums->magic,
+           "sumset info: magic=%#x, block_len=%d, block_num=" FMT_LONG,
+           sums->magic,
            sums->block_len, sums->count);
 
     for (i = 0; i < sums->count; i++) {
-        b = rs_block_sig_ptr(sums, i);
-        rs_hexify(strong_hex, b->strong_sum, sums->strong_sum_len);
+        rs_hexify(strong_hex, rs_block_sig_strong(sums, i),
+                  sums->strong_sum_len);
         rs_log(RS_LOG_INFO | RS_LOG_NONAME,
-               "sum %6d: weak=" FMT_WEAKSUM ", strong=%s", i, b->weak_sum,
-               strong_hex);
+               "sum " FMT_LONG ": weak=" FMT_WEAKSUM ", strong=%s", i,
+               rs_block_sig_weak(sums, i), strong_hex);
     }
 }
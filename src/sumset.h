@@ -31,7 +31,10 @@
 #  include "checksum.h"
 #  include "librsync.h"
 
-/** Signature of a single block. */
+/** Signature of a single block.
+ *
+ * Signatures don't store blocks like this, but it's used for the sums of a
+ * block being matched or sent. */
 typedef struct rs_block_sig {
     rs_weak_sum_t weak_sum;     /**< Block's weak checksum. */
     rs_strong_sum_t strong_sum; /**< Block's strong checksum. */
@@ -40,18 +43,31 @@ typedef struct rs_block_sig {
 /** Signature of a whole file.
  *
  * This includes the all the block sums generated for a file and datastructures
- * for fast matching against them. */
+ * for fast matching against them. The block sums are stored as separate
+ * arrays of weak sums and strong sums, with the strong sums packed at a stride
+ * of strong_sum_len, so scans of the weak sums don't touch the strong sums. */
 struct rs_signature {
     int magic;                  /**< The signature magic value. */
     int block_len;              /**< The block length. */
     int strong_sum_len;         /**< The block strong sum length. */
-    int count;                  /**< Total number of blocks. */
-    int size;                   /**< Total number of blocks allocated. */
-    void *block_sigs;           /**< The packed block_sigs for all blocks. */
+    rs_long_t count;            /**< Total number of blocks. */
+    rs_long_t size;             /**< Total number of blocks allocated. */
+    rs_weak_sum_t *weak_sums;   /**< The weak sums for all blocks. */
+    rs_byte_t *strong_sums;     /**< The strong sums for all blocks. */
     hashtable_t *hashtable;     /**< The hashtable for finding matches. */
+    rs_long_t hashed;           /**< Number of blocks in the hashtable. */
+    void *mem;                  /**< Loaded index holding the tables, or NULL. */
+    void (*mem_free)(void *mem);        /**< Function to free mem, or NULL. */
+    rs_long_t *offsets;         /**< The block offsets and end offset of a
+                                   chunked signature, or NULL. */
+    void const *basis;          /**< The basis data of a local signature. */
+    rs_long_t basis_len;        /**< The length of the basis data. */
     /* The is extra stats not included in the hashtable stats. */
 #  ifndef HASHTABLE_NSTATS
     long calc_strong_count;     /**< The count of strongsum calcs done. */
+    long predict_count;         /**< The count of predicted block checks. */
+    long predict_match_count;   /**< The count of predicted blocks matched. */
+    double build_time;          /**< Seconds spent building the hashtable. */
 #  endif
 };
 
@@ -73,29 +89,168 @@ rs_result rs_signature_init(rs_signature_t *sig, rs_magic_number magic,
                             size_t block_len, size_t strong_len,
                             rs_long_t sig_fsize);
 
+/** Initialize an rs_signature instance to match against basis data in memory.
+ *
+ * A local signature has the weak sums of every block of \p basis but no
+ * strong sums. Candidate matches are checked by comparing them with the basis
+ * data itself, so they can't be false matches and small blocks can be used.
+ * The basis data must stay valid and unchanged until the signature is done.
+ * The hashtable still needs to be built with rs_build_hash_table().
+ *
+ * \param *basis - the basis data.
+ *
+ * \param len - the length of the basis data.
+ *
+ * \param block_len - the block length to use (0 for "recommended"). */
+rs_result rs_signature_init_local(rs_signature_t *sig, void const *basis,
+                                  rs_long_t len, size_t block_len);
+
 /** Destroy an rs_signature instance. */
 void rs_signature_done(rs_signature_t *sig);
 
+/** Length of the header of an indexed signature. */
+#  define RS_SIG_INDEX_HEADER_LEN 64
+
+/** Get the total length of an indexed signature from its header.
+ *
+ * An indexed signature starts with a header of bigendian uint32 fields, and
+ * then has the weak sums, strong sums, bloom filter, hashtable tags and
+ * hashtable block indexes exactly as they are in memory, each aligned to 64
+ * bytes. The hashtable uses block indexes, so it doesn't depend on where it
+ * is loaded. The data is in native byte order, so it can only be loaded on
+ * platforms with the same byte order as the one that saved it.
+ *
+ * \param *header - the RS_SIG_INDEX_HEADER_LEN byte header.
+ *
+ * \param *len - set to the total length. */
+rs_result rs_signature_index_len(void const *header, size_t *len);
+
+/** Initialize an rs_signature instance to use an indexed signature in memory.
+ *
+ * The signature's block sums and hashtable use the memory directly without
+ * copying it, so this takes O(1) time. The signature is read-only.
+ *
+ * \param *data - the indexed signature, aligned to at least 4 bytes and
+ * ideally to 64 bytes.
+ *
+ * \param len - the length of data.
+ *
+ * \param mem_free - called with data by rs_signature_done(), or NULL. */
+rs_result rs_signature_index_load(rs_signature_t *sig, void *data, size_t len,
+                                  void (*mem_free)(void *));
+
+/** Write an indexed signature, building its hashtable first if needed. */
+rs_result rs_signature_index_save(rs_signature_t *sig, FILE *f);
+
 /** Add a block to an rs_signature instance. */
-rs_block_sig_t *rs_signature_add_block(rs_signature_t *sig,
-                                       rs_weak_sum_t weak_sum,
-                                       rs_strong_sum_t *strong_sum);
+void rs_signature_add_block(rs_signature_t *sig, rs_weak_sum_t weak_sum,
+                            rs_strong_sum_t *strong_sum);
+
+/** Add a chunk of length \p len to a chunked rs_signature instance. */
+void rs_signature_add_chunk(rs_signature_t *sig, rs_weak_sum_t weak_sum,
+                            rs_strong_sum_t *strong_sum, size_t len);
+
+/** Get the sums for a block as they are stored in a signature file.
+ *
+ * This undoes the mix32() applied to rollsum weaksums when they are added.
+ *
+ * \param i - the index of the block.
+ *
+ * \param strong_sum - set to point at the block's strong sum.
+ *
+ * \return The block's weak sum. */
+rs_weak_sum_t rs_signature_get_block(rs_signature_t *sig, rs_long_t i,
+                                     rs_strong_sum_t **strong_sum);
 
 /** Find a matching block offset in a signature. */
 rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum,
                                   void const *buf, size_t len);
 
+/** Check if the block at a basis offset matches, without a hashtable lookup.
+ *
+ * After a match the next new data usually matches the next basis block, so
+ * checking it first avoids a hashtable lookup, and among duplicate blocks
+ * finds the one that extends the match instead of the first one.
+ *
+ * \param pos - the basis offset of the block to check, which need not be the
+ * start of a block or in the signature.
+ *
+ * \return Non-zero if pos is a block with the same weak and strong sums. */
+int rs_signature_match_at(rs_signature_t *sig, rs_long_t pos,
+                          rs_weak_sum_t weak_sum, void const *buf, size_t len);
+
+/** Find the first match for a run of consecutive offsets in a signature.
+ *
+ * This is the same as calling rs_signature_find_match() with weak_sums[i]
+ * and buf + i for each i in [0,n) until one matches.
+ *
+ * \param match_pos - set to the matching block offset if a match is found.
+ *
+ * \return The index of the first matching offset, or n if none match. */
+size_t rs_signature_find_matches(rs_signature_t *sig,
+                                 rs_weak_sum_t const *weak_sums, size_t n,
+                                 void const *buf, size_t len,
+                                 rs_long_t *match_pos);
+
+/** Find the longest run of consecutive basis blocks that are all one byte.
+ *
+ * This checks the sums of every block against the sums of a block filled
+ * with \p byte, so it takes O(count) time. A chunked signature has no such
+ * runs.
+ *
+ * \param byte - the value of the bytes.
+ *
+ * \param len - set to the length of the run, or 0 if there is none.
+ *
+ * \return The offset of the run, or -1 if there is none. */
+rs_long_t rs_signature_find_fill(rs_signature_t *sig, int byte,
+                                 rs_long_t *len);
+
+/** Get the length of the run of basis blocks that are all one byte at pos.
+ *
+ * This computes the strong sum of a block filled with \p byte once, so
+ * checking a run of blocks costs less than matching them one at a time.
+ *
+ * \param byte - the value of the bytes.
+ *
+ * \param pos - the offset of the first block, which must be block aligned.
+ *
+ * \param max_len - the length after which to stop checking blocks.
+ *
+ * \return The length of the run, or 0 if the block at pos isn't all \p byte.
+ */
+rs_long_t rs_signature_fill_len(rs_signature_t *sig, int byte, rs_long_t pos,
+                                rs_long_t max_len);
+
+/** Make a copy of a signature for finding matches in another thread.
+ *
+ * The copy shares the block sums and hashtable tables with the original, but
+ * has its own zeroed stats counters so copies can be used concurrently. Use
+ * rs_signature_join() to add its stats back into the original afterwards.
+ *
+ * \param copy - the signature copy to initialize.
+ *
+ * \param table - storage for the copy's hashtable struct. */
+void rs_signature_fork(rs_signature_t const *sig, rs_signature_t *copy,
+                       hashtable_t *table);
+
+/** Add the stats of a copy made by rs_signature_fork() to a signature. */
+void rs_signature_join(rs_signature_t *sig, rs_signature_t const *copy);
+
 /** Assert that rs_sig_args() args for rs_signature_init() are valid.
  *
  * We don't use a static inline function here so that assert failure output
  * points at where rs_sig_args_check() was called from. */
 #  define rs_sig_args_check(magic, block_len, strong_len) do {\
     assert(((magic) & ~0xff) == (RS_MD4_SIG_MAGIC & ~0xff));\
-    assert(((magic) & 0xf0) == 0x30 || ((magic) & 0xf0) == 0x40);\
+    assert(((magic) & 0xf0) == 0x30 || ((magic) & 0xf0) == 0x40 ||\
+           ((magic) & 0xf0) == 0x50);\
     assert((((magic) & 0x0f) == 0x06 &&\
 	    (int)(strong_len) <= RS_MD4_SUM_LENGTH) ||\
 	   (((magic) & 0x0f) == 0x07 &&\
-	    (int)(strong_len) <= RS_BLAKE2_SUM_LENGTH));\
+	    (int)(strong_len) <= RS_BLAKE2_SUM_LENGTH) ||\
+	   (((magic) & 0x0f) == 0x08 &&\
+	    (int)(strong_len) <= RS_XXH3_SUM_LENGTH));\
     assert(0 < (block_len));\
     assert(0 < (strong_len) && (strong_len) <= RS_MAX_STRONG_SUM_LENGTH);\
 } while (0)
@@ -107,10 +262,26 @@ rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum,
 #  define rs_signature_check(sig) do {\
     rs_sig_args_check((sig)->magic, (sig)->block_len, (sig)->strong_sum_len);\
     assert(0 <= (sig)->count && (sig)->count <= (sig)->size);\
-    assert(!(sig)->hashtable || (sig)->hashtable->count <= (sig)->count);\
+    assert(!(sig)->hashtable ||\
+           (sig)->hashtable->count <= (size_t)(sig)->count);\
 } while (0)
 
-/** Get the weaksum kind for a signature. */
+/** Test if a signature magic is for a chunked signature. */
+static inline int rs_sig_magic_chunked(int magic)
+{
+    return (magic & 0xf0) == 0x50;
+}
+
+/** Get the file offset of a block in a signature. */
+static inline rs_long_t rs_signature_block_pos(rs_signature_t const *sig,
+                                               rs_long_t i)
+{
+    return sig->offsets ? sig->offsets[i] : i * sig->block_len;
+}
+
+/** Get the weaksum kind for a signature.
+ *
+ * Chunked signatures use the RabinKarp sum of each whole chunk. */
 static inline weaksum_kind_t rs_signature_weaksum_kind(rs_signature_t const
                                                        *sig)
 {
@@ -121,7 +292,14 @@ static inline weaksum_kind_t rs_signature_weaksum_kind(rs_signature_t const
 static inline strongsum_kind_t rs_signature_strongsum_kind(rs_signature_t const
                                                            *sig)
 {
-    return (sig->magic & 0x0f) == 0x06 ? RS_MD4 : RS_BLAKE2;
+    switch (sig->magic & 0x0f) {
+    case 0x06:
+        return RS_MD4;
+    case 0x08:
+        return RS_XXH3;
+    default:
+        return RS_BLAKE2;
+    }
 }
 
 /** Calculate the weak sum of a buffer. */
@@ -140,4 +318,13 @@ static inline void rs_signature_calc_strong_sum(rs_signature_t const *sig,
     rs_calc_strong_sum(rs_signature_strongsum_kind(sig), buf, len, sum);
 }
 
+/** Calculate the strong sums of a batch of buffers. */
+static inline void rs_signature_calc_strong_sums(rs_signature_t const *sig,
+                                                 void const *const *bufs,
+                                                 size_t len, int n,
+                                                 rs_strong_sum_t *const *sums)
+{
+    rs_calc_strong_sums(rs_signature_strongsum_kind(sig), bufs, len, n, sums);
+}
+
 #endif                          /* !SUMSET_H */
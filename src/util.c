@@ -23,8 +23,10 @@
                                  | On heroin, I have all the answers.
                                  */
 
+#include "config.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "librsync.h"
 #include "util.h"
 #include "trace.h"
@@ -91,3 +93,14 @@ int rs_long_sqrt(rs_long_t v)
     }
     return (int)n;
 }
+
+double rs_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+    return (double)time(NULL);
+}
@@ -37,6 +37,11 @@ void rs_bzero(void *buf, size_t size);
 int rs_long_ln2(rs_long_t v);
 int rs_long_sqrt(rs_long_t v);
 
+/** Get a wall clock time in seconds for timing things.
+ *
+ * This uses a monotonic clock where available, and otherwise time(). */
+double rs_now(void);
+
 /** Allocate and zero-fill an instance of TYPE. */
 #  define rs_alloc_struct(type)				\
         ((type *) rs_alloc_struct0(sizeof(type), #type))
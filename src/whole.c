@@ -27,35 +27,72 @@
                                |        -- Alan Perlis
                                */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "librsync.h"
 #include "whole.h"
 #include "sumset.h"
 #include "job.h"
 #include "buf.h"
+#include "pdelta.h"
+#include "trace.h"
+#include "util.h"
 #include "librsync_export.h"
 
 /** Whole file IO buffer sizes. */
 LIBRSYNC_EXPORT int rs_inbuflen = 0, rs_outbuflen = 0;
 
+/** Whole file number of threads. */
+LIBRSYNC_EXPORT int rs_threads = 0;
+
+/** Whole file delta format. */
+LIBRSYNC_EXPORT rs_magic_number rs_delta_magic = RS_DELTA_MAGIC;
+
+/** Whole file delta effort level. */
+LIBRSYNC_EXPORT int rs_delta_effort = RS_DELTA_EFFORT_MAX;
+
+/** Whole file use of mmap. */
+LIBRSYNC_EXPORT int rs_mmap = 0;
+
+/** More statistics of the last whole-file function. */
+static rs_xstats_t rs_whole_last_xstats;
+
+/** Max input buffer length for signatures with many threads. */
+#define RS_SIG_INBUF_MAX (64 << 20)
+
 rs_result rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file,
                        int inbuflen, int outbuflen)
 {
     rs_buffers_t buf;
     rs_result result;
     rs_filebuf_t *in_fb = NULL, *out_fb = NULL;
+    rs_filemap_t *in_fm = NULL;
+    rs_driven_cb *in_cb = NULL;
+    void *in_opaque = NULL;
 
+    /* Map the input file unless an input buffer size has been requested. */
+    if (in_file && !rs_inbuflen && (in_fm = rs_filemap_new(in_file, 1))) {
+        in_cb = rs_inmapbuf_fill;
+        in_opaque = in_fm;
+    }
     /* Override buffer sizes if rs_inbuflen or rs_outbuflen are set. */
     inbuflen = rs_inbuflen ? rs_inbuflen : inbuflen;
     outbuflen = rs_outbuflen ? rs_outbuflen : outbuflen;
-    if (in_file)
+    if (in_file && !in_fm) {
         in_fb = rs_filebuf_new(in_file, inbuflen);
+        in_cb = rs_infilebuf_fill;
+        in_opaque = in_fb;
+    }
     if (out_file)
         out_fb = rs_filebuf_new(out_file, outbuflen);
     result =
-        rs_job_drive(job, &buf, in_fb ? rs_infilebuf_fill : NULL, in_fb,
+        rs_job_drive(job, &buf, in_cb, in_opaque,
                      out_fb ? rs_outfilebuf_drain : NULL, out_fb);
+    if (in_fm)
+        rs_filemap_free(in_fm, buf.avail_in);
     if (in_fb)
         rs_filebuf_free(in_fb);
     if (out_fb)
@@ -63,6 +100,19 @@ rs_result rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file,
     return result;
 }
 
+/* Return the statistics of a finished whole-file job. */
+static void rs_whole_stats(rs_job_t *job, rs_stats_t *stats)
+{
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_whole_last_xstats = job->xstats;
+}
+
+const rs_xstats_t *rs_whole_xstats(void)
+{
+    return &rs_whole_last_xstats;
+}
+
 rs_result rs_sig_file(FILE *old_file, FILE *sig_file, size_t block_len,
                       size_t strong_len, rs_magic_number sig_magic,
                       rs_stats_t *stats)
@@ -70,53 +120,285 @@ rs_result rs_sig_file(FILE *old_file, FILE *sig_file, size_t block_len,
     rs_job_t *job;
     rs_result r;
     rs_long_t old_fsize = rs_file_size(old_file);
+    size_t inbuflen;
 
     if ((r =
          rs_sig_args(old_fsize, &sig_magic, &block_len,
                      &strong_len)) != RS_DONE)
         return r;
     job = rs_sig_begin(block_len, strong_len, sig_magic);
-    /* Size inbuf for 4 blocks, outbuf for header + 4 blocksums. */
-    r = rs_whole_run(job, old_file, sig_file, 4 * (int)block_len,
+    rs_job_set_threads(job, rs_threads);
+    /* Size inbuf for a batch of blocks for each thread, up to
+       RS_SIG_INBUF_MAX but at least a block, outbuf for header + 4
+       blocksums. */
+    inbuflen = RS_SIG_BATCH_BLOCKS * (size_t)(rs_threads > 1 ? rs_threads : 1);
+    if (inbuflen > RS_SIG_INBUF_MAX / block_len)
+        inbuflen = RS_SIG_INBUF_MAX;
+    else
+        inbuflen *= block_len;
+    if (inbuflen < block_len)
+        inbuflen = block_len;
+    r = rs_whole_run(job, old_file, sig_file, (int)inbuflen,
                      12 + 4 * (4 + (int)strong_len));
-    if (stats)
-        memcpy(stats, &job->stats, sizeof *stats);
+    rs_whole_stats(job, stats);
     rs_job_free(job);
 
     return r;
 }
 
+/* Unmap an indexed signature file when its signature is done. */
+static void rs_sigmap_free(void *fm)
+{
+    rs_filemap_free(fm, 0);
+}
+
+/* Try to load a mapped indexed signature file in place. */
+static rs_result rs_loadsig_map(FILE *sig_file, rs_signature_t **sumset,
+                                rs_stats_t *stats)
+{
+    rs_filemap_t *fm;
+    void const *data;
+    size_t len;
+    rs_result r;
+
+    if (!(fm = rs_filemap_new(sig_file, 0)))
+        return RS_UNIMPLEMENTED;
+    data = rs_filemap_data(fm, &len);
+    /* Use stdio for anything else, or if the data isn't aligned. */
+    if (len < RS_SIG_INDEX_HEADER_LEN || ((size_t)data & 63)
+        || memcmp(data, "rs\x01I", 4)) {
+        rs_filemap_free(fm, len);
+        return RS_UNIMPLEMENTED;
+    }
+    *sumset = rs_alloc_struct(rs_signature_t);
+    if ((r = rs_signature_index_load(*sumset, (void *)data, len,
+                                     rs_sigmap_free)) != RS_DONE) {
+        rs_free_sumset(*sumset);
+        *sumset = NULL;
+        rs_filemap_free(fm, 0);
+        return r;
+    }
+    /* The signature has the data, so it needs to free the mapping. */
+    (*sumset)->mem = fm;
+    rs_filemap_release(fm);
+    memset(&rs_whole_last_xstats, 0, sizeof rs_whole_last_xstats);
+    if (stats) {
+        memset(stats, 0, sizeof *stats);
+        stats->op = "loadsig";
+        stats->block_len = (size_t)(*sumset)->block_len;
+        stats->sig_blocks = (*sumset)->count;
+        stats->in_bytes = (rs_long_t)len;
+        stats->start = stats->end = time(NULL);
+    }
+    return RS_DONE;
+}
+
 rs_result rs_loadsig_file(FILE *sig_file, rs_signature_t **sumset,
                           rs_stats_t *stats)
 {
     rs_job_t *job;
     rs_result r;
 
+    if ((r = rs_loadsig_map(sig_file, sumset, stats)) != RS_UNIMPLEMENTED)
+        return r;
     job = rs_loadsig_begin(sumset);
     /* Set filesize used to estimate signature size. */
     job->sig_fsize = rs_file_size(sig_file);
     /* Size inbuf for 1024x 16 byte blocksums. */
     r = rs_whole_run(job, sig_file, NULL, 1024 * 16, 0);
-    if (stats)
-        memcpy(stats, &job->stats, sizeof *stats);
+    rs_whole_stats(job, stats);
     rs_job_free(job);
 
     return r;
 }
 
+rs_result rs_indexsig_file(rs_signature_t *sumset, FILE *index_file)
+{
+    return rs_signature_index_save(sumset, index_file);
+}
+
+/* Read the rest of a file that can't be mapped into memory. */
+static rs_byte_t *rs_file_read(FILE *f, rs_long_t *len, char const *name)
+{
+    rs_byte_t *data = NULL;
+    size_t alloc = 0, n = 0, got;
+
+    do {
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 1 << 16;
+            data = rs_realloc(data, alloc, name);
+        }
+        n += got = fread(data + n, 1, alloc - n, f);
+    } while (got);
+    if (ferror(f)) {
+        rs_error("error reading %s: %s", name, strerror(errno));
+        free(data);
+        return NULL;
+    }
+    *len = (rs_long_t)n;
+    return data;
+}
+
+/* Input read into memory for a parallel delta. */
+typedef struct rs_membuf {
+    rs_byte_t *data;
+    size_t len;
+} rs_membuf_t;
+
+/* Give the stream the whole of the data read into memory as input. */
+static rs_result rs_inmembuf_fill(rs_job_t *job, rs_buffers_t *buf,
+                                  void *opaque)
+{
+    rs_membuf_t *mb = (rs_membuf_t *)opaque;
+
+    if (!buf->eof_in) {
+        buf->next_in = (char *)mb->data;
+        buf->avail_in = mb->len;
+        buf->eof_in = 1;
+        job->stats.in_bytes += buf->avail_in;
+        rs_trace("seen end of file on input read into memory");
+    }
+    return RS_DONE;
+}
+
 rs_result rs_delta_file(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
                         rs_stats_t *stats)
 {
     rs_job_t *job;
     rs_result r;
+    rs_filemap_t *new_fm = NULL;
+    rs_membuf_t new_mb = { NULL, 0 };
+    void const *data = NULL;
+    size_t len;
+    rs_long_t new_len;
+
+    /* Scan a new regular file in parallel if threads have been requested,
+       unless rs_inbuflen asks for buffered input as in rs_whole_run(). Use
+       the mapped file if it can be mapped, otherwise read it. */
+    if (rs_threads > 1 && !rs_inbuflen) {
+        if ((new_fm = rs_filemap_new(new_file, 0))) {
+            data = rs_filemap_data(new_fm, &len);
+        } else if (rs_file_size(new_file) > 0) {
+            if (!(data = new_mb.data =
+                  rs_file_read(new_file, &new_len, "new file")))
+                return RS_IO_ERROR;
+            new_mb.len = len = (size_t)new_len;
+        }
+    }
+    if (data) {
+        rs_buffers_t buf;
+        rs_filebuf_t *out_fb;
+
+        job = rs_delta_par_begin(sig, data, len, rs_threads, rs_delta_magic,
+                                 rs_delta_effort);
+        out_fb =
+            rs_filebuf_new(delta_file,
+                           rs_outbuflen ? rs_outbuflen : 4 * MAX_DELTA_CMD);
+        if (new_fm) {
+            r = rs_job_drive(job, &buf, rs_inmapbuf_fill, new_fm,
+                             rs_outfilebuf_drain, out_fb);
+            rs_filemap_free(new_fm, buf.avail_in);
+        } else {
+            r = rs_job_drive(job, &buf, rs_inmembuf_fill, &new_mb,
+                             rs_outfilebuf_drain, out_fb);
+            free(new_mb.data);
+        }
+        rs_filebuf_free(out_fb);
+    } else {
+        job = rs_delta_begin(sig);
+        rs_delta_set_magic(job, rs_delta_magic);
+        rs_delta_set_effort(job, rs_delta_effort);
+        /* Size inbuf for 4*(CMD + 1 block), outbuf for 4*CMD. */
+        r = rs_whole_run(job, new_file, delta_file,
+                         4 * (MAX_DELTA_CMD + sig->block_len),
+                         4 * MAX_DELTA_CMD);
+    }
+    rs_whole_stats(job, stats);
+    rs_job_free(job);
+    return r;
+}
+
+rs_result rs_delta_basis_file(rs_signature_t *sig, FILE *basis_file,
+                              FILE *new_file, FILE *delta_file,
+                              rs_stats_t *stats)
+{
+    rs_job_t *job;
+    rs_result r;
+
+    rs_filemap_t *basis_fm = rs_filemap_new(basis_file, 0);
 
     job = rs_delta_begin(sig);
+    rs_delta_set_magic(job, rs_delta_magic);
+    rs_delta_set_effort(job, rs_delta_effort);
+    /* Read straight from the mapped basis if it can be mapped. */
+    if (basis_fm)
+        rs_delta_set_basis(job, rs_filemap_copy_cb, basis_fm);
+    else
+        rs_delta_set_basis(job, rs_file_copy_cb, basis_file);
     /* Size inbuf for 4*(CMD + 1 block), outbuf for 4*CMD. */
     r = rs_whole_run(job, new_file, delta_file,
                      4 * (MAX_DELTA_CMD + sig->block_len), 4 * MAX_DELTA_CMD);
-    if (stats)
-        memcpy(stats, &job->stats, sizeof *stats);
+    rs_whole_stats(job, stats);
     rs_job_free(job);
+    if (basis_fm)
+        rs_filemap_free(basis_fm, 0);
+    return r;
+}
+
+/* Copy basis data from the memory of a local signature. */
+static rs_result rs_local_copy_cb(void *arg, rs_long_t pos, size_t *len,
+                                  void **buf)
+{
+    rs_signature_t const *sig = arg;
+
+    if (pos < 0 || pos >= sig->basis_len) {
+        rs_error("unexpected eof at " FMT_LONG " on local basis", pos);
+        return RS_INPUT_ENDED;
+    }
+    if ((rs_long_t)*len > sig->basis_len - pos)
+        *len = (size_t)(sig->basis_len - pos);
+    *buf = (rs_byte_t *)sig->basis + pos;
+    return RS_DONE;
+}
+
+rs_result rs_delta_local_file(FILE *basis_file, FILE *new_file,
+                              FILE *delta_file, rs_stats_t *stats)
+{
+    rs_signature_t sig;
+    rs_job_t *job;
+    rs_result r;
+    rs_filemap_t *basis_fm = rs_filemap_new(basis_file, 0);
+    rs_byte_t *basis_buf = NULL;
+    void const *basis;
+    rs_long_t basis_len;
+    size_t len;
+
+    /* Use the mapped basis if it can be mapped, otherwise read it. */
+    if (basis_fm) {
+        basis = rs_filemap_data(basis_fm, &len);
+        basis_len = (rs_long_t)len;
+    } else if (!(basis = basis_buf =
+                 rs_file_read(basis_file, &basis_len, "basis file"))) {
+        return RS_IO_ERROR;
+    }
+    memset(&sig, 0, sizeof sig);
+    if ((r = rs_signature_init_local(&sig, basis, basis_len, 0)) == RS_DONE
+        && (r = rs_build_hash_table_par(&sig, rs_threads)) == RS_DONE) {
+        job = rs_delta_begin(&sig);
+        rs_delta_set_magic(job, rs_delta_magic);
+        rs_delta_set_effort(job, rs_delta_effort);
+        rs_delta_set_basis(job, rs_local_copy_cb, &sig);
+        /* Size inbuf for 4*(CMD + 1 block), outbuf for 4*CMD. */
+        r = rs_whole_run(job, new_file, delta_file,
+                         4 * (MAX_DELTA_CMD + sig.block_len),
+                         4 * MAX_DELTA_CMD);
+        rs_whole_stats(job, stats);
+        rs_job_free(job);
+    }
+    rs_signature_done(&sig);
+    if (basis_fm)
+        rs_filemap_free(basis_fm, 0);
+    free(basis_buf);
     return r;
 }
 
@@ -126,12 +408,42 @@ rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file,
     rs_job_t *job;
     rs_result r;
 
-    job = rs_patch_begin(rs_file_copy_cb, basis_file);
+    rs_filemap_t *basis_fm = rs_filemap_new(basis_file, 0);
+
+    /* Copy straight from the mapped basis if it can be mapped. */
+    if (basis_fm)
+        job = rs_patch_begin(rs_filemap_copy_cb, basis_fm);
+    else
+        job = rs_patch_begin(rs_file_copy_cb, basis_file);
     /* Default size inbuf 1*CMD and outbuf 4*CMD. */
     r = rs_whole_run(job, delta_file, new_file, MAX_DELTA_CMD,
                      4 * MAX_DELTA_CMD);
-    if (stats)
-        memcpy(stats, &job->stats, sizeof *stats);
+    rs_whole_stats(job, stats);
+    rs_job_free(job);
+    if (basis_fm)
+        rs_filemap_free(basis_fm, 0);
+    return r;
+}
+
+rs_result rs_sig_from_delta_file(rs_signature_t *old_sig, FILE *delta_file,
+                                 FILE *new_file, FILE *sig_file,
+                                 rs_stats_t *stats)
+{
+    rs_job_t *job;
+    rs_result r;
+
+    rs_filemap_t *new_fm = rs_filemap_new(new_file, 0);
+
+    if (new_fm)
+        job = rs_sig_from_delta_begin(old_sig, rs_filemap_copy_cb, new_fm);
+    else
+        job = rs_sig_from_delta_begin(old_sig, rs_file_copy_cb, new_file);
+    /* Default size inbuf 1*CMD and outbuf for header + 4 blocksums. */
+    r = rs_whole_run(job, delta_file, sig_file, MAX_DELTA_CMD,
+                     12 + 4 * (4 + old_sig->strong_sum_len));
+    rs_whole_stats(job, stats);
     rs_job_free(job);
+    if (new_fm)
+        rs_filemap_free(new_fm, 0);
     return r;
 }
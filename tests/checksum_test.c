@@ -149,10 +149,57 @@ int main(int argc, char **argv)
         0x6f, 0x9d, 0x0c, 0x80, 0x49, 0x64, 0xa1, 0xf4,
         0xaa, 0xee, 0xa3, 0xb9, 0xfb, 0x59, 0x98, 0x35,
     };
+    const unsigned char xx3[16] = {
+        0xf1, 0xf8, 0xa9, 0x3f, 0x50, 0x84, 0x9a, 0xc3,
+        0x94, 0x08, 0xa4, 0x43, 0x3b, 0x95, 0x2d, 0x71,
+    };
 
     rs_calc_strong_sum(RS_MD4, buf, 256, &sum);
     assert(!memcmp(sum, md4, RS_MD4_SUM_LENGTH));
     rs_calc_strong_sum(RS_BLAKE2, buf, 256, &sum);
     assert(!memcmp(sum, bk2, RS_BLAKE2_SUM_LENGTH));
+    rs_calc_strong_sum(RS_XXH3, buf, 256, &sum);
+    assert(!memcmp(sum, xx3, RS_XXH3_SUM_LENGTH));
+
+    /* Test rs_calc_strong_sums() matches rs_calc_strong_sum() at every cpu
+       level. */
+    static unsigned char data[17 * 1000];
+    const char *levels[] = { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+    const size_t lens[] =
+        { 0, 1, 55, 56, 64, 127, 128, 129, 255, 256, 257, 1000 };
+    void const *bufs[17];
+    rs_strong_sum_t sums[17], *sump[17];
+
+    assert(rs_cpu_select("bogus") == RS_PARAM_ERROR);
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + i / 251);
+    for (int l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++) {
+        assert(rs_cpu_select(levels[l]) == RS_DONE);
+        for (int k = 0; k < (int)(sizeof(lens) / sizeof(lens[0])); k++) {
+            size_t len = lens[k];
+            for (int n = 1; n <= 17; n++) {
+                for (int i = 0; i < n; i++) {
+                    bufs[i] = data + i * len;
+                    sump[i] = &sums[i];
+                }
+                rs_calc_strong_sums(RS_BLAKE2, bufs, len, n, sump);
+                for (int i = 0; i < n; i++) {
+                    rs_calc_strong_sum(RS_BLAKE2, bufs[i], len, &sum);
+                    assert(!memcmp(sums[i], sum, RS_BLAKE2_SUM_LENGTH));
+                }
+                rs_calc_strong_sums(RS_MD4, bufs, len, n, sump);
+                for (int i = 0; i < n; i++) {
+                    rs_calc_strong_sum(RS_MD4, bufs[i], len, &sum);
+                    assert(!memcmp(sums[i], sum, RS_MD4_SUM_LENGTH));
+                }
+                rs_calc_strong_sums(RS_XXH3, bufs, len, n, sump);
+                for (int i = 0; i < n; i++) {
+                    rs_calc_strong_sum(RS_XXH3, bufs[i], len, &sum);
+                    assert(!memcmp(sums[i], sum, RS_XXH3_SUM_LENGTH));
+                }
+            }
+        }
+    }
+    assert(rs_cpu_select(NULL) == RS_DONE);
     return 0;
 }
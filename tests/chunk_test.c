@@ -0,0 +1,81 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * chunk_test -- tests for content-defined chunking.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "librsync.h"
+#include "chunk.h"
+
+#define LEN (1 << 20)
+#define POS 5000
+#define INS 10
+
+static unsigned char data[LEN], edit[LEN + INS];
+static unsigned char cuts[LEN + INS + 1], old_cuts[LEN + INS + 1];
+
+/* Mark the chunk ends of buf in cuts, and return the number of chunks. */
+static int chunk_all(unsigned char const *buf, size_t len, size_t avg)
+{
+    size_t pos = 0, n;
+    int count = 0;
+
+    memset(cuts, 0, sizeof(cuts));
+    for (; pos < len; pos += n, count++) {
+        n = rs_chunk_len(buf + pos, len - pos, avg);
+        assert(0 < n && n <= len - pos && n <= rs_chunk_max_len(avg));
+        assert(n >= rs_chunk_min_len(avg) || pos + n == len);
+        cuts[pos + n] = 1;
+    }
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t x = 1;
+    size_t i;
+    int avg, count;
+
+    for (i = 0; i < LEN; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = (unsigned char)(x >> 16);
+    }
+    /* Chunks must always be cut at the same places for the same data. */
+    assert(rs_chunk_len(data, LEN, 256) == 171);
+    assert(rs_chunk_len(data, LEN, 2048) == 2509);
+    assert(rs_chunk_len(data, 10, 256) == 10);
+    assert(rs_chunk_len(edit, LEN, 256) == rs_chunk_max_len(256));
+    /* An insertion only changes the cuts near it. */
+    memcpy(edit, data, POS);
+    memset(edit + POS, 'x', INS);
+    memcpy(edit + POS + INS, data + POS, LEN - POS);
+    for (avg = 64; avg <= 8192; avg *= 4) {
+        count = chunk_all(data, LEN, avg);
+        assert(avg / 2 < LEN / count && LEN / count < avg * 2);
+        memcpy(old_cuts, cuts, sizeof(cuts));
+        chunk_all(edit, LEN + INS, avg);
+        assert(!memcmp(cuts, old_cuts, POS));
+        for (i = POS + INS; !cuts[i] || !old_cuts[i - INS]; i++) ;
+        assert(i < POS + 8 * rs_chunk_max_len(avg));
+        assert(!memcmp(cuts + i, old_cuts + i - INS, LEN + INS + 1 - i));
+    }
+    return 0;
+}
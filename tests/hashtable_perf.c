@@ -0,0 +1,204 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * hashtable_perf -- performance tests for hashtable lookups.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Benchmark finding random keys one at a time with NAME_find() against
+   finding them in batches with NAME_find_batch(), for tables with each of
+   the numbers of entries given as arguments (default 1M 10M 100M). About 1 in
+   256 of the keys searched for are in the table.
+
+   Then compare the default quadratic probing against HASHTABLE_GROUP probing
+   for tables of 1M and 16M buckets filled to high load factors, without bloom
+   filters. This reports the average hash (or group) and entry compares per
+   lookup and ns/lookup, with half of the keys searched for in the table. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hashtable.h"
+
+/* Key type for the hashtable. */
+typedef unsigned mykey_t;
+
+static inline unsigned mykey_hash(const mykey_t *k)
+{
+    return *k;
+}
+
+static inline int mykey_cmp(mykey_t *k, const mykey_t *o)
+{
+    return *k != *o;
+}
+
+/* Instantiate a mykey_hashtable of keys. */
+#define ENTRY mykey
+#include "hashtable.h"
+
+/* Instantiate a mykey_grouptable of keys using group probing. */
+#define HASHTABLE_GROUP
+#define ENTRY mykey
+#define NAME mykey_grouptable
+#include "hashtable.h"
+#undef HASHTABLE_GROUP
+
+/* Number of keys to find in each run. */
+#define FINDS (1 << 24)
+
+/* Simple xorshift pseudo-random number generator. */
+static unsigned rand32(unsigned *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static double now(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static long parse_count(char const *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (*end == 'K')
+        n *= 1000;
+    else if (*end == 'M')
+        n *= 1000000;
+    return n;
+}
+
+/* Print the stats and time for FINDS lookups in table t. */
+static void report(char const *name, hashtable_t *t, double secs)
+{
+    printf("  %-10s %5.2f hashcmp/find %5.2f entrycmp/find %6.1f ns/find\n",
+           name, (double)t->hashcmp_count / (double)t->find_count,
+           (double)t->entrycmp_count / (double)t->find_count,
+           secs * 1e9 / FINDS);
+}
+
+/* Compare probing methods for a table of size buckets at the given loads. */
+static int bench_loads(int size, mykey_t *finds)
+{
+    static int const loads[] = { 50, 70, 85, 95 };
+    hashtable_t *qt, *gt;
+    mykey_t *entries;
+    long n, i, found1, found2;
+    unsigned s;
+    double t1, t2;
+    int j;
+
+    /* The table size for size * 0.7 entries is size. */
+    if (!(entries = malloc((size_t)size * sizeof(mykey_t)))
+        || !(qt = mykey_hashtable_new_bloom((size_t)size / 10 * 7, 0))
+        || !(gt = mykey_grouptable_new_bloom((size_t)size / 10 * 7, 0))) {
+        fprintf(stderr, "can't make table with %d buckets\n", size);
+        return 1;
+    }
+    for (s = 1, i = 0; i < size; i++)
+        entries[i] = rand32(&s);
+    for (n = 0, j = 0; j < 4; j++) {
+        for (; n < (long)size * loads[j] / 100; n++) {
+            mykey_hashtable_add(qt, &entries[n]);
+            mykey_grouptable_add(gt, &entries[n]);
+        }
+        for (s = 2, i = 0; i < FINDS; i++)
+            finds[i] = rand32(&s) % 2 ? rand32(&s) : entries[rand32(&s) % n];
+        mykey_hashtable_stats_init(qt);
+        mykey_grouptable_stats_init(gt);
+        t1 = now();
+        for (found1 = 0, i = 0; i < FINDS; i++)
+            found1 += mykey_hashtable_find(qt, &finds[i]) != NULL;
+        t1 = now() - t1;
+        t2 = now();
+        for (found2 = 0, i = 0; i < FINDS; i++)
+            found2 += mykey_grouptable_find(gt, &finds[i]) != NULL;
+        t2 = now() - t2;
+        if (found1 != found2) {
+            fprintf(stderr, "quadratic found %ld but group found %ld\n",
+                    found1, found2);
+            return 1;
+        }
+        printf("%10lu buckets at %d%% load:\n", (unsigned long)qt->size,
+               loads[j]);
+        report("quadratic", qt, t1);
+        report("group", gt, t2);
+    }
+    mykey_hashtable_free(qt);
+    mykey_grouptable_free(gt);
+    free(entries);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static char const *const def[] = { "1M", "10M", "100M" };
+    char const *const *sizes = argc > 1 ? (char const *const *)argv + 1 : def;
+    int nsizes = argc > 1 ? argc - 1 : 3;
+    hashtable_t *t;
+    mykey_t *entries, *finds, *e;
+    long n, i, found1, found2;
+    unsigned s;
+    double t1, t2;
+    int j, k, m;
+
+    finds = malloc(FINDS * sizeof(mykey_t));
+    for (j = 0; j < nsizes; j++) {
+        n = parse_count(sizes[j]);
+        if (n < 1 || !(entries = malloc((size_t)n * sizeof(mykey_t)))
+            || !(t = mykey_hashtable_new((size_t)n))) {
+            fprintf(stderr, "can't make table with %s entries\n", sizes[j]);
+            return 1;
+        }
+        for (s = 1, i = 0; i < n; i++) {
+            entries[i] = rand32(&s);
+            mykey_hashtable_add(t, &entries[i]);
+        }
+        for (s = 2, i = 0; i < FINDS; i++)
+            finds[i] = rand32(&s) % 256 ? rand32(&s) : entries[rand32(&s) % n];
+        t1 = now();
+        for (found1 = 0, i = 0; i < FINDS; i++)
+            found1 += mykey_hashtable_find(t, &finds[i]) != NULL;
+        t1 = now() - t1;
+        t2 = now();
+        for (found2 = 0, i = 0; i < FINDS; i += k) {
+            m = FINDS - i < 256 ? (int)(FINDS - i) : 256;
+            k = mykey_hashtable_find_batch(t, &finds[i], m, &e);
+            if (k < m) {
+                found2++;
+                k++;
+            }
+        }
+        t2 = now() - t2;
+        if (found1 != found2) {
+            fprintf(stderr, "find found %ld but find_batch found %ld\n",
+                    found1, found2);
+            return 1;
+        }
+        printf("%10ld entries: find %6.1f Mlookups/s, find_batch %6.1f "
+               "Mlookups/s\n", n, FINDS / t1 / 1e6, FINDS / t2 / 1e6);
+        mykey_hashtable_free(t);
+        free(entries);
+    }
+    if (bench_loads(1 << 20, finds) || bench_loads(1 << 24, finds))
+        return 1;
+    free(finds);
+    return 0;
+}
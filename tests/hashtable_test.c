@@ -95,12 +95,43 @@ int mymatch_cmp(mymatch_t *m, const myentry_t *e)
 #define NAME myhashtable
 #include "hashtable.h"
 
+/* Match type for finding indexes of entries in an array.
+
+   This wraps mymatch_t with the array of entries the indexes are for, and
+   the index of the first entry. */
+typedef struct myindexmatch {
+    mymatch_t match;            /* Inherit from mymatch_t. */
+    myentry_t *entries;
+    int64_t base;
+} myindexmatch_t;
+
+void myindexmatch_init(myindexmatch_t *m, int i, myentry_t *entries)
+{
+    mymatch_init(&m->match, i);
+    m->entries = entries;
+    m->base = 0;
+}
+
+int myindexmatch_cmp(myindexmatch_t *m, int64_t i)
+{
+    return mymatch_cmp(&m->match, &m->entries[i - m->base]);
+}
+
+/* Instantiate a myindex hashtable of indexes into an array of myentrys. */
+#define HASHTABLE_INDEX
+#define ENTRY myentry
+#define KEY mykey
+#define MATCH myindexmatch
+#define NAME myindex
+#include "hashtable.h"
+#undef HASHTABLE_INDEX
+
 /* Test driver for hashtable. */
 int main(int argc, char **argv)
 {
     /* Test mykey_hashtable instance. */
     hashtable_t *kt;
-    int ki;
+    size_t ki;
     mykey_t k1, k2;
 
     mykey_init(&k1, 1);
@@ -128,7 +159,11 @@ int main(int argc, char **argv)
     assert(t->size == 512);
     assert(t->count == 0);
     assert(t->etable != NULL);
+#ifdef HASHTABLE_GROUP
+    assert(t->ttable != NULL);
+#else
     assert(t->ktable != NULL);
+#endif
 
     /* Test myhashtable_add() */
     assert(myhashtable_add(t, &e) == &e);       /* Added duplicated copy. */
@@ -163,9 +198,29 @@ int main(int argc, char **argv)
     assert(t->entrycmp_count == 0);
 #endif
 
+    /* Test myhashtable_find_batch() */
+    mymatch_t ms[40];
+    myentry_t *f;
+    for (i = 0; i < 40; i++)
+        mymatch_init(&ms[i], 256 + i);
+    assert(myhashtable_find_batch(t, ms, 40, &f) == 40);        /* None found. */
+    mymatch_init(&ms[33], 100);
+    assert(myhashtable_find_batch(t, ms, 40, &f) == 33);        /* Found in 3rd
+                                                                   batch. */
+    assert(f == &entry[100]);
+    assert(ms[33].value == ms[33].source);
+    assert(myhashtable_find_batch(t, ms, 33, &f) == 33);        /* Not in n. */
+    assert(myhashtable_find_batch(t, ms + 33, 1, &f) == 0);
+    assert(f == &entry[100]);
+#ifndef HASHTABLE_NSTATS
+    assert(t->find_count == 40 + 34 + 33 + 1);
+    assert(t->match_count == 2);
+    myhashtable_stats_init(t);
+#endif
+
     /* Test hashtable iterators */
     myentry_t *p;
-    int iter;
+    size_t iter;
     int count = 0;
     for (p = myhashtable_iter(t, &iter); p != NULL;
          p = myhashtable_next(t, &iter)) {
@@ -175,5 +230,132 @@ int main(int argc, char **argv)
     assert(count == 258);
     myhashtable_free(t);
 
+    /* Test myindex instance. */
+    myindexmatch_t im[40];
+    int64_t j;
+    int wide;
+    assert((t = myindex_new(256)) != NULL);
+    assert(t->size == 512);
+    assert(t->etable == NULL && t->ktable == NULL);
+    assert(t->itable != NULL && t->itable64 == NULL && t->ttable != NULL);
+    myindex_free(t);
+    /* Test with 32 bit indexes, and 64 bit indexes past 2^32 as used for big
+       indexes. */
+    for (wide = 0; wide < 2; wide++) {
+        int64_t base = wide ? (int64_t)1 << 32 : 0;
+
+        t = _hashtable_new(256, HASHTABLE_BLOOM_BITS, HASHTABLE_MODE_INDEX |
+#ifdef HASHTABLE_GROUP
+                           HASHTABLE_MODE_GROUP |
+#endif
+                           (wide ? HASHTABLE_MODE_WIDE : 0));
+        assert(t != NULL);
+        assert(wide ? t->itable == NULL && t->itable64 != NULL :
+               t->itable != NULL && t->itable64 == NULL);
+        for (i = 0; i < 256; i++)
+            assert(myindex_add(t, &entry[i].key, base + i) == base + i);
+        assert(t->count == 256);
+        for (i = 0; i < 256; i++) {
+            myindexmatch_init(&im[0], i, entry);
+            im[0].base = base;
+            assert(myindex_find(t, &im[0]) == base + i);
+        }
+        myindex_free(t);
+    }
+    assert((t = myindex_new(256)) != NULL);
+    for (i = 0; i < 256; i++)
+        assert(myindex_add(t, &entry[i].key, i) == i);
+    myindexmatch_init(&im[0], 256, entry);
+    assert(myindex_find(t, &im[0]) == -1);
+    for (i = 0; i < 40; i++)
+        myindexmatch_init(&im[i], 256 + i, entry);
+    assert(myindex_find_batch(t, im, 40, &j) == 40);
+    myindexmatch_init(&im[33], 100, entry);
+    assert(myindex_find_batch(t, im, 40, &j) == 33);
+    assert(j == 100);
+    count = 0;
+    for (j = myindex_iter(t, &iter); j != -1; j = myindex_next(t, &iter)) {
+        assert(0 <= j && j < 256);
+        count++;
+    }
+    assert(count == 256);
+    myindex_free(t);
+
+    /* Test the tags of hashes that differ only in their low bits or only in
+       their high bits, as in nearby or the same buckets, differ. */
+    count = 0;
+    for (i = 0; i < 1024; i++) {
+        count += hashtable_tag(0x12340000u + (unsigned)i) ==
+            hashtable_tag(0x12340001u + (unsigned)i);
+        count += hashtable_tag(0x00345678u + ((unsigned)i << 22)) ==
+            hashtable_tag(0x01345678u + ((unsigned)i << 22));
+        count += hashtable_grouptag(0x12340000u + (unsigned)i) ==
+            hashtable_grouptag(0x12340010u + (unsigned)i);
+        count += hashtable_grouptag(0x00345678u + ((unsigned)i << 22)) ==
+            hashtable_grouptag(0x02345678u + ((unsigned)i << 22));
+    }
+    assert(count < 32);
+
+    /* Test the first buckets for tables with more than 2^32 buckets are
+       spread through the table, without allocating one. */
+    if (SIZE_MAX > UINT32_MAX) {
+        hashtable_t big = { 0 };
+        unsigned hi = 0;
+
+        big.tmask = (size_t)(((uint64_t)1 << 34) - 1);
+        assert(hashtable_bucket(&big, 0x12345678) ==
+               (size_t)0x12345678 + (size_t)(((uint64_t)0x12345678 & 3) << 32));
+        for (i = 0; i < 1024; i++)
+            hi |= 1u << (unsigned)(hashtable_bucket(&big, mix32(i)) >> 32);
+        assert(hi == 0xf);
+        /* Hashes with nearby first buckets still get different tags. */
+        count = 0;
+        for (i = 0; i < 1024; i++) {
+            unsigned h = mix32((unsigned)i) & ~15u;
+
+            assert(hashtable_bucket(&big, h + 4) ==
+                   hashtable_bucket(&big, h) + 4);
+            assert(hashtable_bucket(&big, h + 16) ==
+                   hashtable_bucket(&big, h) + 16);
+            count += hashtable_tag(h) == hashtable_tag(h + 4);
+            count += hashtable_grouptag(h) == hashtable_grouptag(h + 16);
+        }
+        assert(count < 32);
+        big.tmask = 0xffff;
+        assert(hashtable_bucket(&big, 0x12345678) == 0x5678);
+    }
+
+    /* Test bloom filter has no false negatives and few false positives. */
+    static mykey_t keys[10000];
+    hashtable_t *bt;
+    mykey_t *kp;
+    int fp = 0;
+    assert((bt = mykey_hashtable_new_bloom(10000, 8)) != NULL);
+    for (i = 0; i < 10000; i++) {
+        keys[i] = i;
+        assert(mykey_hashtable_add(bt, &keys[i]) == &keys[i]);
+    }
+    for (i = 0; i < 10000; i++)
+        assert(hashtable_getbloom(bt, nozero(mix32((unsigned)i))));
+    for (i = 10000; i < 110000; i++)
+        fp += hashtable_getbloom(bt, nozero(mix32((unsigned)i)));
+    assert(fp < 4000);          /* Less than 4% false positives. */
+    mykey_hashtable_free(bt);
+
+    /* Test hashtable without a bloom filter. */
+    assert((bt = mykey_hashtable_new_bloom(16, 0)) != NULL);
+    assert(bt->kbloom == NULL);
+    assert(mykey_hashtable_add(bt, &k1) == &k1);
+    assert(mykey_hashtable_find(bt, &k1) == &k1);
+    assert(mykey_hashtable_find(bt, &k2) == NULL);
+    assert(mykey_hashtable_find_batch(bt, &k2, 1, &kp) == 1);
+    mykey_hashtable_free(bt);
+
+    /* Test unmix32() inverts mix32(). */
+    unsigned h = 1;
+    for (i = 0; i < 100000; i++, h = h * 2654435761u + 1)
+        assert(unmix32(mix32(h)) == h);
+    assert(unmix32(mix32(0)) == 0 && unmix32(mix32(~0u)) == ~0u);
+
     return 0;
 }
@@ -0,0 +1,139 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * largesig_test -- tests for signatures with very many blocks.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Build a signature of BLOCKS synthetic blocks (default 2^32 + 1000), then
+   check that sampled blocks are found at the right offsets, both in the
+   signature and after saving and loading it as an indexed signature.
+
+   This exits with 77 (skipped) if there isn't enough memory. It can be built
+   with a small -DHASHTABLE_NARROW_MAX to test 64 bit hashtable indexes with
+   fewer blocks. */
+
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "librsync.h"
+#include "sumset.h"
+#include "trace.h"
+#include "hashtable.h"
+
+#define BLOCK_LEN 16
+#define STRONG_LEN 16
+
+/* The number of blocks to check matches for. */
+#define SAMPLES (1 << 20)
+
+/* Make the unique data for block i. */
+static void make_block(unsigned char *buf, uint64_t i)
+{
+    uint64_t x = i * 0x9e3779b97f4a7c15ULL;
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        buf[j] = (unsigned char)(i >> 8 * j);
+        buf[8 + j] = (unsigned char)(x >> 8 * j);
+    }
+}
+
+/* Check that sampled blocks are found at their offsets in sig. */
+static void check_matches(rs_signature_t *sig, rs_long_t count)
+{
+    unsigned char buf[BLOCK_LEN];
+    rs_long_t step = count / SAMPLES + 1, i;
+
+    for (i = 0; i < count; i += step) {
+        make_block(buf, (uint64_t)i);
+        assert(rs_signature_find_match
+               (sig, rs_signature_calc_weak_sum(sig, buf, BLOCK_LEN), buf,
+                BLOCK_LEN) == i * BLOCK_LEN);
+    }
+    make_block(buf, (uint64_t)count - 1);
+    assert(rs_signature_find_match
+           (sig, rs_signature_calc_weak_sum(sig, buf, BLOCK_LEN), buf,
+            BLOCK_LEN) == (count - 1) * BLOCK_LEN);
+    make_block(buf, (uint64_t)count);
+    assert(rs_signature_find_match
+           (sig, rs_signature_calc_weak_sum(sig, buf, BLOCK_LEN), buf,
+            BLOCK_LEN) == -1);
+}
+
+int main(int argc, char **argv)
+{
+    rs_long_t count = argc > 1 ? atoll(argv[1]) : ((rs_long_t)1 << 32) + 1000;
+    rs_long_t size, need, have, i;
+    rs_signature_t sig;
+    rs_strong_sum_t strong;
+    unsigned char buf[BLOCK_LEN];
+    unsigned char *data;
+    size_t len;
+    FILE *f;
+
+    /* Estimate the memory for the sums and a 64 bit index hashtable, which
+       is also needed again for loading the indexed signature. */
+    for (size = 2; size < 1 + count * 10 / 7; size *= 2) ;
+    need = count * (4 + STRONG_LEN) + size * (1 + 8) + count * 2;
+    have = (rs_long_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (count < 1 || need > have / 10 * 9) {
+        printf("skipping " FMT_LONG " blocks needing " FMT_LONG " MB with "
+               FMT_LONG " MB\n", count, need >> 20, have >> 20);
+        return 77;
+    }
+
+    assert(rs_signature_init
+           (&sig, RS_RK_XXH3_SIG_MAGIC, BLOCK_LEN, STRONG_LEN,
+            12 + count * (4 + STRONG_LEN)) == RS_DONE);
+    assert(sig.size == count);
+    for (i = 0; i < count; i++) {
+        make_block(buf, (uint64_t)i);
+        rs_signature_calc_strong_sum(&sig, buf, BLOCK_LEN, &strong);
+        rs_signature_add_block(&sig,
+                               rs_signature_calc_weak_sum(&sig, buf,
+                                                          BLOCK_LEN), &strong);
+    }
+    assert(sig.count == count);
+    assert(rs_build_hash_table_par(&sig, 8) == RS_DONE);
+    assert(sig.hashtable->count == (size_t)count);
+    if ((uint64_t)count > HASHTABLE_NARROW_MAX)
+        assert(sig.hashtable->itable64 && !sig.hashtable->itable);
+    else
+        assert(sig.hashtable->itable && !sig.hashtable->itable64);
+    check_matches(&sig, count);
+
+    /* Save and reload it as an indexed signature. */
+    assert((f = tmpfile()) != NULL);
+    assert(rs_signature_index_save(&sig, f) == RS_DONE);
+    rs_signature_done(&sig);
+    len = (size_t)ftell(f);
+    assert((data = malloc(len)) != NULL);
+    rewind(f);
+    assert(fread(data, len, 1, f) == 1);
+    fclose(f);
+    assert(rs_signature_index_load(&sig, data, len, free) == RS_DONE);
+    assert(sig.count == count);
+    assert((sig.hashtable->itable64 != NULL) ==
+           ((uint64_t)count > HASHTABLE_NARROW_MAX));
+    check_matches(&sig, count);
+    rs_signature_done(&sig);
+    return 0;
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include "librsync.h"
 #include "rabinkarp.h"
 
 int main(int argc, char **argv)
@@ -31,6 +32,10 @@ int main(int argc, char **argv)
     uint8_t buf[1024];
     uint32_t sum;
 
+    /* Optionally select the cpu level to benchmark. */
+    if (argc > 1 && rs_cpu_select(argv[1]) != RS_DONE)
+        return 1;
+    fprintf(stderr, "%s\n", rs_cpu_features());
     rabinkarp_init(&r);
     for (i = 0; i < 1024 * 1024; i++) {
         fread(buf, 1024, 1, stdin);
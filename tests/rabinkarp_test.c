@@ -22,13 +22,20 @@
 /* Force DEBUG on so that tests can use assert(). */
 #undef NDEBUG
 #include <assert.h>
+#include "librsync.h"
 #include "rabinkarp.h"
 
 int main(int argc, char **argv)
 {
-    rabinkarp_t r;
-    int i;
+    rabinkarp_t r, r2;
+    int i, j, l;
     unsigned char buf[256];
+    static unsigned char data[10000];
+    static uint32_t digests[10000];
+    const char *levels[] = { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+    const size_t lens[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100,
+        255, 256, 1000, 4095, 4096, 4097, 10000
+    };
 
     /* Test rabinkarp_init() */
     rabinkarp_init(&r);
@@ -71,5 +78,39 @@ int main(int argc, char **argv)
         buf[i] = (unsigned char)i;
     rabinkarp_update(&r, buf, 256);
     assert(rabinkarp_digest(&r) == 0xc1972381);
+
+    /* Test rabinkarp_update() matches rabinkarp_rollin() at every cpu level. */
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + i / 251 + (i % 3 ? 0 : 200));
+    for (l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++) {
+        assert(rs_cpu_select(levels[l]) == RS_DONE);
+        for (j = 0; j < (int)(sizeof(lens) / sizeof(lens[0])); j++) {
+            rabinkarp_init(&r);
+            rabinkarp_update(&r, data + 9999, 1);
+            r2 = r;
+            rabinkarp_update(&r, data, lens[j]);
+            for (i = 0; i < (int)lens[j]; i++)
+                rabinkarp_rollin(&r2, data[i]);
+            assert(r.count == r2.count);
+            assert(r.hash == r2.hash);
+            assert(r.mult == r2.mult);
+        }
+        /* Test rabinkarp_rotate_n() matches rabinkarp_rotate(). */
+        for (j = 0; j < (int)(sizeof(lens) / sizeof(lens[0])); j++) {
+            if (lens[j] + 300 > sizeof(data))
+                continue;
+            rabinkarp_init(&r);
+            rabinkarp_update(&r, data, 300);
+            r2 = r;
+            rabinkarp_rotate_n(&r, data, lens[j], digests);
+            for (i = 0; i < (int)lens[j]; i++) {
+                assert(digests[i] == rabinkarp_digest(&r2));
+                rabinkarp_rotate(&r2, data[i], data[i + 300]);
+            }
+            assert(r.count == r2.count);
+            assert(r.hash == r2.hash);
+            assert(r.mult == r2.mult);
+        }
+    }
     return 0;
 }
@@ -22,14 +22,23 @@
 /* Force DEBUG on so that tests can use assert(). */
 #undef NDEBUG
 #include <assert.h>
+#include <string.h>
+#include "librsync.h"
 #include "rollsum.h"
+#include "hashtable.h"
 
 /* Test driver for rollsum. */
 int main(int argc, char **argv)
 {
-    Rollsum r;
-    int i;
+    Rollsum r, r2;
+    int i, j, l;
     unsigned char buf[256];
+    static unsigned char data[10000];
+    static uint32_t digests[10000];
+    const char *levels[] = { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+    const size_t lens[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100,
+        255, 256, 1000, 4095, 4096, 4097, 8191, 8192, 10000
+    };
 
     /* Test RollsumInit() */
     RollsumInit(&r);
@@ -73,5 +82,50 @@ int main(int argc, char **argv)
         buf[i] = (unsigned char)i;
     RollsumUpdate(&r, buf, 256);
     assert(RollsumDigest(&r) == 0x3a009e80);
+
+    /* Test RollsumUpdate() matches RollsumRollin() at every cpu level. */
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + i / 251 + (i % 3 ? 0 : 200));
+    for (l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++) {
+        assert(rs_cpu_select(levels[l]) == RS_DONE);
+        for (j = 0; j < (int)(sizeof(lens) / sizeof(lens[0])); j++) {
+            RollsumInit(&r);
+            RollsumUpdate(&r, data + 9999, 1);
+            r2 = r;
+            RollsumUpdate(&r, data, lens[j]);
+            for (i = 0; i < (int)lens[j]; i++)
+                RollsumRollin(&r2, data[i]);
+            assert(r.count == r2.count);
+            assert(r.s1 == r2.s1);
+            assert(r.s2 == r2.s2);
+        }
+        /* Test RollsumRotateN() matches RollsumRotate(). */
+        for (j = 0; j < (int)(sizeof(lens) / sizeof(lens[0])); j++) {
+            if (lens[j] + 300 > sizeof(data))
+                continue;
+            RollsumInit(&r);
+            RollsumUpdate(&r, data, 300);
+            r2 = r;
+            RollsumRotateN(&r, data, lens[j], digests);
+            for (i = 0; i < (int)lens[j]; i++) {
+                assert(digests[i] == mix32(RollsumDigest(&r2)));
+                RollsumRotate(&r2, data[i], data[i + 300]);
+            }
+            assert(r.count == r2.count);
+            assert(r.s1 == r2.s1);
+            assert(r.s2 == r2.s2);
+        }
+        /* All 0xff bytes give the largest lane sums. */
+        memset(buf, 0xff, sizeof(buf));
+        RollsumInit(&r);
+        r2 = r;
+        for (j = 0; j < 40; j++) {
+            RollsumUpdate(&r, buf, sizeof(buf));
+            for (i = 0; i < (int)sizeof(buf); i++)
+                RollsumRollin(&r2, buf[i]);
+        }
+        assert(r.s1 == r2.s1);
+        assert(r.s2 == r2.s2);
+    }
     return 0;
 }
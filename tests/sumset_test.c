@@ -34,6 +34,7 @@ int main(int argc, char **argv)
     rs_result res;
     rs_weak_sum_t weak = 0x12345678;
     rs_strong_sum_t strong = "ABCDEF";
+    rs_strong_sum_t *pstrong;
     int i;
     unsigned char buf[256];
 
@@ -135,6 +136,26 @@ int main(int argc, char **argv)
     assert(block_len == 1000);
     assert(strong_len == 8);
 
+    /* old_fsize=unknown, magic=rk/xxh3, block_len=rec, strong_len=rec. */
+    magic = RS_RK_XXH3_SIG_MAGIC;
+    block_len = 0;
+    strong_len = 0;
+    res = rs_sig_args(-1, &magic, &block_len, &strong_len);
+    assert(res == RS_DONE);
+    assert(magic == RS_RK_XXH3_SIG_MAGIC);
+    assert(block_len == 2048);
+    assert(strong_len == 16);
+
+    /* old_fsize=100000, magic=rk/xxh3, block_len=rec, strong_len=min. */
+    magic = RS_RK_XXH3_SIG_MAGIC;
+    block_len = 0;
+    strong_len = -1;
+    res = rs_sig_args(1000000, &magic, &block_len, &strong_len);
+    assert(res == RS_DONE);
+    assert(magic == RS_RK_XXH3_SIG_MAGIC);
+    assert(block_len == 896);
+    assert(strong_len == 7);
+
     /* magic=bad. */
     magic = 1;
     block_len = 0;
@@ -158,6 +179,17 @@ int main(int argc, char **argv)
     strong_len = 17;
     res = rs_sig_args(-1, &magic, &block_len, &strong_len);
     assert(res == RS_PARAM_ERROR);
+    magic = RS_RK_XXH3_SIG_MAGIC;
+    block_len = 0;
+    strong_len = 17;
+    res = rs_sig_args(-1, &magic, &block_len, &strong_len);
+    assert(res == RS_PARAM_ERROR);
+    /* There is no rollsum variant of xxh3. */
+    magic = RS_RK_XXH3_SIG_MAGIC - 0x10;
+    block_len = 0;
+    strong_len = 0;
+    res = rs_sig_args(-1, &magic, &block_len, &strong_len);
+    assert(res == RS_BAD_MAGIC);
     magic = RS_MD4_SIG_MAGIC;
     block_len = 0;
     strong_len = 17;
@@ -165,7 +197,8 @@ int main(int argc, char **argv)
     assert(res == RS_PARAM_ERROR);
 
     /* Test rs_signature_init() */
-    /* magic=rec, block_len=rec, strong_len=max. */
+    /* magic=rec, block_len=rec, strong_len=max, with garbage in sig. */
+    memset(&sig, 0xa5, sizeof(sig));
     res = rs_signature_init(&sig, 0, 0, 0, -1);
     assert(res == RS_DONE);
     assert(sig.magic == RS_RK_BLAKE2_SIG_MAGIC);
@@ -173,8 +206,11 @@ int main(int argc, char **argv)
     assert(sig.strong_sum_len == 32);
     assert(sig.count == 0);
     assert(sig.size == 0);
-    assert(sig.block_sigs == NULL);
+    assert(sig.weak_sums == NULL);
+    assert(sig.strong_sums == NULL);
     assert(sig.hashtable == NULL);
+    assert(sig.mem == NULL);
+    assert(sig.mem_free == NULL);
 #ifndef HASHTABLE_NSTATS
     assert(sig.calc_strong_count == 0);
 #endif
@@ -229,12 +265,14 @@ int main(int argc, char **argv)
     assert(sig.strong_sum_len == 6);
     assert(sig.count == 0);
     assert(sig.size == 8);
-    assert(sig.block_sigs != NULL);
+    assert(sig.weak_sums != NULL);
+    assert(sig.strong_sums != NULL);
 
     /* Test rs_signature_done(). */
     rs_signature_done(&sig);
     assert(sig.size == 0);
-    assert(sig.block_sigs == NULL);
+    assert(sig.weak_sums == NULL);
+    assert(sig.strong_sums == NULL);
 
     /* Test rs_signature_calc_strong_sum(). */
     res = rs_signature_init(&sig, RS_MD4_SIG_MAGIC, 16, 6, -1);
@@ -253,10 +291,15 @@ int main(int argc, char **argv)
     rs_signature_add_block(&sig, weak, &strong);
     assert(sig.count == 1);
     assert(sig.size == 16);
-    assert(sig.block_sigs != NULL);
-    assert(((rs_block_sig_t *)sig.block_sigs)->weak_sum == 0x12345678);
-    assert(memcmp(((rs_block_sig_t *)sig.block_sigs)->strong_sum, &strong, 6)
-           == 0);
+    assert(sig.weak_sums[0] == 0x12345678);
+    assert(memcmp(sig.strong_sums, &strong, 6) == 0);
+    /* The strong sums are packed at strong_sum_len stride. */
+    rs_signature_add_block(&sig, weak + 1, &strong);
+    assert(sig.count == 2);
+    assert(sig.weak_sums[1] == 0x12345679);
+    assert(memcmp(sig.strong_sums + 6, &strong, 6) == 0);
+    rs_signature_get_block(&sig, 1, &pstrong);
+    assert((rs_byte_t *)pstrong == sig.strong_sums + 6);
     rs_signature_done(&sig);
 
     /* Prepare rs_build_hash_table() and rs_signature_find_match() tests. */
@@ -282,6 +325,118 @@ int main(int argc, char **argv)
 #ifndef HASHTABLE_NSTATS
     assert(sig.calc_strong_count == 2);
 #endif
+
+    /* Test rs_signature_match_at(). */
+    /* Matching block at its offset. */
+    assert(rs_signature_match_at(&sig, 15 * 16, weak, &buf[15 * 16], 16));
+    /* Matching weak, different block. */
+    assert(!rs_signature_match_at(&sig, 15 * 16, weak, &buf[2], 16));
+    /* Different block offset, unaligned offset, and offsets out of range. */
+    assert(!rs_signature_match_at(&sig, 14 * 16, weak, &buf[15 * 16], 16));
+    assert(!rs_signature_match_at(&sig, 15 * 16 + 1, weak, &buf[15 * 16], 16));
+    assert(!rs_signature_match_at(&sig, 16 * 16, weak, &buf[15 * 16], 16));
+    assert(!rs_signature_match_at(&sig, -16, weak, &buf[15 * 16], 16));
+#ifndef HASHTABLE_NSTATS
+    assert(sig.predict_count == 4);
+    assert(sig.predict_match_count == 1);
+#endif
+    rs_signature_done(&sig);
+
+    /* Test building incrementally and with threads give the same hashtable.
+       Pairs of blocks have the same weak sum and every 8th block duplicates
+       an earlier one, so only the first of each duplicate is indexed. */
+    rs_signature_t psig;
+    int const n = 100000;
+    static unsigned char seen[100000];
+    int k, count;
+    res = rs_signature_init(&sig, 0, 16, 6, 12 + n * (4 + 6));
+    assert(res == RS_DONE);
+    res = rs_signature_init(&psig, 0, 16, 6, 12 + n * (4 + 6));
+    assert(res == RS_DONE);
+    for (i = 0; i < n; i++) {
+        k = i % 8 ? i : i / 3;
+        weak = (rs_weak_sum_t)((unsigned)(k / 2) * 2654435761u);
+        memcpy(strong, &k, sizeof(k));
+        rs_signature_add_block(&sig, weak, &strong);
+        rs_signature_add_block(&psig, weak, &strong);
+        /* Index the blocks loaded so far every 1000 blocks. */
+        if (i % 1000 == 999)
+            assert(rs_build_hash_table(&sig) == RS_DONE);
+    }
+    assert(sig.hashed == n - n % 1000);
+    assert(rs_build_hash_table(&sig) == RS_DONE);
+    assert(sig.hashed == n);
+    assert(rs_build_hash_table_par(&psig, 4) == RS_DONE);
+    assert(psig.hashed == n);
+    /* Only the i / 3 duplicates that are multiples of 8 are new blocks. */
+    count = n - n / 8 + (n / 8 - 1) / 3 + 1;
+    assert(sig.hashtable->count == count);
+    assert(psig.hashtable->count == count);
+    for (i = 0; i < sig.hashtable->size; i++)
+        if (sig.hashtable->ttable[i])
+            seen[sig.hashtable->itable[i]] |= 1;
+    for (i = 0; i < psig.hashtable->size; i++)
+        if (psig.hashtable->ttable[i])
+            seen[psig.hashtable->itable[i]] |= 2;
+    for (i = 0, k = 0; i < n; i++) {
+        assert(seen[i] == 0 || seen[i] == 3);
+        k += seen[i] == 3;
+    }
+    assert(k == count);
+#ifndef HASHTABLE_NSTATS
+    assert(sig.build_time >= 0 && psig.build_time >= 0);
+#endif
+
+    /* Test an indexed signature header gives its length, and a corrupt one
+       with a huge size is rejected before its layout overflows. */
+    unsigned char hdr[RS_SIG_INDEX_HEADER_LEN];
+    size_t len;
+    FILE *f = tmpfile();
+    assert(f);
+    assert(rs_signature_index_save(&sig, f) == RS_DONE);
+    rewind(f);
+    assert(fread(hdr, sizeof(hdr), 1, f) == 1);
+    assert(rs_signature_index_len(hdr, &len) == RS_DONE);
+    fseek(f, 0, SEEK_END);
+    assert(len == (size_t)ftell(f));
+    fclose(f);
+    memset(&hdr[20], 0, 4);     /* size = 2^61 */
+    memcpy(&hdr[44], "\x20\x00\x00\x00", 4);
+    assert(rs_signature_index_len(hdr, &len) == RS_MEM_ERROR);
+    /* And so is one with 64 bit indexes for 2^60 - 1 blocks. */
+    memset(&hdr[16], 0xff, 4);
+    hdr[31] |= HASHTABLE_MODE_WIDE;
+    memcpy(&hdr[40], "\x0f\xff\xff\xff\x10\x00\x00\x00", 8);
+    assert(rs_signature_index_len(hdr, &len) == RS_MEM_ERROR);
+    rs_signature_done(&sig);
+    rs_signature_done(&psig);
+
+    /* Test a local signature of 100 bytes of basis in 16 byte blocks. */
+    unsigned char other[16];
+    memset(other, 0, sizeof(other));
+    res = rs_signature_init_local(&sig, buf, 100, 0);
+    assert(res == RS_DONE);
+    assert(sig.block_len == 64);
+    rs_signature_done(&sig);
+    res = rs_signature_init_local(&sig, buf, 100, 16);
+    assert(res == RS_DONE);
+    assert(sig.count == 7);
+    assert(sig.basis == buf && sig.basis_len == 100);
+    assert(rs_build_hash_table(&sig) == RS_DONE);
+    weak = rs_signature_calc_weak_sum(&sig, &buf[32], 16);
+    assert(sig.weak_sums[2] == weak);
+    /* Matching block, and matching weak with different data. */
+    assert(rs_signature_find_match(&sig, weak, &buf[32], 16) == 32);
+    assert(rs_signature_find_match(&sig, weak, other, 16) == -1);
+    assert(rs_signature_match_at(&sig, 32, weak, &buf[32], 16));
+    assert(!rs_signature_match_at(&sig, 32, weak, other, 16));
+    /* The last short block only matches the same short data. */
+    weak = rs_signature_calc_weak_sum(&sig, &buf[96], 4);
+    assert(rs_signature_find_match(&sig, weak, &buf[96], 4) == 96);
+    assert(!rs_signature_match_at(&sig, 96, weak, &buf[96], 16));
+#ifndef HASHTABLE_NSTATS
+    assert(sig.calc_strong_count == 0);
+#endif
     rs_signature_done(&sig);
 
     return 0;